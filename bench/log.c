@@ -0,0 +1,156 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+/*
+ * Measures what a call to logmsg() costs on the event loop, per message:
+ *
+ *   elided     A message below PRAETOR_LOG_LEVEL, removed at build time.
+ *   filtered   A debug message with debug mode off, under the current macro.
+ *   filtered,  The same message under the macro logmsg() used to be, which
+ *   old macro  tested the debug flag and then the priority against each of
+ *              the levels it hides.
+ *   sync       A message written out before the writer thread is started.
+ *   async      A message handed to the writer thread.
+ *
+ * Every message formats the same arguments as a received IRC line would be
+ * logged with, and the arguments are produced by a function the compiler
+ * can't see through, so that skipping their evaluation shows up in the
+ * numbers. Enabled messages are written to /dev/null.
+ *
+ * Usage: bench_log [count]
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define DEFAULT_COUNT 10000000
+//Enabled messages go through the formatter and a write() each, so fewer are timed
+#define ENABLED_DIVISOR 100
+
+//The file descriptor log.c writes to, if it has one
+extern int log_fd;
+
+//The previous logmsg(), kept for comparison
+#define logmsg_old(loglevel, ...) do{\
+    if(!debug){\
+        if(loglevel == LOG_DEBUG || loglevel == LOG_INFO || loglevel == LOG_NOTICE){\
+            break;\
+        }\
+    }\
+    logprintf(loglevel, __VA_ARGS__);\
+} while(0);
+
+//logmsg(), as built with -DPRAETOR_LOG_LEVEL=LOG_WARNING
+#define logmsg_elided(loglevel, ...) do{\
+    if((loglevel) <= LOG_WARNING && (loglevel) <= log_threshold){\
+        logprintf(loglevel, __VA_ARGS__);\
+    }\
+} while(0);
+
+const char line[] = ":nick!user@host.example.org PRIVMSG #channel :hello, world\r\n";
+
+//Makes the loops reread log_threshold and debug every time, as the event loop would
+#define BARRIER() __asm__ __volatile__("" ::: "memory")
+
+//Counts argument evaluations, so that the loops can't be thrown away
+volatile size_t evaluated = 0;
+
+/**
+ * Stands in for the work done to produce a log message's arguments.
+ */
+__attribute__((noinline)) const char* argument(){
+    evaluated++;
+    return line;
+}
+
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(const char* name, size_t count, double elapsed){
+    printf("%-22s %12zu %12.2f\n", name, count, elapsed * 1e9 / count);
+}
+
+int main(int argc, char** argv){
+    size_t count = DEFAULT_COUNT;
+    if(argc > 1){
+        count = strtoul(argv[1], NULL, 10);
+    }
+    size_t enabled_count = count / ENABLED_DIVISOR > 0 ? count / ENABLED_DIVISOR : 1;
+
+    log_fd = open("/dev/null", O_WRONLY);
+    if(log_fd == -1){
+        perror("open");
+        return 1;
+    }
+
+    printf("%-22s %12s %12s\n", "case", "messages", "ns/message");
+
+    double start = now();
+    for(size_t i = 0; i < count; i++){
+        BARRIER();
+        logmsg_elided(LOG_DEBUG, "%s >> %.*s", "network", (int)sizeof(line) - 1, argument());
+    }
+    report("elided", count, now() - start);
+
+    start = now();
+    for(size_t i = 0; i < count; i++){
+        BARRIER();
+        logmsg(LOG_DEBUG, "%s >> %.*s", "network", (int)sizeof(line) - 1, argument());
+    }
+    report("filtered", count, now() - start);
+
+    start = now();
+    for(size_t i = 0; i < count; i++){
+        BARRIER();
+        logmsg_old(LOG_DEBUG, "%s >> %.*s", "network", (int)sizeof(line) - 1, argument());
+    }
+    report("filtered, old macro", count, now() - start);
+
+    //Everything from here on is written out
+    debug = true;
+    log_threshold = LOG_DEBUG;
+
+    start = now();
+    for(size_t i = 0; i < enabled_count; i++){
+        BARRIER();
+        logmsg(LOG_DEBUG, "%s >> %.*s", "network", (int)sizeof(line) - 1, argument());
+    }
+    report("sync", enabled_count, now() - start);
+
+    if(log_init(NULL) == -1){
+        fprintf(stderr, "Could not start the log writer thread\n");
+        return 1;
+    }
+    start = now();
+    for(size_t i = 0; i < enabled_count; i++){
+        BARRIER();
+        logmsg(LOG_DEBUG, "%s >> %.*s", "network", (int)sizeof(line) - 1, argument());
+    }
+    double elapsed = now() - start;
+    log_flush();
+    report("async", enabled_count, elapsed);
+
+    if(evaluated != 2 * enabled_count){
+        fprintf(stderr, "Filtered messages evaluated their arguments\n");
+        return 1;
+    }
+
+    return 0;
+}
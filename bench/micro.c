@@ -0,0 +1,623 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+/*
+ * Microbenchmarks for the hash table, the queue, and the IRC message parser,
+ * converter and builders. Each is reported in nanoseconds, heap allocations,
+ * and heap bytes allocated per operation, and compared against a baseline.
+ *
+ * Allocations are counted by linking with --wrap for malloc(), calloc() and
+ * realloc(), and by handing jansson the same counting functions, so they
+ * include everything the code under test asks the heap for. Setup and
+ * clean-up between timed sections are neither timed nor counted.
+ *
+ * Each benchmark is run until it has taken at least the minimum time, and the
+ * fastest of three such runs is reported, which keeps timing noise down. The
+ * allocation counts are exact, and don't vary between machines or runs.
+ *
+ * A benchmark regresses when its allocs/op or bytes/op grow by more than the
+ * allocation threshold, in percent. An ns/op grown by more than the time
+ * threshold is flagged as slower, but only counts as a regression with -s:
+ * times depend on the machine, so they can only be held to a baseline
+ * written on the same one. Benchmarks missing from the baseline are
+ * reported, but can't regress.
+ *
+ * Usage: bench_micro [-s] [-b baseline] [-w baseline] [-t time_threshold]
+ *                    [-a alloc_threshold] [-m min_seconds] [filter]
+ *
+ *   -b  Compares against this baseline, and exits with 1 on a regression.
+ *   -w  Writes the results to this baseline.
+ *   -s  Counts slower benchmarks as regressions.
+ *   -t  Percent ns/op may grow by, 10 by default.
+ *   -a  Percent allocs/op and bytes/op may grow by, 0 by default.
+ *   -m  Least time to run each benchmark for, 0.1 by default.
+ *
+ * Only benchmarks whose name contains filter are run.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
+#include "htable.h"
+#include "ircmsg.h"
+#include "queue.h"
+
+#define DEFAULT_TIME_THRESHOLD 10.0
+#define DEFAULT_ALLOC_THRESHOLD 0.0
+#define DEFAULT_MIN_TIME 0.1
+#define RUNS 3
+#define BENCH_NAME_MAX 64
+//Results that are freed after a batch are held here
+#define BATCH_SIZE 64
+
+//Not part of htable.h, since only htable_add() needs it
+int htable_rehash(struct htable* table, size_t scale);
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+//Allocations made while a timed section is running
+size_t alloc_count = 0, alloc_bytes = 0;
+bool counting = false;
+
+void* __wrap_malloc(size_t size){
+    if(counting){
+        alloc_count++;
+        alloc_bytes += size;
+    }
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size){
+    if(counting){
+        alloc_count++;
+        alloc_bytes += nmemb * size;
+    }
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size){
+    if(counting){
+        alloc_count++;
+        alloc_bytes += size;
+    }
+    return __real_realloc(ptr, size);
+}
+
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+//The time spent in timed sections, and the operations they performed
+double elapsed = 0;
+double started = 0;
+size_t ops_done = 0;
+
+void start(){
+    counting = true;
+    started = now();
+}
+
+void stop(size_t ops){
+    elapsed += now() - started;
+    counting = false;
+    ops_done += ops;
+}
+
+struct micro{
+    const char* name;
+    /**
+     * Runs at least \c ops operations, timing them between start() and stop().
+     */
+    void (*run)(const struct micro* m, size_t ops);
+    /**
+     * The number of keys, the size of an item, or the like.
+     */
+    size_t size;
+    /**
+     * The builder measured by bench_ircmsg_build().
+     */
+    char* (*build)(void);
+};
+
+struct result{
+    char name[BENCH_NAME_MAX];
+    double ns, allocs, bytes;
+};
+
+/*
+ * Hash table
+ */
+
+//Keys shaped like the nicks and channel names praetor keys its tables with
+char** keys = NULL;
+size_t key_count = 0;
+
+void make_keys(size_t count){
+    if(count <= key_count){
+        return;
+    }
+    keys = realloc(keys, count * sizeof(char*));
+    for(; key_count < count; key_count++){
+        keys[key_count] = malloc(32);
+        snprintf(keys[key_count], 32, "#channel-%zu", key_count);
+    }
+}
+
+struct htable* filled_table(size_t count, bool casemapped){
+    struct htable* table = htable_create(count * 2);
+    if(casemapped){
+        htable_set_casemapping(table, CASEMAP_RFC1459);
+    }
+    for(size_t i = 0; i < count; i++){
+        htable_add(table, (uint8_t*)keys[i], strlen(keys[i]) + 1, keys[i]);
+    }
+    return table;
+}
+
+void bench_htable_add(const struct micro* m, size_t ops){
+    make_keys(m->size);
+    for(size_t done = 0; done < ops; done += m->size){
+        //Sized so that it never rehashes, which htable_rehash is measured by
+        struct htable* table = htable_create(m->size * 2);
+        start();
+        for(size_t i = 0; i < m->size; i++){
+            htable_add(table, (uint8_t*)keys[i], strlen(keys[i]) + 1, keys[i]);
+        }
+        stop(m->size);
+        htable_destroy(table);
+    }
+}
+
+void lookup_keys(struct htable* table, const struct micro* m, size_t ops){
+    size_t found = 0;
+    start();
+    for(size_t i = 0; i < ops; i++){
+        const char* key = keys[i % m->size];
+        found += htable_lookup(table, (uint8_t*)key, strlen(key) + 1) != NULL;
+    }
+    stop(ops);
+    if(found != ops){
+        fprintf(stderr, "bench_micro: htable_lookup missed %zu keys\n", ops - found);
+        exit(2);
+    }
+}
+
+void bench_htable_lookup(const struct micro* m, size_t ops){
+    make_keys(m->size);
+    struct htable* table = filled_table(m->size, false);
+    lookup_keys(table, m, ops);
+    htable_destroy(table);
+}
+
+//Tables of nicks and channel names compare them as the network does
+void bench_htable_lookup_rfc1459(const struct micro* m, size_t ops){
+    make_keys(m->size);
+    struct htable* table = filled_table(m->size, true);
+    lookup_keys(table, m, ops);
+    htable_destroy(table);
+}
+
+void bench_htable_remove(const struct micro* m, size_t ops){
+    make_keys(m->size);
+    for(size_t done = 0; done < ops; done += m->size){
+        struct htable* table = filled_table(m->size, false);
+        start();
+        for(size_t i = 0; i < m->size; i++){
+            htable_remove(table, (uint8_t*)keys[i], strlen(keys[i]) + 1);
+        }
+        stop(m->size);
+        htable_destroy(table);
+    }
+}
+
+//One operation is one mapping moved to the new buckets
+void bench_htable_rehash(const struct micro* m, size_t ops){
+    make_keys(m->size);
+    for(size_t done = 0; done < ops; done += m->size){
+        struct htable* table = filled_table(m->size, false);
+        start();
+        htable_rehash(table, 2);
+        stop(m->size);
+        htable_destroy(table);
+    }
+}
+
+/*
+ * Queue
+ */
+
+char payload[IRCMSG_SIZE_BUF];
+
+void bench_queue_enqueue(const struct micro* m, size_t ops){
+    struct queue* q = queue_create();
+    for(size_t done = 0; done < ops; done += BATCH_SIZE){
+        start();
+        for(size_t i = 0; i < BATCH_SIZE; i++){
+            queue_enqueue(q, payload, m->size);
+        }
+        stop(BATCH_SIZE);
+        struct item* itm;
+        while((itm = queue_dequeue(q)) != NULL){
+            free(itm);
+        }
+    }
+    queue_destroy(q);
+}
+
+void bench_queue_dequeue(const struct micro* m, size_t ops){
+    struct queue* q = queue_create();
+    struct item* items[BATCH_SIZE];
+    for(size_t done = 0; done < ops; done += BATCH_SIZE){
+        for(size_t i = 0; i < BATCH_SIZE; i++){
+            queue_enqueue(q, payload, m->size);
+        }
+        start();
+        for(size_t i = 0; i < BATCH_SIZE; i++){
+            items[i] = queue_dequeue(q);
+        }
+        stop(BATCH_SIZE);
+        for(size_t i = 0; i < BATCH_SIZE; i++){
+            free(items[i]);
+        }
+    }
+    queue_destroy(q);
+}
+
+void bench_queue_peek(const struct micro* m, size_t ops){
+    struct queue* q = queue_create();
+    struct item* items[BATCH_SIZE];
+    queue_enqueue(q, payload, m->size);
+    for(size_t done = 0; done < ops; done += BATCH_SIZE){
+        start();
+        for(size_t i = 0; i < BATCH_SIZE; i++){
+            items[i] = queue_peek(q);
+        }
+        stop(BATCH_SIZE);
+        for(size_t i = 0; i < BATCH_SIZE; i++){
+            free(items[i]);
+        }
+    }
+    queue_destroy(q);
+}
+
+/*
+ * IRC messages
+ */
+
+//Lines as a busy network sends them, most of them channel traffic
+const char* corpus[] = {
+    ":nick!~user@host.example.org PRIVMSG #channel :hello, world\r\n",
+    ":Somebody!~someone@2001:db8::1 PRIVMSG #praetor :has anyone tried building it with clang?\r\n",
+    ":bot!bot@services.example.net PRIVMSG #channel :\x01" "ACTION waves\x01\r\n",
+    ":nick!~user@host.example.org PRIVMSG praetor :!help\r\n",
+    ":another!~user@gateway/web/irccloud.com/x-abcdefghijklmnop PRIVMSG #channel :a longer message, as people type when they're explaining something, with punctuation and all, and a link: https://example.org/some/long/path?query=string\r\n",
+    ":nick!~user@host.example.org JOIN #channel\r\n",
+    ":nick!~user@host.example.org JOIN #private secretkey\r\n",
+    ":nick!~user@host.example.org PART #channel :leaving\r\n",
+    ":nick!~user@host.example.org QUIT :Ping timeout: 240 seconds\r\n",
+    ":nick!~user@host.example.org NICK newnick\r\n",
+    ":ChanServ!ChanServ@services. MODE #channel +o nick\r\n",
+    ":irc.example.net NOTICE * :*** Looking up your hostname...\r\n",
+    ":irc.example.net 001 praetor :Welcome to the Example Internet Relay Chat Network praetor\r\n",
+    ":irc.example.net 353 praetor = #channel :praetor @ChanServ nick another Somebody +voiced\r\n",
+    ":irc.example.net 366 praetor #channel :End of /NAMES list.\r\n",
+    "PING :irc.example.net\r\n",
+};
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+void bench_ircmsg_parse(const struct micro* m, size_t ops){
+    (void)m;
+    size_t len[CORPUS_SIZE];
+    for(size_t i = 0; i < CORPUS_SIZE; i++){
+        len[i] = strlen(corpus[i]);
+    }
+
+    struct ircmsg* msgs[CORPUS_SIZE];
+    for(size_t done = 0; done < ops; done += CORPUS_SIZE){
+        start();
+        for(size_t i = 0; i < CORPUS_SIZE; i++){
+            msgs[i] = ircmsg_parse("example", corpus[i], len[i]);
+        }
+        stop(CORPUS_SIZE);
+        for(size_t i = 0; i < CORPUS_SIZE; i++){
+            if(msgs[i] == NULL){
+                fprintf(stderr, "bench_micro: Could not parse %s", corpus[i]);
+                exit(2);
+            }
+            ircmsg_free(msgs[i]);
+        }
+    }
+}
+
+//Only JOIN and PRIVMSG are converted, since only those go to plugins
+void bench_ircmsg_to_json(const struct micro* m, size_t ops){
+    (void)m;
+    struct ircmsg* msgs[CORPUS_SIZE];
+    size_t count = 0;
+    for(size_t i = 0; i < CORPUS_SIZE; i++){
+        struct ircmsg* msg = ircmsg_parse("example", corpus[i], strlen(corpus[i]));
+        if(msg->type == JOIN || msg->type == PRIVMSG){
+            msgs[count++] = msg;
+        }
+        else{
+            ircmsg_free(msg);
+        }
+    }
+
+    json_t* objs[CORPUS_SIZE];
+    for(size_t done = 0; done < ops; done += count){
+        start();
+        for(size_t i = 0; i < count; i++){
+            objs[i] = ircmsg_to_json(msgs[i]);
+        }
+        stop(count);
+        for(size_t i = 0; i < count; i++){
+            json_decref(objs[i]);
+        }
+    }
+
+    for(size_t i = 0; i < count; i++){
+        ircmsg_free(msgs[i]);
+    }
+}
+
+char* build_join(void){ return ircmsg_join("#channel,#private", "secretkey", IRCMSG_SIZE_MAX); }
+char* build_nick(void){ return ircmsg_nick("praetor"); }
+char* build_part(void){ return ircmsg_part("#channel", "leaving", IRCMSG_SIZE_MAX); }
+char* build_pass(void){ return ircmsg_pass("hunter2"); }
+char* build_pong(void){ return ircmsg_pong("irc.example.net", NULL); }
+char* build_privmsg(void){ return ircmsg_privmsg("#channel", "a reply from a plugin, of about the length they tend to be", IRCMSG_SIZE_MAX); }
+char* build_quit(void){ return ircmsg_quit("shutting down", IRCMSG_SIZE_MAX); }
+char* build_user(void){ return ircmsg_user("praetor", "0", "praetor IRC bot"); }
+
+void bench_ircmsg_build(const struct micro* m, size_t ops){
+    char* msgs[BATCH_SIZE];
+    for(size_t done = 0; done < ops; done += BATCH_SIZE){
+        start();
+        for(size_t i = 0; i < BATCH_SIZE; i++){
+            msgs[i] = m->build();
+        }
+        stop(BATCH_SIZE);
+        for(size_t i = 0; i < BATCH_SIZE; i++){
+            free(msgs[i]);
+        }
+    }
+}
+
+const struct micro benchmarks[] = {
+    {"htable_add/16", bench_htable_add, 16, NULL},
+    {"htable_add/1024", bench_htable_add, 1024, NULL},
+    {"htable_add/65536", bench_htable_add, 65536, NULL},
+    {"htable_lookup/16", bench_htable_lookup, 16, NULL},
+    {"htable_lookup/1024", bench_htable_lookup, 1024, NULL},
+    {"htable_lookup/65536", bench_htable_lookup, 65536, NULL},
+    {"htable_casemap/16", bench_htable_lookup_rfc1459, 16, NULL},
+    {"htable_casemap/1024", bench_htable_lookup_rfc1459, 1024, NULL},
+    {"htable_casemap/65536", bench_htable_lookup_rfc1459, 65536, NULL},
+    {"htable_remove/16", bench_htable_remove, 16, NULL},
+    {"htable_remove/1024", bench_htable_remove, 1024, NULL},
+    {"htable_remove/65536", bench_htable_remove, 65536, NULL},
+    {"htable_rehash/16", bench_htable_rehash, 16, NULL},
+    {"htable_rehash/1024", bench_htable_rehash, 1024, NULL},
+    {"htable_rehash/65536", bench_htable_rehash, 65536, NULL},
+    {"queue_enqueue/64", bench_queue_enqueue, 64, NULL},
+    {"queue_enqueue/512", bench_queue_enqueue, 512, NULL},
+    {"queue_dequeue/64", bench_queue_dequeue, 64, NULL},
+    {"queue_peek/64", bench_queue_peek, 64, NULL},
+    {"queue_peek/512", bench_queue_peek, 512, NULL},
+    {"ircmsg_parse", bench_ircmsg_parse, 0, NULL},
+    {"ircmsg_to_json", bench_ircmsg_to_json, 0, NULL},
+    {"ircmsg_join", bench_ircmsg_build, 0, build_join},
+    {"ircmsg_nick", bench_ircmsg_build, 0, build_nick},
+    {"ircmsg_part", bench_ircmsg_build, 0, build_part},
+    {"ircmsg_pass", bench_ircmsg_build, 0, build_pass},
+    {"ircmsg_pong", bench_ircmsg_build, 0, build_pong},
+    {"ircmsg_privmsg", bench_ircmsg_build, 0, build_privmsg},
+    {"ircmsg_quit", bench_ircmsg_build, 0, build_quit},
+    {"ircmsg_user", bench_ircmsg_build, 0, build_user},
+};
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+//Rounds to the precision baselines are written with, so that reading one back compares equal
+double thousandths(double value){
+    return (double)(uint64_t)(value * 1000 + 0.5) / 1000;
+}
+
+/**
+ * Runs a benchmark with more and more operations, until it takes at least
+ * min_time, then runs it with that many operations until it's been run RUNS
+ * times, and keeps the fastest run.
+ */
+void measure(const struct micro* m, double min_time, struct result* r){
+    snprintf(r->name, BENCH_NAME_MAX, "%s", m->name);
+    r->ns = -1;
+
+    size_t ops = 1;
+    for(size_t run = 0; run < RUNS;){
+        elapsed = 0;
+        ops_done = 0;
+        alloc_count = 0;
+        alloc_bytes = 0;
+        m->run(m, ops);
+        if(elapsed < min_time){
+            //Aim a little past min_time, growing by at most 100 times at once
+            double scale = elapsed > 0 ? 1.2 * min_time / elapsed : 100;
+            ops = (size_t)(ops * (scale < 100 ? scale : 100)) + 1;
+            continue;
+        }
+
+        double ns = elapsed * 1e9 / ops_done;
+        if(r->ns < 0 || ns < r->ns){
+            r->ns = ns;
+        }
+        r->allocs = thousandths((double)alloc_count / ops_done);
+        r->bytes = thousandths((double)alloc_bytes / ops_done);
+        run++;
+    }
+}
+
+/**
+ * Reads a baseline written with -w.
+ *
+ * \return The number of results read, or -1 if the file can't be opened.
+ */
+ssize_t read_baseline(const char* path, struct result* results, size_t size){
+    FILE* f = fopen(path, "r");
+    if(f == NULL){
+        return -1;
+    }
+
+    char line[256];
+    size_t count = 0;
+    while(count < size && fgets(line, sizeof(line), f) != NULL){
+        if(line[0] == '#'){
+            continue;
+        }
+        struct result* r = &results[count];
+        if(sscanf(line, "%63s %lf %lf %lf", r->name, &r->ns, &r->allocs, &r->bytes) == 4){
+            count++;
+        }
+    }
+
+    fclose(f);
+    return count;
+}
+
+int write_baseline(const char* path, const struct result* results, size_t count){
+    FILE* f = fopen(path, "w");
+    if(f == NULL){
+        return -1;
+    }
+
+    fprintf(f, "# Written by bench_micro; see bench/micro.c\n");
+    fprintf(f, "# %-22s %12s %10s %12s\n", "benchmark", "ns/op", "allocs/op", "bytes/op");
+    for(size_t i = 0; i < count; i++){
+        fprintf(f, "%-24s %12.1f %10.3f %12.3f\n", results[i].name, results[i].ns, results[i].allocs, results[i].bytes);
+    }
+
+    return fclose(f);
+}
+
+//The change from a baseline value, in percent
+double change(double value, double base){
+    if(base == 0){
+        return value == 0 ? 0 : 100;
+    }
+    return (value - base) / base * 100;
+}
+
+int main(int argc, char** argv){
+    const char* baseline_path = NULL;
+    const char* write_path = NULL;
+    double time_threshold = DEFAULT_TIME_THRESHOLD;
+    double alloc_threshold = DEFAULT_ALLOC_THRESHOLD;
+    double min_time = DEFAULT_MIN_TIME;
+    bool strict = false;
+
+    int opt;
+    while((opt = getopt(argc, argv, "a:b:m:st:w:")) != -1){
+        switch(opt){
+            case 'a': alloc_threshold = strtod(optarg, NULL); break;
+            case 'b': baseline_path = optarg; break;
+            case 'm': min_time = strtod(optarg, NULL); break;
+            case 's': strict = true; break;
+            case 't': time_threshold = strtod(optarg, NULL); break;
+            case 'w': write_path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: bench_micro [-s] [-b baseline] [-w baseline] [-t time_threshold] [-a alloc_threshold] [-m min_seconds] [filter]\n");
+                return 2;
+        }
+    }
+    const char* filter = optind < argc ? argv[optind] : "";
+
+    json_set_alloc_funcs(__wrap_malloc, free);
+
+    struct result baseline[BENCHMARK_COUNT];
+    ssize_t baseline_count = 0;
+    if(baseline_path != NULL && (baseline_count = read_baseline(baseline_path, baseline, BENCHMARK_COUNT)) == -1){
+        fprintf(stderr, "bench_micro: Could not read baseline %s, comparing against nothing\n", baseline_path);
+        baseline_count = 0;
+    }
+
+    printf("%-24s %12s %10s %10s %10s %8s\n", "benchmark", "ns/op", "allocs/op", "bytes/op", "base ns", "change");
+
+    struct result results[BENCHMARK_COUNT];
+    size_t count = 0;
+    size_t regressions = 0, slower = 0;
+    for(size_t i = 0; i < BENCHMARK_COUNT; i++){
+        if(strstr(benchmarks[i].name, filter) == NULL){
+            continue;
+        }
+
+        struct result* r = &results[count++];
+        measure(&benchmarks[i], min_time, r);
+        printf("%-24s %12.1f %10.2f %10.1f", r->name, r->ns, r->allocs, r->bytes);
+
+        const struct result* base = NULL;
+        for(ssize_t j = 0; j < baseline_count; j++){
+            if(strcmp(baseline[j].name, r->name) == 0){
+                base = &baseline[j];
+                break;
+            }
+        }
+        if(base == NULL){
+            printf(" %10s %8s\n", "-", "new");
+            continue;
+        }
+
+        double dt = change(r->ns, base->ns);
+        printf(" %10.1f %+7.1f%%", base->ns, dt);
+        if(dt > time_threshold && strict){
+            printf("  REGRESSED, time");
+            regressions++;
+        }
+        else if(dt > time_threshold){
+            printf("  slower");
+            slower++;
+        }
+        if(change(r->allocs, base->allocs) > alloc_threshold || change(r->bytes, base->bytes) > alloc_threshold){
+            printf("  REGRESSED, allocs %.2f bytes %.1f", base->allocs, base->bytes);
+            regressions++;
+        }
+        printf("\n");
+    }
+
+    if(write_path != NULL){
+        if(write_baseline(write_path, results, count) == -1){
+            fprintf(stderr, "bench_micro: Could not write baseline %s\n", write_path);
+            return 2;
+        }
+        printf("Wrote baseline %s\n", write_path);
+    }
+
+    if(slower > 0){
+        printf("%zu benchmarks slower than %s by more than %.1f%%, which may be the machine; write a baseline here with -w and compare with -s to be sure\n", slower, baseline_path, time_threshold);
+    }
+    if(regressions > 0){
+        printf("%zu regressions against %s (time threshold %.1f%%, allocation threshold %.1f%%)\n", regressions, baseline_path, time_threshold, alloc_threshold);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,483 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+/*
+ * Plays back traffic recorded with praetor's -C option through praetor's own
+ * event loop, and reports how quickly it was handled.
+ *
+ * Every network in the capture is connected to one end of a socket pair, and
+ * the lines praetor received from it are written to the other end, so that
+ * they go through inet_recv(), irc_recv(), ircmsg_parse(), and out to plugins
+ * just as they did when they were captured. Whatever praetor sends to networks
+ * is read back and counted, for comparison with what it sent when the traffic
+ * was captured.
+ *
+ * With a configuration file, its plugins are loaded and receive the traffic,
+ * and its networks' plugin ACLs apply. Without one, there are no plugins, and
+ * only the network side of praetor is measured. With -P, plugins are not
+ * loaded; instead, the messages captured from them are handed to
+ * plugin_dispatch() at the time they were captured, so that the replay is the
+ * same every time.
+ *
+ * By default, traffic is played back at the speed it was recorded. With -f,
+ * it's played back as fast as praetor will take it.
+ *
+ * Latency is measured for each line, from the moment it's written to the
+ * socket until the iteration of the event loop that handled it returns.
+ *
+ * Usage: bench_replay [-f] [-P] [-c config_path] capture_path
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "config.h"
+#include "htable.h"
+#include "log.h"
+#include "nexus.h"
+#include "plugin.h"
+#include "queue.h"
+#include "signals.h"
+#include "timer.h"
+#include "util.h"
+
+//When playing back as fast as possible, the number of lines written before letting praetor catch up
+#define REPLAY_BATCH 64
+
+//Holds whatever praetor sends to a network
+#define REPLAY_DRAIN_SIZE 65536
+
+//After the last record, how long praetor must stay quiet, in milliseconds, before its output is counted
+#define REPLAY_QUIET 200
+
+/**
+ * A network taking part in the replay, and the far end of its socket pair.
+ */
+struct replay_network{
+    struct network* n;
+    int peer;
+    //Bytes written to praetor
+    uint64_t written;
+    //Lines written to praetor that it hasn't handled yet, as the offset of their end and the time they were written
+    uint64_t* pending_end;
+    uint64_t* pending_time;
+    size_t pending_head, pending_count, pending_size;
+};
+
+struct replay_network* networks = NULL;
+size_t network_count = 0;
+
+//Per-line latencies, in nanoseconds
+uint64_t* latencies = NULL;
+size_t latency_count = 0, latency_size = 0;
+
+//Lines and bytes sent by praetor during the replay
+size_t sent_lines = 0, sent_bytes = 0;
+
+//Wakes the event loop up when the next record is due
+struct timer due_timer;
+
+uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void die(const char* msg){
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
+
+void due(void* arg){
+    (void)arg;
+}
+
+/**
+ * Looks up a configured network or plugin by a name from a capture, which
+ * holds only the first CAPTURE_SOURCE_MAX bytes of longer names.
+ */
+void* replay_lookup(struct htable* table, const char* name){
+    void* value = htable_lookup(table, (uint8_t*)name, strlen(name)+1);
+    if(value != NULL || strlen(name) < CAPTURE_SOURCE_MAX){
+        return value;
+    }
+
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(table, &size);
+    for(size_t i = 0; keys != NULL && i < size && value == NULL; i++){
+        if(strncmp((char*)keys[i]->key, name, CAPTURE_SOURCE_MAX) == 0){
+            value = htable_lookup(table, keys[i]->key, keys[i]->key_size);
+        }
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    return value;
+}
+
+/**
+ * Finds the network a capture refers to by name, setting it up for the replay
+ * the first time it's seen.
+ */
+struct replay_network* replay_network(const char* name){
+    for(size_t i = 0; i < network_count; i++){
+        if(strncmp(networks[i].n->name, name, CAPTURE_SOURCE_MAX) == 0){
+            return &networks[i];
+        }
+    }
+
+    void* tmp = realloc(networks, (network_count + 1) * sizeof(struct replay_network));
+    if(tmp == NULL){
+        die("Out of memory");
+    }
+    networks = tmp;
+    struct replay_network* r = &networks[network_count++];
+    memset(r, 0, sizeof(struct replay_network));
+
+    //Networks missing from the configuration get just enough of one to receive traffic
+    r->n = replay_lookup(rc_network, name);
+    if(r->n == NULL){
+        char* copy = malloc(strlen(name)+1);
+        if(copy == NULL || (r->n = calloc(1, sizeof(struct network))) == NULL){
+            die("Out of memory");
+        }
+        strcpy(copy, name);
+        r->n->name = copy;
+        r->n->channels = htable_create(5);
+        r->n->admins = htable_create(5);
+        r->n->plugins = htable_create(5);
+        if(r->n->channels == NULL || r->n->admins == NULL || r->n->plugins == NULL){
+            die("Out of memory");
+        }
+        isupport_init(&r->n->isupport);
+        r->n->casemapping = CASEMAP_DEFAULT;
+    }
+    struct network* n = r->n;
+
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1){
+        die("Could not create socket pair");
+    }
+    setnonblock(sv[0]);
+    setnonblock(sv[1]);
+    n->sock = sv[0];
+    r->peer = sv[1];
+
+    n->ssl = false;
+    n->recv_queue = calloc(IRCMSG_SIZE_MAX + 1, sizeof(char));
+    n->recv_queue_size = IRCMSG_SIZE_MAX + 1;
+    n->recv_queue_idx = 0;
+    n->send_queue = queue_create();
+    if(n->recv_queue == NULL || n->send_queue == NULL){
+        die("Out of memory");
+    }
+    if(htable_add(rc_network_sock, (uint8_t*)&n->sock, sizeof(n->sock), n) != 0 || watch_add(n->sock, false) == -1){
+        die("Could not watch network socket");
+    }
+    n->connected = true;
+
+    return r;
+}
+
+/**
+ * Reads back, and counts, whatever praetor sent to each network.
+ */
+void replay_drain(){
+    char buf[REPLAY_DRAIN_SIZE];
+    for(size_t i = 0; i < network_count; i++){
+        ssize_t ret;
+        while((ret = read(networks[i].peer, buf, sizeof(buf))) > 0){
+            sent_bytes += ret;
+            for(ssize_t j = 0; j < ret; j++){
+                sent_lines += buf[j] == '\n';
+            }
+        }
+    }
+}
+
+/**
+ * Records the latency of every line praetor has finished handling.
+ *
+ * \return The number of lines still waiting to be handled, on all networks.
+ */
+size_t replay_settle(){
+    uint64_t now = now_ns();
+    size_t waiting = 0;
+    for(size_t i = 0; i < network_count; i++){
+        struct replay_network* r = &networks[i];
+
+        //Anything praetor hasn't read yet, or has read only part of, hasn't been handled
+        int unread = 0;
+        ioctl(r->n->sock, FIONREAD, &unread);
+        uint64_t handled = r->written - unread - r->n->recv_queue_idx;
+
+        while(r->pending_count > 0 && r->pending_end[r->pending_head] <= handled){
+            if(latency_count == latency_size){
+                latency_size = latency_size == 0 ? 4096 : latency_size * 2;
+                if((latencies = realloc(latencies, latency_size * sizeof(uint64_t))) == NULL){
+                    die("Out of memory");
+                }
+            }
+            latencies[latency_count++] = now - r->pending_time[r->pending_head];
+            r->pending_head = (r->pending_head + 1) % r->pending_size;
+            r->pending_count--;
+        }
+        waiting += r->pending_count;
+    }
+
+    return waiting;
+}
+
+/**
+ * Runs the event loop until praetor has handled every line written to it.
+ */
+void replay_pump(){
+    while(replay_settle() > 0){
+        run();
+        replay_drain();
+    }
+}
+
+/**
+ * Writes a captured line to praetor, letting it catch up whenever the socket
+ * fills.
+ */
+void replay_line(struct replay_network* r, const char* line, size_t len){
+    if(r->pending_count == r->pending_size){
+        size_t size = r->pending_size == 0 ? 256 : r->pending_size * 2;
+        uint64_t* end = malloc(size * sizeof(uint64_t));
+        uint64_t* time = malloc(size * sizeof(uint64_t));
+        if(end == NULL || time == NULL){
+            die("Out of memory");
+        }
+        for(size_t i = 0; i < r->pending_count; i++){
+            end[i] = r->pending_end[(r->pending_head + i) % r->pending_size];
+            time[i] = r->pending_time[(r->pending_head + i) % r->pending_size];
+        }
+        free(r->pending_end);
+        free(r->pending_time);
+        r->pending_end = end;
+        r->pending_time = time;
+        r->pending_head = 0;
+        r->pending_size = size;
+    }
+
+    uint64_t start = now_ns();
+    for(size_t done = 0; done < len;){
+        ssize_t ret = write(r->peer, line + done, len - done);
+        if(ret > 0){
+            done += ret;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK){
+            run();
+            replay_drain();
+            replay_settle();
+        }
+        else{
+            die("Could not write to network socket");
+        }
+    }
+    r->written += len;
+
+    size_t tail = (r->pending_head + r->pending_count) % r->pending_size;
+    r->pending_end[tail] = r->written;
+    r->pending_time[tail] = start;
+    r->pending_count++;
+}
+
+/**
+ * Dispatches a message captured from a plugin on its behalf.
+ *
+ * \return true if the plugin is configured, and the message was dispatched.
+ */
+bool replay_plugin(const char* name, const char* data, size_t len){
+    struct plugin* p = replay_lookup(rc_plugin, name);
+    if(p == NULL){
+        return false;
+    }
+
+    json_t* obj = json_loadb(data, len, 0, NULL);
+    if(obj == NULL){
+        return false;
+    }
+    plugin_dispatch(p, obj);
+    json_decref(obj);
+
+    return true;
+}
+
+int compare_u64(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double p){
+    if(latency_count == 0){
+        return 0;
+    }
+    size_t idx = (size_t)(p * (latency_count - 1));
+    return latencies[idx] / 1e3;
+}
+
+int main(int argc, char** argv){
+    bool fast = false, replay_plugins = false;
+    char* config_path = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "c:fP")) != -1){
+        switch(opt){
+            case 'c':
+                config_path = optarg;
+                break;
+            case 'f':
+                fast = true;
+                break;
+            case 'P':
+                replay_plugins = true;
+                break;
+            default:
+                die("Usage: bench_replay [-f] [-P] [-c config_path] capture_path");
+        }
+    }
+    if(optind != argc - 1){
+        die("Usage: bench_replay [-f] [-P] [-c config_path] capture_path");
+    }
+
+    foreground = true;
+
+    rc_praetor = calloc(1, sizeof(struct praetor));
+    rc_network = htable_create(5);
+    rc_network_sock = htable_create(5);
+    rc_plugin = htable_create(5);
+    rc_plugin_sock = htable_create(5);
+    rc_plugin_pid = htable_create(5);
+    if(rc_praetor == NULL || rc_network == NULL || rc_network_sock == NULL || rc_plugin == NULL || rc_plugin_sock == NULL || rc_plugin_pid == NULL){
+        die("Out of memory");
+    }
+    rc_praetor->batch_size = 1;
+
+    if(config_path != NULL && config_load(config_path) == -1){
+        die("Could not load configuration");
+    }
+    if(signal_init() == -1){
+        die("Could not install signal handlers");
+    }
+    if(!replay_plugins && htable_get_mapping_count(rc_plugin) > 0 && plugin_load_all() < 0){
+        fprintf(stderr, "Could not load all plugins\n");
+    }
+
+    struct capture_reader* reader = capture_reader_open(argv[optind]);
+    if(reader == NULL){
+        die("Could not open capture file");
+    }
+    timer_init(&due_timer, due, NULL);
+
+    size_t lines = 0, bytes = 0, plugin_frames = 0, plugin_skipped = 0, captured_sent = 0, captured_plugin = 0, captured_plugin_in = 0;
+    uint64_t first = 0, start = 0;
+    struct capture_record record;
+    int ret;
+    while((ret = capture_read(reader, &record)) == 0){
+        if(start == 0){
+            first = record.time;
+            start = now_ns();
+        }
+
+        //Keep the event loop going until the record is due
+        if(!fast){
+            uint64_t at = start + (record.time - first);
+            for(uint64_t now = now_ns(); now < at; now = now_ns()){
+                if(replay_settle() > 0 || (at - now) / 1000000 > 0){
+                    timer_arm(&due_timer, (at - now) / 1000000);
+                    run();
+                    replay_drain();
+                }
+            }
+        }
+
+        switch(record.kind){
+            case CAPTURE_NETWORK_IN:
+                replay_line(replay_network(record.source), record.data, record.len);
+                lines++;
+                bytes += record.len;
+                if(fast && lines % REPLAY_BATCH == 0){
+                    replay_pump();
+                }
+                break;
+            case CAPTURE_NETWORK_OUT:
+                captured_sent++;
+                break;
+            case CAPTURE_PLUGIN_IN:
+                //Loaded plugins say whatever they say this time around
+                if(!replay_plugins){
+                    captured_plugin_in++;
+                }
+                else if(replay_plugin(record.source, record.data, record.len)){
+                    plugin_frames++;
+                }
+                else{
+                    plugin_skipped++;
+                }
+                break;
+            case CAPTURE_PLUGIN_OUT:
+                captured_plugin++;
+                break;
+            default:
+                break;
+        }
+    }
+    if(ret == -1){
+        fprintf(stderr, "Capture file ends with a corrupt or incomplete record, stopping there\n");
+    }
+    replay_pump();
+    double elapsed = (now_ns() - start) / 1e9;
+    capture_reader_close(reader);
+
+    //Plugins may still be catching up
+    size_t last_sent = sent_bytes;
+    for(uint64_t quiet = now_ns(); now_ns() - quiet < REPLAY_QUIET * 1000000ULL;){
+        timer_arm(&due_timer, REPLAY_QUIET);
+        run();
+        replay_drain();
+        if(sent_bytes != last_sent){
+            last_sent = sent_bytes;
+            quiet = now_ns();
+        }
+    }
+    plugin_unload_all();
+
+    qsort(latencies, latency_count, sizeof(uint64_t), compare_u64);
+
+    printf("%-24s %s\n", "mode", fast ? "as fast as possible" : "recorded speed");
+    printf("%-24s %zu lines, %zu bytes in %.3f s\n", "received", lines, bytes, elapsed);
+    printf("%-24s %.0f lines/s, %.2f MB/s\n", "throughput", lines / elapsed, bytes / elapsed / 1e6);
+    printf("%-24s p50 %.1f, p90 %.1f, p99 %.1f, max %.1f us\n", "latency", percentile(0.5), percentile(0.9), percentile(0.99), percentile(1));
+    if(replay_plugins){
+        printf("%-24s %zu dispatched, %zu for plugins not configured\n", "plugin messages", plugin_frames, plugin_skipped);
+    }
+    else{
+        printf("%-24s %zu (captured), left to loaded plugins\n", "plugin messages", captured_plugin_in);
+    }
+    printf("%-24s %zu lines, %zu bytes (captured: %zu lines)\n", "sent to networks", sent_lines, sent_bytes, captured_sent);
+    printf("%-24s %zu (captured)\n", "sent to plugins", captured_plugin);
+
+    return 0;
+}
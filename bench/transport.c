@@ -0,0 +1,233 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+/*
+ * Measures the throughput of the two plugin transports by pushing the same
+ * stream of fixed-size messages through each to a forked consumer, the same
+ * way praetor writes batches to a plugin.
+ *
+ * Usage: bench_transport [message_count] [message_size]
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ring.h"
+
+#define DEFAULT_COUNT 1000000
+#define DEFAULT_SIZE 200
+#define BATCH_SIZE 64
+#define RING_SIZE 1048576
+
+double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+void report(const char* transport, size_t count, size_t size, double seconds, size_t syscalls){
+    printf("%-10s %10zu %6zu %10.3f %12.0f %10.1f %10zu\n", transport, count, size, seconds, count / seconds, (count * size) / seconds / 1e6, syscalls);
+}
+
+//Reads exactly len bytes, or dies trying
+void read_all(int fd, char* buf, size_t len){
+    while(len > 0){
+        ssize_t ret = read(fd, buf, len);
+        if(ret <= 0){
+            _exit(1);
+        }
+        buf += ret;
+        len -= ret;
+    }
+}
+
+double bench_socket(size_t count, size_t size, size_t* syscalls){
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1){
+        perror("socketpair");
+        exit(1);
+    }
+
+    char* msg = malloc(size);
+    memset(msg, 'x', size);
+
+    if(fork() == 0){
+        close(fds[0]);
+        char* buf = malloc(size * BATCH_SIZE);
+        size_t remaining = count * size;
+        while(remaining > 0){
+            ssize_t ret = read(fds[1], buf, remaining < size * BATCH_SIZE ? remaining : size * BATCH_SIZE);
+            if(ret <= 0){
+                _exit(1);
+            }
+            remaining -= ret;
+        }
+        char ack = 0;
+        write(fds[1], &ack, 1);
+        _exit(0);
+    }
+    close(fds[1]);
+
+    struct iovec iov[BATCH_SIZE];
+    double start = now();
+    for(size_t sent = 0; sent < count;){
+        size_t n = 0;
+        for(; n < BATCH_SIZE && sent + n < count; n++){
+            iov[n].iov_base = msg;
+            iov[n].iov_len = size;
+        }
+
+        //Resume partial writes the same way plugin_flush() does
+        struct iovec* cur = iov;
+        size_t left = n;
+        while(left > 0){
+            ssize_t ret = writev(fds[0], cur, left);
+            (*syscalls)++;
+            if(ret == -1){
+                perror("writev");
+                exit(1);
+            }
+            while(left > 0 && (size_t)ret >= cur->iov_len){
+                ret -= cur->iov_len;
+                cur++;
+                left--;
+            }
+            if(left > 0){
+                cur->iov_base = (char*)cur->iov_base + ret;
+                cur->iov_len -= ret;
+            }
+        }
+        sent += n;
+    }
+
+    char ack;
+    read_all(fds[0], &ack, 1);
+    double elapsed = now() - start;
+
+    wait(NULL);
+    close(fds[0]);
+    free(msg);
+
+    return elapsed;
+}
+
+double bench_ring(size_t count, size_t size, size_t* syscalls){
+    struct ring* r = ring_create(RING_SIZE);
+    if(r == NULL){
+        fprintf(stderr, "Could not create ring\n");
+        exit(1);
+    }
+
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1){
+        perror("socketpair");
+        exit(1);
+    }
+
+    char* msg = malloc(size);
+    memset(msg, 'x', size);
+
+    if(fork() == 0){
+        close(fds[0]);
+        //Attach the way a plugin would, rather than relying on the inherited mapping
+        struct ring* cr = ring_attach(dup(r->fd));
+        if(cr == NULL){
+            _exit(1);
+        }
+
+        char* buf = malloc(size);
+        for(size_t received = 0; received < count;){
+            ssize_t ret = ring_read(cr, buf, size);
+            if(ret > 0){
+                received++;
+                continue;
+            }
+            if(ring_sleep(cr)){
+                char bell;
+                read_all(fds[1], &bell, 1);
+            }
+        }
+
+        char ack = 0;
+        write(fds[1], &ack, 1);
+        _exit(0);
+    }
+    close(fds[1]);
+
+    double start = now();
+    for(size_t sent = 0; sent < count;){
+        size_t n = 0;
+        for(; n < BATCH_SIZE && sent < count; n++, sent++){
+            while(ring_write(r, msg, size) == -1){
+                //Full; make sure the consumer is awake before waiting on it
+                if(ring_wake(r)){
+                    char bell = 0;
+                    write(fds[0], &bell, 1);
+                    (*syscalls)++;
+                }
+                sched_yield();
+            }
+        }
+        if(ring_wake(r)){
+            char bell = 0;
+            write(fds[0], &bell, 1);
+            (*syscalls)++;
+        }
+    }
+
+    char ack;
+    read_all(fds[0], &ack, 1);
+    double elapsed = now() - start;
+
+    wait(NULL);
+    close(fds[0]);
+    ring_destroy(r);
+    free(msg);
+
+    return elapsed;
+}
+
+int main(int argc, char* argv[]){
+    size_t count = DEFAULT_COUNT;
+    size_t size = DEFAULT_SIZE;
+    if(argc > 1){
+        count = strtoul(argv[1], NULL, 10);
+    }
+    if(argc > 2){
+        size = strtoul(argv[2], NULL, 10);
+    }
+    if(count == 0 || size == 0 || size > RING_SIZE / 2){
+        fprintf(stderr, "Usage: %s [message_count] [message_size]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-10s %10s %6s %10s %12s %10s %10s\n", "transport", "messages", "size", "seconds", "msgs/s", "MB/s", "syscalls");
+
+    size_t syscalls = 0;
+    double elapsed = bench_socket(count, size, &syscalls);
+    report("socket", count, size, elapsed, syscalls);
+
+    syscalls = 0;
+    elapsed = bench_ring(count, size, &syscalls);
+    report("shm", count, size, elapsed, syscalls);
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+/*
+ * A shared plugin that answers CTCP VERSION requests. Build it with:
+ *
+ *     cc -std=c11 -fPIC -shared -I../../include ctcp_version.c -o ctcp_version.so
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "plugin_abi.h"
+
+#define CTCP_VERSION "\001VERSION\001"
+
+int ctcp_version_init(const struct praetor_api* api, void** ctx){
+    *ctx = (void*)api;
+
+    return 0;
+}
+
+void ctcp_version_on_event(void* ctx, const struct ircmsg* msg){
+    const struct praetor_api* api = ctx;
+
+    if(msg->type != PRIVMSG || msg->sender == NULL){
+        return;
+    }
+    if(strncmp(msg->privmsg->msg, CTCP_VERSION, strlen(CTCP_VERSION)) != 0){
+        return;
+    }
+
+    char line[IRCMSG_SIZE_BUF];
+    int len = snprintf(line, sizeof(line), "NOTICE %s :\001VERSION praetor\001\r\n", msg->sender);
+    if(len > 0 && len <= IRCMSG_SIZE_MAX){
+        api->send(msg->network, line, len);
+    }
+}
+
+const struct praetor_plugin praetor_plugin = {
+    .abi_version = PRAETOR_PLUGIN_ABI_VERSION,
+    .init = ctcp_version_init,
+    .on_event = ctcp_version_on_event
+};
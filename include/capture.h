@@ -0,0 +1,174 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_CAPTURE
+#define PRAETOR_CAPTURE
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * The first bytes of every capture file. The last byte is the version of the
+ * format.
+ */
+#define CAPTURE_MAGIC "PRAECAP\x01"
+#define CAPTURE_MAGIC_SIZE 8
+
+/**
+ * The longest source name a capture file may hold. Longer names are cut
+ * short, so sources are told apart, and matched on replay, by this many
+ * bytes of their names.
+ */
+#define CAPTURE_SOURCE_MAX 256
+
+/**
+ * The kinds of record in a capture file.
+ *
+ * A capture file is CAPTURE_MAGIC, followed by records. Every record begins
+ * with its kind, as a single byte. All other integers are unsigned LEB128.
+ *
+ * CAPTURE_CLOCK records hold an absolute reading of the monotonic clock, in
+ * nanoseconds. Every other record holds the nanoseconds elapsed since the
+ * record before it, so the first record written by each process is a clock.
+ *
+ * CAPTURE_SOURCE records hold a number, the length of a name, and the name.
+ * Traffic records name their network or plugin by that number, which is
+ * assigned the first time the name is captured.
+ *
+ * Traffic records hold the time, the source number, the length of the data,
+ * and the data.
+ */
+enum capture_kind{
+    CAPTURE_CLOCK = 0,
+    CAPTURE_SOURCE = 1,
+    /**
+     * A line received from a network, including its CRLF.
+     */
+    CAPTURE_NETWORK_IN = 2,
+    /**
+     * A line sent to a network, including its CRLF.
+     */
+    CAPTURE_NETWORK_OUT = 3,
+    /**
+     * A message received from a plugin.
+     */
+    CAPTURE_PLUGIN_IN = 4,
+    /**
+     * A message queued for a plugin.
+     */
+    CAPTURE_PLUGIN_OUT = 5
+};
+
+/**
+ * A single piece of traffic read back from a capture file.
+ */
+struct capture_record{
+    enum capture_kind kind;
+    /**
+     * The time at which the traffic was captured, in nanoseconds on the
+     * monotonic clock of the machine it was captured on.
+     */
+    uint64_t time;
+    /**
+     * The network or plugin the traffic came from, or went to.
+     */
+    const char* source;
+    /**
+     * The traffic itself. This is not NUL-terminated.
+     */
+    const char* data;
+    size_t len;
+};
+
+/**
+ * The file to which traffic is being captured, or NULL if capturing is off.
+ */
+extern FILE* capture_file;
+
+/**
+ * The path given to capture_open(), or NULL if capturing is off.
+ */
+extern const char* capture_path;
+
+/**
+ * Starts appending all traffic to and from networks and plugins to a file.
+ *
+ * \param path The file to capture to. It's created if it doesn't exist.
+ *
+ * \return 0 on success.
+ * \return -1 if the file could not be opened, or isn't a capture file.
+ */
+int capture_open(const char* path);
+
+/**
+ * Writes out everything captured so far.
+ */
+void capture_flush();
+
+/**
+ * Writes out everything captured so far, and stops capturing.
+ */
+void capture_close();
+
+/**
+ * Appends a record of some traffic to the capture file. This function should
+ * not be used directly under normal circumstances. Use the capture() macro
+ * instead.
+ *
+ * \param kind   What the traffic is, and which way it went.
+ * \param source The name of the network or plugin the traffic belongs to.
+ * \param buf    The traffic.
+ * \param len    The size of the traffic, in bytes.
+ */
+void capture_record(enum capture_kind kind, const char* source, const char* buf, size_t len);
+
+/**
+ * Records some traffic, if capturing is on. Use this macro wherever traffic
+ * needs to be captured; when capturing is off, it costs a single comparison.
+ */
+#define capture(kind, ...) do{\
+    if(capture_file != NULL){\
+        capture_record(kind, __VA_ARGS__);\
+    }\
+} while(0);
+
+/**
+ * Reads back a capture file.
+ */
+struct capture_reader;
+
+/**
+ * Opens a capture file for reading.
+ *
+ * \return A reader on success.
+ * \return NULL if the file could not be opened, isn't a capture file, or the
+ *         system is out of memory.
+ */
+struct capture_reader* capture_reader_open(const char* path);
+
+/**
+ * Reads the next piece of traffic from a capture file. Clock and source
+ * records are consumed along the way. The contents of \c record remain valid
+ * until the next call to this function, or to capture_reader_close().
+ *
+ * \return 0 on success.
+ * \return 1 at the end of the file.
+ * \return -1 if the file is corrupt, or the system is out of memory.
+ */
+int capture_read(struct capture_reader* r, struct capture_record* record);
+
+/**
+ * Closes a capture file opened by capture_reader_open().
+ */
+void capture_reader_close(struct capture_reader* r);
+
+#endif
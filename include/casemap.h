@@ -0,0 +1,79 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_CASEMAP
+#define PRAETOR_CASEMAP
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The ways a network may compare nicks and channel names without regard to
+ * case, as named by the CASEMAPPING token it sends in RPL_ISUPPORT.
+ */
+enum casemapping{
+    //A-Z are lowercase a-z
+    CASEMAP_ASCII,
+    //As ascii, and []\^ are uppercase {}|~, as ircds read RFC 1459
+    CASEMAP_RFC1459,
+    //As rfc1459, but ^ and ~ are different characters
+    CASEMAP_STRICT_RFC1459
+};
+
+/**
+ * The number of casemappings.
+ */
+#define CASEMAP_COUNT 3
+
+/**
+ * The casemapping assumed until a network says otherwise.
+ */
+#define CASEMAP_DEFAULT CASEMAP_RFC1459
+
+/**
+ * For each casemapping, the lowercase form of every byte, so that folding a
+ * string costs one table lookup per character.
+ */
+extern const uint8_t casemap_tables[CASEMAP_COUNT][256];
+
+/**
+ * Copies a string into \c buf, folded to lowercase under \c mapping, so that
+ * names that differ only in case fold to the same string. \c buf must hold at
+ * least \c len characters.
+ *
+ * \return The length of the folded string, which is always \c len.
+ */
+size_t casemap_fold(char* buf, const char* str, size_t len, enum casemapping mapping);
+
+/**
+ * Compares \c len characters of two strings without regard to case under
+ * \c mapping.
+ *
+ * \return true if the strings are equal once folded.
+ */
+bool casemap_equal(const char* a, const char* b, size_t len, enum casemapping mapping);
+
+/**
+ * Looks up a casemapping by the name a network gives it.
+ *
+ * \return 0 on success.
+ * \return -1 if the name is not one praetor knows.
+ */
+int casemap_from_name(const char* name, enum casemapping* mapping);
+
+/**
+ * Returns the name of a casemapping, as a network gives it.
+ */
+const char* casemap_name(enum casemapping mapping);
+
+#endif
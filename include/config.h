@@ -18,8 +18,18 @@
 #include <stdbool.h>
 #include <tls.h>
 
+#include <jansson.h>
+
+#include "casemap.h"
 #include "htable.h"
+#include "isupport.h"
+#include "metrics.h"
+#include "plugin_abi.h"
 #include "queue.h"
+#include "ring.h"
+#include "state.h"
+#include "timer.h"
+#include "trace.h"
 
 /**
  * A pointer to the global struct containing praetor's daemon-specific
@@ -39,7 +49,13 @@ extern struct htable* rc_network, * rc_network_sock;
  * loaded plugins, indexed by the user-specified name of the plugin, and by
  * socket file descriptor, respectively.
  */
-extern struct htable* rc_plugin, * rc_plugin_sock;
+extern struct htable* rc_plugin, * rc_plugin_sock, * rc_plugin_pid;
+
+/**
+ * The absolute path of praetor's main configuration file, from which the
+ * configuration is reloaded on SIGHUP.
+ */
+extern char* rc_path;
 
 /**
  * General configuration options, not specific to any particular network or
@@ -61,6 +77,36 @@ struct praetor{
      * to this directory.
      */
     const char* workdir;
+    /**
+     * The maximum number of messages that will be accumulated for a plugin
+     * before they are written to it in a single batch.
+     */
+    size_t batch_size;
+    /**
+     * The maximum number of milliseconds that a message may wait in a
+     * plugin's batch before the batch is written. If this is 0, batches are
+     * written at the end of every iteration of the event loop.
+     */
+    size_t batch_delay;
+    /**
+     * The path of a Unix socket on which metrics are served, or NULL.
+     */
+    const char* metrics_socket;
+    /**
+     * The port of 127.0.0.1 on which metrics are served, or 0.
+     */
+    size_t metrics_port;
+    /**
+     * The path of a Unix socket on which administrative commands are
+     * accepted, or NULL.
+     */
+    const char* control_socket;
+    /**
+     * The section of the configuration file that the strings in this struct
+     * point into. This holds a reference, so that the strings outlive the
+     * rest of the file.
+     */
+    json_t* source;
 };
 
 /**
@@ -80,6 +126,12 @@ struct network{
      * If this is set to true, praetor will attempt to connect using SSL/TLS.
      */
     bool ssl;
+    /**
+     * A file of PEM-encoded certificates, against which the network's
+     * certificate is verified instead of the system's default certificate
+     * authorities. May be NULL.
+     */
+    const char* ca_file;
     /**
      * praetor will attempt to use this nickname first when registering a
      * connection with the IRC server. See <a
@@ -115,6 +167,11 @@ struct network{
      * The message to be sent with a QUIT command.
      */
     const char* quit_msg;
+    /**
+     * How the network compares nicks and channel names without regard to
+     * case, which \c channels and \c admins are keyed under.
+     */
+    enum casemapping casemapping;
     /**
      * A hash table containing channel configuration settings.
      */
@@ -125,13 +182,19 @@ struct network{
     struct htable* admins;
     /**
      * A hash table containing plugin configuration for this network. This hash
-     * table maps plugin handles to plugin structs.
+     * table maps plugin handles to plugin structs. If this table is empty,
+     * plugins are not restricted on this network.
      */
     struct htable* plugins;
     /**
      * A socket file descriptor for the connection to this IRC network.
      */
     int sock;
+    /**
+     * Set once the connection to this network has been established, and
+     * registration has begun.
+     */
+    bool connected;
     /**
      * A list of struct addrinfo. praetor will connect using each until one
      * succeeds.
@@ -163,6 +226,33 @@ struct network{
      * A buffer for the messages to be sent to this network.
      */
     struct queue* send_queue;
+    /**
+     * Counters served by the metrics endpoint.
+     */
+    struct network_metrics metrics;
+    /**
+     * The time at which bytes were last read from this network, as returned
+     * by metrics_now().
+     */
+    uint64_t recv_at;
+    /**
+     * Plugin replies in \c send_queue whose latency is being traced.
+     */
+    struct trace_sends trace_sends;
+    /**
+     * What the network says it supports. See isupport.h.
+     */
+    struct isupport isupport;
+    /**
+     * The channels praetor is in on this network, and their members, or NULL
+     * while disconnected. See state.h.
+     */
+    struct state* state;
+    /**
+     * The section of the configuration file that the strings in this struct
+     * point into, held by reference.
+     */
+    json_t* source;
 };
 
 /**
@@ -174,9 +264,44 @@ struct network{
 enum plugin_status{
     PLUGIN_LOADED = 0,
     PLUGIN_UNLOADED = 1,
+    PLUGIN_RESTARTING = 2,
+    PLUGIN_QUARANTINED = 3,
     PLUGIN_DEAD = -1
 };
 
+/**
+ * The means by which messages are exchanged with a plugin, which is one of:
+ *  - Socket: Messages are written to and read from the plugin's standard
+ *    streams, which are connected to a UNIX domain socket.
+ *  - Shared memory: Messages are exchanged via a pair of rings in shared
+ *    memory, and the socket is only used to wake a sleeping reader.
+ */
+enum plugin_type{
+    PLUGIN_TYPE_PROCESS = 0,
+    PLUGIN_TYPE_SHARED = 1
+};
+
+enum plugin_transport{
+    PLUGIN_TRANSPORT_SOCKET = 0,
+    PLUGIN_TRANSPORT_SHM = 1
+};
+
+/**
+ * A single serialized message waiting to be written to a plugin.
+ */
+struct plugin_frame{
+    char* buf;
+    size_t len;
+    /**
+     * When the message was queued, as returned by metrics_now().
+     */
+    uint64_t queued_at;
+    /**
+     * The message's correlation id, or 0 if it isn't traced.
+     */
+    uint64_t trace;
+};
+
 /**
  * This struct represents the configuration of a loaded plugin
  */
@@ -189,14 +314,87 @@ struct plugin{
      * The current status of the plugin.
      */
     enum plugin_status status;
+    /**
+     * Whether this plugin runs as a child process, or is loaded into praetor
+     * as a shared object.
+     */
+    enum plugin_type type;
+    /**
+     * If \c type is PLUGIN_TYPE_SHARED, the handle returned by dlopen() for
+     * this plugin.
+     */
+    void* handle;
+    /**
+     * If \c type is PLUGIN_TYPE_SHARED, the interface exported by this plugin.
+     */
+    const struct praetor_plugin* abi;
+    /**
+     * If \c type is PLUGIN_TYPE_SHARED, the context set by the plugin's init
+     * function.
+     */
+    void* ctx;
     /**
      * The process ID of the child process spawned for this plugin.
      */
     pid_t pid;
+    /**
+     * The time, in milliseconds on the monotonic clock, at which this plugin
+     * was last loaded.
+     */
+    uint64_t start_time;
+    /**
+     * The number of times this plugin has been restarted after crashing.
+     */
+    size_t restart_count;
+    /**
+     * The number of times this plugin has crashed since \c crash_window_start.
+     */
+    size_t crash_count;
+    /**
+     * The time, in milliseconds on the monotonic clock, of the first crash
+     * counted in \c crash_count.
+     */
+    uint64_t crash_window_start;
+    /**
+     * Counters served by the metrics endpoint.
+     */
+    struct plugin_metrics metrics;
+    /**
+     * A timer used to restart this plugin after it has crashed.
+     */
+    struct timer restart_timer;
     /**
      * Praetor's end of the socket pair for this plugin.
      */
     int sock;
+    /**
+     * The means by which messages are exchanged with this plugin.
+     */
+    enum plugin_transport transport;
+    /**
+     * If \c transport is PLUGIN_TRANSPORT_SHM, the rings carrying messages to
+     * and from this plugin, respectively.
+     */
+    struct ring* ring_tx, * ring_rx;
+    /**
+     * Messages waiting to be written to this plugin. This array holds up to
+     * rc_praetor->batch_size frames.
+     */
+    struct plugin_frame* batch;
+    /**
+     * The number of frames in \c batch.
+     */
+    size_t batch_count;
+    /**
+     * The number of bytes of the first frame in \c batch that have already
+     * been written, if the last write was partial.
+     */
+    size_t batch_offset;
+    /**
+     * A timer used to flush \c batch once rc_praetor->batch_delay has
+     * elapsed, or to retry a flush that would have blocked.
+     */
+    struct timer batch_timer;
     /**
      * The name of the plugin author, to be printed on calls to
      * plugin_get_author().
@@ -216,10 +414,15 @@ struct plugin{
      */
     char* path;
     /**
-     * If set to true, this plugin will be allowed to send and receive private
-     * messages.
+     * If set to true, this plugin will be sent raw IRC lines, each prefixed by
+     * the name of the network it was received from, instead of JSON messages.
+     */
+    bool raw;
+    /**
+     * A hash table containing the names of networks on which this plugin will
+     * be allowed to send and receive private messages.
      */
-    bool private_messages;
+    struct htable* private_messages;
     /**
      * The number of milliseconds that this plugin will be required to wait
      * before sending another message. If the plugin sends messages at a rate
@@ -227,16 +430,48 @@ struct plugin{
      * as the rate_limit timer cycles.
      */
     size_t rate_limit;
+    /**
+     * Messages from this plugin waiting on \c rate_limit. Each item holds the
+     * message's correlation id as a uint64_t, the name of the destination
+     * network, a NUL, and the IRC message.
+     */
+    struct queue* outbox;
+    /**
+     * Set if this plugin may send a message right away. This is cleared by
+     * every message sent, and set again by \c rate_timer.
+     */
+    bool rate_token;
+    /**
+     * A timer that fires \c rate_limit milliseconds after each message sent
+     * by this plugin.
+     */
+    struct timer rate_timer;
+    /**
+     * A buffer for the bytes read from this plugin's socket. At any given
+     * time, this buffer may contain no full messages, or multiple messages.
+     */
+    char* recv_buf;
+    /**
+     * The number of bytes in \c recv_buf.
+     */
+    size_t recv_len;
     /**
      * A hash table containing channels that this plugin will be allowed to
-     * receive input from.
+     * receive input from. Each key is a network name and a channel name, each
+     * NUL-terminated. A key holding only a NUL-terminated network name allows
+     * every channel on that network.
      */
     struct htable* input;
     /**
      * A hash table containing channels that this plugin will be allowed to
-     * send output to.
+     * send output to, keyed the same way as \c input.
      */
     struct htable* output;
+    /**
+     * The section of the configuration file that the strings in this struct
+     * point into, held by reference.
+     */
+    json_t* source;
 };
 
 /**
@@ -247,6 +482,62 @@ struct channel{
     const char* key;
 };
 
+/**
+ * Compares two optional strings from a configuration file.
+ *
+ * \return true if exactly one of the strings is NULL, or if they differ.
+ */
+bool config_str_differs(const char* a, const char* b);
+
+/**
+ * Frees a network's configuration, disconnecting from the network first if
+ * a connection is open.
+ */
+void config_network_free(struct network* n);
+
+/**
+ * Sets how a network compares nicks and channel names, rekeying its channel
+ * and admin tables under the new casemapping.
+ *
+ * \return 0 on success.
+ * \return -1 if two configured channels or admins become the same name under
+ *         the new casemapping, or the system is out of memory, in which case
+ *         the tables keep their keys and the network its casemapping.
+ */
+int config_network_set_casemapping(struct network* n, enum casemapping mapping);
+
+/**
+ * Frees a plugin's configuration. The plugin must already be unloaded.
+ */
+void config_plugin_free(struct plugin* p);
+
+/**
+ * Frees every network and plugin in the given hash tables, then the tables
+ * themselves.
+ */
+void config_free(struct htable* networks, struct htable* plugins);
+
+/**
+ * Parses a configuration file's contents into the given structures. Each
+ * network and plugin holds its own reference to its section of \c root, so
+ * \c root may be released once this function returns.
+ *
+ * On failure, anything already added to \c networks and \c plugins must be
+ * freed with config_free().
+ *
+ * \param root     The root object of the configuration file.
+ * \param praetor  Daemon-specific configuration, which is given defaults for
+ *                 anything not specified.
+ * \param networks A hash table that receives a struct network for each
+ *                 configured network, indexed by name.
+ * \param plugins  A hash table that receives a struct plugin for each
+ *                 configured plugin, indexed by name.
+ *
+ * \return 0 on success.
+ * \return -1 if the configuration is invalid.
+ */
+int config_parse(json_t* root, struct praetor* praetor, struct htable* networks, struct htable* plugins);
+
 /**
  * Parses praetor's main configuration file, and returns the results into the
  * appropriate global objects. These are:
@@ -258,6 +549,8 @@ struct channel{
  * All fields of the rc_praetor struct are given default values, and do not
  * need to be specified by the user unless the defaults need to be overridden.
  *
+ * The absolute path of the file is kept in rc_path.
+ *
  * \param path The path to the main configuration file.
  *
  * \return 0 on success.
@@ -265,4 +558,24 @@ struct channel{
  */
 int config_load(char* path);
 
+/**
+ * Reloads the configuration file at rc_path, and applies only what changed:
+ *     - Networks that were added are connected, and networks that were
+ *       removed are sent QUIT and disconnected.
+ *     - Networks whose host, ssl, ca_file, nick, user, real_name, or pass
+ *       changed are reconnected. Otherwise, added channels are joined and
+ *       removed channels are parted, without dropping the connection.
+ *     - Plugins that were added are loaded, and plugins that were removed are
+ *       unloaded.
+ *     - Plugins whose path, type, raw, or transport changed are restarted, as
+ *       are quarantined plugins. Otherwise, their ACLs and rate limits are
+ *       replaced in place.
+ *
+ * If the file is invalid, nothing is applied.
+ *
+ * \return 0 on success, or if the file is invalid.
+ * \return -1 if the system is out of memory.
+ */
+int config_reload();
+
 #endif
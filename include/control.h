@@ -0,0 +1,87 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_CONTROL
+#define PRAETOR_CONTROL
+
+#include <jansson.h>
+
+/**
+ * The longest command, including its terminating newline, that a control
+ * client may send. Clients sending longer commands are disconnected.
+ */
+#define CONTROL_LINE_MAX 512
+
+/**
+ * The most control connections that may be open at once; more are turned
+ * away.
+ */
+#define CONTROL_CLIENTS_MAX 4
+
+/**
+ * Starts listening for administrative commands on a Unix socket, which is
+ * only accessible to praetor's own user. Connections are serviced from the
+ * event loop.
+ *
+ * Each command is a single line of words separated by spaces, and is answered
+ * by a single line holding a JSON object, whose "ok" member is true if the
+ * command succeeded. If it didn't, the "error" member says why. See
+ * control_execute() for the commands understood.
+ *
+ * \param socket_path The path of the socket. Anything already at this path is
+ *                    removed.
+ *
+ * \return 0 on success.
+ * \return -1 if the socket could not be set up.
+ */
+int control_init(const char* socket_path);
+
+/**
+ * Stops listening for commands, closes every control connection, and removes
+ * the socket.
+ */
+void control_close();
+
+/**
+ * Carries out a single command, which is one of:
+ *     - help: Lists these commands.
+ *     - status: Reports the log level, the number of interned strings, each
+ *       network's connection state, queue depths, what it supports, and how
+ *       many channels and users praetor is tracking there, and each plugin's
+ *       status, process id and queue depths.
+ *     - htables: Reports the mapping and bucket counts, load factors, and
+ *       load thresholds of every hash table in the configuration.
+ *     - metrics: Reports every metric, in the Prometheus text format, as the
+ *       "metrics" member.
+ *     - trace: Reports a summary of each latency histogram with samples, as
+ *       SIGUSR1 writes to the log, as the "trace" member: an array of
+ *       objects giving the kind, name, and stage the histogram belongs to,
+ *       its sample count, and its mean, p50, p90 and p99 in milliseconds.
+ *       Quantiles beyond the largest bucket are null.
+ *     - log_level [level]: Reports, or sets, the least severe priority that
+ *       is logged, by its name in <syslog.h>, e.g. "debug" or "warning".
+ *     - reconnect network: Drops the connection to the given network, if
+ *       there is one, and connects to it again.
+ *     - reload [plugin]: Restarts the given plugin, or reloads the whole
+ *       configuration file, as on SIGHUP.
+ *     - members network channel: Reports the nick and membership prefixes of
+ *       each member of a channel praetor is in.
+ *
+ * \param line The command, without its terminating newline. This is modified
+ *             while it's split into words.
+ *
+ * \return The response to the command, to be freed with json_decref().
+ * \return NULL if the system is out of memory.
+ */
+json_t* control_execute(char* line);
+
+#endif
@@ -16,9 +16,12 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "casemap.h"
+
 /**
  * The htable struct represents a chaining hash table. Keys are hashed using
- * Bob Jenkins's one-at-a-time hash algorithm.
+ * Bob Jenkins's one-at-a-time hash algorithm, and compared byte for byte
+ * unless the table is given a casemapping with htable_set_casemapping().
  */
 struct htable;
 
@@ -33,6 +36,12 @@ struct htable_key{
     uint8_t key[];
 };
 
+/**
+ * Hashes \c len bytes of \c key with Bob Jenkins's one-at-a-time hash, as the
+ * table does.
+ */
+uint32_t hash(const uint8_t* key, size_t len);
+
 /**
  * Creates a new hash table with \c size buckets.
  *
@@ -86,6 +95,24 @@ int htable_remove(struct htable* table, const uint8_t* key, size_t key_size);
  */
 void* htable_lookup(const struct htable* table, const uint8_t* key, size_t key_size);
 
+/**
+ * Makes the table hash and compare keys without regard to case under the
+ * given casemapping, so that, under rfc1459, "#Foo[1]" and "#foo{1}" are the
+ * same key. Keys are folded through a lookup table as they're hashed, so
+ * lookups cost about what they do in a table without a casemapping. Keys are
+ * stored as they were given, and htable_get_keys() returns them that way.
+ *
+ * The table may already hold mappings, which are rehashed under the new
+ * casemapping.
+ *
+ * \return 0 on success.
+ * \return -1 if two keys in the table would be the same key under the new
+ *         casemapping, in which case the table is left as it was.
+ * \return -2 if the system is out of memory, in which case the table is left
+ *         as it was.
+ */
+int htable_set_casemapping(struct htable* table, enum casemapping mapping);
+
 /**
  * Generates an array of keys contained within the given table.
  *
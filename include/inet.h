@@ -65,8 +65,9 @@ int inet_getaddrinfo(struct network* n);
 int inet_connect(struct network* n);
 
 /**
- * Calls \c inet_connect() for every network present in \c rc_network. This
- * function will only fail if the system is out memory.
+ * Calls \c inet_connect() for every network present in \c rc_network that
+ * isn't already connected. This function will only fail if the system is out
+ * memory.
  * 
  * \return 0 on success.
  * \return -1 on failure.
@@ -127,6 +128,17 @@ int inet_disconnect(struct network* n);
  */
 int inet_tls_upgrade(struct network* n);
 
+/**
+ * Grows the receive queue of the given network to hold \c size bytes,
+ * including its null-terminator, so that it can hold the longer lines the
+ * network says it may send.
+ *
+ * \return 0 on success, or if the receive queue is already that large.
+ * \return -1 if the system is out of memory, in which case the receive queue
+ *         is left as it was.
+ */
+int inet_grow_recv_queue(struct network* n, size_t size);
+
 /**
  * Reads from the socket belonging to the given network until its receive queue
  * is full, or until reading would block.
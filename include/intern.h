@@ -0,0 +1,116 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_INTERN
+#define PRAETOR_INTERN
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "casemap.h"
+
+/**
+ * The number of buckets the intern table starts out with. It grows as needed.
+ */
+#define INTERN_BUCKETS_MIN 1024
+
+/**
+ * The number of strings that no one holds a reference to that may stay
+ * interned, in case they're needed again soon, before they're freed. While
+ * more strings than this are in use, up to as many as are in use may stay.
+ */
+#define INTERN_UNUSED_MIN 1024
+
+/**
+ * An interned string. There is only ever one istr holding a given string, so
+ * two interned strings are equal if and only if their pointers are, and two
+ * names that differ only in case under a casemapping have the same string in
+ * that casemapping's slot of \c folded.
+ *
+ * An istr is shared by everyone holding it, and must not be modified.
+ */
+struct istr{
+    //The next string in this string's bucket
+    struct istr* next;
+    //The number of references held to this string
+    size_t refs;
+    //The hash of \c str, as returned by hash()
+    uint32_t hash;
+    //This string casefolded under each casemapping, which is this string itself if it's already casefolded
+    struct istr* folded[CASEMAP_COUNT];
+    //The length of \c str, not including its null-terminator
+    size_t len;
+    char str[];
+};
+
+/**
+ * Returns a reference to the interned copy of a string, interning it first if
+ * it isn't already.
+ *
+ * The intern table is only used from the event loop, and is not thread-safe.
+ *
+ * \param str The string, which need not be null-terminated.
+ * \param len The length of \c str.
+ *
+ * \return A reference to the interned string, to be released with
+ *         intern_release().
+ * \return NULL if the system is out of memory.
+ */
+struct istr* intern(const char* str, size_t len);
+
+/**
+ * Looks up the interned copy of a string, without taking a reference to it.
+ *
+ * \return The interned string.
+ * \return NULL if the string isn't interned.
+ */
+struct istr* intern_find(const char* str, size_t len);
+
+/**
+ * Looks up the interned copy of a string's form casefolded under \c mapping,
+ * without taking a reference to it. Any name that's interned can be found
+ * this way, whatever its case.
+ *
+ * \return The interned, casefolded string.
+ * \return NULL if the casefolded string isn't interned.
+ */
+struct istr* intern_find_folded(const char* str, size_t len, enum casemapping mapping);
+
+/**
+ * Returns the interned string whose \c str member is \c str, which must have
+ * been taken from an istr.
+ *
+ * \return The interned string.
+ * \return NULL if \c str is NULL.
+ */
+struct istr* intern_handle(const char* str);
+
+/**
+ * Takes another reference to an interned string.
+ *
+ * \return \c s.
+ */
+struct istr* intern_ref(struct istr* s);
+
+/**
+ * Releases a reference to an interned string. Once no references to it
+ * remain, the string may be freed at any time. Does nothing if \c s is NULL.
+ */
+void intern_release(struct istr* s);
+
+/**
+ * Returns the number of distinct strings currently interned, including those
+ * that no one holds a reference to.
+ */
+size_t intern_get_count();
+
+#endif
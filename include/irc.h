@@ -19,7 +19,10 @@
  * Queues the given IRC message for sending.
  *
  * No formatting will be done on the given message; it should be a complete IRC
- * message, ready to be sent as-is.
+ * message, ready to be sent as-is. A JOIN, or a PRIVMSG or NOTICE, may be
+ * merged into the message queued before it, if that's of the same kind, isn't
+ * the next message to be sent, and the merged message fits within the
+ * network's LINELEN and TARGMAX; see isupport.h.
  */
 int irc_send(const struct network* n, char* buf, size_t len);
 
@@ -55,19 +58,64 @@ int irc_recv(const struct network* n, char* buf, size_t len);
 int irc_register_connection(const struct network* n);
 
 /**
- * Joins all channels configured for the given network. This function may not
- * partially succeed; if this function fails, no JOIN messages are queued, and
- * no channels are joined.
+ * Queues a JOIN message for a single channel on the given network. Channels
+ * joined one after another share as few JOIN messages as they fit in, keyed
+ * channels first.
+ *
+ * \param n The network configuration that this function will apply to.
+ * \param c The channel to join.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory.
+ */
+int irc_join(const struct network* n, const struct channel* c);
+
+/**
+ * Joins all channels configured for the given network. If a JOIN message
+ * cannot be queued for one channel, the rest are still queued.
  *
  * This function only fails if the system is out of memory.
  *
  * \param n The network configuration that this function will apply to.
  *
  * \return 0 on success.
- * \return -1 on failure.
+ * \return -1 if any channel could not be joined.
  */
 int irc_join_all(const struct network* n);
 
+/**
+ * Queues a PART message for a single channel on the given network, using the
+ * network's quit message as the part message.
+ *
+ * \param n       The network configuration that this function will apply to.
+ * \param channel The name of the channel to leave.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory.
+ */
+int irc_part(const struct network* n, const char* channel);
+
+/**
+ * Asks a network for the members of a channel praetor is in, which state.h
+ * tracks from the reply.
+ *
+ * \return 0 on success.
+ * \return -1 if the channel's name doesn't fit in a line, or the system is
+ *         out of memory.
+ */
+int irc_names(const struct network* n, const char* channel);
+
+/**
+ * Queues a QUIT message for the given network, using the network's quit
+ * message.
+ *
+ * \param n The network configuration that this function will apply to.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory.
+ */
+int irc_quit(const struct network* n);
+
 /**
  * This function queues a PONG message as a response to the given PING message
  * for the given network.
@@ -15,6 +15,7 @@
 
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <jansson.h>
 
@@ -38,6 +39,13 @@
  */
 #define IRCMSG_SIZE_BUF 513
 
+/**
+ * The characters that may begin a channel name. See <a
+ * href="https://tools.ietf.org/html/rfc2811#section-2.1">RFC2811</a> for more
+ * information.
+ */
+#define IRCMSG_CHANNEL_PREFIXES "#&+!"
+
 enum ircmsg_type{
     JOIN = 0,
     PRIVMSG = 1,
@@ -47,7 +55,7 @@ enum ircmsg_type{
 };
 
 struct ircmsg_join{
-    char* channel;
+    const char* channel;
     char* key;
 };
 
@@ -62,7 +70,7 @@ struct ircmsg_pong{
 };
 
 struct ircmsg_privmsg{
-    char* target;
+    const char* target;
     char* msg;
     bool is_hilight;
     bool is_pm;
@@ -76,11 +84,14 @@ struct ircmsg_unknown{
 struct ircmsg{
     //Common fields
     enum ircmsg_type type;
-    char* network;
-    char* sender;
-    char* user;
-    char* host;
-    char* cmd;
+    //These, and the channel or target of a JOIN or PRIVMSG, are interned; see intern.h
+    const char* network;
+    const char* sender;
+    const char* user;
+    const char* host;
+    const char* cmd;
+    //When the message was read from its network, as returned by metrics_now(), or 0
+    uint64_t recv_at;
     //Command-specific fields
     union {
         struct ircmsg_join* join;
@@ -91,11 +102,22 @@ struct ircmsg{
     };
 };
 
+/**
+ * Determines whether a message target names a channel, rather than a user.
+ *
+ * \return true if \c target begins with one of IRCMSG_CHANNEL_PREFIXES.
+ * \return false otherwise.
+ */
+bool ircmsg_is_channel(const char* target);
+
 /**
  * Parses the given IRC message into an ircmsg struct.
  *
  * The ircmsg struct returned by this function is dynamically allocated and
- * must be freed by the caller via ircmsg_free().
+ * must be freed by the caller via ircmsg_free(). Its network, prefix, command,
+ * and JOIN or PRIVMSG target strings are interned, so that two messages from
+ * the same sender share the same \c sender string, and intern_handle() can be
+ * used to find its hash and casefolded form.
  *
  * \param network The network that the given message was destined to, or was
  *                received from.
@@ -113,7 +135,8 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len);
  *
  * This function is meant to work with ircmsg structs that are allocated both
  * dynamically or on the stack, and does not free the struct itself; it only
- * frees memory associated with the fields contained within the object.
+ * frees memory associated with the fields contained within the object, and
+ * releases its interned strings.
  */
 void ircmsg_free(struct ircmsg* msg);
 
@@ -127,18 +150,23 @@ void ircmsg_free(struct ircmsg* msg);
 json_t* ircmsg_to_json(const struct ircmsg* msg);
 
 /**
- * Unpacks the given JSON object into an ircmsg struct.
+ * Builds an IRC message from a JSON message sent by a plugin. Currently, only
+ * PRIVMSG messages are supported.
  *
- * The returned IRC message string must be freed by the caller. The network to
- * which this message is destined will be stored at the pointer pointed to by
- * \c network. This string must also be freed by the caller.
+ * The returned IRC message string must be freed by the caller. The network
+ * and target to which this message is destined are stored at the pointers
+ * pointed to by \c network and \c target. These strings belong to \c obj,
+ * and remain valid only as long as \c obj does.
  *
  * \param[out] network The network to which this message is destined.
+ * \param[out] target  The channel or nick to which this message is destined.
+ * \param linelen      The longest line the network accepts, including its
+ *                     CRLF. Longer messages are truncated.
  *
- * \return An ircmsg struct on success.
+ * \return A NUL-terminated IRC message, including its CRLF, on success.
  * \return NULL on failure.
  */
-char* ircmsg_from_json(json_t* obj, char** network);
+char* ircmsg_from_json(json_t* obj, const char** network, const char** target, size_t linelen);
 
 /**
  * The functions below implement the IRC message types described in RFC 2812
@@ -146,12 +174,19 @@ char* ircmsg_from_json(json_t* obj, char** network);
  *
  * On success, these functions return a dynamically-allocated string which must
  * be freed by the caller. On failure they return NULL.
+ *
+ * Those taking a \c linelen build lines of at most that many bytes, including
+ * the CRLF, which is the network's LINELEN (see isupport.h), or
+ * IRCMSG_SIZE_MAX. Text that doesn't fit is truncated, but a JOIN whose
+ * channels don't fit is not built at all.
  */
-char* ircmsg_join(const char* channels, const char* keys);
+char* ircmsg_join(const char* channels, const char* keys, size_t linelen);
 char* ircmsg_nick(const char* nick);
+char* ircmsg_part(const char* channels, const char* message, size_t linelen);
 char* ircmsg_pass(const char* pass);
 char* ircmsg_pong(const char* server, const char* server2);
-char* ircmsg_privmsg(const char* msgtarget, const char* text);
+char* ircmsg_privmsg(const char* msgtarget, const char* text, size_t linelen);
+char* ircmsg_quit(const char* message, size_t linelen);
 char* ircmsg_user(const char* user, const char* mode, const char* real_name);
 
 #endif
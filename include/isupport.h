@@ -0,0 +1,165 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_ISUPPORT
+#define PRAETOR_ISUPPORT
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <jansson.h>
+
+#include "ircmsg.h"
+#include "state.h"
+
+/**
+ * The longest line, including its terminating carriage-return and newline,
+ * that praetor will send or receive, however long a network says its lines
+ * may be.
+ */
+#define ISUPPORT_LINELEN_MAX 4096
+
+/**
+ * The most commands a network's TARGMAX may give limits for, and the longest
+ * command name among them.
+ */
+#define ISUPPORT_TARGMAX_MAX 16
+#define ISUPPORT_CMD_MAX 15
+
+/**
+ * The most groups of channel prefixes a network's CHANLIMIT may give limits
+ * for.
+ */
+#define ISUPPORT_CHANLIMIT_MAX 8
+
+/**
+ * The most characters a network's CHANTYPES may list.
+ */
+#define ISUPPORT_CHANTYPES_MAX 8
+
+/**
+ * A limit that isn't limited.
+ */
+#define ISUPPORT_UNLIMITED SIZE_MAX
+
+struct network;
+
+/**
+ * A limit a network places on a single command, or a group of channels.
+ */
+struct isupport_limit{
+    //The command, or the channel prefixes the limit applies to
+    char name[ISUPPORT_CMD_MAX + 1];
+    size_t max;
+};
+
+/**
+ * What a network says it supports in its RPL_ISUPPORT (005) replies. Until a
+ * network says otherwise, praetor assumes the limits of RFC 1459. The
+ * network's CASEMAPPING is kept in struct network, since its tables are keyed
+ * under it.
+ */
+struct isupport{
+    /**
+     * The longest line the network accepts, including its terminating
+     * carriage-return and newline, from LINELEN.
+     */
+    size_t linelen;
+    /**
+     * The longest nick the network allows, from NICKLEN, or
+     * ISUPPORT_UNLIMITED if it hasn't said.
+     */
+    size_t nicklen;
+    /**
+     * The most parameterized modes a single MODE command may change, from
+     * MODES.
+     */
+    size_t modes;
+    /**
+     * The most targets a PRIVMSG or NOTICE may have, from MAXTARGETS, for
+     * networks that don't send TARGMAX.
+     */
+    size_t maxtargets;
+    /**
+     * The most targets each command may have, from TARGMAX.
+     */
+    struct isupport_limit targmax[ISUPPORT_TARGMAX_MAX];
+    size_t targmax_count;
+    /**
+     * The most channels of each type praetor may be in, from CHANLIMIT.
+     */
+    struct isupport_limit chanlimit[ISUPPORT_CHANLIMIT_MAX];
+    size_t chanlimit_count;
+    /**
+     * The membership prefix modes, and the symbol for each, from PREFIX.
+     */
+    char prefix_modes[STATE_PREFIX_MAX + 1];
+    char prefix_symbols[STATE_PREFIX_MAX + 1];
+    /**
+     * The channel modes that take a parameter, from CHANMODES. See state.h.
+     */
+    char chanmodes_list[STATE_CHANMODES_MAX + 1];
+    char chanmodes_param[STATE_CHANMODES_MAX + 1];
+    char chanmodes_set_param[STATE_CHANMODES_MAX + 1];
+    /**
+     * The characters a channel name may begin with, from CHANTYPES, or
+     * IRCMSG_CHANNEL_PREFIXES if the network hasn't said.
+     */
+    char chantypes[ISUPPORT_CHANTYPES_MAX + 1];
+};
+
+/**
+ * Sets every limit to what's assumed of a network that hasn't said what it
+ * supports.
+ */
+void isupport_init(struct isupport* is);
+
+/**
+ * Updates what a network supports from an RPL_ISUPPORT reply it sent, and
+ * applies the changes: a new CASEMAPPING rekeys the network's tables and
+ * state, a longer LINELEN grows its receive buffer, and PREFIX and CHANMODES
+ * change how its state reads MODE messages and NAMES replies, with the modes
+ * of members already tracked carried over to the new prefixes. Any other
+ * message is ignored.
+ */
+void isupport_update(struct network* n, const struct ircmsg* msg);
+
+/**
+ * Returns the most targets a command may be sent to at once on a network.
+ * Commands the network gives no limit for are assumed to take a single
+ * target, except for JOIN and PART, which RFC 1459 lets take any number, and
+ * PRIVMSG and NOTICE, which take MAXTARGETS.
+ */
+size_t isupport_targmax(const struct isupport* is, const char* cmd);
+
+/**
+ * Returns the most channels praetor may be in on a network that are of the
+ * same type as \c channel.
+ */
+size_t isupport_chanlimit(const struct isupport* is, const char* channel);
+
+/**
+ * Returns whether a target names a channel on a network, going by the
+ * network's CHANTYPES.
+ */
+bool isupport_is_channel(const struct isupport* is, const char* target);
+
+/**
+ * Packs what a network supports into a JSON object, for the control socket.
+ *
+ * \return A JSON object, which must be freed with json_decref().
+ * \return NULL if the system is out of memory.
+ */
+json_t* isupport_to_json(const struct network* n);
+
+#endif
@@ -22,21 +22,60 @@
  */
 #define LOG_FACILITY LOG_DAEMON
 
+/**
+ * The least severe priority that is compiled into praetor. Messages less
+ * severe than this are removed at build time, along with the evaluation of
+ * their arguments. By default nothing is removed; build with, for example,
+ * -DPRAETOR_LOG_LEVEL=LOG_WARNING to remove debug, info, and notice messages.
+ */
+#ifndef PRAETOR_LOG_LEVEL
+#define PRAETOR_LOG_LEVEL LOG_DEBUG
+#endif
+
 /**
  * If this variable is set to true, logs will include debug messages.
  */
 extern bool debug;
 
+/**
+ * The least severe priority that is logged at runtime. This is LOG_WARNING by
+ * default, and LOG_DEBUG in debug mode.
+ */
+extern int log_threshold;
+
 /**
  * If this variable is set to true, logs will be written to stdout instead of
- * the syslog.
+ * the syslog, unless a log file was given to log_init().
  */
 extern bool foreground;
 
 /**
- * Logs messages to the foreground. This function should not be used directly
+ * The file given to log_init(), or NULL if logs aren't written to a file.
+ */
+extern const char* log_path;
+
+/**
+ * The number of messages that the log can hold before the writer thread
+ * catches up. Messages logged while the log is full are dropped, and counted.
+ * This must be a power of two.
+ */
+#define LOG_RING_SIZE 1024
+
+/**
+ * The longest a single message may be, including its timestamp. Longer
+ * messages are truncated.
+ */
+#define LOG_RECORD_SIZE 1024
+
+/**
+ * Formats a message, and hands it to the writer thread. Until log_init() has
+ * been called, or for messages at LOG_ERR or above, the message is written out
+ * before this function returns. This function should not be used directly
  * under normal circumstances. Use the logmsg() macro instead.
  *
+ * This function is safe to call from any thread, and never blocks on other
+ * threads, except to wait for errors to be written.
+ *
  * \param loglevel One of the set of log priorities defined in <syslog.h>. Do
  *                 \b not include the logging facility. This function will use the logging
  *                 facility defined by LOG_FACILITY by default.
@@ -45,19 +84,44 @@ extern bool foreground;
 void logprintf(int loglevel, char* msg, ...);
 
 /**
- * This macro defines the logic for choosing whether to log messages to the
- * syslog, or to stdout. Use this macro wherever a message needs to be logged.
+ * Starts the thread that writes out logged messages, so that logging no
+ * longer waits on the destination. This must be called after daemonizing,
+ * since the thread doesn't survive fork().
+ *
+ * \param path If not NULL, the file to which messages are appended. Otherwise,
+ *             messages go to stdout in foreground mode, or to the syslog.
+ *
+ * \return 0 on success.
+ * \return -1 if the log file could not be opened, or the thread could not be
+ *         started. Messages are then written out synchronously.
+ */
+int log_init(const char* path);
+
+/**
+ * Waits until every message logged so far has been written out. This should
+ * be called before anything that would discard the writer thread, like
+ * exec().
+ */
+void log_flush();
+
+/**
+ * Evaluates to true if messages at the given priority are logged. Wrap any
+ * work done only to build a log message in this, so that it's skipped along
+ * with the message.
+ */
+#define LOG_ENABLED(loglevel) ((loglevel) <= PRAETOR_LOG_LEVEL && (loglevel) <= log_threshold)
+
+/**
+ * This macro filters out messages below the configured verbosity, and hands
+ * the rest to logprintf(). Use this macro wherever a message needs to be
+ * logged.
+ *
+ * Priorities are compile-time constants, so the first half of LOG_ENABLED()
+ * either removes the call entirely or folds away, leaving a single comparison
+ * against log_threshold before any of the arguments are evaluated.
  */
 #define logmsg(loglevel, ...) do{\
-    if(!debug){\
-        if(loglevel == LOG_DEBUG || loglevel == LOG_INFO || loglevel == LOG_NOTICE){\
-            break;\
-        }\
-    }\
-    if(!foreground){\
-        syslog(LOG_FACILITY | loglevel, __VA_ARGS__);\
-    }\
-    else{\
+    if(LOG_ENABLED(loglevel)){\
         logprintf(loglevel, __VA_ARGS__);\
     }\
 } while(0);
@@ -0,0 +1,166 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_METRICS
+#define PRAETOR_METRICS
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The number of finite buckets in a histogram. Their upper bounds, in
+ * nanoseconds, are listed in metrics.c, and range from 10 microseconds to 1
+ * second.
+ */
+#define METRICS_BUCKET_COUNT 15
+
+/**
+ * A distribution of durations, reported as a Prometheus histogram in seconds.
+ */
+struct metrics_histogram{
+    /**
+     * The number of observations that fell into each bucket, and not into any
+     * smaller one. Observations larger than the largest bucket are only
+     * counted in \c count.
+     */
+    uint64_t buckets[METRICS_BUCKET_COUNT];
+    uint64_t count;
+    /**
+     * The sum of all observations, in nanoseconds.
+     */
+    uint64_t sum;
+};
+
+/**
+ * Counters kept for each network. These live in struct network, and so are
+ * kept across reloads for as long as the connection is.
+ */
+struct network_metrics{
+    uint64_t lines_in;
+    uint64_t lines_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    /**
+     * Lines received that ircmsg_parse() could not make sense of.
+     */
+    uint64_t parse_failures;
+    /**
+     * Connections that were lost or failed, and retried.
+     */
+    uint64_t reconnects;
+    /**
+     * The time from a line's last bytes being read to the line being handled.
+     */
+    struct metrics_histogram read_latency;
+    /**
+     * The time from a line being handled to it having been parsed and handed
+     * to every plugin that may read it.
+     */
+    struct metrics_histogram parse_latency;
+    /**
+     * The time traced plugin replies spent in the send queue.
+     */
+    struct metrics_histogram send_queue_latency;
+    /**
+     * The time from a traced message being read to a plugin's reply to it
+     * being sent.
+     */
+    struct metrics_histogram total_latency;
+};
+
+/**
+ * Counters kept for each plugin, in struct plugin.
+ */
+struct plugin_metrics{
+    /**
+     * Messages written to the plugin in full, or handed to it, for shared
+     * object plugins.
+     */
+    uint64_t delivered;
+    /**
+     * Messages discarded rather than written to the plugin.
+     */
+    uint64_t dropped;
+    /**
+     * The time between a message being queued for the plugin, and it being
+     * written to the plugin in full.
+     */
+    struct metrics_histogram ipc_latency;
+    /**
+     * The time from a traced message being written to the plugin to the
+     * plugin's reply being read.
+     */
+    struct metrics_histogram reply_latency;
+    /**
+     * The time traced replies were held back by the plugin's rate limit.
+     */
+    struct metrics_histogram rate_limit_latency;
+};
+
+/**
+ * The time spent in each iteration of the event loop, not counting the time
+ * spent waiting in poll().
+ */
+extern struct metrics_histogram metrics_loop;
+
+/**
+ * Returns the current time on the monotonic clock, in nanoseconds.
+ */
+uint64_t metrics_now();
+
+/**
+ * Records a duration in a histogram.
+ *
+ * \param ns The duration, in nanoseconds.
+ */
+void metrics_observe(struct metrics_histogram* h, uint64_t ns);
+
+/**
+ * Estimates a quantile of a histogram.
+ *
+ * \param q The quantile, between 0 and 1.
+ *
+ * \return The upper bound, in nanoseconds, of the bucket the quantile falls
+ *         in, or UINT64_MAX if it falls beyond the largest bucket.
+ */
+uint64_t metrics_quantile(const struct metrics_histogram* h, double q);
+
+/**
+ * Starts serving metrics in the Prometheus text format, over HTTP, on a Unix
+ * socket, a port of the loopback interface, or both. Connections are accepted
+ * and answered from the event loop.
+ *
+ * \param socket_path The path of a Unix socket to listen on, or NULL. Anything
+ *                    already at this path is removed.
+ * \param port        The port of 127.0.0.1 to listen on, or 0.
+ *
+ * \return 0 on success.
+ * \return -1 if either socket could not be set up.
+ */
+int metrics_init(const char* socket_path, int port);
+
+/**
+ * Stops serving metrics, and removes the Unix socket, if there is one.
+ */
+void metrics_close();
+
+/**
+ * Renders every metric in the Prometheus text format.
+ *
+ * \param len Set to the length of the returned text.
+ *
+ * \return A null-terminated string, to be freed by the caller.
+ * \return NULL if the system is out of memory.
+ */
+char* metrics_render(size_t* len);
+
+#endif
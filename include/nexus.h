@@ -29,6 +29,23 @@
  */
 int watch_add(int fd, bool connection);
 
+/**
+ * Adds a file descriptor to the global file descriptor monitor list, along
+ * with a function to be called from run() whenever poll() reports activity on
+ * it. This is for descriptors that belong to neither a network nor a plugin.
+ *
+ * \param fd    A valid file descriptor.
+ * \param write If set \c true, the descriptor is monitored for writability
+ *              instead of readability.
+ * \param fn    The function to be called with the descriptor, the events
+ *              reported by poll(), and \c arg.
+ *
+ * \return 0 if the file descriptor was successfully added to the monitor list.
+ * \return -1 on an out-of-memory condition, or if the descriptor already has a
+ *         callback.
+ */
+int watch_add_callback(int fd, bool write, void (*fn)(int fd, short revents, void* arg), void* arg);
+
 /**
  * Removes a file descriptor from the global file descriptor monitor list.
  *
@@ -14,14 +14,43 @@
 #define PRAETOR_PLUGIN
 
 #include <jansson.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #include "config.h"
+#include "htable.h"
 #include "ircmsg.h"
 
+/**
+ * The file descriptors at which a plugin using the shared memory transport
+ * will find the ring carrying messages from praetor, and the ring carrying
+ * messages to praetor, respectively. See ring.h for the layout of a ring.
+ */
+#define PLUGIN_RING_FD_IN 3
+#define PLUGIN_RING_FD_OUT 4
+
+/**
+ * The size of the buffer required to hold any key built by plugin_acl_key().
+ */
+#define PLUGIN_ACL_KEY_SIZE 1024
+
 /**
  * Loads an executable plugin from its configured path. The executable will be
- * forked, and its standard streams will be directed over an anonymous UNIX
- * domain socket toward praetor.
+ * started with posix_spawn(), and its standard input and output will be
+ * directed over an anonymous UNIX domain socket toward praetor. Apart from its
+ * standard error and the descriptors described below, the plugin inherits no
+ * file descriptors from praetor, and starts with an empty signal mask.
+ *
+ * If the plugin uses the shared memory transport, a ring is created for each
+ * direction and passed to the plugin at PLUGIN_RING_FD_IN and
+ * PLUGIN_RING_FD_OUT, and \c PRAETOR_TRANSPORT=shm is set in its environment.
+ * Whenever praetor writes to the plugin's ring while the plugin is asleep (see
+ * ring_sleep()), it writes a single byte to the plugin's socket to wake it,
+ * and expects the plugin to do the same.
+ *
+ * Shared plugins are instead loaded into praetor with dlopen(), and must
+ * export a struct praetor_plugin as described in plugin_abi.h. No process or
+ * socket is created for them.
  *
  * \return 0 on success.
  * \return -1 if the plugin could not be loaded.
@@ -39,7 +68,8 @@ int plugin_load_all();
 /**
  * Unloads a currently-loaded executable plugin by removing its mappings in the
  * rc_plugin and rc_plugin_sock hash tables, closing its socket connection, and
- * then terminating its process.
+ * then terminating its process. Shared plugins are shut down and closed with
+ * dlclose() instead.
  *
  * \return 0 on success.
  * \return -1 if the plugin could not be terminated successfully.
@@ -73,29 +103,194 @@ int plugin_reload(struct plugin* p);
 int plugin_reload_all();
 
 /**
- * Converts the given IRC message into a JSON message, and sends it to the
- * given plugin.
+ * Writes every message batched for the given plugin in as few calls to
+ * writev() as possible.
  *
- * If the message could not be sent, the plugin will be reloaded via
- * plugin_reload().
+ * If writing would block, the remainder of the batch is kept, and another
+ * flush is scheduled shortly afterward. If writing fails for any other reason,
+ * the plugin will be unloaded.
+ *
+ * \return 0 on success, or if writing would have blocked.
+ * \return -1 if the plugin had to be unloaded.
+ */
+int plugin_flush(struct plugin* p);
+
+/**
+ * Adds a serialized message to the given plugin's batch, taking ownership of
+ * \c buf.
+ *
+ * The batch is flushed via plugin_flush() as soon as it holds
+ * rc_praetor->batch_size messages, or once rc_praetor->batch_delay
+ * milliseconds have passed since the first message was added. If
+ * rc_praetor->batch_delay is 0, the caller is responsible for flushing the
+ * batch at the end of the current event loop iteration.
+ *
+ * \param buf   A dynamically-allocated message, which will be freed once it
+ *              has been written.
+ * \param len   The length of \c buf.
+ * \param trace The correlation id of the message, or 0 if it isn't traced.
  *
  * \return 0 on success.
- * \return -1 on failure to send the JSON message.
+ * \return -1 if the batch was full and could not be flushed, or if the plugin
+ *         had to be unloaded.
+ */
+int plugin_queue(struct plugin* p, char* buf, size_t len, uint64_t trace);
+
+/**
+ * Converts the given IRC message into a JSON message, and queues it for the
+ * given plugin via plugin_queue(). Shared plugins are handed the message
+ * directly, through their \c on_event function.
+ *
+ * \return 0 on success.
+ * \return -1 on failure to queue the JSON message.
  * \return -2 on failure to convert the given IRC message into a JSON message.
  */
 int plugin_send(struct plugin* p, struct ircmsg* msg);
 
+/**
+ * Sends a raw IRC line to the given plugin, without parsing it or converting
+ * it into a JSON message. The line is prefixed by the name of the network it
+ * was received from and a single space, i.e.
+ *
+ *     network :nick!user@host PRIVMSG #channel :text\r\n
+ *
+ * This is the only form of input received by plugins that have \c raw set.
+ * The line is queued via plugin_queue(), or handed directly to a shared
+ * plugin's \c on_raw function.
+ *
+ * \param network The name of the network the line was received from.
+ * \param line    The IRC line, including its terminating carriage-return and
+ *                newline.
+ * \param len     The length of \c line.
+ *
+ * \return 0 on success.
+ * \return -1 on failure to queue the line.
+ */
+int plugin_send_raw(struct plugin* p, const char* network, const char* line, size_t len);
+
 /**
  * Reads a JSON message from the specified plugin.
  *
- * If the message could not be loaded or parsed, the plugin will be reloaded
- * via plugin_reload().
+ * Input from the plugin's socket is buffered, since a message may arrive
+ * across several reads, and a single read may hold several messages. Each call
+ * returns at most one message, so this function should be called until it
+ * returns NULL.
+ *
+ * If the plugin sends a malformed message, or a message larger than praetor's
+ * receive buffer, the plugin will be unloaded via plugin_unload(). If the
+ * plugin closes its socket, the socket is no longer monitored, and the plugin
+ * is left to the supervisor once its process terminates.
+ *
+ * For plugins using the shared memory transport, this function reads one
+ * message from the plugin's ring. Here, too, it should be called until it
+ * returns NULL, since the plugin will not wake praetor again until praetor has
+ * found the ring empty.
  *
  * \return A pointer to the received JSON object on success.
- * \return NULL if input could not be read successfully.
+ * \return NULL if no complete message is available, or on error.
  */
 json_t* plugin_recv(struct plugin* p);
 
+/**
+ * Builds the key under which a channel is stored in a plugin's \c input and
+ * \c output hash tables: the network name and the channel name, each
+ * NUL-terminated.
+ *
+ * \param buf A buffer of at least PLUGIN_ACL_KEY_SIZE bytes.
+ *
+ * \return The size of the key on success.
+ * \return 0 if the key would not fit in PLUGIN_ACL_KEY_SIZE bytes.
+ */
+size_t plugin_acl_key(char* buf, const char* network, const char* channel);
+
+/**
+ * Sends a complete line from a plugin to a network, holding it in the
+ * plugin's outbox if the plugin is over its rate limit, to be sent by
+ * plugin_rate_timeout(). The caller must have checked the line against the
+ * plugin's ACLs.
+ *
+ * \param id The correlation id of the message the line answers, or 0.
+ *
+ * \return 0 if the line was queued for the network, or held in the outbox.
+ * \return -1 if the outbox is full, or the system is out of memory.
+ */
+int plugin_send_line(struct plugin* p, struct network* n, const char* msg, size_t len, uint64_t id);
+
+/**
+ * Checks whether a plugin's \c input or \c output hash table allows the given
+ * channel.
+ *
+ * \return true if the table allows every channel on the network, or this
+ *         channel in particular.
+ * \return false otherwise.
+ */
+bool plugin_acl_allows(const struct htable* acl, const char* network, const char* channel);
+
+/**
+ * Checks whether a message received from a network may be sent to a plugin,
+ * according to the plugin's \c input and \c private_messages
+ * configuration for that network. On a network with a plugins section, a
+ * plugin that isn't listed there may read nothing. Raw plugins are held to
+ * the same rules; \c msg is NULL for a line that could not be parsed, which
+ * may only be read on networks without a plugins section.
+ *
+ * \return true if the plugin may receive the message.
+ * \return false otherwise.
+ */
+bool plugin_can_read(const struct plugin* p, const struct network* n, const struct ircmsg* msg);
+
+/**
+ * Checks whether a plugin may send a message to the given channel or nick on
+ * a network, according to the plugin's \c output and \c private_messages
+ * configuration for that network.
+ *
+ * \return true if the plugin may send the message.
+ * \return false otherwise.
+ */
+bool plugin_can_write(const struct plugin* p, const struct network* n, const char* target);
+
+/**
+ * Sends the next message waiting in a plugin's outbox, or allows the plugin
+ * to send its next message immediately if none are waiting. This is the
+ * callback for every plugin's \c rate_timer.
+ */
+void plugin_rate_timeout(void* arg);
+
+/**
+ * Answers a plugin's query about the channels praetor is in, by queueing a
+ * JSON reply for the plugin. A query is one of:
+ *     - {"query": "members", "network": ..., "channel": ...}: Answered with a
+ *       "members" object mapping the nick of each member of the channel to
+ *       their membership prefixes, or null if praetor is not in the channel.
+ *     - {"query": "channels", "network": ..., "nick": ...}: Answered with a
+ *       "channels" object mapping each channel in which praetor can see the
+ *       nick to the nick's membership prefixes there.
+ * The reply also echoes the query's other members. Channels outside the
+ * plugin's input ACL can't be queried, and are left out of replies.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory.
+ * \return -2 if the query was malformed, or not allowed by the plugin's ACLs.
+ */
+int plugin_query(struct plugin* p, json_t* obj);
+
+/**
+ * Converts a JSON message received from a plugin into an IRC message, and
+ * sends it to the network it names, if the plugin's ACLs allow it.
+ *
+ * If the plugin is rate-limited and has sent a message within the last
+ * \c rate_limit milliseconds, the message is held in the plugin's outbox
+ * instead, up to a fixed number of messages.
+ *
+ * Messages with a "query" member are instead answered by plugin_query().
+ *
+ * \return 0 on success.
+ * \return -1 on failure to queue the message.
+ * \return -2 if the message was malformed, or not allowed by the plugin's
+ *         ACLs.
+ */
+int plugin_dispatch(struct plugin* p, json_t* obj);
+
 /**
  * Returns a pointer to the name of the plugin author(s).
  */
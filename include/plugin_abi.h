@@ -0,0 +1,126 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_PLUGIN_ABI
+#define PRAETOR_PLUGIN_ABI
+
+#include <stddef.h>
+
+#include "ircmsg.h"
+
+/**
+ * The version of the interface described in this file. praetor refuses to
+ * load a shared plugin built against any other version.
+ */
+#define PRAETOR_PLUGIN_ABI_VERSION 2
+
+/**
+ * The name of the symbol that every shared plugin must export. The symbol must
+ * be a struct praetor_plugin.
+ */
+#define PRAETOR_PLUGIN_SYMBOL "praetor_plugin"
+
+/**
+ * The functions praetor makes available to shared plugins. A pointer to this
+ * struct is passed to a plugin's init function, and remains valid until its
+ * shutdown function returns.
+ */
+struct praetor_api{
+    /**
+     * Always PRAETOR_PLUGIN_ABI_VERSION.
+     */
+    unsigned int abi_version;
+    /**
+     * Queues a raw IRC message to be sent to a network. The message must be a
+     * single line including its terminating CRLF, and is copied before this
+     * function returns. It may only be called from the plugin's other
+     * functions, while praetor is running them.
+     *
+     * Messages are held to the plugin's output ACLs and rate limit like those
+     * of any other plugin: on a network with a plugins section, every channel
+     * or nick in the message's first parameter must be one the plugin may
+     * send to, and messages over the rate limit wait in the plugin's outbox.
+     *
+     * \return 0 on success, including when the message waits in the outbox.
+     * \return -1 if the network does not exist, the message is too long or
+     *         not a single line, the plugin may not send it, the plugin's
+     *         outbox is full, or the system is out of memory.
+     */
+    int (*send)(const char* network, const char* line, size_t len);
+    /**
+     * Logs a message through praetor, at one of the priorities defined in
+     * <syslog.h>.
+     */
+    void (*log)(int loglevel, const char* msg);
+    /**
+     * Calls \c fn with the nick of each member of a channel that praetor is
+     * in, along with the membership prefixes the member has there, such as
+     * "@" for a channel operator, most powerful first. The strings passed to
+     * \c fn are only valid until it returns.
+     *
+     * \return 0 on success.
+     * \return -1 if the network does not exist, or praetor is not in the
+     *         channel.
+     */
+    int (*members)(const char* network, const char* channel, void (*fn)(void* arg, const char* nick, const char* prefixes), void* arg);
+    /**
+     * Calls \c fn with the name of each channel in which praetor can see the
+     * given nick, along with the membership prefixes the nick has there. The
+     * strings passed to \c fn are only valid until it returns.
+     *
+     * \return 0 on success.
+     * \return -1 if the network does not exist, or praetor can't see the nick
+     *         in any channel.
+     */
+    int (*channels)(const char* network, const char* nick, void (*fn)(void* arg, const char* channel, const char* prefixes), void* arg);
+};
+
+/**
+ * The interface exported by a shared plugin, under the name
+ * PRAETOR_PLUGIN_SYMBOL.
+ *
+ * Shared plugins run inside praetor's process, on its event loop. They must
+ * not block, and a shared plugin that crashes takes praetor with it.
+ */
+struct praetor_plugin{
+    /**
+     * Must be PRAETOR_PLUGIN_ABI_VERSION.
+     */
+    unsigned int abi_version;
+    /**
+     * Called once, right after the plugin is loaded. Anything stored in \c ctx
+     * is passed back to the plugin's other functions. May be NULL.
+     *
+     * \return 0 on success.
+     * \return -1 if the plugin could not be initialized, in which case it will
+     *         be unloaded without a call to \c shutdown.
+     */
+    int (*init)(const struct praetor_api* api, void** ctx);
+    /**
+     * Called for every message received from a network. The message belongs
+     * to praetor, and must not be modified or used after this function
+     * returns.
+     */
+    void (*on_event)(void* ctx, const struct ircmsg* msg);
+    /**
+     * Called for every line received from a network if the plugin is
+     * configured to receive raw lines, in place of \c on_event. The line
+     * includes its terminating CRLF and is not NUL-terminated. May be NULL.
+     */
+    void (*on_raw)(void* ctx, const char* network, const char* line, size_t len);
+    /**
+     * Called once, right before the plugin is unloaded. May be NULL.
+     */
+    void (*shutdown)(void* ctx);
+};
+
+#endif
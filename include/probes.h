@@ -0,0 +1,69 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_PROBES
+#define PRAETOR_PROBES
+
+/**
+ * \file
+ * Static tracepoints for perf, bpftrace, SystemTap, and the like.
+ *
+ * When praetor is built with PRAETOR_USDT set to 1, each PROBE macro becomes
+ * a USDT probe in the "praetor" provider: a single nop in the instruction
+ * stream, plus a note telling tracers where its arguments live. Arguments are
+ * computed whether or not a tracer is attached, so probes only take values
+ * that are already at hand. Otherwise, the macros expand to nothing. See
+ * example/bpftrace/ for scripts that use them.
+ *
+ * The probes, and their arguments, are:
+ *     - line_received(const char* network, const char* line, size_t len)
+ *           A line was taken from a network's receive buffer.
+ *     - parse_done(const char* network, const char* cmd)
+ *           That line was parsed.
+ *     - event_dispatched(const char* plugin, uint64_t id)
+ *           A message was queued for a plugin, or handed to a shared plugin.
+ *           \c id is the message's correlation id, or 0.
+ *     - frame_received(const char* plugin, uint64_t id)
+ *           A message from a plugin is about to be dispatched. \c id is the
+ *           correlation id the plugin echoed, or 0.
+ *     - line_enqueued(const char* network, const char* line, size_t len)
+ *           A line was added to a network's send queue by irc_send().
+ *     - line_written(const char* network, const char* line, size_t len)
+ *           A line was written to a network's socket.
+ *     - connect(const char* network, const char* host)
+ *           A connection to a network was started.
+ *     - disconnect(const char* network)
+ *           A connection to a network was torn down.
+ *     - timer_fire(void* arg, uint64_t late)
+ *           A timer fired, \c late milliseconds after its deadline. \c arg is
+ *           the argument the timer was initialized with.
+ *
+ * Lines are not necessarily null-terminated; read them using their length.
+ */
+
+#if PRAETOR_USDT
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(praetor, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(praetor, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(praetor, name, a, b, c)
+
+#else
+
+#define PROBE1(name, a) do{}while(0)
+#define PROBE2(name, a, b) do{}while(0)
+#define PROBE3(name, a, b, c) do{}while(0)
+
+#endif
+
+#endif
@@ -89,6 +89,40 @@ struct item* queue_dequeue(struct queue* q);
  */
 struct item* queue_peek(struct queue* q);
 
+/**
+ * Returns a copy of the item at the back of the queue. The caller is
+ * responsible for freeing the returned item.
+ *
+ * This function will fail if the system is out of memory, or if there are no
+ * items in the queue.
+ *
+ * \return On success, returns an item.
+ * \return On failure, returns NULL.
+ */
+struct item* queue_peek_tail(struct queue* q);
+
+/**
+ * Replaces the value of the item at the back of the queue with \c size bytes
+ * of \c value, leaving its place in the queue as it was.
+ *
+ * This function will fail if the system is out of memory, or if there are no
+ * items in the queue, in which case the queue is left as it was.
+ *
+ * \return 0 on success.
+ * \return -1 on failure.
+ */
+int queue_replace_tail(struct queue* q, const void* value, size_t size);
+
+/**
+ * Calls \c fn with the value of each item in the queue, from front to back,
+ * without removing them. \c fn must not modify the queue.
+ *
+ * \return 0 on success.
+ * \return -1 if \c fn returned -1, in which case the remaining items are
+ *         skipped.
+ */
+int queue_foreach(const struct queue* q, int (*fn)(void* arg, const uint8_t* value, size_t size), void* arg);
+
 /**
  * Returns the number of items present in the given queue.
  */
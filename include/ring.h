@@ -0,0 +1,189 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_RING
+#define PRAETOR_RING
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * The size, in bytes, that the fields of a ring header are padded to, so that
+ * the producer and the consumer do not write to the same cache line.
+ */
+#define RING_CACHE_LINE 64
+
+/**
+ * The value stored in the \c magic field of every ring header.
+ */
+#define RING_MAGIC 0x52474e52
+
+/**
+ * The header at the start of every shared memory segment containing a ring.
+ *
+ * A ring is a single-producer, single-consumer queue of variably-sized
+ * records. Each record is stored as a 32-bit length in host byte order,
+ * followed by that many bytes of payload. Records may wrap around the end of
+ * the data area, which immediately follows this header.
+ *
+ * \c head and \c tail are free-running byte counters; the number of bytes in
+ * use is always <tt>head - tail</tt>, modulo 2^32.
+ */
+struct ring_header{
+    /**
+     * Always RING_MAGIC.
+     */
+    uint32_t magic;
+    /**
+     * The size of the data area, in bytes. This is always a power of two.
+     */
+    uint32_t size;
+    char pad0[RING_CACHE_LINE - (2 * sizeof(uint32_t))];
+    /**
+     * The position at which the producer will write the next record. Only the
+     * producer may modify this field.
+     */
+    _Atomic uint32_t head;
+    char pad1[RING_CACHE_LINE - sizeof(uint32_t)];
+    /**
+     * The position at which the consumer will read the next record. Only the
+     * consumer may modify this field.
+     */
+    _Atomic uint32_t tail;
+    /**
+     * Set by the consumer right before it goes to sleep waiting for input, and
+     * cleared by whichever producer wakes it.
+     */
+    _Atomic uint32_t waiting;
+    char pad2[RING_CACHE_LINE - (2 * sizeof(uint32_t))];
+};
+
+/**
+ * A handle for a ring mapped into this process.
+ */
+struct ring{
+    struct ring_header* hdr;
+    uint8_t* data;
+    /**
+     * The file descriptor for the shared memory segment holding the ring.
+     */
+    int fd;
+    /**
+     * The size of the mapping, including the header.
+     */
+    size_t map_size;
+    /**
+     * The size of the data area, as it was when the ring was created or
+     * attached. The header is shared with the other process, which may change
+     * it, so only this copy is used to index the ring.
+     */
+    uint32_t size;
+};
+
+/**
+ * Creates a new ring in an anonymous shared memory segment, and maps it into
+ * this process. The segment is unlinked immediately; it can only be shared by
+ * passing its file descriptor (the \c fd field) to another process.
+ *
+ * \param size The size of the data area, in bytes. This will be rounded up to
+ *             the next power of two.
+ *
+ * \return A dynamically-allocated ring on success, which must be freed via
+ *         ring_destroy().
+ * \return NULL on failure.
+ */
+struct ring* ring_create(size_t size);
+
+/**
+ * Maps an existing ring, created in another process via ring_create(), into
+ * this process.
+ *
+ * \param fd A file descriptor for the ring's shared memory segment.
+ *
+ * \return A dynamically-allocated ring on success, which must be freed via
+ *         ring_destroy().
+ * \return NULL if the segment could not be mapped, or does not hold a ring.
+ */
+struct ring* ring_attach(int fd);
+
+/**
+ * Unmaps the given ring, and closes its file descriptor.
+ */
+void ring_destroy(struct ring* r);
+
+/**
+ * Appends a record to the ring. Only the producer may call this function.
+ * Records must not be empty.
+ *
+ * \return 0 on success.
+ * \return -1 if there is not enough free space in the ring for the record.
+ * \return -2 if \c len is 0, or the other process has corrupted the ring, in
+ *         which case the ring must no longer be used.
+ */
+int ring_write(struct ring* r, const void* buf, size_t len);
+
+/**
+ * Returns the length of the next record in the ring. Only the consumer may
+ * call this function.
+ *
+ * \return The length of the next record.
+ * \return 0 if the ring is empty.
+ * \return -1 if the other process has corrupted the ring, by changing its
+ *         size, or writing a record that's empty or longer than what's in the
+ *         ring, in which case the ring must no longer be used.
+ */
+ssize_t ring_next_size(struct ring* r);
+
+/**
+ * Removes the next record from the ring, and copies it into \c buf. Only the
+ * consumer may call this function.
+ *
+ * \param len The size of \c buf.
+ *
+ * \return The length of the record on success.
+ * \return 0 if the ring is empty.
+ * \return -1 if the record is larger than \c len; the record is left in the
+ *         ring.
+ * \return -2 if the other process has corrupted the ring, as described for
+ *         ring_next_size(), in which case the ring must no longer be used.
+ */
+ssize_t ring_read(struct ring* r, void* buf, size_t len);
+
+/**
+ * Removes the next record from the ring without reading it, for when it
+ * can't be read. Only the consumer may call this function.
+ *
+ * \return The length of the record on success.
+ * \return 0 if the ring is empty.
+ * \return -2 if the other process has corrupted the ring, as described for
+ *         ring_next_size(), in which case the ring must no longer be used.
+ */
+ssize_t ring_skip(struct ring* r);
+
+/**
+ * Called by the consumer once it has found the ring empty, before it goes to
+ * sleep. If this function returns \c false, a record arrived in the meantime
+ * and the consumer must not go to sleep.
+ */
+bool ring_sleep(struct ring* r);
+
+/**
+ * Called by the producer after writing one or more records. Returns \c true
+ * if the consumer went to sleep and must be woken by some other means; the
+ * caller is then responsible for waking it.
+ */
+bool ring_wake(struct ring* r);
+
+#endif
@@ -19,13 +19,31 @@ extern volatile sig_atomic_t sigchld;
 extern volatile sig_atomic_t sighup;
 extern volatile sig_atomic_t sigpipe;
 extern volatile sig_atomic_t sigterm;
+extern volatile sig_atomic_t sigusr1;
+extern volatile sig_atomic_t sigusr2;
 
 /**
- * Sets signal disposition and installs handlers for:
+ * A file descriptor that becomes readable whenever one of the signals handled
+ * by praetor is delivered. On Linux, this is a signalfd; elsewhere, it is the
+ * read end of a self-pipe written to by the signal handlers.
+ */
+extern int signal_fd;
+
+/**
+ * Arranges for the following signals to be delivered via signal_fd, and adds
+ * signal_fd to the global monitor list, so that signals are handled as soon
+ * as poll() returns, like any other event:
  *     - SIGCHLD
  *     - SIGHUP
  *     - SIGPIPE
  *     - SIGTERM
+ *     - SIGUSR1
+ *     - SIGUSR2
+ *
+ * On Linux, these signals are blocked in the calling thread, and read from a
+ * signalfd. Any other thread must block them as well, or they may be delivered
+ * to that thread instead. Elsewhere, handlers are installed which write to a
+ * self-pipe.
  *
  * \return 0 on success.
  * \return -1 on error.
@@ -33,17 +51,26 @@ extern volatile sig_atomic_t sigterm;
 int signal_init();
 
 /**
- * Processes any delivered signals. Signal delivery is blocked during the
+ * Drains signal_fd and calls handle_signals(). This is the callback for
+ * signal_fd in the global monitor list.
+ */
+void signal_dispatch(int fd, short revents, void* arg);
+
+/**
+ * Processes every delivered signal. Signal delivery is blocked during the
  * execution of this function.
  *
  * \return 0 on success.
- * \return -1 if any signal handler fails.
+ * \return -1 if any signal handler fails. The signals whose handlers failed
+ *         remain pending.
  */
 int handle_signals();
 
 int sigchld_handler();
 int sighup_handler();
 int sigpipe_handler();
+int sigusr1_handler();
+int sigusr2_handler();
 void sigterm_handler();
 
 #endif
@@ -0,0 +1,153 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_STATE
+#define PRAETOR_STATE
+
+#include <stddef.h>
+
+#include "casemap.h"
+#include "ircmsg.h"
+
+/**
+ * The most channel membership prefixes, such as @ for operators, that a
+ * network may define.
+ */
+#define STATE_PREFIX_MAX 8
+
+/**
+ * The membership prefix modes assumed until a network says otherwise, most
+ * powerful first, and the symbol shown for each.
+ */
+#define STATE_PREFIX_MODES "qaohv"
+#define STATE_PREFIX_SYMBOLS "~&@%+"
+
+/**
+ * The longest list of channel modes of a single type that a network may
+ * define.
+ */
+#define STATE_CHANMODES_MAX 64
+
+/**
+ * The channel modes, other than membership prefixes, that are assumed to take
+ * a parameter until a network says otherwise: list modes, such as bans, which
+ * always take one; modes that always take one; and modes that only take one
+ * when they're set.
+ */
+#define STATE_CHANMODES_LIST "beI"
+#define STATE_CHANMODES_PARAM "k"
+#define STATE_CHANMODES_SET_PARAM "l"
+
+struct network;
+
+/**
+ * The channels praetor is in on a network, who is in each of them, and with
+ * which membership prefixes.
+ */
+struct state;
+
+/**
+ * Updates the state of a network with a message received from it, creating
+ * the network's state if it has none yet. JOIN, PART, QUIT, NICK, KICK, and
+ * MODE messages, NAMES replies, and the welcome message are tracked; anything
+ * else is ignored.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory, in which case the state may not
+ *         reflect \c msg.
+ */
+int state_update(struct network* n, const struct ircmsg* msg);
+
+/**
+ * Frees a network's state. Does nothing if \c s is NULL.
+ */
+void state_free(struct state* s);
+
+/**
+ * Rekeys a network's state under a new casemapping, once the network says
+ * which one it uses. A state reads MODE messages and NAMES replies with the
+ * membership prefixes and channel modes in its network's isupport, so new
+ * channel modes need no such call.
+ *
+ * \return 0 on success.
+ * \return -1 if two tracked nicks or channels become the same name under the
+ *         new casemapping, or the system is out of memory, in which case the
+ *         state is left as it was.
+ */
+int state_set_casemapping(struct state* s, enum casemapping mapping);
+
+/**
+ * Carries the prefix modes of every tracked member over to the membership
+ * prefixes now in the network's isupport, which were \c old_modes. Modes the
+ * network no longer has are dropped.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory, in which case the state is left
+ *         as it was.
+ */
+int state_set_prefixes(struct state* s, const char* old_modes);
+
+/**
+ * Begins tracking a connection adopted from before an upgrade, on which
+ * praetor has the given nick, replacing any state the network had.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory.
+ */
+int state_adopt(struct network* n, const char* nick);
+
+/**
+ * Records that praetor is in a channel on a connection adopted with
+ * state_adopt(). Its other members are learned from a NAMES reply.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory.
+ */
+int state_adopt_channel(struct network* n, const char* channel);
+
+/**
+ * Returns the nick praetor has on a network, which is the configured one
+ * until the network says otherwise.
+ */
+const char* state_get_nick(const struct network* n);
+
+/**
+ * Calls \c fn with the nick of each member of a channel praetor is in, and
+ * the membership prefixes the member has there, most powerful first.
+ *
+ * \return 0 on success.
+ * \return -1 if praetor is not in the channel.
+ */
+int state_members(const struct network* n, const char* channel, void (*fn)(void* arg, const char* nick, const char* prefixes), void* arg);
+
+/**
+ * Calls \c fn with the name of each channel in which praetor can see the
+ * given nick, and the membership prefixes the nick has there, most powerful
+ * first.
+ *
+ * \return 0 on success.
+ * \return -1 if praetor can't see the nick in any channel.
+ */
+int state_channels(const struct network* n, const char* nick, void (*fn)(void* arg, const char* channel, const char* prefixes), void* arg);
+
+/**
+ * Returns the number of channels praetor is in on the network.
+ */
+size_t state_get_channel_count(const struct network* n);
+
+/**
+ * Returns the number of distinct users praetor can see on the network,
+ * including itself.
+ */
+size_t state_get_user_count(const struct network* n);
+
+#endif
@@ -0,0 +1,89 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_SUPERVISOR
+#define PRAETOR_SUPERVISOR
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/**
+ * Maps the process ID of a newly-spawned plugin to that plugin in the
+ * rc_plugin_pid hash table, so that the plugin can be found when its process
+ * terminates.
+ *
+ * \return 0 on success.
+ * \return -1 if the mapping could not be added.
+ */
+int supervisor_watch(struct plugin* p);
+
+/**
+ * Reaps every terminated child process. Plugins that terminated while they
+ * were loaded are cleaned up via plugin_unload() and handed to
+ * supervisor_schedule().
+ *
+ * \return 0 on success.
+ */
+int supervisor_reap();
+
+/**
+ * Waits up to \c timeout milliseconds for every child process to terminate,
+ * reaping each one without treating it as a crash. Plugins that are still
+ * running once the time is up are sent SIGKILL and reaped. This is meant for
+ * plugins that have already been unloaded, when praetor is about to replace
+ * itself and couldn't reap them afterward.
+ *
+ * \return 0 if every child process was reaped.
+ * \return -1 if child processes not mapped to any plugin are still running.
+ */
+int supervisor_reap_all(uint64_t timeout);
+
+/**
+ * Returns how many milliseconds to wait before restarting a plugin that has
+ * crashed \c crash_count times within the crash window: one second after the
+ * first crash, doubling with each crash after it.
+ *
+ * \return The delay, in milliseconds.
+ * \return 0 if the plugin has crashed too many times, and must be quarantined,
+ *         or if \c crash_count is 0.
+ */
+uint64_t supervisor_delay(size_t crash_count);
+
+/**
+ * Schedules a restart for a plugin that crashed or failed to restart. The
+ * delay before each restart is given by supervisor_delay(), for every crash
+ * within a fixed window of time. A plugin that crashes too many times within that
+ * window is put into PLUGIN_QUARANTINED, and is not restarted again until it
+ * is explicitly reloaded.
+ */
+void supervisor_schedule(struct plugin* p);
+
+/**
+ * Cancels any pending restart for a plugin, and forgets its recent crashes.
+ */
+void supervisor_cancel(struct plugin* p);
+
+/**
+ * Cancels any pending restart for a plugin, and removes every process ID
+ * mapped to it, so that the plugin can be freed.
+ */
+void supervisor_forget(struct plugin* p);
+
+/**
+ * Restarts a plugin. This is the callback for every plugin's
+ * \c restart_timer.
+ */
+void supervisor_restart(void* arg);
+
+#endif
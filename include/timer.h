@@ -0,0 +1,103 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_TIMER
+#define PRAETOR_TIMER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A one-shot timer, fired by the main event loop.
+ *
+ * Timers are meant to be embedded within the structs that own them; this
+ * module never allocates or frees a timer, it only keeps track of armed timers
+ * in a min-heap ordered by deadline.
+ */
+struct timer{
+    /**
+     * The time, in milliseconds on the monotonic clock, at which this timer
+     * will fire.
+     */
+    uint64_t deadline;
+    /**
+     * The function that will be called when this timer fires.
+     */
+    void (*fn)(void* arg);
+    /**
+     * The argument that will be passed to \c fn.
+     */
+    void* arg;
+    /**
+     * The position of this timer within the timer heap, or SIZE_MAX if the
+     * timer is not armed.
+     */
+    size_t idx;
+};
+
+/**
+ * Initializes the given timer. A timer must be initialized before it is
+ * armed, and is initially disarmed.
+ *
+ * \param fn  The function to call when the timer fires.
+ * \param arg The argument to pass to \c fn.
+ */
+void timer_init(struct timer* t, void (*fn)(void* arg), void* arg);
+
+/**
+ * Arms the given timer to fire after \c delay milliseconds. If the timer is
+ * already armed, its deadline is moved.
+ *
+ * This function will fail only if the system is out of memory.
+ *
+ * \return 0 on success.
+ * \return -1 on failure.
+ */
+int timer_arm(struct timer* t, uint64_t delay);
+
+/**
+ * Disarms the given timer. Disarming a timer that is not armed does nothing.
+ */
+void timer_disarm(struct timer* t);
+
+/**
+ * Returns \c true if the given timer is armed.
+ */
+bool timer_armed(const struct timer* t);
+
+/**
+ * Returns the current time, in milliseconds, on the monotonic clock.
+ */
+uint64_t timer_now();
+
+/**
+ * Returns the number of milliseconds until the next armed timer is due to
+ * fire, for use as a poll() timeout.
+ *
+ * \param max The value to return if no timer is due to fire within \c max
+ *            milliseconds.
+ */
+int timer_next_timeout(int max);
+
+/**
+ * Returns the number of timers currently armed.
+ */
+size_t timer_get_armed_count();
+
+/**
+ * Fires every timer whose deadline has passed. Each timer is disarmed before
+ * its function is called, and may be re-armed from within that function.
+ */
+void timer_run();
+
+#endif
@@ -0,0 +1,117 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_TRACE
+#define PRAETOR_TRACE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The number of traces that may be waiting for a plugin's reply at once. A
+ * reply to a message sent this many messages ago or more is not traced.
+ */
+#define TRACE_SLOTS 1024
+
+/**
+ * The number of traced replies that may be waiting in a network's send queue
+ * at once. Replies queued while this many are waiting are not traced.
+ */
+#define TRACE_SENDS_MAX 16
+
+struct metrics_histogram;
+struct network;
+struct plugin;
+
+/**
+ * A traced reply waiting in a network's send queue.
+ */
+struct trace_send{
+    uint64_t id;
+    /**
+     * The value that the network's \c metrics.lines_out will have once the
+     * reply has been sent.
+     */
+    uint64_t position;
+};
+
+/**
+ * The traced replies waiting in a network's send queue, oldest first.
+ */
+struct trace_sends{
+    struct trace_send sends[TRACE_SENDS_MAX];
+    size_t head;
+    size_t count;
+};
+
+/**
+ * Starts tracing a message on its way to a plugin.
+ *
+ * \param recv_at When the message was read from its network, as returned by
+ *                metrics_now().
+ *
+ * \return The message's correlation id, which is never 0.
+ */
+uint64_t trace_start(uint64_t recv_at);
+
+/**
+ * Notes that a traced message has been written to its plugin.
+ */
+void trace_written(uint64_t id);
+
+/**
+ * Notes that a plugin has replied to a traced message, and records how long
+ * the plugin took in its reply histogram.
+ *
+ * \return true if the reply can be traced further.
+ * \return false if \c id is unknown, has been replied to already, or is too
+ *         old to still be traced.
+ */
+bool trace_reply(uint64_t id, struct plugin* p);
+
+/**
+ * Notes that a plugin's reply to a traced message has been queued for
+ * sending to a network, and records how long it was held back by the
+ * plugin's rate limit.
+ */
+void trace_queued(uint64_t id, struct plugin* p, struct network* n);
+
+/**
+ * Completes the traces of every reply a network has now sent, recording their
+ * time in the send queue and their total time. Called by inet_send() for each
+ * line sent, when \c n->trace_sends.count isn't 0.
+ */
+void trace_sent(struct network* n);
+
+/**
+ * Forgets the traced replies waiting in a network's send queue, when the
+ * queue is discarded.
+ */
+void trace_discard(struct network* n);
+
+/**
+ * Calls \c fn with each of every network's and plugin's latency histograms,
+ * and the event loop's, skipping those without samples. \c kind is
+ * "network", "plugin", or "praetor", \c name is the network's or plugin's
+ * name, and \c stage is what the histogram measures, as in the trace_*
+ * metrics.
+ */
+void trace_foreach(void (*fn)(void* arg, const char* kind, const char* name, const char* stage, const struct metrics_histogram* h), void* arg);
+
+/**
+ * Writes a summary of every network's and plugin's latency histograms to the
+ * log.
+ */
+void trace_dump();
+
+#endif
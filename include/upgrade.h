@@ -0,0 +1,76 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_UPGRADE
+#define PRAETOR_UPGRADE
+
+#include <stdbool.h>
+
+/**
+ * The environment variable through which an upgrading praetor tells its
+ * replacement which file descriptor holds the state it handed over.
+ */
+#define UPGRADE_ENV "PRAETOR_UPGRADE_FD"
+
+/**
+ * The path of the binary that is executed on an upgrade.
+ */
+extern char* upgrade_binary;
+
+/**
+ * Remembers the binary praetor was started from, so that it can be executed
+ * again after praetor has changed directories. This must be called before
+ * daemonizing.
+ *
+ * \param argv0 The first element of the argument vector given to main().
+ *
+ * \return 0 on success.
+ * \return -1 if the path could not be resolved.
+ */
+int upgrade_init(const char* argv0);
+
+/**
+ * Returns true if this process was started by an upgrade, and has state to
+ * adopt.
+ */
+bool upgrade_pending();
+
+/**
+ * Replaces this process with a fresh copy of upgrade_binary, without dropping
+ * any plaintext IRC connections. For each connected network, the socket, the
+ * contents of the receive and send queues, and the joined channels are
+ * written to an unlinked temporary file, and the socket is left open across
+ * exec().
+ *
+ * Plugins are unloaded and reaped, killing any that take too long to exit,
+ * and loaded again by the new process. TLS sessions
+ * can't be handed over, so networks using TLS are sent QUIT, and reconnect.
+ *
+ * On failure, this process carries on as it was.
+ *
+ * \return -1 on failure. On success, this function does not return.
+ */
+int upgrade_exec();
+
+/**
+ * Adopts the connections handed over by the process that executed this one.
+ * This must be called after the configuration is loaded, and before
+ * connecting to networks. Networks that were removed from the configuration,
+ * or whose connection settings changed, are sent QUIT and disconnected, and
+ * connected to again as usual.
+ *
+ * \return 0 on success, or if there was nothing to adopt.
+ * \return -1 if the handed over state could not be read.
+ */
+int upgrade_adopt();
+
+#endif
@@ -36,4 +36,30 @@ char rdigit();
  */
 int strrepl(char* src, char i, char (*f)(), bool first);
 
+/**
+ * Sets the close-on-exec flag on a file descriptor, so that it is not
+ * inherited by plugins.
+ *
+ * \return 0 on success.
+ * \return -1 on failure, with errno set by fcntl().
+ */
+int setcloexec(int fd);
+
+/**
+ * Clears the close-on-exec flag on a file descriptor, so that it is inherited
+ * across exec().
+ *
+ * \return 0 on success.
+ * \return -1 on failure, with errno set by fcntl().
+ */
+int clearcloexec(int fd);
+
+/**
+ * Puts a file descriptor into non-blocking mode.
+ *
+ * \return 0 on success.
+ * \return -1 on failure, with errno set by fcntl().
+ */
+int setnonblock(int fd);
+
 #endif
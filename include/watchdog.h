@@ -0,0 +1,107 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_WATCHDOG
+#define PRAETOR_WATCHDOG
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The longest, in milliseconds, that a single iteration of the event loop may
+ * take before the watchdog reports it as stalled.
+ */
+#define WATCHDOG_THRESHOLD 1000
+
+/**
+ * The signal the watchdog sends the event loop's thread to have it record its
+ * own backtrace. SIGURG is ignored by default, and never sent to praetor
+ * otherwise, since no socket is ever given an owner.
+ */
+#define WATCHDOG_SIGNAL SIGURG
+
+/**
+ * The number of distinct activities whose stalls are counted. Stalls in any
+ * further activities are only logged.
+ */
+#define WATCHDOG_ACTIVITIES_MAX 16
+
+/**
+ * The number of stalls the watchdog has seen during one activity.
+ */
+struct watchdog_stall{
+    /**
+     * The name of the activity, as passed to watchdog_enter(), or "event loop"
+     * for stalls outside of any instrumented section.
+     */
+    const char* activity;
+    _Atomic uint64_t count;
+};
+
+/**
+ * The activities that have stalled the event loop so far. Only the first
+ * \c watchdog_stall_count entries are in use; entries are only ever added, by
+ * the watchdog thread.
+ */
+extern struct watchdog_stall watchdog_stalls[WATCHDOG_ACTIVITIES_MAX];
+extern _Atomic size_t watchdog_stall_count;
+
+/**
+ * Starts the watchdog thread, which checks a few times per WATCHDOG_THRESHOLD
+ * whether the event loop is stuck in an iteration. Each stall is logged once,
+ * along with the activity the event loop was in, and, on glibc, a backtrace
+ * of the event loop's thread.
+ *
+ * Must be called from the thread that runs the event loop, and after
+ * daemonizing.
+ *
+ * \return 0 on success.
+ * \return -1 if the watchdog could not be started.
+ */
+int watchdog_init();
+
+/**
+ * Notes that the event loop has started working on an iteration.
+ *
+ * \param since When the iteration started, as returned by metrics_now().
+ */
+void watchdog_busy(uint64_t since);
+
+/**
+ * Notes that the event loop is about to wait for input, and logs how long the
+ * iteration took if the watchdog reported it as stalled.
+ */
+void watchdog_idle();
+
+/**
+ * Marks the start of an activity that may block the event loop, so that the
+ * watchdog can name it if it does.
+ *
+ * \param activity A name for the activity, which must outlive the program,
+ *                 e.g. a string literal.
+ *
+ * \return The activity that was in progress before, to be passed to
+ *         watchdog_leave().
+ */
+const char* watchdog_enter(const char* activity);
+
+/**
+ * Marks the end of an activity started with watchdog_enter().
+ *
+ * \param previous The value returned by the matching call to
+ *                 watchdog_enter().
+ */
+void watchdog_leave(const char* previous);
+
+#endif
@@ -0,0 +1,344 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "log.h"
+#include "util.h"
+
+//Captured traffic is written out whenever this much of it has accumulated, or the event loop goes idle
+#define CAPTURE_BUFFER_SIZE 65536
+
+//The most bytes an unsigned LEB128 encoding of a uint64_t takes
+#define CAPTURE_VARINT_MAX 10
+
+FILE* capture_file = NULL;
+const char* capture_path = NULL;
+
+char capture_buffer[CAPTURE_BUFFER_SIZE];
+
+/**
+ * The names that have been given numbers in the capture file by this process,
+ * indexed by number. There's one per network and plugin, so they're searched
+ * linearly.
+ */
+char** capture_sources = NULL;
+size_t capture_source_count = 0;
+
+//The time at which the last record was written
+uint64_t capture_last = 0;
+
+struct capture_reader{
+    FILE* file;
+    //The time of the last record read
+    uint64_t time;
+    //Source names, indexed by number
+    char** sources;
+    size_t source_count;
+    //Holds the data of the last record read
+    char* buf;
+    size_t buf_size;
+};
+
+/**
+ * Returns the current time on the monotonic clock, in nanoseconds.
+ */
+uint64_t capture_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Writes an unsigned LEB128 integer to the capture file.
+ */
+void capture_put_varint(uint64_t value){
+    uint8_t buf[CAPTURE_VARINT_MAX];
+    size_t len = 0;
+    do{
+        buf[len] = value & 0x7f;
+        value >>= 7;
+        if(value != 0){
+            buf[len] |= 0x80;
+        }
+        len++;
+    } while(value != 0);
+    fwrite(buf, 1, len, capture_file);
+}
+
+/**
+ * Reads an unsigned LEB128 integer from a capture file.
+ *
+ * \return 0 on success.
+ * \return -1 at the end of the file, or if the integer is too long.
+ */
+int capture_get_varint(FILE* f, uint64_t* value){
+    *value = 0;
+    for(size_t i = 0; i < CAPTURE_VARINT_MAX; i++){
+        int c = fgetc(f);
+        if(c == EOF){
+            return -1;
+        }
+        *value |= (uint64_t)(c & 0x7f) << (7 * i);
+        if((c & 0x80) == 0){
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Looks up the number given to a source name, giving it the next number, and
+ * writing a source record, if it doesn't have one yet.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory.
+ */
+int capture_source(const char* name, uint64_t* id){
+    //Names are kept only as far as they're written, and must match as far as that
+    for(size_t i = 0; i < capture_source_count; i++){
+        if(capture_sources[i] == name || strncmp(capture_sources[i], name, CAPTURE_SOURCE_MAX) == 0){
+            *id = i;
+            return 0;
+        }
+    }
+
+    size_t len = strlen(name);
+    if(len > CAPTURE_SOURCE_MAX){
+        len = CAPTURE_SOURCE_MAX;
+    }
+    void* tmp = realloc(capture_sources, (capture_source_count + 1) * sizeof(char*));
+    if(tmp == NULL){
+        return -1;
+    }
+    capture_sources = tmp;
+    if((capture_sources[capture_source_count] = malloc(len + 1)) == NULL){
+        return -1;
+    }
+    memcpy(capture_sources[capture_source_count], name, len);
+    capture_sources[capture_source_count][len] = '\0';
+
+    *id = capture_source_count++;
+    fputc(CAPTURE_SOURCE, capture_file);
+    capture_put_varint(*id);
+    capture_put_varint(len);
+    fwrite(name, 1, len, capture_file);
+
+    return 0;
+}
+
+int capture_open(const char* path){
+    //Captures hold everything sent and received, so only praetor's user may read them
+    int fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0600);
+    FILE* f = fd == -1 ? NULL : fdopen(fd, "a+b");
+    if(f == NULL){
+        logmsg(LOG_WARNING, "capture: Could not open capture file %s, %s\n", path, strerror(errno));
+        if(fd != -1){
+            close(fd);
+        }
+        return -1;
+    }
+    setcloexec(fd);
+
+    //Keep adding to an existing capture, such as one started before an upgrade
+    char magic[CAPTURE_MAGIC_SIZE];
+    fseek(f, 0, SEEK_END);
+    if(ftell(f) == 0){
+        fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, f);
+    }
+    else{
+        rewind(f);
+        if(fread(magic, 1, CAPTURE_MAGIC_SIZE, f) != CAPTURE_MAGIC_SIZE || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0){
+            logmsg(LOG_WARNING, "capture: %s is not a capture file\n", path);
+            fclose(f);
+            return -1;
+        }
+        fseek(f, 0, SEEK_END);
+    }
+    setvbuf(f, capture_buffer, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+    capture_file = f;
+    capture_path = path;
+
+    capture_last = capture_now();
+    fputc(CAPTURE_CLOCK, capture_file);
+    capture_put_varint(capture_last);
+
+    logmsg(LOG_INFO, "capture: Capturing traffic to %s\n", path);
+    return 0;
+}
+
+void capture_flush(){
+    if(capture_file != NULL && fflush(capture_file) == EOF){
+        logmsg(LOG_WARNING, "capture: Could not write to capture file %s, %s\n", capture_path, strerror(errno));
+        logmsg(LOG_WARNING, "capture: No longer capturing traffic\n");
+        capture_close();
+    }
+}
+
+void capture_close(){
+    if(capture_file == NULL){
+        return;
+    }
+
+    fclose(capture_file);
+    capture_file = NULL;
+    capture_path = NULL;
+
+    for(size_t i = 0; i < capture_source_count; i++){
+        free(capture_sources[i]);
+    }
+    free(capture_sources);
+    capture_sources = NULL;
+    capture_source_count = 0;
+}
+
+void capture_record(enum capture_kind kind, const char* source, const char* buf, size_t len){
+    uint64_t id;
+    if(capture_source(source, &id) == -1){
+        logmsg(LOG_WARNING, "capture: Could not capture traffic for '%s', the system is out of memory\n", source);
+        return;
+    }
+
+    uint64_t now = capture_now();
+    fputc(kind, capture_file);
+    capture_put_varint(now - capture_last);
+    capture_put_varint(id);
+    capture_put_varint(len);
+    fwrite(buf, 1, len, capture_file);
+    capture_last = now;
+
+    if(ferror(capture_file)){
+        logmsg(LOG_WARNING, "capture: Could not write to capture file %s\n", capture_path);
+        logmsg(LOG_WARNING, "capture: No longer capturing traffic\n");
+        capture_close();
+    }
+}
+
+struct capture_reader* capture_reader_open(const char* path){
+    struct capture_reader* r = calloc(1, sizeof(struct capture_reader));
+    if(r == NULL){
+        return NULL;
+    }
+
+    if((r->file = fopen(path, "rb")) == NULL){
+        free(r);
+        return NULL;
+    }
+
+    char magic[CAPTURE_MAGIC_SIZE];
+    if(fread(magic, 1, CAPTURE_MAGIC_SIZE, r->file) != CAPTURE_MAGIC_SIZE || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0){
+        fclose(r->file);
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+int capture_read(struct capture_reader* r, struct capture_record* record){
+    while(true){
+        int kind = fgetc(r->file);
+        if(kind == EOF){
+            return 1;
+        }
+
+        uint64_t value, id, len;
+        switch(kind){
+            case CAPTURE_CLOCK:
+                if(capture_get_varint(r->file, &value) == -1){
+                    return -1;
+                }
+                r->time = value;
+                break;
+            case CAPTURE_SOURCE:
+                //Every process that appends to the file numbers its sources from 0 again
+                if(capture_get_varint(r->file, &id) == -1 || capture_get_varint(r->file, &len) == -1){
+                    return -1;
+                }
+                if(id > r->source_count || len > CAPTURE_SOURCE_MAX){
+                    return -1;
+                }
+                if(id == r->source_count){
+                    void* tmp = realloc(r->sources, (r->source_count + 1) * sizeof(char*));
+                    if(tmp == NULL){
+                        return -1;
+                    }
+                    r->sources = tmp;
+                    r->sources[r->source_count++] = NULL;
+                }
+
+                char* name = malloc(len + 1);
+                if(name == NULL){
+                    return -1;
+                }
+                if(fread(name, 1, len, r->file) != len){
+                    free(name);
+                    return -1;
+                }
+                name[len] = '\0';
+                free(r->sources[id]);
+                r->sources[id] = name;
+                break;
+            case CAPTURE_NETWORK_IN:
+            case CAPTURE_NETWORK_OUT:
+            case CAPTURE_PLUGIN_IN:
+            case CAPTURE_PLUGIN_OUT:
+                if(capture_get_varint(r->file, &value) == -1 || capture_get_varint(r->file, &id) == -1 || capture_get_varint(r->file, &len) == -1){
+                    return -1;
+                }
+                if(id >= r->source_count){
+                    return -1;
+                }
+                if(len > r->buf_size){
+                    void* tmp = realloc(r->buf, len);
+                    if(tmp == NULL){
+                        return -1;
+                    }
+                    r->buf = tmp;
+                    r->buf_size = len;
+                }
+                if(fread(r->buf, 1, len, r->file) != len){
+                    return -1;
+                }
+
+                r->time += value;
+                record->kind = kind;
+                record->time = r->time;
+                record->source = r->sources[id];
+                record->data = r->buf;
+                record->len = len;
+                return 0;
+            default:
+                return -1;
+        }
+    }
+}
+
+void capture_reader_close(struct capture_reader* r){
+    for(size_t i = 0; i < r->source_count; i++){
+        free(r->sources[i]);
+    }
+    free(r->sources);
+    free(r->buf);
+    fclose(r->file);
+    free(r);
+}
@@ -11,6 +11,7 @@
 */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,41 +23,176 @@
 #include "config.h"
 #include "log.h"
 #include "htable.h"
+#include "inet.h"
+#include "irc.h"
+#include "plugin.h"
+#include "queue.h"
+#include "supervisor.h"
+#include "watchdog.h"
 
 #define SCHEMA_CHANNELS "{s:s, s?s}"
-#define SCHEMA_DAEMON "{s?s, s?s, s?s}"
-#define SCHEMA_NETWORKS "{s?o, s:s, s?o, s:s, s:s, s:s, s?s, s?o, s?s, s:s, s?b, s:s}"
-#define SCHEMA_PLUGINS "{s:s, s:s}"
+#define SCHEMA_DAEMON "{s?s, s?s, s?s, s?i, s?i, s?s, s?i, s?s}"
+#define SCHEMA_NETWORKS "{s?o, s:s, s?s, s?o, s:s, s:s, s:s, s?s, s?o, s?s, s:s, s?b, s:s}"
+#define SCHEMA_NETWORK_PLUGINS "{s:s, s?o, s?o, s?b, s?i}"
+#define SCHEMA_PLUGINS "{s:s, s:s, s?s, s?b, s?s}"
 #define SCHEMA_ROOT "{s?o, s?o, s?o}"
 
+#define DEFAULT_BATCH_SIZE 256
+#define DEFAULT_BATCH_DELAY 0
+
 struct praetor* rc_praetor;
 struct htable* rc_network, * rc_network_sock;
-struct htable* rc_plugin, * rc_plugin_sock;
+struct htable* rc_plugin, * rc_plugin_sock, * rc_plugin_pid;
+
+char* rc_path = NULL;
+
+//ACL entries map to the table they're in, so they stay valid when a reload hands the table to another plugin
+int config_acl_add(struct htable* acl, const char* network, json_t* channels, struct plugin* p){
+    //An omitted list allows every channel on the network
+    if(channels == NULL){
+        if(htable_add(acl, (uint8_t*)network, strlen(network)+1, acl) == -2){
+            logmsg(LOG_ERR, "config: Could not add channels for plugin %s, the system is out of memory\n", p->name);
+            _exit(-1);
+        }
+        return 0;
+    }
+    if(!json_is_array(channels)){
+        logmsg(LOG_ERR, "config: input and output for plugin %s must be arrays\n", p->name);
+        return -1;
+    }
+
+    json_t* value;
+    size_t index;
+    json_array_foreach(channels, index, value){
+        if(!json_is_string(value)){
+            logmsg(LOG_ERR, "config: input and output for plugin %s must contain only channel names\n", p->name);
+            return -1;
+        }
+
+        char key[PLUGIN_ACL_KEY_SIZE];
+        size_t key_size = plugin_acl_key(key, network, json_string_value(value));
+        if(key_size == 0){
+            logmsg(LOG_ERR, "config: Channel name %s for plugin %s is too long\n", json_string_value(value), p->name);
+            return -1;
+        }
+        if(htable_add(acl, (uint8_t*)key, key_size, acl) == -2){
+            logmsg(LOG_ERR, "config: Could not add channels for plugin %s, the system is out of memory\n", p->name);
+            _exit(-1);
+        }
+    }
+
+    return 0;
+}
+
+void config_network_free(struct network* n){
+    //Networks that are still connected, or connecting, are disconnected first
+    if(n->sock != -1 && htable_lookup(rc_network_sock, (uint8_t*)&n->sock, sizeof(n->sock)) == n){
+        inet_disconnect(n);
+    }
+    free(n->recv_queue);
+    queue_destroy(n->send_queue);
+    if(n->addr != NULL){
+        freeaddrinfo(n->addr);
+    }
+
+    if(n->channels != NULL){
+        size_t size = 0;
+        struct htable_key** channels = htable_get_keys(n->channels, &size);
+        for(size_t i = 0; channels != NULL && i < size; i++){
+            free(htable_lookup(n->channels, channels[i]->key, channels[i]->key_size));
+        }
+        if(channels != NULL){
+            htable_key_list_free(channels, size);
+        }
+        htable_destroy(n->channels);
+    }
+    if(n->admins != NULL){
+        htable_destroy(n->admins);
+    }
+    if(n->plugins != NULL){
+        htable_destroy(n->plugins);
+    }
+
+    json_decref(n->source);
+    free(n);
+}
+
+int config_network_set_casemapping(struct network* n, enum casemapping mapping){
+    if(htable_set_casemapping(n->channels, mapping) != 0){
+        goto fail;
+    }
+    if(htable_set_casemapping(n->admins, mapping) != 0){
+        htable_set_casemapping(n->channels, n->casemapping);
+        goto fail;
+    }
+    n->casemapping = mapping;
+    return 0;
+
+    fail:
+        logmsg(LOG_WARNING, "config: Could not compare names on network %s under casemapping %s, keeping %s\n", n->name, casemap_name(mapping), casemap_name(n->casemapping));
+        return -1;
+}
+
+void config_plugin_free(struct plugin* p){
+    timer_disarm(&p->batch_timer);
+    timer_disarm(&p->restart_timer);
+    timer_disarm(&p->rate_timer);
+
+    for(size_t i = 0; i < p->batch_count; i++){
+        free(p->batch[i].buf);
+    }
+    free(p->batch);
+    free(p->recv_buf);
+
+    queue_destroy(p->outbox);
+
+    if(p->input != NULL){
+        htable_destroy(p->input);
+    }
+    if(p->output != NULL){
+        htable_destroy(p->output);
+    }
+    if(p->private_messages != NULL){
+        htable_destroy(p->private_messages);
+    }
+
+    json_decref(p->source);
+    free(p);
+}
+
+void config_free(struct htable* networks, struct htable* plugins){
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(networks, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        config_network_free(htable_lookup(networks, keys[i]->key, keys[i]->key_size));
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+    htable_destroy(networks);
 
-json_t* root = NULL;
+    keys = htable_get_keys(plugins, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        config_plugin_free(htable_lookup(plugins, keys[i]->key, keys[i]->key_size));
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+    htable_destroy(plugins);
+}
 
 void config_init(struct praetor* rc_praetor){
     rc_praetor->user = "praetor";
     rc_praetor->group = "praetor";
     rc_praetor->workdir = "/var/lib/praetor";
+    rc_praetor->batch_size = DEFAULT_BATCH_SIZE;
+    rc_praetor->batch_delay = DEFAULT_BATCH_DELAY;
 }
 
-int config_load(char* path){
-    srandom(time(NULL));
+int config_parse(json_t* root, struct praetor* praetor, struct htable* networks, struct htable* plugins_table){
     json_error_t error;
-    //if we're reloading the config, free the old one
-    if(root != NULL){
-        json_decref(root);
-    }
-    root = json_load_file(path, 0, &error);
-    logmsg(LOG_DEBUG, "config: Loaded configuration file %s\n", path);
-    if(root == NULL){
-        logmsg(LOG_ERR, "config: %s at line %d, column %d\n", error.text, error.line, error.column);
-        return -1;
-    }
-
-    config_init(rc_praetor);
-    json_t* praetor_section = NULL, *networks_section = NULL, *plugins_section;
+    config_init(praetor);
+    json_t* praetor_section = NULL, *networks_section = NULL, *plugins_section = NULL;
     
     //Unpack and validate root object
     int ret = json_unpack_ex(
@@ -78,19 +214,37 @@ int config_load(char* path){
         logmsg(LOG_WARNING, "config: No praetor section, using default settings\n");
     }
     else{
+        int batch_size = DEFAULT_BATCH_SIZE, batch_delay = DEFAULT_BATCH_DELAY, metrics_port = 0;
         int ret = json_unpack_ex(
             praetor_section,
             &error,
             JSON_STRICT,
             SCHEMA_DAEMON,
-            "user", &rc_praetor->user,
-            "group", &rc_praetor->group,
-            "workdir", &rc_praetor->workdir
+            "user", &praetor->user,
+            "group", &praetor->group,
+            "workdir", &praetor->workdir,
+            "batch_size", &batch_size,
+            "batch_delay", &batch_delay,
+            "metrics_socket", &praetor->metrics_socket,
+            "metrics_port", &metrics_port,
+            "control_socket", &praetor->control_socket
         );
         if(ret == -1){
             logmsg(LOG_ERR, "config: %s at line %d, column %d. Source: %s\n", error.text, error.line, error.column, error.source);
             return -1;
         }
+        if(batch_size < 1 || batch_delay < 0){
+            logmsg(LOG_ERR, "config: batch_size must be at least 1, and batch_delay must not be negative\n");
+            return -1;
+        }
+        if(metrics_port < 0 || metrics_port > 65535){
+            logmsg(LOG_ERR, "config: metrics_port must be between 0 and 65535\n");
+            return -1;
+        }
+        praetor->batch_size = batch_size;
+        praetor->batch_delay = batch_delay;
+        praetor->metrics_port = metrics_port;
+        praetor->source = json_incref(praetor_section);
     }
 
     //Unpack and validate plugins configuration section
@@ -110,23 +264,74 @@ int config_load(char* path){
                 logmsg(LOG_ERR, "config: Cannot allocate memory for plugin configuration\n");
                 return -1;
             }
-            if(json_unpack_ex(value, &error, JSON_STRICT, SCHEMA_PLUGINS, "name", &plugin_this->name, "path", &plugin_this->path) == -1){
+            plugin_this->sock = -1;
+            plugin_this->status = PLUGIN_UNLOADED;
+            plugin_this->rate_token = true;
+            //The batch timer gets its callback when the plugin is loaded
+            timer_init(&plugin_this->batch_timer, NULL, NULL);
+            timer_init(&plugin_this->restart_timer, supervisor_restart, plugin_this);
+            timer_init(&plugin_this->rate_timer, plugin_rate_timeout, plugin_this);
+
+            plugin_this->input = htable_create(10);
+            plugin_this->output = htable_create(10);
+            plugin_this->private_messages = htable_create(5);
+            plugin_this->outbox = queue_create();
+            if(plugin_this->input == NULL || plugin_this->output == NULL || plugin_this->private_messages == NULL || plugin_this->outbox == NULL){
+                logmsg(LOG_ERR, "config: Could not create plugin configuration, the system is out of memory\n");
+                _exit(-1);
+            }
+            //ACLs span networks, so channel names in them are compared as RFC 1459 says
+            if(htable_set_casemapping(plugin_this->input, CASEMAP_DEFAULT) != 0 || htable_set_casemapping(plugin_this->output, CASEMAP_DEFAULT) != 0){
+                logmsg(LOG_ERR, "config: Could not create plugin configuration, the system is out of memory\n");
+                _exit(-1);
+            }
+
+            int raw = 0;
+            const char* type = NULL;
+            const char* transport = NULL;
+            if(json_unpack_ex(value, &error, JSON_STRICT, SCHEMA_PLUGINS, "name", &plugin_this->name, "path", &plugin_this->path, "type", &type, "raw", &raw, "transport", &transport) == -1){
                 logmsg(LOG_ERR, "config: %s at line %d, column %d. Source: %s\n", error.text, error.line, error.column, error.source);
+                config_plugin_free(plugin_this);
+                return -1;
+            }
+            plugin_this->raw = raw;
+            plugin_this->source = json_incref(value);
+
+            if(type == NULL || strcmp(type, "process") == 0){
+                plugin_this->type = PLUGIN_TYPE_PROCESS;
+            }
+            else if(strcmp(type, "shared") == 0){
+                plugin_this->type = PLUGIN_TYPE_SHARED;
+            }
+            else{
+                logmsg(LOG_ERR, "config: Unknown type '%s' for plugin %s, must be one of 'process' or 'shared'\n", type, plugin_this->name);
+                config_plugin_free(plugin_this);
+                return -1;
+            }
+
+            if(transport == NULL || strcmp(transport, "socket") == 0){
+                plugin_this->transport = PLUGIN_TRANSPORT_SOCKET;
+            }
+            else if(strcmp(transport, "shm") == 0){
+                plugin_this->transport = PLUGIN_TRANSPORT_SHM;
+            }
+            else{
+                logmsg(LOG_ERR, "config: Unknown transport '%s' for plugin %s, must be one of 'socket' or 'shm'\n", transport, plugin_this->name);
+                config_plugin_free(plugin_this);
                 return -1;
             }
             
-            int ret = htable_add(rc_plugin, (uint8_t*)plugin_this->name, strlen(plugin_this->name)+1, plugin_this);
+            int ret = htable_add(plugins_table, (uint8_t*)plugin_this->name, strlen(plugin_this->name)+1, plugin_this);
             if(ret == -1){
                 logmsg(LOG_ERR, "config: Could not add configuration for plugin %s, plugin already exists\n", plugin_this->name);
-                _exit(-1);
+                config_plugin_free(plugin_this);
+                return -1;
             }
             else if(ret == -2){
                 logmsg(LOG_ERR, "config: Could not add configuration for plugin %s, the system is out of memory\n", plugin_this->name);
                 _exit(-1);
             }
 
-            plugin_this->sock = -1;
-
             logmsg(LOG_DEBUG, "config: Added configuration for plugin %s\n", plugin_this->name);
         }
     }
@@ -140,8 +345,8 @@ int config_load(char* path){
         return -1;
     }
     else{
-        json_t* value, *channel_value, *channels, *admins, *plugins;
-        size_t index, channel_index;
+        json_t* value, *channel_value, *plugin_value, *channels, *admins, *plugins;
+        size_t index, channel_index, plugin_index;
         json_array_foreach(networks_section, index, value){
             //create a fresh networkinfo struct for each network
             struct network* network_this = calloc(1, sizeof(struct network));
@@ -149,10 +354,25 @@ int config_load(char* path){
                 logmsg(LOG_ERR, "config: Cannot allocate memory for network configuration\n");
                 return -1;
             }
+            //Optional sections left out of this network must not inherit the previous network's
+            channels = NULL;
+            admins = NULL;
+            plugins = NULL;
+            int ssl = 0;
+            network_this->sock = -1;
+
             //instantiate hash tables for this network
             network_this->channels = htable_create(10);
             network_this->plugins = htable_create(10);
-            if(network_this->channels == NULL || network_this->plugins == NULL){
+            network_this->admins = htable_create(5);
+            if(network_this->channels == NULL || network_this->plugins == NULL || network_this->admins == NULL){
+                logmsg(LOG_ERR, "config: Could not create network configuration, the system is out of memory\n");
+                _exit(-1);
+            }
+            //Names are compared as RFC 1459 says until the network says otherwise
+            isupport_init(&network_this->isupport);
+            network_this->casemapping = CASEMAP_DEFAULT;
+            if(htable_set_casemapping(network_this->channels, CASEMAP_DEFAULT) != 0 || htable_set_casemapping(network_this->admins, CASEMAP_DEFAULT) != 0){
                 logmsg(LOG_ERR, "config: Could not create network configuration, the system is out of memory\n");
                 _exit(-1);
             }
@@ -164,6 +384,7 @@ int config_load(char* path){
                 SCHEMA_NETWORKS,
                 "admins", &admins,
                 "alt_nick", &network_this->alt_nick,
+                "ca_file", &network_this->ca_file,
                 "channels", &channels,
                 "host", &network_this->host,
                 "name", &network_this->name,
@@ -172,18 +393,23 @@ int config_load(char* path){
                 "plugins", &plugins,
                 "quit_msg", &network_this->quit_msg,
                 "real_name", &network_this->real_name,
-                "ssl", &network_this->ssl,
+                "ssl", &ssl,
                 "user", &network_this->user
             );
             if(ret == -1){
                 logmsg(LOG_ERR, "config: %s at line %d, column %d. Source: %s\n", error.text, error.line, error.column, error.source);
+                config_network_free(network_this);
                 return -1;
             }
-            //add this networkinfo to the global hash table, indexed by its name
-            ret = htable_add(rc_network, (uint8_t*)network_this->name, strlen(network_this->name)+1, network_this);
+            network_this->ssl = ssl;
+            network_this->source = json_incref(value);
+
+            //add this networkinfo to the hash table, indexed by its name
+            ret = htable_add(networks, (uint8_t*)network_this->name, strlen(network_this->name)+1, network_this);
             if(ret == -1){
                 logmsg(LOG_ERR, "config: Could not add configuration for network %s, network already exists\n", network_this->name);
-                _exit(-1);
+                config_network_free(network_this);
+                return -1;
             }
             else if(ret == -2){
                 logmsg(LOG_ERR, "config: Could not add configuration for network %s, the system is out of memory\n", network_this->name);
@@ -194,14 +420,56 @@ int config_load(char* path){
 
             //Unpack and validate plugins configuration section for this network
             if(plugins == NULL){
-                logmsg(LOG_WARNING, "config: No plugins section, praetor will not load any plugins\n");
+                logmsg(LOG_WARNING, "config: No plugins section for network %s, plugins will not be restricted on this network\n", network_this->name);
             }
             else if(!json_is_array(plugins)){
-                logmsg(LOG_ERR, "config: networks section must be an array\n");
+                logmsg(LOG_ERR, "config: plugins section for network %s must be an array\n", network_this->name);
                 return -1;
             }
             else{
-                //This is where I'd be parsing the plugins section for the network
+                json_array_foreach(plugins, plugin_index, plugin_value){
+                    const char* name = NULL;
+                    json_t* input = NULL, * output = NULL;
+                    int private_messages = 0, rate_limit = 0;
+                    if(json_unpack_ex(plugin_value, &error, JSON_STRICT, SCHEMA_NETWORK_PLUGINS, "name", &name, "input", &input, "output", &output, "private_messages", &private_messages, "rate_limit", &rate_limit) == -1){
+                        logmsg(LOG_ERR, "config: %s at line %d, column %d. Source: %s\n", error.text, error.line, error.column, error.source);
+                        return -1;
+                    }
+
+                    struct plugin* p = htable_lookup(plugins_table, (uint8_t*)name, strlen(name)+1);
+                    if(p == NULL){
+                        logmsg(LOG_WARNING, "config: Network %s configures plugin %s, but no such plugin is defined\n", network_this->name, name);
+                        continue;
+                    }
+                    ret = htable_add(network_this->plugins, (uint8_t*)p->name, strlen(p->name)+1, p);
+                    if(ret == -1){
+                        logmsg(LOG_ERR, "config: Plugin %s is configured more than once for network %s\n", p->name, network_this->name);
+                        return -1;
+                    }
+                    else if(ret == -2){
+                        logmsg(LOG_ERR, "config: Could not add configuration for plugin %s, the system is out of memory\n", p->name);
+                        _exit(-1);
+                    }
+
+                    if(config_acl_add(p->input, network_this->name, input, p) == -1 || config_acl_add(p->output, network_this->name, output, p) == -1){
+                        return -1;
+                    }
+                    if(private_messages && htable_add(p->private_messages, (uint8_t*)network_this->name, strlen(network_this->name)+1, p->private_messages) == -2){
+                        logmsg(LOG_ERR, "config: Could not add configuration for plugin %s, the system is out of memory\n", p->name);
+                        _exit(-1);
+                    }
+
+                    //A plugin only has one outbox, so it's held to the strictest limit of any network
+                    if(rate_limit < 0){
+                        logmsg(LOG_ERR, "config: rate_limit for plugin %s must not be negative\n", p->name);
+                        return -1;
+                    }
+                    if((size_t)rate_limit * 1000 > p->rate_limit){
+                        p->rate_limit = (size_t)rate_limit * 1000;
+                    }
+
+                    logmsg(LOG_DEBUG, "config: Added configuration for plugin %s on network %s\n", p->name, network_this->name);
+                }
             }
 
             //Unpack and validate admins configuration section for this network
@@ -233,12 +501,14 @@ int config_load(char* path){
                     }
                     if(json_unpack_ex(channel_value, &error, JSON_STRICT, SCHEMA_CHANNELS, "name", &channel_this->name, "key", &channel_this->key) == -1){
                         logmsg(LOG_ERR, "config: %s at line %d, column %d. Source: %s\n", error.text, error.line, error.column, error.source);
+                        free(channel_this);
                         return -1;
                     }
                     ret = htable_add(network_this->channels, (uint8_t*)channel_this->name, strlen(channel_this->name)+1, channel_this);
                     if(ret == -1){
                         logmsg(LOG_ERR, "config: Could not add configuration for channel %s, channel already exists\n", channel_this->name);
-                        _exit(-1);
+                        free(channel_this);
+                        return -1;
                     }
                     else if(ret == -2){
                         logmsg(LOG_ERR, "config: Could not add configuration for channel %s, the system is out of memory\n", channel_this->name);
@@ -252,3 +522,339 @@ int config_load(char* path){
 
     return 0;
 }
+
+int config_load(char* path){
+    srandom(time(NULL));
+
+    //Remember where the file is, so that it can be found again after we've changed directories
+    char resolved[PATH_MAX];
+    if(realpath(path, resolved) == NULL){
+        logmsg(LOG_ERR, "config: Could not resolve configuration file path %s, %s\n", path, strerror(errno));
+        return -1;
+    }
+    free(rc_path);
+    if((rc_path = malloc(strlen(resolved)+1)) == NULL){
+        logmsg(LOG_ERR, "config: Could not load configuration, the system is out of memory\n");
+        return -1;
+    }
+    strcpy(rc_path, resolved);
+
+    json_error_t error;
+    json_t* root = json_load_file(rc_path, 0, &error);
+    if(root == NULL){
+        logmsg(LOG_ERR, "config: %s at line %d, column %d\n", error.text, error.line, error.column);
+        return -1;
+    }
+    logmsg(LOG_DEBUG, "config: Loaded configuration file %s\n", rc_path);
+
+    //Every section we keep holds its own reference to the parts of the file it uses
+    int ret = config_parse(root, rc_praetor, rc_network, rc_plugin);
+    json_decref(root);
+
+    return ret;
+}
+
+bool config_str_differs(const char* a, const char* b){
+    if(a == NULL || b == NULL){
+        return a != b;
+    }
+    return strcmp(a, b) != 0;
+}
+
+/**
+ * Swaps every setting that comes from the configuration file between two
+ * structs describing the same plugin, leaving runtime state where it is.
+ */
+void config_plugin_swap(struct plugin* a, struct plugin* b){
+    struct plugin tmp = *a;
+
+    a->name = b->name;
+    a->path = b->path;
+    a->type = b->type;
+    a->raw = b->raw;
+    a->transport = b->transport;
+    a->input = b->input;
+    a->output = b->output;
+    a->private_messages = b->private_messages;
+    a->rate_limit = b->rate_limit;
+    a->source = b->source;
+
+    b->name = tmp.name;
+    b->path = tmp.path;
+    b->type = tmp.type;
+    b->raw = tmp.raw;
+    b->transport = tmp.transport;
+    b->input = tmp.input;
+    b->output = tmp.output;
+    b->private_messages = tmp.private_messages;
+    b->rate_limit = tmp.rate_limit;
+    b->source = tmp.source;
+}
+
+/**
+ * Applies a freshly parsed set of plugins to the running set. Plugins are kept
+ * running unless they were removed, or their path, type, raw, or transport
+ * setting changed. Every struct in \c plugins is either moved into rc_plugin or
+ * freed.
+ */
+void config_reload_plugins(struct htable* plugins){
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(plugins, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        struct plugin* p_new = htable_lookup(plugins, keys[i]->key, keys[i]->key_size);
+        struct plugin* p = htable_lookup(rc_plugin, keys[i]->key, keys[i]->key_size);
+        if(p == NULL){
+            if(htable_add(rc_plugin, keys[i]->key, keys[i]->key_size, p_new) == -2){
+                logmsg(LOG_ERR, "config: Could not add plugin %s, the system is out of memory\n", p_new->name);
+                _exit(-1);
+            }
+            logmsg(LOG_INFO, "config: Loading new plugin %s\n", p_new->name);
+            plugin_load(p_new);
+            continue;
+        }
+
+        bool restart = config_str_differs(p->path, p_new->path) || p->type != p_new->type || p->raw != p_new->raw || p->transport != p_new->transport;
+        config_plugin_swap(p, p_new);
+        config_plugin_free(p_new);
+
+        //A reload also gives quarantined plugins another chance
+        if(restart || p->status == PLUGIN_QUARANTINED){
+            logmsg(LOG_INFO, "config: Restarting plugin %s\n", p->name);
+            if(p->status != PLUGIN_UNLOADED){
+                plugin_unload(p);
+            }
+            plugin_load(p);
+        }
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    //Whatever wasn't in the new configuration is unloaded and forgotten
+    keys = htable_get_keys(rc_plugin, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        if(htable_lookup(plugins, keys[i]->key, keys[i]->key_size) != NULL){
+            continue;
+        }
+
+        struct plugin* p = htable_lookup(rc_plugin, keys[i]->key, keys[i]->key_size);
+        logmsg(LOG_INFO, "config: Unloading removed plugin %s\n", p->name);
+        if(p->status != PLUGIN_UNLOADED){
+            plugin_unload(p);
+        }
+        supervisor_forget(p);
+        htable_remove(rc_plugin, keys[i]->key, keys[i]->key_size);
+        config_plugin_free(p);
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+}
+
+/**
+ * Points every plugin in a network's plugins table at the running plugin of
+ * the same name.
+ */
+void config_relink_plugins(struct network* n){
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(n->plugins, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        struct plugin* p = htable_lookup(rc_plugin, keys[i]->key, keys[i]->key_size);
+        htable_remove(n->plugins, keys[i]->key, keys[i]->key_size);
+        if(htable_add(n->plugins, keys[i]->key, keys[i]->key_size, p) == -2){
+            logmsg(LOG_ERR, "config: Could not configure plugins for network %s, the system is out of memory\n", n->name);
+            _exit(-1);
+        }
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+}
+
+/**
+ * Joins the channels in \c n_new that aren't in \c n, and parts the ones in
+ * \c n that aren't in \c n_new.
+ */
+void config_reload_channels(struct network* n, struct network* n_new){
+    //Networks that are still connecting join the new channel list once they've registered
+    if(n->sock == -1 || htable_lookup(rc_network_sock, (uint8_t*)&n->sock, sizeof(n->sock)) != n){
+        return;
+    }
+
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(n_new->channels, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        if(htable_lookup(n->channels, keys[i]->key, keys[i]->key_size) == NULL){
+            irc_join(n, htable_lookup(n_new->channels, keys[i]->key, keys[i]->key_size));
+        }
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    keys = htable_get_keys(n->channels, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        if(htable_lookup(n_new->channels, keys[i]->key, keys[i]->key_size) == NULL){
+            irc_part(n, (char*)keys[i]->key);
+        }
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+}
+
+/**
+ * Says goodbye to a network, disconnects from it, and frees it.
+ */
+void config_network_quit(struct network* n){
+    if(n->sock != -1 && htable_lookup(rc_network_sock, (uint8_t*)&n->sock, sizeof(n->sock)) == n){
+        if(irc_quit(n) == 0){
+            inet_send(n);
+        }
+    }
+    config_network_free(n);
+}
+
+/**
+ * Applies a freshly parsed set of networks to the running set. Connections are
+ * kept open unless the network was removed, or one of the settings used to
+ * connect and register changed. Every struct in \c networks is either moved
+ * into rc_network or freed.
+ */
+void config_reload_networks(struct htable* networks){
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(networks, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        struct network* n_new = htable_lookup(networks, keys[i]->key, keys[i]->key_size);
+        struct network* n = htable_lookup(rc_network, keys[i]->key, keys[i]->key_size);
+        config_relink_plugins(n_new);
+
+        if(n != NULL && (config_str_differs(n->host, n_new->host) || n->ssl != n_new->ssl || config_str_differs(n->ca_file, n_new->ca_file) || config_str_differs(n->nick, n_new->nick)
+            || config_str_differs(n->user, n_new->user) || config_str_differs(n->real_name, n_new->real_name) || config_str_differs(n->pass, n_new->pass))){
+            logmsg(LOG_INFO, "config: Connection settings for network %s changed, reconnecting\n", n->name);
+            htable_remove(rc_network, keys[i]->key, keys[i]->key_size);
+            config_network_quit(n);
+            n = NULL;
+        }
+
+        if(n == NULL){
+            if(htable_add(rc_network, keys[i]->key, keys[i]->key_size, n_new) == -2){
+                logmsg(LOG_ERR, "config: Could not add network %s, the system is out of memory\n", n_new->name);
+                _exit(-1);
+            }
+            logmsg(LOG_INFO, "config: Connecting to network %s\n", n_new->name);
+            inet_connect(n_new);
+            continue;
+        }
+
+        //The new channel list is compared under the casemapping the network already told us about
+        if(n_new->casemapping != n->casemapping){
+            config_network_set_casemapping(n_new, n->casemapping);
+        }
+        config_reload_channels(n, n_new);
+
+        //Keep the connection, but take everything else from the new configuration
+        struct network tmp = *n;
+        n->name = n_new->name;
+        n->host = n_new->host;
+        n->ca_file = n_new->ca_file;
+        n->nick = n_new->nick;
+        n->alt_nick = n_new->alt_nick;
+        n->user = n_new->user;
+        n->real_name = n_new->real_name;
+        n->pass = n_new->pass;
+        n->quit_msg = n_new->quit_msg;
+        n->channels = n_new->channels;
+        n->admins = n_new->admins;
+        n->plugins = n_new->plugins;
+        n->source = n_new->source;
+
+        n_new->channels = tmp.channels;
+        n_new->admins = tmp.admins;
+        n_new->plugins = tmp.plugins;
+        n_new->source = tmp.source;
+        config_network_free(n_new);
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    keys = htable_get_keys(rc_network, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        if(htable_lookup(networks, keys[i]->key, keys[i]->key_size) != NULL){
+            continue;
+        }
+
+        struct network* n = htable_lookup(rc_network, keys[i]->key, keys[i]->key_size);
+        logmsg(LOG_INFO, "config: Disconnecting from removed network %s\n", n->name);
+        htable_remove(rc_network, keys[i]->key, keys[i]->key_size);
+        config_network_quit(n);
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+}
+
+int config_reload(){
+    json_error_t error;
+    const char* activity = watchdog_enter("json_load_file");
+    json_t* root = json_load_file(rc_path, 0, &error);
+    watchdog_leave(activity);
+    if(root == NULL){
+        logmsg(LOG_ERR, "config: Not reloading configuration, %s at line %d, column %d\n", error.text, error.line, error.column);
+        return 0;
+    }
+
+    struct praetor praetor;
+    memset(&praetor, 0, sizeof(praetor));
+    struct htable* networks = htable_create(5), * plugins = htable_create(5);
+    if(networks == NULL || plugins == NULL){
+        logmsg(LOG_WARNING, "config: Could not reload configuration, the system is out of memory\n");
+        if(networks != NULL){
+            htable_destroy(networks);
+        }
+        if(plugins != NULL){
+            htable_destroy(plugins);
+        }
+        json_decref(root);
+        return -1;
+    }
+
+    //Nothing is applied unless the whole file is valid
+    int ret = config_parse(root, &praetor, networks, plugins);
+    json_decref(root);
+    if(ret == -1){
+        logmsg(LOG_ERR, "config: Not reloading configuration from %s, the running configuration is unchanged\n", rc_path);
+        json_decref(praetor.source);
+        config_free(networks, plugins);
+        return 0;
+    }
+    logmsg(LOG_INFO, "config: Reloading configuration from %s\n", rc_path);
+
+    if(config_str_differs(rc_praetor->user, praetor.user) || config_str_differs(rc_praetor->group, praetor.group) || config_str_differs(rc_praetor->workdir, praetor.workdir)){
+        logmsg(LOG_WARNING, "config: Changes to user, group, and workdir take effect when praetor is restarted\n");
+    }
+    //Plugin batches are sized when plugins are loaded
+    if(rc_praetor->batch_size != praetor.batch_size){
+        logmsg(LOG_WARNING, "config: Changes to batch_size take effect when praetor is restarted\n");
+        praetor.batch_size = rc_praetor->batch_size;
+    }
+    //The metrics and control sockets are opened once, after praetor has daemonized
+    if(config_str_differs(rc_praetor->metrics_socket, praetor.metrics_socket) || rc_praetor->metrics_port != praetor.metrics_port){
+        logmsg(LOG_WARNING, "config: Changes to metrics_socket and metrics_port take effect when praetor is restarted\n");
+    }
+    if(config_str_differs(rc_praetor->control_socket, praetor.control_socket)){
+        logmsg(LOG_WARNING, "config: Changes to control_socket take effect when praetor is restarted\n");
+    }
+    json_decref(rc_praetor->source);
+    *rc_praetor = praetor;
+
+    //Plugins go first, so that networks can be pointed at the ones that are still running
+    config_reload_plugins(plugins);
+    config_reload_networks(networks);
+
+    htable_destroy(plugins);
+    htable_destroy(networks);
+
+    return 0;
+}
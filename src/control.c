@@ -0,0 +1,657 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
+#include "config.h"
+#include "control.h"
+#include "htable.h"
+#include "inet.h"
+#include "intern.h"
+#include "isupport.h"
+#include "log.h"
+#include "metrics.h"
+#include "nexus.h"
+#include "plugin.h"
+#include "queue.h"
+#include "state.h"
+#include "trace.h"
+#include "util.h"
+
+#define CONTROL_BACKLOG 4
+
+int control_sock = -1;
+char* control_path = NULL;
+
+/**
+ * A connection to the control socket. Commands are read until a full line has
+ * arrived; while the responses to it are written, no more commands are read.
+ */
+struct control_client{
+    int sock;
+    char request[CONTROL_LINE_MAX];
+    size_t request_len;
+    char* response;
+    size_t response_len;
+    size_t response_sent;
+};
+
+struct control_client* control_clients[CONTROL_CLIENTS_MAX];
+
+/**
+ * The names of the log priorities in <syslog.h>, from most to least severe.
+ */
+const char* control_log_levels[] = {"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"};
+
+/**
+ * Returns the name of a plugin status, as reported by the status command.
+ */
+const char* control_plugin_status_name(enum plugin_status status){
+    switch(status){
+        case PLUGIN_LOADED:
+            return "loaded";
+        case PLUGIN_UNLOADED:
+            return "unloaded";
+        case PLUGIN_RESTARTING:
+            return "restarting";
+        case PLUGIN_QUARANTINED:
+            return "quarantined";
+        case PLUGIN_DEAD:
+            return "dead";
+        default:
+            return "unknown";
+    }
+}
+
+/**
+ * Builds the response to a command that failed.
+ */
+json_t* control_error(const char* error){
+    return json_pack("{s:b, s:s}", "ok", false, "error", error);
+}
+
+/**
+ * Adds a description of a hash table to a list of them.
+ */
+void control_append_htable(json_t* list, const char* name, const char* owner, const struct htable* table){
+    if(table == NULL){
+        return;
+    }
+
+    json_t* obj = json_pack("{s:s, s:I, s:I, s:f, s:f}",
+        "name", name,
+        "mappings", (json_int_t)htable_get_mapping_count(table),
+        "buckets", (json_int_t)htable_get_bucket_count(table),
+        "load_factor", htable_get_load_factor(table),
+        "load_threshold", htable_get_load_threshold(table)
+    );
+    if(obj != NULL && owner != NULL){
+        json_object_set_new(obj, "owner", json_string(owner));
+    }
+    json_array_append_new(list, obj);
+}
+
+/**
+ * Builds the response to the htables command.
+ */
+json_t* control_htables(){
+    json_t* list = json_array();
+    if(list == NULL){
+        return NULL;
+    }
+
+    control_append_htable(list, "rc_network", NULL, rc_network);
+    control_append_htable(list, "rc_network_sock", NULL, rc_network_sock);
+    control_append_htable(list, "rc_plugin", NULL, rc_plugin);
+    control_append_htable(list, "rc_plugin_sock", NULL, rc_plugin_sock);
+    control_append_htable(list, "rc_plugin_pid", NULL, rc_plugin_pid);
+
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(rc_network, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        const struct network* n = htable_lookup(rc_network, keys[i]->key, keys[i]->key_size);
+        control_append_htable(list, "channels", n->name, n->channels);
+        control_append_htable(list, "admins", n->name, n->admins);
+        control_append_htable(list, "plugins", n->name, n->plugins);
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    keys = htable_get_keys(rc_plugin, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        const struct plugin* p = htable_lookup(rc_plugin, keys[i]->key, keys[i]->key_size);
+        control_append_htable(list, "private_messages", p->name, p->private_messages);
+        control_append_htable(list, "input", p->name, p->input);
+        control_append_htable(list, "output", p->name, p->output);
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    return json_pack("{s:b, s:o}", "ok", true, "htables", list);
+}
+
+/**
+ * Builds the response to the status command.
+ */
+json_t* control_status(){
+    json_t* networks = json_array();
+    json_t* plugins = json_array();
+    if(networks == NULL || plugins == NULL){
+        json_decref(networks);
+        json_decref(plugins);
+        return NULL;
+    }
+
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(rc_network, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        const struct network* n = htable_lookup(rc_network, keys[i]->key, keys[i]->key_size);
+        json_array_append_new(networks, json_pack("{s:s, s:s, s:b, s:b, s:I, s:I, s:I, s:I, s:I, s:I, s:I, s:o}",
+            "name", n->name,
+            "host", n->host,
+            "ssl", n->ssl,
+            "connected", n->connected,
+            "send_queue", (json_int_t)(n->send_queue == NULL ? 0 : queue_get_size(n->send_queue)),
+            "recv_buffered", (json_int_t)n->recv_queue_idx,
+            "lines_in", (json_int_t)n->metrics.lines_in,
+            "lines_out", (json_int_t)n->metrics.lines_out,
+            "reconnects", (json_int_t)n->metrics.reconnects,
+            "channels", (json_int_t)state_get_channel_count(n),
+            "users", (json_int_t)state_get_user_count(n),
+            "isupport", isupport_to_json(n)
+        ));
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    keys = htable_get_keys(rc_plugin, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        const struct plugin* p = htable_lookup(rc_plugin, keys[i]->key, keys[i]->key_size);
+        json_array_append_new(plugins, json_pack("{s:s, s:s, s:s, s:s, s:I, s:I, s:I, s:I, s:I, s:I}",
+            "name", p->name,
+            "status", control_plugin_status_name(p->status),
+            "type", p->type == PLUGIN_TYPE_SHARED ? "shared" : "process",
+            "transport", p->transport == PLUGIN_TRANSPORT_SHM ? "shm" : "socket",
+            "pid", (json_int_t)(p->type == PLUGIN_TYPE_SHARED || p->status != PLUGIN_LOADED ? 0 : p->pid),
+            "batch", (json_int_t)p->batch_count,
+            "outbox", (json_int_t)(p->outbox == NULL ? 0 : queue_get_size(p->outbox)),
+            "delivered", (json_int_t)p->metrics.delivered,
+            "dropped", (json_int_t)p->metrics.dropped,
+            "restarts", (json_int_t)p->restart_count
+        ));
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    return json_pack("{s:b, s:s, s:I, s:o, s:o}", "ok", true, "log_level", control_log_levels[log_threshold], "interned", (json_int_t)intern_get_count(), "networks", networks, "plugins", plugins);
+}
+
+/**
+ * Reports the log level, or sets it if \c level isn't NULL.
+ */
+json_t* control_log_level(const char* level){
+    if(level == NULL){
+        return json_pack("{s:b, s:s}", "ok", true, "log_level", control_log_levels[log_threshold]);
+    }
+
+    for(int i = LOG_EMERG; i <= LOG_DEBUG; i++){
+        if(strcmp(level, control_log_levels[i]) == 0){
+            logmsg(LOG_NOTICE, "control: Setting log level to %s\n", level);
+            log_threshold = i;
+            json_t* ret = json_pack("{s:b, s:s}", "ok", true, "log_level", level);
+            //Messages removed at build time can't be brought back
+            if(ret != NULL && i > PRAETOR_LOG_LEVEL){
+                json_object_set_new(ret, "warning", json_string("Messages less severe than the level praetor was built with are not logged"));
+            }
+            return ret;
+        }
+    }
+
+    return control_error("Unknown log level, expected one of emerg, alert, crit, err, warning, notice, info, or debug");
+}
+
+/**
+ * Tears down the connection to the named network, if it has one, and starts
+ * a new one.
+ */
+json_t* control_reconnect(const char* name){
+    if(name == NULL){
+        return control_error("Expected the name of a network");
+    }
+    struct network* n = htable_lookup(rc_network, (uint8_t*)name, strlen(name)+1);
+    if(n == NULL){
+        return control_error("No such network");
+    }
+
+    logmsg(LOG_NOTICE, "control: Reconnecting to network '%s'\n", n->name);
+
+    //Only a network that's mapped by its socket has a connection to tear down
+    if(htable_lookup(rc_network_sock, (uint8_t*)&n->sock, sizeof(n->sock)) == n){
+        inet_disconnect(n);
+    }
+    //Networks that have run out of addresses start over with a fresh lookup
+    if(n->addr_idx == INT_MAX){
+        n->addr_idx = 0;
+    }
+    n->metrics.reconnects++;
+    if(inet_connect(n) < 0){
+        return control_error("Could not connect to the network, see the log for details");
+    }
+
+    return json_pack("{s:b}", "ok", true);
+}
+
+/**
+ * Restarts the named plugin, or reloads the configuration file if \c name is
+ * NULL.
+ */
+json_t* control_reload(const char* name){
+    if(name == NULL){
+        logmsg(LOG_NOTICE, "control: Reloading configuration\n");
+        if(config_reload() == -1){
+            return control_error("Could not reload the configuration, the system is out of memory");
+        }
+        return json_pack("{s:b}", "ok", true);
+    }
+
+    struct plugin* p = htable_lookup(rc_plugin, (uint8_t*)name, strlen(name)+1);
+    if(p == NULL){
+        return control_error("No such plugin");
+    }
+
+    logmsg(LOG_NOTICE, "control: Restarting plugin '%s'\n", p->name);
+    if(p->status != PLUGIN_UNLOADED){
+        plugin_unload(p);
+    }
+    if(plugin_load(p) == -1){
+        return control_error("Could not load the plugin, see the log for details");
+    }
+
+    return json_pack("{s:b}", "ok", true);
+}
+
+/**
+ * Adds a member to the object being built by control_members().
+ */
+void control_add_member(void* arg, const char* nick, const char* prefixes){
+    json_object_set_new(arg, nick, json_string(prefixes));
+}
+
+/**
+ * Lists the members of a channel, and their membership prefixes.
+ */
+json_t* control_members(const char* network, const char* channel){
+    if(network == NULL || channel == NULL){
+        return control_error("Expected the name of a network and a channel");
+    }
+    struct network* n = htable_lookup(rc_network, (uint8_t*)network, strlen(network)+1);
+    if(n == NULL){
+        return control_error("No such network");
+    }
+
+    json_t* members = json_object();
+    if(members == NULL){
+        return NULL;
+    }
+    if(state_members(n, channel, control_add_member, members) == -1){
+        json_decref(members);
+        return control_error("Not in that channel");
+    }
+
+    return json_pack("{s:b, s:o}", "ok", true, "members", members);
+}
+
+/**
+ * Packs a latency quantile into JSON in milliseconds, as null if it's beyond
+ * the largest bucket.
+ */
+json_t* control_quantile(const struct metrics_histogram* h, double q){
+    uint64_t ns = metrics_quantile(h, q);
+    return ns == UINT64_MAX ? json_null() : json_real(ns / 1e6);
+}
+
+/**
+ * Appends a summary of a latency histogram to a JSON array.
+ */
+void control_add_histogram(void* arg, const char* kind, const char* name, const char* stage, const struct metrics_histogram* h){
+    json_array_append_new(arg, json_pack("{s:s, s:s, s:s, s:I, s:f, s:o, s:o, s:o}",
+        "kind", kind,
+        "name", name,
+        "stage", stage,
+        "samples", (json_int_t)h->count,
+        "mean", h->sum / 1e6 / h->count,
+        "p50", control_quantile(h, 0.5),
+        "p90", control_quantile(h, 0.9),
+        "p99", control_quantile(h, 0.99)
+    ));
+}
+
+/**
+ * Summarizes the latency histograms, as SIGUSR1 writes them to the log.
+ */
+json_t* control_trace(){
+    json_t* histograms = json_array();
+    if(histograms == NULL){
+        return NULL;
+    }
+    trace_foreach(control_add_histogram, histograms);
+
+    return json_pack("{s:b, s:o}", "ok", true, "trace", histograms);
+}
+
+json_t* control_execute(char* line){
+    char* saveptr = NULL;
+    char* cmd = strtok_r(line, " \t\r", &saveptr);
+    char* arg = cmd == NULL ? NULL : strtok_r(NULL, " \t\r", &saveptr);
+    char* arg2 = arg == NULL ? NULL : strtok_r(NULL, " \t\r", &saveptr);
+    if(cmd == NULL){
+        return control_error("Expected a command, try 'help'");
+    }
+    if((arg2 != NULL && strcmp(cmd, "members") != 0) || (arg2 != NULL && strtok_r(NULL, " \t\r", &saveptr) != NULL)){
+        return control_error("Too many arguments");
+    }
+
+    if(strcmp(cmd, "help") == 0){
+        return json_pack("{s:b, s:[s, s, s, s, s, s, s, s, s]}", "ok", true, "commands",
+            "help", "status", "htables", "metrics", "trace", "log_level [level]", "reconnect network", "reload [plugin]", "members network channel");
+    }
+    if(strcmp(cmd, "status") == 0){
+        return control_status();
+    }
+    if(strcmp(cmd, "htables") == 0){
+        return control_htables();
+    }
+    if(strcmp(cmd, "metrics") == 0){
+        size_t len = 0;
+        char* text = metrics_render(&len);
+        if(text == NULL){
+            return NULL;
+        }
+        json_t* ret = json_pack("{s:b, s:s}", "ok", true, "metrics", text);
+        free(text);
+        return ret;
+    }
+    if(strcmp(cmd, "trace") == 0){
+        return control_trace();
+    }
+    if(strcmp(cmd, "log_level") == 0){
+        return control_log_level(arg);
+    }
+    if(strcmp(cmd, "reconnect") == 0){
+        return control_reconnect(arg);
+    }
+    if(strcmp(cmd, "reload") == 0){
+        return control_reload(arg);
+    }
+    if(strcmp(cmd, "members") == 0){
+        return control_members(arg, arg2);
+    }
+
+    return control_error("Unknown command, try 'help'");
+}
+
+/**
+ * Closes a control connection, discarding any responses not yet written.
+ */
+void control_client_close(struct control_client* c){
+    for(size_t i = 0; i < CONTROL_CLIENTS_MAX; i++){
+        if(control_clients[i] == c){
+            control_clients[i] = NULL;
+        }
+    }
+    watch_remove(c->sock);
+    close(c->sock);
+    free(c->response);
+    free(c);
+}
+
+void control_client_read(int fd, short revents, void* arg);
+
+/**
+ * Writes as much of the pending responses to a client as its socket will
+ * take, and goes back to reading commands once all of them have been written.
+ */
+void control_client_write(int fd, short revents, void* arg){
+    (void)revents;
+    struct control_client* c = arg;
+
+    while(c->response_sent < c->response_len){
+        ssize_t ret = write(fd, c->response + c->response_sent, c->response_len - c->response_sent);
+        if(ret == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                logmsg(LOG_DEBUG, "control: Could not send response, %s\n", strerror(errno));
+                control_client_close(c);
+            }
+            return;
+        }
+        c->response_sent += ret;
+    }
+
+    free(c->response);
+    c->response = NULL;
+    c->response_len = 0;
+    c->response_sent = 0;
+
+    watch_remove(fd);
+    if(watch_add_callback(fd, false, control_client_read, c) == -1){
+        control_client_close(c);
+    }
+}
+
+/**
+ * Appends the response to a command to those waiting to be written to a
+ * client.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory.
+ */
+int control_respond(struct control_client* c, json_t* response){
+    char* text = response == NULL ? NULL : json_dumps(response, JSON_COMPACT);
+    json_decref(response);
+    if(text == NULL){
+        return -1;
+    }
+
+    size_t len = strlen(text);
+    char* tmp = realloc(c->response, c->response_len + len + 1);
+    if(tmp == NULL){
+        free(text);
+        return -1;
+    }
+    memcpy(tmp + c->response_len, text, len);
+    tmp[c->response_len + len] = '\n';
+    c->response = tmp;
+    c->response_len += len + 1;
+    free(text);
+
+    return 0;
+}
+
+/**
+ * Reads commands from a client, and answers every one that has arrived in
+ * full.
+ */
+void control_client_read(int fd, short revents, void* arg){
+    (void)revents;
+    struct control_client* c = arg;
+
+    ssize_t ret = read(fd, c->request + c->request_len, CONTROL_LINE_MAX - c->request_len);
+    if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+        return;
+    }
+    if(ret <= 0){
+        control_client_close(c);
+        return;
+    }
+    c->request_len += ret;
+
+    char* eol;
+    while((eol = memchr(c->request, '\n', c->request_len)) != NULL){
+        *eol = '\0';
+        size_t line_len = eol - c->request + 1;
+
+        if(control_respond(c, control_execute(c->request)) == -1){
+            logmsg(LOG_WARNING, "control: Could not answer command, the system is out of memory\n");
+            control_client_close(c);
+            return;
+        }
+
+        memmove(c->request, c->request + line_len, c->request_len - line_len);
+        c->request_len -= line_len;
+    }
+
+    if(c->request_len == CONTROL_LINE_MAX){
+        logmsg(LOG_WARNING, "control: Closing connection that sent a command longer than %d bytes\n", CONTROL_LINE_MAX);
+        control_client_close(c);
+        return;
+    }
+
+    if(c->response_len > 0){
+        watch_remove(fd);
+        if(watch_add_callback(fd, true, control_client_write, c) == -1){
+            control_client_close(c);
+        }
+    }
+}
+
+/**
+ * Accepts a connection on the control socket.
+ */
+void control_accept(int fd, short revents, void* arg){
+    (void)revents;
+    (void)arg;
+
+    int sock = accept(fd, NULL, NULL);
+    if(sock == -1){
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            logmsg(LOG_WARNING, "control: Could not accept connection, %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    size_t slot = 0;
+    while(slot < CONTROL_CLIENTS_MAX && control_clients[slot] != NULL){
+        slot++;
+    }
+    if(slot == CONTROL_CLIENTS_MAX){
+        logmsg(LOG_DEBUG, "control: Turning away connection, %d are already open\n", CONTROL_CLIENTS_MAX);
+        close(sock);
+        return;
+    }
+
+    struct control_client* c = calloc(1, sizeof(struct control_client));
+    if(c == NULL){
+        logmsg(LOG_WARNING, "control: Could not accept connection, the system is out of memory\n");
+        close(sock);
+        return;
+    }
+    c->sock = sock;
+
+    if(setnonblock(sock) == -1 || setcloexec(sock) == -1 || watch_add_callback(sock, false, control_client_read, c) == -1){
+        logmsg(LOG_WARNING, "control: Could not accept connection\n");
+        close(sock);
+        free(c);
+        return;
+    }
+    control_clients[slot] = c;
+}
+
+int control_init(const char* socket_path){
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if(strlen(socket_path) >= sizeof(addr.sun_path)){
+        logmsg(LOG_WARNING, "control: Socket path %s is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    if((control_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
+        logmsg(LOG_WARNING, "control: Could not open socket, %s\n", strerror(errno));
+        goto fail;
+    }
+    //A socket left behind by an earlier process, or by the one that upgraded into this one
+    unlink(socket_path);
+    //Anyone who can connect can reconfigure praetor, so the socket is never created open to others
+    mode_t mask = umask(S_IRWXG | S_IRWXO);
+    int ret = bind(control_sock, (struct sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if(ret == -1){
+        logmsg(LOG_WARNING, "control: Could not bind to %s, %s\n", socket_path, strerror(errno));
+        goto fail;
+    }
+    if((control_path = malloc(strlen(socket_path) + 1)) == NULL){
+        logmsg(LOG_WARNING, "control: Could not listen on %s, the system is out of memory\n", socket_path);
+        unlink(socket_path);
+        goto fail;
+    }
+    strcpy(control_path, socket_path);
+
+    if(chmod(socket_path, S_IRUSR | S_IWUSR) == -1){
+        logmsg(LOG_WARNING, "control: Could not restrict access to %s, %s\n", socket_path, strerror(errno));
+        goto fail;
+    }
+
+    if(setnonblock(control_sock) == -1 || setcloexec(control_sock) == -1){
+        logmsg(LOG_WARNING, "control: Could not set socket file descriptor flags, %s\n", strerror(errno));
+        goto fail;
+    }
+    if(listen(control_sock, CONTROL_BACKLOG) == -1){
+        logmsg(LOG_WARNING, "control: Could not listen for connections, %s\n", strerror(errno));
+        goto fail;
+    }
+    if(watch_add_callback(control_sock, false, control_accept, NULL) == -1){
+        goto fail;
+    }
+
+    logmsg(LOG_INFO, "control: Listening for commands on %s\n", socket_path);
+    return 0;
+
+    fail:
+        control_close();
+        return -1;
+}
+
+void control_close(){
+    for(size_t i = 0; i < CONTROL_CLIENTS_MAX; i++){
+        if(control_clients[i] != NULL){
+            control_client_close(control_clients[i]);
+        }
+    }
+    if(control_sock != -1){
+        watch_remove(control_sock);
+        close(control_sock);
+        control_sock = -1;
+    }
+    if(control_path != NULL){
+        unlink(control_path);
+        free(control_path);
+        control_path = NULL;
+    }
+}
@@ -10,11 +10,13 @@
 * can be found in the "LICENSE" file bundled with this source distribution.
 */
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "casemap.h"
 #include "htable.h"
 #include "log.h"
 
@@ -32,6 +34,9 @@ struct htable{
     size_t mapping_count;
     size_t bucket_count;
     double load_threshold;
+    //Whether keys are hashed and compared without regard to case, under casemapping
+    bool casemapped;
+    enum casemapping casemapping;
 };
 
 uint32_t hash(const uint8_t* key, size_t len){
@@ -49,6 +54,45 @@ uint32_t hash(const uint8_t* key, size_t len){
     return hash;
 }
 
+/**
+ * Hashes a key as the given table does, which is folded under its
+ * casemapping, if it has one, so that keys differing only in case hash alike.
+ */
+uint32_t htable_hash(const struct htable* table, const uint8_t* key, size_t len){
+    if(!table->casemapped){
+        return hash(key, len);
+    }
+
+    const uint8_t* fold = casemap_tables[table->casemapping];
+    uint32_t hash, i;
+    for(hash = i = 0; i < len; ++i){
+        hash += fold[key[i]];
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+    }
+
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+
+    return hash;
+}
+
+/**
+ * Returns whether an entry's key is the given key, as the table compares them.
+ */
+bool htable_key_equal(const struct htable* table, const struct htable_entry* entry, const uint8_t* key, size_t key_size){
+    //The sizes must match, or undefined behavior will occur
+    if(entry->key_size != key_size){
+        return false;
+    }
+    //Keys are most often looked up in the case they were added in
+    if(memcmp(entry->key, key, key_size) == 0){
+        return true;
+    }
+    return table->casemapped && casemap_equal((const char*)entry->key, (const char*)key, key_size, table->casemapping);
+}
+
 struct htable* htable_create(size_t size){
     if(size == 0){
         return NULL;
@@ -105,29 +149,45 @@ void htable_destroy(struct htable* table){
     free(table);
 }
 
-//Rehashing is done this way to avoid invalidating the user's pointer after a call to htable_add()
-int htable_rehash(struct htable* table, size_t scale){
+/**
+ * Moves every mapping in a table into \c bucket_count new buckets, hashing
+ * and comparing keys as \c casemapped and \c mapping say from then on.
+ *
+ * \return 0 on success.
+ * \return -1 if two keys would be the same key in the new table, in which
+ *         case the table is left as it was.
+ * \return -2 if the system is out of memory, in which case the table is left
+ *         as it was.
+ */
+//The buckets are swapped into the table, so the user's pointer stays valid after a call to htable_add()
+int htable_rebuild(struct htable* table, size_t bucket_count, bool casemapped, enum casemapping mapping){
     //Create a temporary table
-    struct htable* tmp_table = htable_create(table->bucket_count * scale);
+    struct htable* tmp_table = htable_create(bucket_count);
     if(tmp_table == NULL){
-        return -1;
+        return -2;
     }
+    tmp_table->casemapped = casemapped;
+    tmp_table->casemapping = mapping;
 
     //Enumerate keys from the table that needs to be rehashed
     size_t size = 0;
-    struct htable_key** key_list = htable_get_keys(table, &size);
-    if(key_list == NULL){
-        htable_destroy(tmp_table);
-        return -1;
+    struct htable_key** key_list = NULL;
+    if(table->mapping_count > 0){
+        key_list = htable_get_keys(table, &size);
+        if(key_list == NULL){
+            htable_destroy(tmp_table);
+            return -2;
+        }
     }
 
     //Add all entries into the temporary table
     for(size_t i = 0; i < size; i++){
         void* value = htable_lookup(table, key_list[i]->key, key_list[i]->key_size);
-        if(htable_add(tmp_table, key_list[i]->key, key_list[i]->key_size, value) == -2){
+        int ret = htable_add(tmp_table, key_list[i]->key, key_list[i]->key_size, value);
+        if(ret != 0){
             htable_key_list_free(key_list, size);
             htable_destroy(tmp_table);
-            return -1;
+            return ret;
         }
     }
 
@@ -137,16 +197,31 @@ int htable_rehash(struct htable* table, size_t scale){
     tmp_table->buckets = tmp_buckets;
 
     //Update bucket counts
-    table->bucket_count *= scale;
-    tmp_table->bucket_count /= scale;
+    tmp_table->bucket_count = table->bucket_count;
+    table->bucket_count = bucket_count;
+    table->casemapped = casemapped;
+    table->casemapping = mapping;
 
     //Clean-up
-    htable_key_list_free(key_list, size);
+    if(key_list != NULL){
+        htable_key_list_free(key_list, size);
+    }
     htable_destroy(tmp_table);
 
     return 0;
 }
 
+int htable_rehash(struct htable* table, size_t scale){
+    return htable_rebuild(table, table->bucket_count * scale, table->casemapped, table->casemapping) == 0 ? 0 : -1;
+}
+
+int htable_set_casemapping(struct htable* table, enum casemapping mapping){
+    if(table->casemapped && table->casemapping == mapping){
+        return 0;
+    }
+    return htable_rebuild(table, table->bucket_count, true, mapping);
+}
+
 int htable_add(struct htable* table, const uint8_t* key, size_t key_size, void* value){
     if(table == NULL){
         logmsg(LOG_DEBUG, "Cannot add mapping to NULL table\n");
@@ -166,7 +241,7 @@ int htable_add(struct htable* table, const uint8_t* key, size_t key_size, void*
         return -1;
     }
     
-    size_t index = hash(key, key_size) % table->bucket_count;
+    size_t index = htable_hash(table, key, key_size) % table->bucket_count;
 
     struct htable_entry* this = table->buckets[index];
     //If this bucket is empty, add the first entry
@@ -224,14 +299,13 @@ int htable_remove(struct htable* table, const uint8_t* key, size_t key_size){
         return -1;
     }
     
-    size_t index = hash(key, key_size) % table->bucket_count;
+    size_t index = htable_hash(table, key, key_size) % table->bucket_count;
 
     struct htable_entry* this = table->buckets[index];
     struct htable_entry* prev_entry = this;
 
     for(; this != NULL; this = this->next){
-        //The sizes must match, or undefined behavior will occur
-        if(this->key_size == key_size && memcmp(this->key, key, key_size) == 0){
+        if(htable_key_equal(table, this, key, key_size)){
             //If this was the first entry in the bucket:
             if(table->buckets[index] == this){
                 //If there are entries below this, move them up
@@ -273,11 +347,11 @@ void* htable_lookup(const struct htable* table, const uint8_t* key, size_t key_s
         return NULL;
     }
     
-    size_t index = hash(key, key_size) % table->bucket_count;
+    size_t index = htable_hash(table, key, key_size) % table->bucket_count;
 
     struct htable_entry* this = table->buckets[index];
     for(; this != NULL; this = this->next){
-        if(this->key_size == key_size && memcmp(this->key, key, key_size) == 0){
+        if(htable_key_equal(table, this, key, key_size)){
             return this->value;
         }
     }
@@ -364,3 +438,7 @@ void htable_set_load_threshold(struct htable* table, double threshold){
 size_t htable_get_mapping_count(const struct htable* table){
     return table->mapping_count;
 }
+
+size_t htable_get_bucket_count(const struct htable* table){
+    return table->bucket_count;
+}
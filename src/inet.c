@@ -12,9 +12,10 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -24,12 +25,20 @@
 
 #include <tls.h>
 
+#include "capture.h"
 #include "config.h"
 #include "htable.h"
 #include "ircmsg.h"
+#include "isupport.h"
 #include "log.h"
+#include "metrics.h"
 #include "nexus.h"
+#include "probes.h"
 #include "queue.h"
+#include "state.h"
+#include "trace.h"
+#include "util.h"
+#include "watchdog.h"
 
 #define DEFAULT_PORT "6667"
 #define DEFAULT_PORT_TLS "6697"
@@ -66,7 +75,9 @@ int inet_getaddrinfo(struct network* n){
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     
+    const char* activity = watchdog_enter("getaddrinfo");
     int s = getaddrinfo(host, service, &hints, &result);
+    watchdog_leave(activity);
 
     if(s < 0 || result == NULL){
         if(s == EAI_SYSTEM){
@@ -122,6 +133,12 @@ int inet_tls_upgrade(struct network* n){
         goto fail;
     }
 
+    if(n->ca_file != NULL && tls_config_set_ca_file(cfg, n->ca_file) == -1){
+        logmsg(LOG_WARNING, "inet: Could not load certificate authorities for '%s' from %s, %s\n", n->name, n->ca_file, tls_config_error(cfg));
+        tls_config_free(cfg);
+        goto fail;
+    }
+
     //uint32_t protocols;
     //tls_config_parse_protocols(&protocols, "secure");
     //tls_config_set_protocols(cfg, protocols);
@@ -138,7 +155,10 @@ int inet_tls_upgrade(struct network* n){
         goto fail;
     }
 
-    if(tls_handshake(ctx) == -1){
+    const char* activity = watchdog_enter("tls_handshake");
+    int handshake = tls_handshake(ctx);
+    watchdog_leave(activity);
+    if(handshake == -1){
         logmsg(LOG_WARNING, "inet: Could not perform TLS handshake with '%s' host '%s', %s\n", n->name, host, tls_error(ctx));
         goto fail;
     }
@@ -220,18 +240,20 @@ int inet_connect(struct network* n){
         return -1;
     }
     n->sock = sock;
+    PROBE2(connect, n->name, host);
 
-    //Put the socket fd into non-blocking mode
-    int flags = fcntl(sock, F_GETFL);
-    if(flags == -1){
-        logmsg(LOG_DEBUG, "inet: Could not get socket file descriptor flags for '%s' host '%s', %s\n", n->name, host, strerror(errno));
-        goto fail;
-    }
-    if(fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1){
+    //Put the socket fd into non-blocking mode, and keep it out of plugins
+    if(setnonblock(sock) == -1 || setcloexec(sock) == -1){
         logmsg(LOG_DEBUG, "inet: Could not set socket file descriptor flags for '%s' host '%s', %s\n", n->name, host, strerror(errno));
         goto fail;
     }
 
+    //IRC lines are small, and replies shouldn't wait on the ACK of whatever was sent before them
+    int nodelay = 1;
+    if(setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1){
+        logmsg(LOG_DEBUG, "inet: Could not disable Nagle's algorithm for '%s' host '%s', %s\n", n->name, host, strerror(errno));
+    }
+
     //Create a receive queue for the network, if one doesn't already exist
     if(n->recv_queue == 0){
         //+1 to account for a null-terminator; the buffer can then be read like any string
@@ -318,7 +340,11 @@ int inet_connect_all(){
 
     for(size_t i = 0; i < size; i++){
         struct network* n = htable_lookup(rc_network, networks[i]->key, networks[i]->key_size);
-        if(n != NULL){
+        //Connections handed over by an upgrade are already up
+        if(n != NULL && n->sock != -1 && htable_lookup(rc_network_sock, (uint8_t*)&n->sock, sizeof(n->sock)) == n){
+            continue;
+        }
+        else if(n != NULL){
             inet_connect(n);
         }
         else{
@@ -352,6 +378,7 @@ int inet_check_connection(struct network* n){
             logmsg(LOG_WARNING, "inet: Could not monitor connection to '%s', the system is out of memory\n", n->name);
             goto fail;
         }
+        n->connected = true;
 		return 0;
     }
     else if(optval == INT_MAX){
@@ -370,6 +397,7 @@ int inet_check_connection(struct network* n){
 }
 
 int inet_disconnect(struct network* n){
+    PROBE1(disconnect, n->name);
     if(n->ssl){
         tls_close(n->ctx);
     }
@@ -395,6 +423,32 @@ int inet_disconnect(struct network* n){
     //De-allocate send queue
     queue_destroy(n->send_queue);
     n->send_queue = 0;
+    trace_discard(n);
+
+    //The channels we were in are gone with the connection, and the next server may support something else
+    state_free(n->state);
+    n->state = NULL;
+    isupport_init(&n->isupport);
+    config_network_set_casemapping(n, CASEMAP_DEFAULT);
+
+    n->connected = false;
+
+    return 0;
+}
+
+int inet_grow_recv_queue(struct network* n, size_t size){
+    if(size <= n->recv_queue_size){
+        return 0;
+    }
+
+    char* recv_queue = realloc(n->recv_queue, size);
+    if(recv_queue == NULL){
+        logmsg(LOG_WARNING, "inet: Could not grow receive queue for network '%s', the system is out of memory\n", n->name);
+        return -1;
+    }
+    memset(recv_queue + n->recv_queue_size, '\0', size - n->recv_queue_size);
+    n->recv_queue = recv_queue;
+    n->recv_queue_size = size;
 
     return 0;
 }
@@ -453,10 +507,13 @@ int inet_recv(struct network* n){
     }
 
     n->recv_queue_idx += ret;
+    n->metrics.bytes_in += ret;
+    n->recv_at = metrics_now();
     return 0;
 
     reconn:
         logmsg(LOG_DEBUG, "inet: Attempting to reconnect to network '%s'\n", n->name);
+        n->metrics.reconnects++;
         inet_disconnect(n);
         inet_connect(n);
         return -1;
@@ -476,6 +533,7 @@ int inet_send_immediate(struct network* n, const char* buf, size_t len){
             n->addr_idx++;
             goto reconn;            
         }
+        capture(CAPTURE_NETWORK_OUT, n->name, buf, len);
         return 0;
     }
 
@@ -487,6 +545,7 @@ int inet_send_immediate(struct network* n, const char* buf, size_t len){
 #endif
             case EAGAIN:
                 logmsg(LOG_WARNING, "inet: Send to network '%s' would block, discarding message\n", n->name);
+                //fall through
             case ENOBUFS:
                 return -1;
             case ECONNRESET:
@@ -502,10 +561,12 @@ int inet_send_immediate(struct network* n, const char* buf, size_t len){
         }
     }
 
+    capture(CAPTURE_NETWORK_OUT, n->name, buf, len);
     return 0;
 
     reconn:
         logmsg(LOG_DEBUG, "inet: Attempting to reconnect to network '%s'\n", n->name);
+        n->metrics.reconnects++;
         inet_disconnect(n);
         inet_connect(n);
         return -1;
@@ -515,8 +576,15 @@ int inet_send(struct network* n){
     struct item* itm = NULL;
     while((itm = queue_peek(n->send_queue)) != NULL){
         if(inet_send_immediate(n, (char*)itm->value, itm->size) == 0){
+            PROBE3(line_written, n->name, (char*)itm->value, itm->size);
             logmsg(LOG_DEBUG, "%s >> %.*s", n->name, (int)itm->size, itm->value);
+            n->metrics.lines_out++;
+            n->metrics.bytes_out += itm->size;
             free(queue_dequeue(n->send_queue));
+            free(itm);
+            if(n->trace_sends.count > 0){
+                trace_sent(n);
+            }
         }
         else{
             free(itm);
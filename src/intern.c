@@ -0,0 +1,220 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "casemap.h"
+#include "htable.h"
+#include "intern.h"
+#include "log.h"
+
+//The longest string that's casefolded without allocating a buffer for it
+#define INTERN_FOLD_BUF 512
+
+//The buckets of the intern table, a power of two in number
+struct istr** intern_buckets = NULL;
+size_t intern_bucket_count = 0;
+size_t intern_count = 0;
+
+//The number of interned strings that no one holds a reference to
+size_t intern_unused = 0;
+
+/**
+ * Doubles the number of buckets in the intern table, moving every string into
+ * its new bucket. The table is left as it was if the system is out of memory.
+ */
+void intern_grow(){
+    size_t count = intern_bucket_count * 2;
+    struct istr** buckets = calloc(count, sizeof(struct istr*));
+    if(buckets == NULL){
+        logmsg(LOG_DEBUG, "intern: Could not grow intern table, the system is out of memory\n");
+        return;
+    }
+
+    for(size_t i = 0; i < intern_bucket_count; i++){
+        struct istr* s = intern_buckets[i];
+        while(s != NULL){
+            struct istr* next = s->next;
+            s->next = buckets[s->hash & (count - 1)];
+            buckets[s->hash & (count - 1)] = s;
+            s = next;
+        }
+    }
+
+    free(intern_buckets);
+    intern_buckets = buckets;
+    intern_bucket_count = count;
+}
+
+/**
+ * Frees every interned string that no one holds a reference to. Strings only
+ * held by the strings freed here are freed by a later sweep.
+ */
+void intern_sweep(){
+    for(size_t i = 0; i < intern_bucket_count; i++){
+        struct istr** link = &intern_buckets[i];
+        while(*link != NULL){
+            struct istr* s = *link;
+            if(s->refs > 0){
+                link = &s->next;
+                continue;
+            }
+
+            for(int m = 0; m < CASEMAP_COUNT; m++){
+                if(s->folded[m] != s && --s->folded[m]->refs == 0){
+                    intern_unused++;
+                }
+            }
+            *link = s->next;
+            intern_count--;
+            intern_unused--;
+            free(s);
+        }
+    }
+}
+
+struct istr* intern_find(const char* str, size_t len){
+    if(intern_buckets == NULL){
+        return NULL;
+    }
+
+    uint32_t h = hash((const uint8_t*)str, len);
+    for(struct istr* s = intern_buckets[h & (intern_bucket_count - 1)]; s != NULL; s = s->next){
+        if(s->hash == h && s->len == len && memcmp(s->str, str, len) == 0){
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+struct istr* intern_find_folded(const char* str, size_t len, enum casemapping mapping){
+    char stack_buf[INTERN_FOLD_BUF];
+    char* buf = len > INTERN_FOLD_BUF ? malloc(len) : stack_buf;
+    if(buf == NULL){
+        return NULL;
+    }
+
+    struct istr* s = intern_find(buf, casemap_fold(buf, str, len, mapping));
+
+    if(buf != stack_buf){
+        free(buf);
+    }
+    return s;
+}
+
+struct istr* intern(const char* str, size_t len){
+    if(intern_buckets == NULL){
+        intern_buckets = calloc(INTERN_BUCKETS_MIN, sizeof(struct istr*));
+        if(intern_buckets == NULL){
+            goto fail_oom;
+        }
+        intern_bucket_count = INTERN_BUCKETS_MIN;
+    }
+
+    struct istr* s = intern_find(str, len);
+    if(s != NULL){
+        if(s->refs++ == 0){
+            intern_unused--;
+        }
+        return s;
+    }
+
+    s = malloc(sizeof(struct istr) + len + 1);
+    if(s == NULL){
+        goto fail_oom;
+    }
+    s->refs = 1;
+    s->hash = hash((const uint8_t*)str, len);
+    s->len = len;
+    memcpy(s->str, str, len);
+    s->str[len] = '\0';
+
+    //Every string holds a reference to each of its folded forms, other than itself
+    char stack_buf[INTERN_FOLD_BUF];
+    char* buf = len > INTERN_FOLD_BUF ? malloc(len) : stack_buf;
+    if(buf == NULL){
+        free(s);
+        goto fail_oom;
+    }
+    for(int m = 0; m < CASEMAP_COUNT; m++){
+        casemap_fold(buf, str, len, m);
+        if(memcmp(buf, str, len) == 0){
+            s->folded[m] = s;
+        }
+        //Most names fold the same way under every casemapping
+        else if(m > 0 && s->folded[m - 1] != s && memcmp(buf, s->folded[m - 1]->str, len) == 0){
+            s->folded[m] = intern_ref(s->folded[m - 1]);
+        }
+        else if((s->folded[m] = intern(buf, len)) == NULL){
+            while(m-- > 0){
+                if(s->folded[m] != s){
+                    intern_release(s->folded[m]);
+                }
+            }
+            if(buf != stack_buf){
+                free(buf);
+            }
+            free(s);
+            return NULL;
+        }
+    }
+    if(buf != stack_buf){
+        free(buf);
+    }
+
+    //Interning the folded forms may have grown the table
+    s->next = intern_buckets[s->hash & (intern_bucket_count - 1)];
+    intern_buckets[s->hash & (intern_bucket_count - 1)] = s;
+    intern_count++;
+
+    if(intern_count > intern_bucket_count){
+        intern_grow();
+    }
+
+    return s;
+
+    fail_oom:
+        logmsg(LOG_WARNING, "intern: Could not intern string, the system is out of memory\n");
+        return NULL;
+}
+
+struct istr* intern_handle(const char* str){
+    if(str == NULL){
+        return NULL;
+    }
+    return (struct istr*)(str - offsetof(struct istr, str));
+}
+
+struct istr* intern_ref(struct istr* s){
+    s->refs++;
+    return s;
+}
+
+void intern_release(struct istr* s){
+    if(s == NULL || --s->refs > 0){
+        return;
+    }
+
+    //Strings are kept around for a while, since the same nicks and hosts keep coming back
+    intern_unused++;
+    if(intern_unused > INTERN_UNUSED_MIN && intern_unused > intern_count - intern_unused){
+        intern_sweep();
+    }
+}
+
+size_t intern_get_count(){
+    return intern_count;
+}
@@ -12,6 +12,7 @@
 
 #include <errno.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,18 +20,248 @@
 #include <tls.h>
 #include <unistd.h>
 
+#include "capture.h"
 #include "config.h"
 #include "htable.h"
 #include "ircmsg.h"
 #include "log.h"
 #include "nexus.h"
+#include "probes.h"
+
+/**
+ * A JOIN, PRIVMSG, or NOTICE line, split into the parts that are merged when
+ * lines are coalesced.
+ */
+struct irc_line{
+    const char* cmd;
+    //The comma-separated channels or nicks the line is sent to
+    const char* targets;
+    size_t targets_len;
+    size_t target_count;
+    //A JOIN's comma-separated keys, or the text of a PRIVMSG or NOTICE, colon included
+    const char* rest;
+    size_t rest_len;
+};
+
+/**
+ * Returns the number of items in a comma-separated list, \c len characters
+ * long.
+ */
+size_t irc_list_count(const char* list, size_t len){
+    size_t count = len > 0;
+    for(const char* comma = list; (comma = memchr(comma, ',', len - (comma - list))) != NULL; comma++){
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Returns the length of the first \c count items of a comma-separated list,
+ * not including the comma after them.
+ */
+size_t irc_list_prefix(const char* list, size_t len, size_t count){
+    if(count == 0){
+        return 0;
+    }
+
+    size_t i = 0;
+    for(size_t seen = 0; i < len; i++){
+        if(list[i] == ',' && ++seen == count){
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * Returns whether any item of the comma-separated list \c a names the same
+ * channel or nick as any item of \c b, under the network's casemapping.
+ */
+bool irc_list_overlaps(const struct network* n, const char* a, size_t a_len, const char* b, size_t b_len){
+    for(const char* item = a; item < a + a_len;){
+        const char* item_end = memchr(item, ',', a + a_len - item);
+        item_end = item_end == NULL ? a + a_len : item_end;
+
+        for(const char* other = b; other < b + b_len;){
+            const char* other_end = memchr(other, ',', b + b_len - other);
+            other_end = other_end == NULL ? b + b_len : other_end;
+            if(item_end - item == other_end - other && casemap_equal(item, other, item_end - item, n->casemapping)){
+                return true;
+            }
+            other = other_end + 1;
+        }
+
+        item = item_end + 1;
+    }
+    return false;
+}
+
+/**
+ * Splits a line into an irc_line, if it's a JOIN, PRIVMSG, or NOTICE that
+ * can be merged with another: one without tags or a prefix, whose targets are
+ * a list without empty items, and, for a JOIN, that isn't "JOIN 0".
+ *
+ * \return 0 on success.
+ * \return -1 if the line can't be merged.
+ */
+int irc_line_split(const char* buf, size_t len, struct irc_line* line){
+    if(len < 2 || memcmp(buf + len - 2, "\r\n", 2) != 0){
+        return -1;
+    }
+    len -= 2;
+
+    const char* cmds[] = {"JOIN", "PRIVMSG", "NOTICE"};
+    line->cmd = NULL;
+    for(size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++){
+        size_t cmd_len = strlen(cmds[i]);
+        if(len > cmd_len + 1 && memcmp(buf, cmds[i], cmd_len) == 0 && buf[cmd_len] == ' '){
+            line->cmd = cmds[i];
+            buf += cmd_len + 1;
+            len -= cmd_len + 1;
+            break;
+        }
+    }
+    if(line->cmd == NULL || memchr(buf, '\0', len) != NULL || memchr(buf, '\r', len) != NULL || memchr(buf, '\n', len) != NULL){
+        return -1;
+    }
+
+    const char* space = memchr(buf, ' ', len);
+    line->targets = buf;
+    line->targets_len = space == NULL ? len : (size_t)(space - buf);
+    line->rest = space == NULL ? buf + len : space + 1;
+    line->rest_len = space == NULL ? 0 : len - line->targets_len - 1;
+    line->target_count = irc_list_count(line->targets, line->targets_len);
+
+    const char* targets = line->targets;
+    size_t targets_len = line->targets_len;
+    if(targets_len == 0 || targets[0] == ':' || targets[0] == ',' || targets[targets_len - 1] == ','){
+        return -1;
+    }
+    for(size_t i = 1; i < targets_len; i++){
+        if(targets[i] == ',' && targets[i - 1] == ','){
+            return -1;
+        }
+    }
+
+    if(strcmp(line->cmd, "JOIN") == 0){
+        //Keys are given to the channels at the front of the list, so there are never more keys than channels
+        bool keys_ok = line->rest_len == 0 || (line->rest[0] != ':' && memchr(line->rest, ' ', line->rest_len) == NULL);
+        if(!keys_ok || irc_list_count(line->rest, line->rest_len) > line->target_count || (targets_len == 1 && targets[0] == '0')){
+            return -1;
+        }
+    }
+    else if(line->rest_len == 0){
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Appends \c len characters of \c str to the comma-separated list being built
+ * in \c buf, which holds \c size characters.
+ *
+ * \return false if the list would no longer fit in \c buf.
+ */
+bool irc_line_append(char* buf, size_t* buf_len, size_t size, const char* str, size_t len){
+    if(len == 0){
+        return true;
+    }
+    bool separate = *buf_len > 0;
+    if(*buf_len + separate + len > size){
+        return false;
+    }
+
+    if(separate){
+        buf[(*buf_len)++] = ',';
+    }
+    memcpy(buf + *buf_len, str, len);
+    *buf_len += len;
+    return true;
+}
+
+/**
+ * Merges a line into the last line in a network's send queue, when both are
+ * JOINs, or both are a PRIVMSG or NOTICE of the same text, and the merged line
+ * fits within the network's line length and TARGMAX. A JOIN's keyed channels
+ * are kept at the front of its list, so that its keys still line up with
+ * them. The head of the queue is never merged into, since it may already be
+ * partly written to the network, waiting on a retry.
+ *
+ * \return 0 if the line was merged.
+ * \return -1 if the line must be queued on its own.
+ */
+int irc_coalesce(const struct network* n, const char* buf, size_t len){
+    struct irc_line next;
+    if(queue_get_size(n->send_queue) < 2 || irc_line_split(buf, len, &next) == -1){
+        return -1;
+    }
+
+    struct item* tail = queue_peek_tail(n->send_queue);
+    if(tail == NULL){
+        return -1;
+    }
+
+    int ret = -1;
+    char merged[ISUPPORT_LINELEN_MAX + 1];
+    struct irc_line last;
+    if(irc_line_split((char*)tail->value, tail->size, &last) == -1 || strcmp(last.cmd, next.cmd) != 0){
+        goto done;
+    }
+    if(last.target_count + next.target_count > isupport_targmax(&n->isupport, next.cmd)){
+        goto done;
+    }
+    bool join = strcmp(next.cmd, "JOIN") == 0;
+    if(!join && (last.rest_len != next.rest_len || memcmp(last.rest, next.rest, next.rest_len) != 0)){
+        goto done;
+    }
+    //A target given twice might be sent to once, or twice
+    if(irc_list_overlaps(n, last.targets, last.targets_len, next.targets, next.targets_len)){
+        goto done;
+    }
+
+    size_t last_keyed = join ? irc_list_prefix(last.targets, last.targets_len, irc_list_count(last.rest, last.rest_len)) : last.targets_len;
+    size_t next_keyed = join ? irc_list_prefix(next.targets, next.targets_len, irc_list_count(next.rest, next.rest_len)) : next.targets_len;
+    size_t last_skip = last_keyed + (last_keyed > 0 && last_keyed < last.targets_len);
+    size_t next_skip = next_keyed + (next_keyed > 0 && next_keyed < next.targets_len);
+
+    char targets[ISUPPORT_LINELEN_MAX];
+    char rest[ISUPPORT_LINELEN_MAX];
+    size_t targets_len = 0, rest_len = 0;
+    bool fits = irc_line_append(targets, &targets_len, sizeof(targets), last.targets, last_keyed)
+        && irc_line_append(targets, &targets_len, sizeof(targets), next.targets, next_keyed)
+        && irc_line_append(targets, &targets_len, sizeof(targets), last.targets + last_skip, last.targets_len - last_skip)
+        && irc_line_append(targets, &targets_len, sizeof(targets), next.targets + next_skip, next.targets_len - next_skip)
+        && irc_line_append(rest, &rest_len, sizeof(rest), last.rest, last.rest_len)
+        && (!join || irc_line_append(rest, &rest_len, sizeof(rest), next.rest, next.rest_len));
+    if(!fits){
+        goto done;
+    }
+
+    int merged_len = snprintf(merged, sizeof(merged), "%s %.*s%s%.*s\r\n", next.cmd, (int)targets_len, targets, rest_len > 0 ? " " : "", (int)rest_len, rest);
+    if(merged_len < 0 || (size_t)merged_len > n->isupport.linelen){
+        goto done;
+    }
+
+    ret = queue_replace_tail(n->send_queue, merged, merged_len);
+
+    done:
+        free(tail);
+        return ret;
+}
 
 int irc_send(struct network* n, char* buf, size_t len){
+    if(irc_coalesce(n, buf, len) == 0){
+        PROBE3(line_enqueued, n->name, buf, len);
+        return 0;
+    }
+
     if(queue_enqueue(n->send_queue, buf, len) == -1){
         logmsg(LOG_WARNING, "irc: Could not queue message for sending to network '%s'\n", n->name);
         logmsg(LOG_DEBUG, "irc: Failed to send message:\n%.*s\n", (int)len, buf);
         return -1;
     }
+    PROBE3(line_enqueued, n->name, buf, len);
 
     return 0;
 }
@@ -56,6 +287,8 @@ int irc_recv(struct network* n, char* buf, size_t len){
     strncpy(buf, n->recv_queue, bytes_to_read);
     buf[bytes_to_read] = '\0';
     logmsg(LOG_DEBUG, "%s", buf);
+    capture(CAPTURE_NETWORK_IN, n->name, buf, bytes_to_read);
+    n->metrics.lines_in++;
 
     //Shift the remaining text to the front of the receive queue
     memmove(n->recv_queue, eom + 1, remainder);
@@ -72,8 +305,10 @@ int irc_register_connection(const struct network* n){
             goto fail_pass;
         }
         if(queue_enqueue(n->send_queue, pass, strlen(pass)) == -1){
+            free(pass);
             goto fail_pass;
         }
+        free(pass);
     }
 
     char* nick = ircmsg_nick(n->nick);
@@ -81,8 +316,10 @@ int irc_register_connection(const struct network* n){
         goto fail_nick;
     }
     if(queue_enqueue(n->send_queue, nick, strlen(nick)) == -1){
+        free(nick);
         goto fail_nick;
     }
+    free(nick);
 
     //mode is hard-coded here because we haven't made this a user-configurable option yet
     char* user = ircmsg_user(n->user, "0", n->real_name);
@@ -90,8 +327,10 @@ int irc_register_connection(const struct network* n){
         goto fail_user;
     }
     if(queue_enqueue(n->send_queue, user, strlen(user)) == -1){
+        free(user);
         goto fail_user;
     }
+    free(user);
 
     return 0;
 
@@ -113,6 +352,24 @@ int irc_register_connection(const struct network* n){
             return -1;
 }
 
+int irc_join(const struct network* n, const struct channel* c){
+    char* join = ircmsg_join(c->name, c->key, n->isupport.linelen);
+    if(join == NULL){
+        logmsg(LOG_WARNING, "irc: Could not join channel '%s' on network '%s', the system is out of memory\n", c->name, n->name);
+        return -1;
+    }
+
+    //Channels joined together go out as few JOIN messages as fit
+    if(irc_coalesce(n, join, strlen(join)) == -1 && queue_enqueue(n->send_queue, join, strlen(join)) == -1){
+        logmsg(LOG_WARNING, "irc: Could not join channel '%s' on network '%s' because a JOIN message could not be queued, the system is out of memory\n", c->name, n->name);
+        free(join);
+        return -1;
+    }
+
+    free(join);
+    return 0;
+}
+
 int irc_join_all(const struct network* n){
     size_t size = 0;
     struct htable_key** channels = htable_get_keys(n->channels, &size);
@@ -120,33 +377,67 @@ int irc_join_all(const struct network* n){
         return -1;
     }
 
-    size_t i;
-    for(i = 0; i < size; i++){
-        struct channel* c = htable_lookup(n->channels, channels[i]->key, strlen((char*)channels[i]->key)+1);
-
-        char* join = ircmsg_join(c->name, c->key);
-        if(join == NULL){
-            logmsg(LOG_WARNING, "irc: Could not queue JOIN messages for network '%s', the system is out of memory\n", n->name);
-            goto fail;
-        }
-
-        if(queue_enqueue(n->send_queue, join, strlen(join)) == -1){
-            logmsg(LOG_WARNING, "irc: Could not join channel '%s' on network '%s' because a JOIN message could not be queued, the system is out of memory\n", c->name, n->name);
-            goto fail;
+    int ret = 0;
+    for(size_t i = 0; i < size; i++){
+        struct channel* c = htable_lookup(n->channels, channels[i]->key, channels[i]->key_size);
+        if(irc_join(n, c) == -1){
+            ret = -1;
         }
     }
 
     htable_key_list_free(channels, size);
 
+    return ret;
+}
+
+int irc_part(const struct network* n, const char* channel){
+    char* part = ircmsg_part(channel, n->quit_msg, n->isupport.linelen);
+    if(part == NULL){
+        logmsg(LOG_WARNING, "irc: Could not part channel '%s' on network '%s', the system is out of memory\n", channel, n->name);
+        return -1;
+    }
+
+    if(queue_enqueue(n->send_queue, part, strlen(part)) == -1){
+        logmsg(LOG_WARNING, "irc: Could not part channel '%s' on network '%s' because a PART message could not be queued, the system is out of memory\n", channel, n->name);
+        free(part);
+        return -1;
+    }
+
+    free(part);
     return 0;
+}
 
-    fail:
-        //If we don't have enough memory to queue all of the join messages, then don't send any at all
-        for(size_t j = 0; j < i; j++){
-            free(queue_dequeue(n->send_queue));
-        }
-        htable_key_list_free(channels, size);
+int irc_names(const struct network* n, const char* channel){
+    char names[ISUPPORT_LINELEN_MAX + 1];
+    int count = snprintf(names, sizeof(names), "NAMES %s\r\n", channel);
+    if(count < 0 || (size_t)count > n->isupport.linelen){
+        logmsg(LOG_WARNING, "irc: Could not list the members of channel '%s' on network '%s', its name is too long\n", channel, n->name);
+        return -1;
+    }
+
+    if(queue_enqueue(n->send_queue, names, count) == -1){
+        logmsg(LOG_WARNING, "irc: Could not list the members of channel '%s' on network '%s' because a NAMES message could not be queued, the system is out of memory\n", channel, n->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+int irc_quit(const struct network* n){
+    char* quit = ircmsg_quit(n->quit_msg, n->isupport.linelen);
+    if(quit == NULL){
+        logmsg(LOG_WARNING, "irc: Could not quit network '%s', the system is out of memory\n", n->name);
         return -1;
+    }
+
+    if(queue_enqueue(n->send_queue, quit, strlen(quit)) == -1){
+        logmsg(LOG_WARNING, "irc: Could not quit network '%s' because a QUIT message could not be queued, the system is out of memory\n", n->name);
+        free(quit);
+        return -1;
+    }
+
+    free(quit);
+    return 0;
 }
 
 int irc_handle_ping(const struct network* n, const struct ircmsg* msg){
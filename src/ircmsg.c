@@ -22,17 +22,36 @@
 #include <jansson.h>
 
 #include "config.h"
+#include "intern.h"
 #include "ircmsg.h"
 #include "log.h"
 #include "queue.h"
 
+bool ircmsg_is_channel(const char* target){
+    return target[0] != '\0' && strchr(IRCMSG_CHANNEL_PREFIXES, target[0]) != NULL;
+}
+
+/**
+ * Interns a null-terminated token, returning the interned copy's string.
+ *
+ * \return The interned string, which belongs to an istr.
+ * \return NULL if the system is out of memory.
+ */
+const char* ircmsg_intern(const char* tok){
+    struct istr* s = intern(tok, strlen(tok));
+    return s == NULL ? NULL : s->str;
+}
+
 struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
     struct ircmsg* ret = NULL;
     
-    char* sender = NULL;
-    char* user = NULL;
-    char* host = NULL;
-    char* cmd = NULL;
+    //The network, prefix, command, and target are interned, since the same few keep coming up
+    const char* n = NULL;
+    const char* sender = NULL;
+    const char* user = NULL;
+    const char* host = NULL;
+    const char* cmd = NULL;
+    const char* target = NULL;
     
     //Argument vector for the command args
     size_t argc = 0;
@@ -44,12 +63,18 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
     char* saveptr = NULL;
     char* saveptr2 = NULL;
 
+    //The line terminator isn't part of the last argument
+    while(len > 0 && (msg[len - 1] == '\n' || msg[len - 1] == '\r')){
+        len--;
+    }
+
     //Duplicate the string, since strtok will modify it
-    char* msg_dup = malloc(len);
+    char* msg_dup = malloc(len + 1);
     if(msg_dup == NULL){
         goto fail_oom;
     }
-    strncpy(msg_dup, msg, len);
+    memcpy(msg_dup, msg, len);
+    msg_dup[len] = '\0';
 
     //Begin parsing
     tok = strtok_r(msg_dup, " ", &saveptr);
@@ -72,11 +97,10 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
         //If the prefix specifies a username:
         if(strchr(tok, '!') != NULL){
             tok2 = strtok_r(tok, "!", &saveptr2);
-            sender = malloc(strlen(tok2) + 1);
+            sender = ircmsg_intern(tok2);
             if(sender == NULL){
                 goto fail_oom;
             }
-            strcpy(sender, tok2);
 
             tok2 = strtok_r(NULL, "@", &saveptr2);
             if(tok2 == NULL){
@@ -84,11 +108,10 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
                 goto fail;
             }
 
-            user = malloc(strlen(tok2) + 1);
+            user = ircmsg_intern(tok2);
             if(user == NULL){
                 goto fail_oom;
             }
-            strcpy(user, tok2);
             
             tok2 = strtok_r(NULL, "@", &saveptr2);
             if(tok2 == NULL){
@@ -96,20 +119,18 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
                 goto fail;
             }
             
-            host = malloc(strlen(tok2) + 1);
+            host = ircmsg_intern(tok2);
             if(host == NULL){
                 goto fail_oom;
             }
-            strcpy(host, tok2);
         }
         //Otherwise, if the prefix specifies a hostname with no user:
         else if(strchr(tok, '@') != NULL){
             tok2 = strtok_r(tok, "@", &saveptr2);
-            sender = malloc(strlen(tok2) + 1);
+            sender = ircmsg_intern(tok2);
             if(sender == NULL){
                 goto fail_oom;
             }
-            strcpy(sender, tok2);
 
             tok2 = strtok_r(NULL, "@", &saveptr2);
             if(tok2 == NULL){
@@ -117,20 +138,17 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
                 goto fail;
             }
 
-            host = malloc(strlen(tok2) + 1);
+            host = ircmsg_intern(tok2);
             if(host == NULL){
                 goto fail_oom;
             }
-            strcpy(host, tok2);
         }
         //The prefix only contains a sender nick or server
         else{
-            sender = malloc(strlen(tok) + 1);
+            sender = ircmsg_intern(tok);
             if(sender == NULL){
                 goto fail_oom;
             }
-
-            strcpy(sender, tok);
         }
 
         tok2 = NULL;
@@ -145,19 +163,22 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
     }
     
     //Parse the command, there was no prefix
-    cmd = malloc(strlen(tok) + 1);
+    cmd = ircmsg_intern(tok);
     if(cmd == NULL){
         goto fail_oom;
     }
-    strcpy(cmd, tok);
 
     ret = malloc(sizeof(struct ircmsg));
     if(ret == NULL){
         goto fail_oom;
     }
+    ret->recv_at = 0;
+
+    //The first argument of these is a channel or nick
+    bool has_target = strcasecmp(cmd, "PRIVMSG") == 0 || strcasecmp(cmd, "JOIN") == 0;
 
     //Tokenize and save arguments
-    for(size_t i = 0; i < sizeof(argv); i++){
+    for(size_t i = 0; i < IRCMSG_CMD_PARAMS_MAX; i++){
         tok = strtok_r(NULL, " ", &saveptr);
         if(tok == NULL){
             break;
@@ -169,6 +190,14 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
             tok2 = strtok_r(NULL, "", &saveptr);
             //If the trailing arg was a single word, save it and break
             if(tok2 == NULL){
+                if(i == 0 && has_target){
+                    if((target = ircmsg_intern(tok + 1)) == NULL){
+                        goto fail_oom;
+                    }
+                    argc++;
+                    break;
+                }
+
                 argv[i] = malloc(strlen(tok) + 1);
                 if(argv[i] == NULL){
                     goto fail_oom;
@@ -180,19 +209,26 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
                 break;
             }
 
-            //Otherwise, combine the two tokens
+            //Otherwise, combine the two tokens, restoring the space that strtok_r() consumed
             argv[i] = malloc(strlen(tok) + strlen(tok2) + 1);
             if(argv[i] == NULL){
                 goto fail_oom;
             }
 
-            strncpy(argv[i], tok, strlen(tok));
-            strncpy(argv[i] + strlen(tok), tok2, strlen(tok2) + 1);
+            sprintf(argv[i], "%s %s", tok + 1, tok2);
 
             argc++;
             break;
         }
 
+        if(i == 0 && has_target){
+            if((target = ircmsg_intern(tok)) == NULL){
+                goto fail_oom;
+            }
+            argc++;
+            continue;
+        }
+
         argv[i] = malloc(strlen(tok) + 1);
         if(argv[i] == NULL){
             goto fail_oom;
@@ -234,10 +270,10 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
             goto fail_oom;
         }
 
-        privmsg->target = argv[0];
+        privmsg->target = target;
         privmsg->msg = argv[1];
         privmsg->is_hilight = false;
-        privmsg->is_pm = false;
+        privmsg->is_pm = !ircmsg_is_channel(privmsg->target);
 
         ret->type = PRIVMSG;
         ret->privmsg = privmsg;
@@ -253,7 +289,8 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
             goto fail_oom;
         }
 
-        join->channel = argv[0];
+        join->channel = target;
+        join->key = NULL;
         if(argc == 2){
             join->key = argv[1];
         }
@@ -282,12 +319,12 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
         ret->unknown = unknown;
     }
 
-    //To-Do: Do you need to +1 this strlen()?
-    char* n = malloc(strlen(network));
+    n = ircmsg_intern(network);
     if(n == NULL){
+        //The command-specific struct holds the arguments, which are freed below
+        free(ret->unknown);
         goto fail_oom;
     }
-    strcpy(n, network);
 
     ret->cmd = cmd;
     ret->host = host;
@@ -309,13 +346,14 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
     logmsg(LOG_WARNING, "ircmsg: Parsing error, the system is out of memory\n");
 
     fail:
-    logmsg(LOG_DEBUG, "ircmsg: Could not parse message: %s\n", msg);
+    logmsg(LOG_DEBUG, "ircmsg: Could not parse message: %.*s\n", (int)len, msg);
 
     free(ret);
-    free(sender);
-    free(user);
-    free(host);
-    free(cmd);
+    intern_release(intern_handle(sender));
+    intern_release(intern_handle(user));
+    intern_release(intern_handle(host));
+    intern_release(intern_handle(cmd));
+    intern_release(intern_handle(target));
     free(msg_dup);
     for(size_t i = 0; i < argc; i++){
         free(argv[i]);
@@ -325,11 +363,11 @@ struct ircmsg* ircmsg_parse(const char* network, const char* msg, size_t len){
 }
 
 void ircmsg_free(struct ircmsg* msg){
-    free(msg->network);
-    free(msg->sender);
-    free(msg->user);
-    free(msg->host);
-    free(msg->cmd);
+    intern_release(intern_handle(msg->network));
+    intern_release(intern_handle(msg->sender));
+    intern_release(intern_handle(msg->user));
+    intern_release(intern_handle(msg->host));
+    intern_release(intern_handle(msg->cmd));
     
     switch(msg->type){
         case PING:
@@ -341,16 +379,26 @@ void ircmsg_free(struct ircmsg* msg){
             free(msg->pong->server2);
             break;
         case PRIVMSG:
-            free(msg->privmsg->target);
+            intern_release(intern_handle(msg->privmsg->target));
             free(msg->privmsg->msg);
             break;
-        default:
+        case JOIN:
+            intern_release(intern_handle(msg->join->channel));
+            free(msg->join->key);
+            break;
+        case UNKNOWN:
+            for(size_t i = 0; i < msg->unknown->argc; i++){
+                free(msg->unknown->argv[i]);
+            }
             break;
     }
+
+    //The command-specific struct is always dynamically allocated
+    free(msg->unknown);
 }
 
-char* ircmsg_join(const char* channels, const char* keys){
-    char* msg = malloc(IRCMSG_SIZE_BUF);
+char* ircmsg_join(const char* channels, const char* keys, size_t linelen){
+    char* msg = malloc(linelen + 1);
     if(msg == NULL){
         logmsg(LOG_WARNING, "ircmsg: Could not allocate memory for JOIN message, the system is out of memory\n");
         return NULL;
@@ -358,10 +406,10 @@ char* ircmsg_join(const char* channels, const char* keys){
 
     int count = 0;
     if(keys == NULL){
-        count = snprintf(msg, IRCMSG_SIZE_BUF, "JOIN %s\r\n", channels);
+        count = snprintf(msg, linelen + 1, "JOIN %s\r\n", channels);
     }
     else{
-        count = snprintf(msg, IRCMSG_SIZE_BUF, "JOIN %s %s\r\n", channels, keys);
+        count = snprintf(msg, linelen + 1, "JOIN %s %s\r\n", channels, keys);
     }
 
     if(count < 0){
@@ -371,8 +419,11 @@ char* ircmsg_join(const char* channels, const char* keys){
         return NULL;
     }
 
-    if(count >= IRCMSG_SIZE_BUF){
-        logmsg(LOG_WARNING, "ircmsg: JOIN message truncated, size %d exceeded maximum message size\n", count);
+    //A truncated list would join a channel that was never asked for
+    if((size_t)count > linelen){
+        logmsg(LOG_WARNING, "ircmsg: Could not craft JOIN message, size %d exceeds maximum message size\n", count);
+        free(msg);
+        return NULL;
     }
 
     return msg;
@@ -400,6 +451,39 @@ char* ircmsg_nick(const char* nick){
     return msg;
 }
 
+char* ircmsg_part(const char* channels, const char* message, size_t linelen){
+    char* msg = malloc(linelen + 1);
+    if(msg == NULL){
+        logmsg(LOG_WARNING, "ircmsg: Could not allocate memory for PART message, the system is out of memory\n");
+        return NULL;
+    }
+
+    int count = 0;
+    if(message == NULL){
+        count = snprintf(msg, linelen + 1, "PART %s\r\n", channels);
+    }
+    else{
+        count = snprintf(msg, linelen + 1, "PART %s :%s\r\n", channels, message);
+    }
+
+    if(count < 0){
+        logmsg(LOG_WARNING, "ircmsg: Could not craft PART message, %s\n", strerror(errno));
+
+        free(msg);
+        return NULL;
+    }
+
+    if((size_t)count > linelen){
+        logmsg(LOG_WARNING, "ircmsg: PART message truncated, size %d exceeded maximum message size\n", count);
+        //Truncation cut off the line terminator
+        msg[linelen - 2] = '\r';
+        msg[linelen - 1] = '\n';
+        msg[linelen] = '\0';
+    }
+
+    return msg;
+}
+
 char* ircmsg_pass(const char* pass){
     char* msg = malloc(IRCMSG_SIZE_BUF);
     if(msg == NULL){
@@ -454,14 +538,14 @@ char* ircmsg_pong(const char* server, const char* server2){
 //To-Do: Implement message-splitting here:
 //  - Return an array of strings instead of a single string to accomodate text
 //    that doesn't fit in a single message.
-char* ircmsg_privmsg(const char* msgtarget, const char* text){
-    char* msg = malloc(IRCMSG_SIZE_BUF);
+char* ircmsg_privmsg(const char* msgtarget, const char* text, size_t linelen){
+    char* msg = malloc(linelen + 1);
     if(msg == NULL){
         logmsg(LOG_WARNING, "ircmsg: Could not allocate memory for PRIVMSG message, the system is out of memory\n");
         return NULL;
     }
 
-    int count = snprintf(msg, IRCMSG_SIZE_BUF, "PRIVMSG %s :%s\r\n", msgtarget, text);
+    int count = snprintf(msg, linelen + 1, "PRIVMSG %s :%s\r\n", msgtarget, text);
     if(count < 0){
         logmsg(LOG_WARNING, "ircmsg: Could not craft PRIVMSG message, %s\n", strerror(errno));
 
@@ -469,8 +553,45 @@ char* ircmsg_privmsg(const char* msgtarget, const char* text){
         return NULL;
     }
 
-    if(count >= IRCMSG_SIZE_BUF){
+    if((size_t)count > linelen){
         logmsg(LOG_WARNING, "ircmsg: PRIVMSG message truncated, size %d exceeded maximum message size\n", count);
+        //Truncation cut off the line terminator
+        msg[linelen - 2] = '\r';
+        msg[linelen - 1] = '\n';
+        msg[linelen] = '\0';
+    }
+
+    return msg;
+}
+
+char* ircmsg_quit(const char* message, size_t linelen){
+    char* msg = malloc(linelen + 1);
+    if(msg == NULL){
+        logmsg(LOG_WARNING, "ircmsg: Could not allocate memory for QUIT message, the system is out of memory\n");
+        return NULL;
+    }
+
+    int count = 0;
+    if(message == NULL){
+        count = snprintf(msg, linelen + 1, "QUIT\r\n");
+    }
+    else{
+        count = snprintf(msg, linelen + 1, "QUIT :%s\r\n", message);
+    }
+
+    if(count < 0){
+        logmsg(LOG_WARNING, "ircmsg: Could not craft QUIT message, %s\n", strerror(errno));
+
+        free(msg);
+        return NULL;
+    }
+
+    if((size_t)count > linelen){
+        logmsg(LOG_WARNING, "ircmsg: QUIT message truncated, size %d exceeded maximum message size\n", count);
+        //Truncation cut off the line terminator
+        msg[linelen - 2] = '\r';
+        msg[linelen - 1] = '\n';
+        msg[linelen] = '\0';
     }
 
     return msg;
@@ -524,7 +645,7 @@ json_t* ircmsg_to_json(const struct ircmsg* msg){
             specific = json_pack_ex(
                 &error,
                 0,
-                "{s:s, s:s}",
+                "{s:s, s:s?}",
                 "channel", msg->join->channel,
                 "key", msg->join->key
             );
@@ -565,14 +686,9 @@ json_t* ircmsg_to_json(const struct ircmsg* msg){
         return NULL;
 }
 
-char* ircmsg_from_json(json_t* obj, char** network){
-    struct ircmsg* msg = calloc(1, sizeof(struct ircmsg));
-    if(msg == NULL){
-        logmsg(LOG_WARNING, "ircmsg: Could not build IRC message from JSON message, the system is out of memory\n");
-        return NULL;
-    }
-
-    char* msgbuf = NULL;
+char* ircmsg_from_json(json_t* obj, const char** network, const char** target, size_t linelen){
+    const char* cmd = NULL;
+    const char* text = NULL;
 
     json_error_t error;
 
@@ -580,51 +696,41 @@ char* ircmsg_from_json(json_t* obj, char** network){
         obj,
         &error,
         0,
-        "{s:s, s?s, s?s, s?s, s:s}",
-        "network", msg->network,
-        "sender", msg->sender,
-        "user", msg->user,
-        "host", msg->host,
-        "cmd", msg->cmd
+        "{s:s, s:s}",
+        "network", network,
+        "cmd", &cmd
     );
-
     if(ret == -1){
         logmsg(LOG_WARNING, "ircmsg: Could not build IRC message from JSON message, unable to unpack common object\n");
         goto fail;
     }
-    
-    if(strcasecmp(msg->cmd, "PRIVMSG") == 0){
+
+    if(strcasecmp(cmd, "PRIVMSG") == 0){
         ret = json_unpack_ex(
             obj,
             &error,
             0,
             "{s:s, s:s}",
-            "target", msg->privmsg->target,
-            "msg", msg->privmsg->msg
+            "target", target,
+            "msg", &text
         );
-
         if(ret == -1){
             logmsg(LOG_WARNING, "ircmsg: Could not build IRC message from JSON message, unable to unpack PRIVMSG object\n");
             goto fail;
         }
+        //Anything that would end the line early could be used to smuggle in another command, and a list of targets past the ACLs
+        if((*target)[0] == '\0' || (*target)[0] == ':' || strpbrk(*target, " ,\r\n") != NULL || strpbrk(text, "\r\n") != NULL){
+            logmsg(LOG_WARNING, "ircmsg: Could not build IRC message from JSON message, target or message contains illegal characters\n");
+            return NULL;
+        }
 
-        msgbuf = ircmsg_privmsg(msg->privmsg->target, msg->privmsg->msg);
-    }
-    
-    *network = malloc(strlen(msg->network)+1);
-    if(*network == NULL){
-        logmsg(LOG_WARNING, "ircmsg: Could not return network from JSON message, the system is out of memory\n");
-        free(msg);
-        free(msgbuf);
-        return NULL;
+        return ircmsg_privmsg(*target, text, linelen);
     }
-    strcpy(*network, msg->network);
 
-    return msgbuf;
+    logmsg(LOG_WARNING, "ircmsg: Could not build IRC message from JSON message, unsupported command '%s'\n", cmd);
+    return NULL;
 
     fail:
-        logmsg(LOG_WARNING, "%s in %s at line %d, column %d\n", error.text, error.source, error.line, error.column);
-        free(msg);
-        free(msgbuf);
+        logmsg(LOG_WARNING, "ircmsg: %s in %s at line %d, column %d\n", error.text, error.source, error.line, error.column);
         return NULL;
 }
@@ -0,0 +1,348 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <jansson.h>
+
+#include "casemap.h"
+#include "config.h"
+#include "inet.h"
+#include "ircmsg.h"
+#include "isupport.h"
+#include "log.h"
+#include "state.h"
+
+void isupport_init(struct isupport* is){
+    memset(is, 0, sizeof(struct isupport));
+    is->linelen = IRCMSG_SIZE_MAX;
+    is->nicklen = ISUPPORT_UNLIMITED;
+    is->modes = 3;
+    is->maxtargets = 1;
+    strcpy(is->prefix_modes, STATE_PREFIX_MODES);
+    strcpy(is->prefix_symbols, STATE_PREFIX_SYMBOLS);
+    strcpy(is->chanmodes_list, STATE_CHANMODES_LIST);
+    strcpy(is->chanmodes_param, STATE_CHANMODES_PARAM);
+    strcpy(is->chanmodes_set_param, STATE_CHANMODES_SET_PARAM);
+    strcpy(is->chantypes, IRCMSG_CHANNEL_PREFIXES);
+}
+
+/**
+ * Parses the number in a token's value, \c len characters long. A token
+ * without a value is unlimited.
+ *
+ * \return The number, or \c fallback if the value isn't a number.
+ */
+size_t isupport_number(const char* value, size_t len, size_t fallback){
+    if(len == 0){
+        return ISUPPORT_UNLIMITED;
+    }
+
+    size_t number = 0;
+    for(size_t i = 0; i < len; i++){
+        if(!isdigit((unsigned char)value[i]) || number > (ISUPPORT_UNLIMITED - 9) / 10){
+            return fallback;
+        }
+        number = number * 10 + (value[i] - '0');
+    }
+    return number;
+}
+
+/**
+ * Parses a list of limits like "PRIVMSG:4,JOIN:" into \c limits, which holds
+ * up to \c max of them. Names too long to keep are skipped.
+ *
+ * \return The number of limits parsed.
+ */
+size_t isupport_limits(struct isupport_limit* limits, size_t max, const char* value){
+    size_t count = 0;
+    while(*value != '\0' && count < max){
+        size_t len = strcspn(value, ",");
+        size_t name_len = strcspn(value, ":,");
+        if(name_len > 0 && name_len <= ISUPPORT_CMD_MAX && name_len < len){
+            memcpy(limits[count].name, value, name_len);
+            limits[count].name[name_len] = '\0';
+            limits[count].max = isupport_number(value + name_len + 1, len - name_len - 1, 1);
+            count++;
+        }
+
+        value += len;
+        if(*value == ','){
+            value++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Parses a PREFIX value like "(ov)@+". An empty value means the network has
+ * no membership prefixes.
+ *
+ * \return 0 on success.
+ * \return -1 if the value is malformed, or lists more than STATE_PREFIX_MAX
+ *         prefixes, in which case \c is is left as it was.
+ */
+int isupport_prefix(struct isupport* is, const char* value){
+    if(*value == '\0'){
+        is->prefix_modes[0] = '\0';
+        is->prefix_symbols[0] = '\0';
+        return 0;
+    }
+
+    const char* close = strchr(value, ')');
+    if(*value != '(' || close == NULL){
+        return -1;
+    }
+    size_t count = close - value - 1;
+    if(count > STATE_PREFIX_MAX || strlen(close + 1) != count){
+        return -1;
+    }
+
+    memcpy(is->prefix_modes, value + 1, count);
+    is->prefix_modes[count] = '\0';
+    strcpy(is->prefix_symbols, close + 1);
+    return 0;
+}
+
+/**
+ * Parses a CHANMODES value like "beI,k,l,imnpst". Types of modes past the
+ * fourth, which take no parameter, are ignored.
+ *
+ * \return 0 on success.
+ * \return -1 if a type lists more than STATE_CHANMODES_MAX modes, in which case
+ *         \c is is left as it was.
+ */
+int isupport_chanmodes(struct isupport* is, const char* value){
+    char* types[] = {is->chanmodes_list, is->chanmodes_param, is->chanmodes_set_param};
+    size_t lens[3] = {0};
+
+    const char* type = value;
+    for(size_t i = 0; i < 3; i++){
+        lens[i] = strcspn(type, ",");
+        if(lens[i] > STATE_CHANMODES_MAX){
+            return -1;
+        }
+        type += lens[i];
+        if(*type == ','){
+            type++;
+        }
+    }
+
+    type = value;
+    for(size_t i = 0; i < 3; i++){
+        memcpy(types[i], type, lens[i]);
+        types[i][lens[i]] = '\0';
+        type += lens[i];
+        if(*type == ','){
+            type++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Switches a network, its tables, and its state over to a new casemapping.
+ * The state is forgotten if two of the names in it become the same name.
+ */
+void isupport_casemapping(struct network* n, enum casemapping mapping){
+    if(mapping == n->casemapping){
+        return;
+    }
+
+    logmsg(LOG_INFO, "isupport: Network '%s' compares names under casemapping %s\n", n->name, casemap_name(mapping));
+    config_network_set_casemapping(n, mapping);
+    if(n->state != NULL && state_set_casemapping(n->state, mapping) == -1){
+        logmsg(LOG_WARNING, "isupport: Could not rekey the state of network '%s' under casemapping %s, forgetting it\n", n->name, casemap_name(mapping));
+        state_free(n->state);
+        n->state = NULL;
+    }
+}
+
+/**
+ * Returns whether the name of a token, \c len characters long, is \c name.
+ */
+bool isupport_is(const char* token, size_t len, const char* name){
+    return len == strlen(name) && strncmp(token, name, len) == 0;
+}
+
+/**
+ * Applies a single token from an RPL_ISUPPORT reply, such as "LINELEN=2048",
+ * or "-LINELEN", which returns LINELEN to what's assumed without it.
+ */
+void isupport_token(struct network* n, const char* token){
+    struct isupport* is = &n->isupport;
+    struct isupport defaults;
+    isupport_init(&defaults);
+
+    bool negated = *token == '-';
+    if(negated){
+        token++;
+    }
+    size_t name_len = strcspn(token, "=");
+    const char* value = token[name_len] == '=' ? token + name_len + 1 : "";
+    size_t value_len = strlen(value);
+
+    if(isupport_is(token, name_len, "LINELEN")){
+        size_t linelen = negated ? defaults.linelen : isupport_number(value, value_len, defaults.linelen);
+        //Lines are never shorter than RFC 1459 says, or longer than we're prepared to buffer
+        if(linelen < IRCMSG_SIZE_MAX){
+            linelen = IRCMSG_SIZE_MAX;
+        }
+        else if(linelen > ISUPPORT_LINELEN_MAX){
+            linelen = ISUPPORT_LINELEN_MAX;
+        }
+        if(n->recv_queue != NULL && linelen + 1 > n->recv_queue_size && inet_grow_recv_queue(n, linelen + 1) == -1){
+            return;
+        }
+        is->linelen = linelen;
+    }
+    else if(isupport_is(token, name_len, "NICKLEN")){
+        is->nicklen = negated ? defaults.nicklen : isupport_number(value, value_len, defaults.nicklen);
+    }
+    else if(isupport_is(token, name_len, "MODES")){
+        is->modes = negated ? defaults.modes : isupport_number(value, value_len, defaults.modes);
+    }
+    else if(isupport_is(token, name_len, "MAXTARGETS")){
+        is->maxtargets = negated ? defaults.maxtargets : isupport_number(value, value_len, defaults.maxtargets);
+    }
+    else if(isupport_is(token, name_len, "TARGMAX")){
+        is->targmax_count = negated ? 0 : isupport_limits(is->targmax, ISUPPORT_TARGMAX_MAX, value);
+    }
+    else if(isupport_is(token, name_len, "CHANLIMIT")){
+        is->chanlimit_count = negated ? 0 : isupport_limits(is->chanlimit, ISUPPORT_CHANLIMIT_MAX, value);
+    }
+    else if(isupport_is(token, name_len, "CASEMAPPING")){
+        enum casemapping mapping = CASEMAP_DEFAULT;
+        if(!negated && casemap_from_name(value, &mapping) == -1){
+            logmsg(LOG_WARNING, "isupport: Network '%s' uses unknown casemapping '%s', keeping %s\n", n->name, value, casemap_name(n->casemapping));
+            return;
+        }
+        isupport_casemapping(n, mapping);
+    }
+    else if(isupport_is(token, name_len, "PREFIX")){
+        char old_modes[STATE_PREFIX_MAX + 1];
+        strcpy(old_modes, is->prefix_modes);
+        if(isupport_prefix(is, negated ? "(" STATE_PREFIX_MODES ")" STATE_PREFIX_SYMBOLS : value) == -1){
+            logmsg(LOG_WARNING, "isupport: Ignoring malformed PREFIX '%s' from network '%s'\n", value, n->name);
+        }
+        //Members' modes are kept as bits indexed by their place in the list
+        else if(n->state != NULL && strcmp(old_modes, is->prefix_modes) != 0 && state_set_prefixes(n->state, old_modes) == -1){
+            logmsg(LOG_WARNING, "isupport: Could not carry over membership prefixes on network '%s', forgetting its state\n", n->name);
+            state_free(n->state);
+            n->state = NULL;
+        }
+    }
+    else if(isupport_is(token, name_len, "CHANMODES")){
+        if(isupport_chanmodes(is, negated ? STATE_CHANMODES_LIST "," STATE_CHANMODES_PARAM "," STATE_CHANMODES_SET_PARAM : value) == -1){
+            logmsg(LOG_WARNING, "isupport: Ignoring malformed CHANMODES '%s' from network '%s'\n", value, n->name);
+        }
+    }
+    //An empty CHANTYPES means the network has no channels at all
+    else if(isupport_is(token, name_len, "CHANTYPES")){
+        if(negated){
+            strcpy(is->chantypes, defaults.chantypes);
+        }
+        else if(value_len > ISUPPORT_CHANTYPES_MAX || strpbrk(value, ",:") != NULL){
+            logmsg(LOG_WARNING, "isupport: Ignoring malformed CHANTYPES '%s' from network '%s'\n", value, n->name);
+        }
+        else{
+            strcpy(is->chantypes, value);
+        }
+    }
+}
+
+void isupport_update(struct network* n, const struct ircmsg* msg){
+    if(msg->type != UNKNOWN || strcmp(msg->cmd, "005") != 0){
+        return;
+    }
+
+    //The first parameter is our nick, and the last says these "are supported by this server"
+    const struct ircmsg_unknown* args = msg->unknown;
+    for(size_t i = 1; i < args->argc; i++){
+        if(args->argv[i][0] != '\0' && strchr(args->argv[i], ' ') == NULL){
+            isupport_token(n, args->argv[i]);
+        }
+    }
+}
+
+size_t isupport_targmax(const struct isupport* is, const char* cmd){
+    for(size_t i = 0; i < is->targmax_count; i++){
+        if(strcasecmp(is->targmax[i].name, cmd) == 0){
+            return is->targmax[i].max;
+        }
+    }
+
+    if(strcasecmp(cmd, "JOIN") == 0 || strcasecmp(cmd, "PART") == 0){
+        return ISUPPORT_UNLIMITED;
+    }
+    if(strcasecmp(cmd, "PRIVMSG") == 0 || strcasecmp(cmd, "NOTICE") == 0){
+        return is->maxtargets;
+    }
+    return 1;
+}
+
+size_t isupport_chanlimit(const struct isupport* is, const char* channel){
+    for(size_t i = 0; i < is->chanlimit_count; i++){
+        if(strchr(is->chanlimit[i].name, channel[0]) != NULL){
+            return is->chanlimit[i].max;
+        }
+    }
+    return ISUPPORT_UNLIMITED;
+}
+
+bool isupport_is_channel(const struct isupport* is, const char* target){
+    return target[0] != '\0' && strchr(is->chantypes, target[0]) != NULL;
+}
+
+/**
+ * Packs a limit into JSON, as null if it's unlimited.
+ */
+json_t* isupport_limit_to_json(size_t max){
+    return max == ISUPPORT_UNLIMITED ? json_null() : json_integer((json_int_t)max);
+}
+
+/**
+ * Packs a list of limits into a JSON object mapping each name to its limit.
+ */
+json_t* isupport_limits_to_json(const struct isupport_limit* limits, size_t count){
+    json_t* obj = json_object();
+    for(size_t i = 0; obj != NULL && i < count; i++){
+        json_object_set_new(obj, limits[i].name, isupport_limit_to_json(limits[i].max));
+    }
+    return obj;
+}
+
+json_t* isupport_to_json(const struct network* n){
+    const struct isupport* is = &n->isupport;
+    char prefix[2 * STATE_PREFIX_MAX + 3];
+    char chanmodes[3 * STATE_CHANMODES_MAX + 3];
+    snprintf(prefix, sizeof(prefix), "(%s)%s", is->prefix_modes, is->prefix_symbols);
+    snprintf(chanmodes, sizeof(chanmodes), "%s,%s,%s", is->chanmodes_list, is->chanmodes_param, is->chanmodes_set_param);
+
+    return json_pack("{s:s, s:I, s:o, s:o, s:o, s:o, s:o, s:s, s:s, s:s}",
+        "casemapping", casemap_name(n->casemapping),
+        "linelen", (json_int_t)is->linelen,
+        "nicklen", isupport_limit_to_json(is->nicklen),
+        "modes", isupport_limit_to_json(is->modes),
+        "maxtargets", isupport_limit_to_json(is->maxtargets),
+        "targmax", isupport_limits_to_json(is->targmax, is->targmax_count),
+        "chanlimit", isupport_limits_to_json(is->chanlimit, is->chanlimit_count),
+        "prefix", prefix,
+        "chanmodes", chanmodes,
+        "chantypes", is->chantypes
+    );
+}
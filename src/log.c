@@ -10,56 +10,378 @@
 * can be found in the "LICENSE" file bundled with this source distribution.
 */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <syslog.h>
 #include <time.h>
+#include <unistd.h>
+
+#include "log.h"
 
 #define DATE_BUFFER_SIZE 100
 
+//The number of bytes the writer thread accumulates before writing them out
+#define LOG_BATCH_SIZE 65536
+
+//The longest that an error will wait for the writer thread to write it out, in milliseconds
+#define LOG_FLUSH_TIMEOUT 1000
+
 bool debug = false;
 bool foreground = false;
+int log_threshold = LOG_WARNING;
+
+/**
+ * A single preformatted log message in the ring. Each record's \c seq field
+ * tells producers and the writer thread who may use it next: a record at index
+ * \c i is free for the producer holding ticket \c seq, and ready to be
+ * written once \c seq is one greater than that ticket.
+ */
+struct log_record{
+    _Atomic size_t seq;
+    int loglevel;
+    /**
+     * The length of the timestamp and level prefix at the start of \c text,
+     * which the syslog leaves out in favour of its own.
+     */
+    size_t prefix_len;
+    size_t len;
+    char text[LOG_RECORD_SIZE];
+};
+
+struct log_record log_ring[LOG_RING_SIZE];
+
+//The next ticket to be handed to a producer
+_Atomic size_t log_head = 0;
+
+//The ticket of the next record the writer thread will write
+_Atomic size_t log_tail = 0;
+
+//The number of messages written out so far; errors wait on this
+_Atomic size_t log_written = 0;
+
+//The number of messages dropped because the ring was full
+_Atomic size_t log_dropped = 0;
+
+//Set while the writer thread is running, and messages must go through the ring
+_Atomic bool log_running = false;
+
+//Set by the writer thread right before it sleeps, and cleared by whichever producer wakes it
+_Atomic bool log_waiting = false;
+
+//A pipe used to wake the writer thread
+int log_doorbell[2] = {-1, -1};
+
+//The file that messages are written to, or -1 if they go to the syslog
+int log_fd = -1;
+
+const char* log_path = NULL;
+
+pthread_t log_thread;
+
+/**
+ * Every thread keeps the last timestamp it formatted, since it only changes
+ * once per second.
+ */
+_Thread_local time_t log_cached_sec = -1;
+_Thread_local char log_cached_date[DATE_BUFFER_SIZE];
+_Thread_local size_t log_cached_date_len = 0;
+
+const char* log_level_name(int loglevel){
+    switch(loglevel){
+        case LOG_ALERT:
+            return "Alert";
+        case LOG_CRIT:
+            return "Critical";
+        case LOG_DEBUG:
+            return "Debug";
+        case LOG_EMERG:
+            return "Emergency";
+        case LOG_ERR:
+            return "Error";
+        case LOG_INFO:
+            return "Info";
+        case LOG_NOTICE:
+            return "Notice";
+        case LOG_WARNING:
+            return "Warning";
+        default:
+            return "Unknown";
+    }
+}
+
+/**
+ * Formats a log message, prefixed by a timestamp and its level, into \c buf.
+ *
+ * \return The length of the formatted message, which is truncated to fit.
+ */
+size_t log_format(char* buf, size_t size, size_t* prefix_len, int loglevel, const char* msg, va_list args){
+    time_t now = time(NULL);
+    if(now != log_cached_sec){
+        struct tm bd_time;
+        localtime_r(&now, &bd_time);
+        log_cached_date_len = strftime(log_cached_date, DATE_BUFFER_SIZE, "[%F %T]", &bd_time);
+        log_cached_sec = now;
+    }
+
+    int prefix = snprintf(buf, size, "%.*s %s: ", (int)log_cached_date_len, log_cached_date, log_level_name(loglevel));
+    if(prefix < 0){
+        prefix = 0;
+    }
+    else if((size_t)prefix >= size){
+        prefix = size - 1;
+    }
+    *prefix_len = prefix;
+
+    int count = vsnprintf(buf + prefix, size - prefix, msg, args);
+    if(count < 0){
+        count = 0;
+    }
+
+    size_t len = prefix + count;
+    if(len >= size){
+        //Truncation cut off the line terminator
+        len = size - 1;
+        buf[len - 1] = '\n';
+    }
+
+    return len;
+}
+
+/**
+ * A variadic wrapper for log_format().
+ */
+size_t log_format_args(char* buf, size_t size, size_t* prefix_len, int loglevel, const char* msg, ...){
+    va_list args;
+    va_start(args, msg);
+    size_t len = log_format(buf, size, prefix_len, loglevel, msg, args);
+    va_end(args);
+
+    return len;
+}
+
+/**
+ * Writes a single message out immediately, from whichever thread is calling.
+ */
+void log_write_sync(int loglevel, const char* buf, size_t len, size_t prefix_len){
+    if(log_fd != -1){
+        write(log_fd, buf, len);
+    }
+    else if(foreground){
+        fwrite(buf, 1, len, stdout);
+        fflush(stdout);
+    }
+    else{
+        syslog(LOG_FACILITY | loglevel, "%.*s", (int)(len - prefix_len), buf + prefix_len);
+    }
+}
+
+/**
+ * Claims the next record in the ring.
+ *
+ * \return The claimed record, whose ticket is stored in \c ticket.
+ * \return NULL if the ring is full.
+ */
+struct log_record* log_claim(size_t* ticket){
+    size_t pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    while(true){
+        struct log_record* rec = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+        if(seq == pos){
+            if(atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)){
+                *ticket = pos;
+                return rec;
+            }
+        }
+        //The writer thread hasn't freed this record since the ring last wrapped around
+        else if((intptr_t)(seq - pos) < 0){
+            return NULL;
+        }
+        else{
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Waits until the writer thread has written out the message holding the given
+ * ticket, or until LOG_FLUSH_TIMEOUT has passed.
+ */
+void log_wait(size_t ticket){
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+    for(int i = 0; i < LOG_FLUSH_TIMEOUT && atomic_load_explicit(&log_written, memory_order_acquire) <= ticket; i++){
+        nanosleep(&ts, NULL);
+    }
+}
 
 void logprintf(int loglevel, char* msg, ...){
     va_list args;
     va_start(args, msg);
 
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
+    if(!atomic_load_explicit(&log_running, memory_order_acquire)){
+        char buf[LOG_RECORD_SIZE];
+        size_t prefix_len;
+        size_t len = log_format(buf, sizeof(buf), &prefix_len, loglevel, msg, args);
+        log_write_sync(loglevel, buf, len, prefix_len);
+        va_end(args);
+        return;
+    }
 
-    char date_buffer[DATE_BUFFER_SIZE];
-    struct tm* bd_time = localtime(&ts.tv_sec);
-    strftime(date_buffer, DATE_BUFFER_SIZE, "[%F %T]", bd_time);
+    size_t ticket;
+    struct log_record* rec = log_claim(&ticket);
+    if(rec == NULL){
+        atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+    rec->loglevel = loglevel;
+    rec->len = log_format(rec->text, sizeof(rec->text), &rec->prefix_len, loglevel, msg, args);
+    atomic_store_explicit(&rec->seq, ticket + 1, memory_order_release);
+    va_end(args);
 
-    if(loglevel == LOG_ALERT){
-        printf("%s Alert: ", date_buffer);
+    //Pairs with the fence in log_writer(), so that either we see it waiting, or it sees this message
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_exchange_explicit(&log_waiting, false, memory_order_acq_rel)){
+        char bell = 0;
+        write(log_doorbell[1], &bell, 1);
     }
-    else if(loglevel == LOG_CRIT){
-        printf("%s Critical: ", date_buffer);
+
+    //Errors are often the last thing praetor says before it exits, so they can't be left in the ring
+    if(loglevel <= LOG_ERR){
+        log_wait(ticket);
     }
-    else if(loglevel == LOG_DEBUG){
-        printf("%s Debug: ", date_buffer);
+}
+
+/**
+ * Writes out everything in the ring. Messages bound for a file or stdout are
+ * gathered into a single write.
+ */
+void log_drain(char* batch){
+    size_t batch_len = 0;
+    int fd = log_fd != -1 ? log_fd : (foreground ? STDOUT_FILENO : -1);
+
+    size_t dropped = atomic_exchange_explicit(&log_dropped, 0, memory_order_relaxed);
+    if(dropped > 0){
+        char note[LOG_RECORD_SIZE];
+        size_t prefix_len;
+        size_t len = log_format_args(note, sizeof(note), &prefix_len, LOG_WARNING, "log: %zu messages were dropped, the log could not keep up\n", dropped);
+        log_write_sync(LOG_WARNING, note, len, prefix_len);
     }
-    else if(loglevel == LOG_EMERG){
-        printf("%s Emergency: ", date_buffer);
+
+    size_t tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+    while(true){
+        struct log_record* rec = &log_ring[tail & (LOG_RING_SIZE - 1)];
+        if(atomic_load_explicit(&rec->seq, memory_order_acquire) != tail + 1){
+            break;
+        }
+
+        if(fd == -1){
+            syslog(LOG_FACILITY | rec->loglevel, "%.*s", (int)(rec->len - rec->prefix_len), rec->text + rec->prefix_len);
+        }
+        else{
+            if(batch_len + rec->len > LOG_BATCH_SIZE){
+                write(fd, batch, batch_len);
+                batch_len = 0;
+            }
+            memcpy(batch + batch_len, rec->text, rec->len);
+            batch_len += rec->len;
+        }
+
+        //Hand the record back to producers, one lap of the ring later
+        atomic_store_explicit(&rec->seq, tail + LOG_RING_SIZE, memory_order_release);
+        tail++;
+        atomic_store_explicit(&log_tail, tail, memory_order_relaxed);
     }
-    else if(loglevel == LOG_ERR){
-        printf("%s Error: ", date_buffer);
+
+    if(batch_len > 0){
+        write(fd, batch, batch_len);
     }
-    else if(loglevel == LOG_INFO){
-        printf("%s Info: ", date_buffer);
+    atomic_store_explicit(&log_written, tail, memory_order_release);
+}
+
+void* log_writer(void* arg){
+    (void)arg;
+
+    static char batch[LOG_BATCH_SIZE];
+    char buf[64];
+    struct pollfd pfd = {.fd = log_doorbell[0], .events = POLLIN};
+    while(true){
+        log_drain(batch);
+
+        //Check once more after announcing that we're going to sleep, or a message could slip by unannounced
+        atomic_store_explicit(&log_waiting, true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        size_t tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+        if(atomic_load_explicit(&log_ring[tail & (LOG_RING_SIZE - 1)].seq, memory_order_acquire) == tail + 1){
+            atomic_store_explicit(&log_waiting, false, memory_order_relaxed);
+            continue;
+        }
+
+        poll(&pfd, 1, -1);
+        while(read(log_doorbell[0], buf, sizeof(buf)) > 0);
+    }
+
+    return NULL;
+}
+
+int log_init(const char* path){
+    if(path != NULL){
+        log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP);
+        if(log_fd == -1){
+            logmsg(LOG_ERR, "log: Could not open log file %s, %s\n", path, strerror(errno));
+            return -1;
+        }
+        fcntl(log_fd, F_SETFD, FD_CLOEXEC);
+        log_path = path;
     }
-    else if(loglevel == LOG_NOTICE){
-        printf("%s Notice: ", date_buffer);
+
+    if(pipe(log_doorbell) == -1){
+        logmsg(LOG_ERR, "log: Could not create pipe for log writer, %s\n", strerror(errno));
+        return -1;
     }
-    else if(loglevel == LOG_WARNING){
-        printf("%s Warning: ", date_buffer);
+    for(int i = 0; i < 2; i++){
+        fcntl(log_doorbell[i], F_SETFD, FD_CLOEXEC);
+        fcntl(log_doorbell[i], F_SETFL, fcntl(log_doorbell[i], F_GETFL) | O_NONBLOCK);
     }
-    vprintf(msg, args);
 
-    va_end(args);
+    for(size_t i = 0; i < LOG_RING_SIZE; i++){
+        atomic_init(&log_ring[i].seq, i);
+    }
+
+    //The writer thread must not take any of the signals that the event loop handles
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int ret = pthread_create(&log_thread, NULL, log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(ret != 0){
+        logmsg(LOG_ERR, "log: Could not start log writer, %s\n", strerror(ret));
+        return -1;
+    }
 
-    fflush(NULL);
+    atomic_store_explicit(&log_running, true, memory_order_release);
+
+    return 0;
+}
+
+void log_flush(){
+    if(!atomic_load_explicit(&log_running, memory_order_acquire)){
+        fflush(NULL);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&log_head, memory_order_acquire);
+    if(head > 0){
+        log_wait(head - 1);
+    }
 }
@@ -21,39 +21,50 @@
 #include <jansson.h>
 #include <openssl/opensslv.h>
 
+#include "capture.h"
 #include "config.h"
+#include "control.h"
 #include "daemonize.h"
 #include "htable.h"
 #include "inet.h"
 #include "log.h"
+#include "metrics.h"
 #include "nexus.h"
 #include "plugin.h"
 #include "signals.h"
+#include "upgrade.h"
+#include "watchdog.h"
 
 /**
  * Prints command-line application usage information.
  */
 void print_usage(){
-    printf("\nUsage: praetor [-d][-f] -c config_path\n");
+    printf("\nUsage: praetor [-d][-f][-l log_path][-C capture_path] -c config_path\n");
     printf("\nCommand-line options:\n");
     printf("\n\t-c,\tSpecifies praetor's main configuration file path");
+    printf("\n\t-C,\tRecords all traffic to and from networks and plugins in the given file");
     printf("\n\t-d,\tEnables debug mode, increasing logging verbosity");
     printf("\n\t-f,\tEnables foreground mode. praetor will run in the foreground, and log to stdout");
     printf("\n\t-h,\tPrints this help information");
+    printf("\n\t-l,\tAppends logs to the given file, instead of the syslog or stdout");
     printf("\n\t-v,\tPrints version information\n\n");
 }
 
 int main(int argc, char* argv[]){
     setlogmask(LOG_MASK(LOG_WARNING) | LOG_MASK(LOG_ERR) | LOG_MASK(LOG_CRIT) | LOG_MASK(LOG_ALERT) | LOG_MASK(LOG_EMERG));
-    char* config_path = NULL;
+    char* config_path = NULL, * log_file = NULL, * capture_file_path = NULL;
     int opt;
-    while((opt = getopt(argc, argv, "c:dfhv")) != -1){
+    while((opt = getopt(argc, argv, "c:C:dfhl:v")) != -1){
         switch(opt){
             case 'c':
                 config_path = optarg;
                 break;
+            case 'C':
+                capture_file_path = optarg;
+                break;
             case 'd':
                 debug = true;
+                log_threshold = LOG_DEBUG;
                 setlogmask(LOG_MASK(LOG_DEBUG) | LOG_MASK(LOG_INFO) | LOG_MASK(LOG_NOTICE) | LOG_MASK(LOG_WARNING) | LOG_MASK(LOG_ERR) | LOG_MASK(LOG_CRIT) | LOG_MASK(LOG_ALERT) | LOG_MASK(LOG_EMERG));
                 break;
             case 'f':
@@ -62,6 +73,9 @@ int main(int argc, char* argv[]){
             case 'h':
                 print_usage();
                 _exit(0);
+            case 'l':
+                log_file = optarg;
+                break;
             case 'v':
                 printf("\npraetor Version: %s\nCommit Hash: %s\nCopyright 2015-2018 David Zero\n\n", PRAETOR_VERSION, COMMIT_HASH);
                 printf("This build of praetor has been compiled with support for:\n");
@@ -91,8 +105,9 @@ int main(int argc, char* argv[]){
     rc_network_sock = htable_create(5);
     rc_plugin = htable_create(5);
     rc_plugin_sock = htable_create(5);
+    rc_plugin_pid = htable_create(5);
 
-    if(rc_network == NULL || rc_network_sock == NULL || rc_plugin == NULL || rc_plugin_sock == NULL){
+    if(rc_network == NULL || rc_network_sock == NULL || rc_plugin == NULL || rc_plugin_sock == NULL || rc_plugin_pid == NULL){
         logmsg(LOG_ERR, "Could not allocate global data structures, the system is out of memory\n");
         _exit(-1);
     }
@@ -102,28 +117,63 @@ int main(int argc, char* argv[]){
         _exit(-1);
     }
 
-    //daemonize
-    if(!foreground){
+    //remember where we came from, in case we're asked to upgrade
+    if(upgrade_init(argv[0]) == -1){
+        logmsg(LOG_WARNING, "main: praetor will not be able to upgrade itself\n");
+    }
+
+    //daemonize, unless we were executed by an upgrade, and already are a daemon
+    if(!foreground && !upgrade_pending()){
         if(daemonize(rc_praetor->workdir, rc_praetor->user, rc_praetor->group) == -1){
             _exit(-1);
         }
     }
 
+    //from here on, messages are written out by a separate thread
+    if(log_init(log_file) == -1){
+        logmsg(LOG_WARNING, "main: Could not start log writer, logging synchronously\n");
+    }
+
+    //record traffic for later replay
+    if(capture_file_path != NULL && capture_open(capture_file_path) == -1){
+        logmsg(LOG_WARNING, "main: Could not start capturing traffic\n");
+    }
+
+    //serve metrics
+    if((rc_praetor->metrics_socket != NULL || rc_praetor->metrics_port != 0) && metrics_init(rc_praetor->metrics_socket, rc_praetor->metrics_port) == -1){
+        logmsg(LOG_WARNING, "main: Could not start serving metrics\n");
+    }
+
+    //accept administrative commands
+    if(rc_praetor->control_socket != NULL && control_init(rc_praetor->control_socket) == -1){
+        logmsg(LOG_WARNING, "main: Could not open control socket\n");
+    }
+
     //install signal handlers
     if(signal_init() < 0){
         logmsg(LOG_ERR, "main: Could not install signal handlers\n");
         _exit(-1);
     }
 
+    //report event loop stalls
+    if(watchdog_init() == -1){
+        logmsg(LOG_WARNING, "main: Could not start watchdog\n");
+    }
+
+    //take over connections handed to us by an upgrade
+    if(upgrade_adopt() == -1){
+        logmsg(LOG_WARNING, "main: Could not adopt connections from previous process, reconnecting\n");
+    }
+
     //load plugins
     if(plugin_load_all() < 0){
         logmsg(LOG_WARNING, "main: Could not load all plugins\n");
     }
 
     //connect to IRC
-    //if(inet_connect_all() == -1){
-    //    logmsg(LOG_WARNING, "main: Could not connect to any IRC networks\n");
-    //}
+    if(htable_get_mapping_count(rc_network) > 0 && inet_connect_all() == -1){
+        logmsg(LOG_WARNING, "main: Could not connect to any IRC networks\n");
+    }
 
     //main event loop
     while(true){
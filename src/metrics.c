@@ -0,0 +1,535 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "htable.h"
+#include "log.h"
+#include "metrics.h"
+#include "nexus.h"
+#include "queue.h"
+#include "util.h"
+#include "watchdog.h"
+
+//The most connections that may be scraping metrics at once; more are turned away
+#define METRICS_CLIENTS_MAX 8
+
+//The most of a request that's read before it's answered; the request itself is ignored
+#define METRICS_REQUEST_MAX 1024
+
+#define METRICS_BACKLOG 8
+
+//The upper bound of each histogram bucket, in nanoseconds
+const uint64_t metrics_bounds[METRICS_BUCKET_COUNT] = {
+    10000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000,
+    50000000, 100000000, 250000000, 500000000, 1000000000
+};
+
+struct metrics_histogram metrics_loop = {{0}, 0, 0};
+
+int metrics_unix_sock = -1;
+int metrics_inet_sock = -1;
+char* metrics_unix_path = NULL;
+
+size_t metrics_client_count = 0;
+
+/**
+ * A connection to the metrics endpoint, which is read from until the request
+ * has arrived, and then written to until the response has been sent.
+ */
+struct metrics_client{
+    int sock;
+    char request[METRICS_REQUEST_MAX];
+    size_t request_len;
+    char* response;
+    size_t response_len;
+    size_t response_sent;
+};
+
+/**
+ * A buffer that rendered metrics are appended to.
+ */
+struct metrics_buf{
+    char* buf;
+    size_t len;
+    size_t size;
+    //Set if the system ran out of memory while appending
+    bool failed;
+};
+
+uint64_t metrics_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_observe(struct metrics_histogram* h, uint64_t ns){
+    for(size_t i = 0; i < METRICS_BUCKET_COUNT; i++){
+        if(ns <= metrics_bounds[i]){
+            h->buckets[i]++;
+            break;
+        }
+    }
+    h->count++;
+    h->sum += ns;
+}
+
+uint64_t metrics_quantile(const struct metrics_histogram* h, double q){
+    uint64_t rank = (uint64_t)(q * h->count + 0.5), cumulative = 0;
+    for(size_t i = 0; i < METRICS_BUCKET_COUNT; i++){
+        cumulative += h->buckets[i];
+        if(cumulative >= rank){
+            return metrics_bounds[i];
+        }
+    }
+    return UINT64_MAX;
+}
+
+/**
+ * Appends formatted text to a buffer, growing it as needed.
+ */
+void metrics_append(struct metrics_buf* b, const char* fmt, ...){
+    if(b->failed){
+        return;
+    }
+
+    while(true){
+        va_list ap;
+        va_start(ap, fmt);
+        int ret = vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+        if(ret < 0){
+            b->failed = true;
+            return;
+        }
+        if((size_t)ret < b->size - b->len){
+            b->len += ret;
+            return;
+        }
+
+        size_t size = b->size * 2 > b->len + ret + 1 ? b->size * 2 : b->len + ret + 1;
+        void* tmp = realloc(b->buf, size);
+        if(tmp == NULL){
+            b->failed = true;
+            return;
+        }
+        b->buf = tmp;
+        b->size = size;
+    }
+}
+
+/**
+ * Appends a label value, escaped as the Prometheus text format requires.
+ */
+void metrics_append_label(struct metrics_buf* b, const char* value){
+    for(; *value != '\0'; value++){
+        switch(*value){
+            case '\\': metrics_append(b, "\\\\"); break;
+            case '"': metrics_append(b, "\\\""); break;
+            case '\n': metrics_append(b, "\\n"); break;
+            default: metrics_append(b, "%c", *value);
+        }
+    }
+}
+
+/**
+ * Appends the HELP and TYPE lines for a metric.
+ */
+void metrics_append_header(struct metrics_buf* b, const char* name, const char* type, const char* help){
+    metrics_append(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/**
+ * Appends one sample of a metric, labelled with a network or plugin name.
+ */
+void metrics_append_sample(struct metrics_buf* b, const char* name, const char* label, const char* value, uint64_t sample){
+    metrics_append(b, "%s{%s=\"", name, label);
+    metrics_append_label(b, value);
+    metrics_append(b, "\"} %llu\n", (unsigned long long)sample);
+}
+
+/**
+ * Appends the labels of a histogram sample, and the comma that separates them
+ * from \c le, if there are any. \c label, and \c stage, may be NULL.
+ */
+void metrics_append_labels(struct metrics_buf* b, const char* label, const char* value, const char* stage, bool comma){
+    if(label != NULL){
+        metrics_append(b, "%s=\"", label);
+        metrics_append_label(b, value);
+        metrics_append(b, "\"");
+    }
+    if(stage != NULL){
+        metrics_append(b, "%sstage=\"%s\"", label != NULL ? "," : "", stage);
+    }
+    if(comma && (label != NULL || stage != NULL)){
+        metrics_append(b, ",");
+    }
+}
+
+/**
+ * Appends the samples of a histogram, labelled with a network or plugin name,
+ * a stage, both, or neither.
+ */
+void metrics_append_histogram(struct metrics_buf* b, const char* name, const char* label, const char* value, const char* stage, const struct metrics_histogram* h){
+    uint64_t cumulative = 0;
+    for(size_t i = 0; i <= METRICS_BUCKET_COUNT; i++){
+        metrics_append(b, "%s_bucket{", name);
+        metrics_append_labels(b, label, value, stage, true);
+        if(i < METRICS_BUCKET_COUNT){
+            cumulative += h->buckets[i];
+            metrics_append(b, "le=\"%g\"} %llu\n", metrics_bounds[i] / 1e9, (unsigned long long)cumulative);
+        }
+        else{
+            metrics_append(b, "le=\"+Inf\"} %llu\n", (unsigned long long)h->count);
+        }
+    }
+
+    bool labelled = label != NULL || stage != NULL;
+    metrics_append(b, "%s_sum%s", name, labelled ? "{" : "");
+    metrics_append_labels(b, label, value, stage, false);
+    metrics_append(b, "%s %.9f\n", labelled ? "}" : "", h->sum / 1e9);
+    metrics_append(b, "%s_count%s", name, labelled ? "{" : "");
+    metrics_append_labels(b, label, value, stage, false);
+    metrics_append(b, "%s %llu\n", labelled ? "}" : "", (unsigned long long)h->count);
+}
+
+//Network counters, by name, and the offset of each in struct network_metrics
+const struct{
+    const char* name;
+    const char* help;
+    size_t offset;
+} metrics_network_counters[] = {
+    {"praetor_network_lines_received_total", "Lines received from the network.", offsetof(struct network_metrics, lines_in)},
+    {"praetor_network_lines_sent_total", "Lines sent to the network.", offsetof(struct network_metrics, lines_out)},
+    {"praetor_network_bytes_received_total", "Bytes received from the network.", offsetof(struct network_metrics, bytes_in)},
+    {"praetor_network_bytes_sent_total", "Bytes sent to the network.", offsetof(struct network_metrics, bytes_out)},
+    {"praetor_network_parse_failures_total", "Lines received that could not be parsed.", offsetof(struct network_metrics, parse_failures)},
+    {"praetor_network_reconnects_total", "Connections that were lost or failed, and retried.", offsetof(struct network_metrics, reconnects)},
+};
+
+char* metrics_render(size_t* len){
+    struct metrics_buf b = {NULL, 0, 0, false};
+
+    size_t network_count = 0, plugin_count = 0;
+    struct htable_key** networks = htable_get_keys(rc_network, &network_count);
+    struct htable_key** plugins = htable_get_keys(rc_plugin, &plugin_count);
+    if((networks == NULL && network_count > 0) || (plugins == NULL && plugin_count > 0)){
+        b.failed = true;
+        goto done;
+    }
+
+    for(size_t i = 0; i < sizeof(metrics_network_counters) / sizeof(metrics_network_counters[0]); i++){
+        metrics_append_header(&b, metrics_network_counters[i].name, "counter", metrics_network_counters[i].help);
+        for(size_t j = 0; j < network_count; j++){
+            const struct network* n = htable_lookup(rc_network, networks[j]->key, networks[j]->key_size);
+            uint64_t value = *(const uint64_t*)((const char*)&n->metrics + metrics_network_counters[i].offset);
+            metrics_append_sample(&b, metrics_network_counters[i].name, "network", n->name, value);
+        }
+    }
+
+    metrics_append_header(&b, "praetor_network_send_queue_depth", "gauge", "Lines waiting to be sent to the network.");
+    for(size_t j = 0; j < network_count; j++){
+        const struct network* n = htable_lookup(rc_network, networks[j]->key, networks[j]->key_size);
+        metrics_append_sample(&b, "praetor_network_send_queue_depth", "network", n->name, n->send_queue == NULL ? 0 : queue_get_size(n->send_queue));
+    }
+
+    metrics_append_header(&b, "praetor_plugin_events_delivered_total", "counter", "Messages written to the plugin.");
+    for(size_t j = 0; j < plugin_count; j++){
+        const struct plugin* p = htable_lookup(rc_plugin, plugins[j]->key, plugins[j]->key_size);
+        metrics_append_sample(&b, "praetor_plugin_events_delivered_total", "plugin", p->name, p->metrics.delivered);
+    }
+    metrics_append_header(&b, "praetor_plugin_events_dropped_total", "counter", "Messages discarded instead of being written to the plugin.");
+    for(size_t j = 0; j < plugin_count; j++){
+        const struct plugin* p = htable_lookup(rc_plugin, plugins[j]->key, plugins[j]->key_size);
+        metrics_append_sample(&b, "praetor_plugin_events_dropped_total", "plugin", p->name, p->metrics.dropped);
+    }
+    metrics_append_header(&b, "praetor_plugin_ipc_latency_seconds", "histogram", "Time from a message being queued for the plugin to it being written.");
+    for(size_t j = 0; j < plugin_count; j++){
+        const struct plugin* p = htable_lookup(rc_plugin, plugins[j]->key, plugins[j]->key_size);
+        metrics_append_histogram(&b, "praetor_plugin_ipc_latency_seconds", "plugin", p->name, NULL, &p->metrics.ipc_latency);
+    }
+
+    metrics_append_header(&b, "praetor_network_stage_seconds", "histogram", "Time spent by messages from each network in each stage of handling.");
+    for(size_t j = 0; j < network_count; j++){
+        const struct network* n = htable_lookup(rc_network, networks[j]->key, networks[j]->key_size);
+        metrics_append_histogram(&b, "praetor_network_stage_seconds", "network", n->name, "read", &n->metrics.read_latency);
+        metrics_append_histogram(&b, "praetor_network_stage_seconds", "network", n->name, "parse", &n->metrics.parse_latency);
+        metrics_append_histogram(&b, "praetor_network_stage_seconds", "network", n->name, "send_queue", &n->metrics.send_queue_latency);
+        metrics_append_histogram(&b, "praetor_network_stage_seconds", "network", n->name, "total", &n->metrics.total_latency);
+    }
+
+    metrics_append_header(&b, "praetor_plugin_stage_seconds", "histogram", "Time spent by traced messages to and replies from each plugin in each stage of handling.");
+    for(size_t j = 0; j < plugin_count; j++){
+        const struct plugin* p = htable_lookup(rc_plugin, plugins[j]->key, plugins[j]->key_size);
+        metrics_append_histogram(&b, "praetor_plugin_stage_seconds", "plugin", p->name, "plugin", &p->metrics.reply_latency);
+        metrics_append_histogram(&b, "praetor_plugin_stage_seconds", "plugin", p->name, "rate_limit", &p->metrics.rate_limit_latency);
+    }
+
+    metrics_append_header(&b, "praetor_loop_iteration_seconds", "histogram", "Time spent handling each iteration of the event loop, not counting time spent waiting.");
+    metrics_append_histogram(&b, "praetor_loop_iteration_seconds", NULL, NULL, NULL, &metrics_loop);
+
+    metrics_append_header(&b, "praetor_loop_stalls_total", "counter", "Iterations of the event loop that ran longer than the watchdog's threshold, by the activity they were stalled in.");
+    size_t stall_count = atomic_load_explicit(&watchdog_stall_count, memory_order_acquire);
+    for(size_t i = 0; i < stall_count; i++){
+        metrics_append_sample(&b, "praetor_loop_stalls_total", "activity", watchdog_stalls[i].activity, atomic_load_explicit(&watchdog_stalls[i].count, memory_order_relaxed));
+    }
+
+    done:
+        if(networks != NULL){
+            htable_key_list_free(networks, network_count);
+        }
+        if(plugins != NULL){
+            htable_key_list_free(plugins, plugin_count);
+        }
+        if(b.failed){
+            free(b.buf);
+            return NULL;
+        }
+        *len = b.len;
+        return b.buf;
+}
+
+void metrics_client_close(struct metrics_client* c){
+    watch_remove(c->sock);
+    close(c->sock);
+    free(c->response);
+    free(c);
+    metrics_client_count--;
+}
+
+/**
+ * Writes as much of the response to a client as its socket will take, and
+ * closes the connection once all of it has been written.
+ */
+void metrics_client_write(int fd, short revents, void* arg){
+    (void)revents;
+    struct metrics_client* c = arg;
+
+    while(c->response_sent < c->response_len){
+        ssize_t ret = write(fd, c->response + c->response_sent, c->response_len - c->response_sent);
+        if(ret == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                logmsg(LOG_DEBUG, "metrics: Could not send metrics, %s\n", strerror(errno));
+                metrics_client_close(c);
+            }
+            return;
+        }
+        c->response_sent += ret;
+    }
+
+    metrics_client_close(c);
+}
+
+/**
+ * Reads a client's request until its headers have arrived, then answers it
+ * with the current metrics.
+ */
+void metrics_client_read(int fd, short revents, void* arg){
+    (void)revents;
+    struct metrics_client* c = arg;
+
+    ssize_t ret = read(fd, c->request + c->request_len, METRICS_REQUEST_MAX - 1 - c->request_len);
+    if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
+        return;
+    }
+    if(ret <= 0){
+        metrics_client_close(c);
+        return;
+    }
+    c->request_len += ret;
+    c->request[c->request_len] = '\0';
+
+    //Whatever was asked for, the answer is the same; just wait for the end of the headers
+    if(strstr(c->request, "\r\n\r\n") == NULL && strstr(c->request, "\n\n") == NULL && c->request_len < METRICS_REQUEST_MAX - 1){
+        return;
+    }
+
+    size_t body_len = 0;
+    char* body = metrics_render(&body_len);
+    if(body == NULL){
+        logmsg(LOG_WARNING, "metrics: Could not render metrics, the system is out of memory\n");
+        metrics_client_close(c);
+        return;
+    }
+
+    const char* fmt = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n";
+    int header_len = snprintf(NULL, 0, fmt, body_len);
+    if((c->response = malloc(header_len + body_len + 1)) == NULL){
+        logmsg(LOG_WARNING, "metrics: Could not send metrics, the system is out of memory\n");
+        free(body);
+        metrics_client_close(c);
+        return;
+    }
+    snprintf(c->response, header_len + 1, fmt, body_len);
+    memcpy(c->response + header_len, body, body_len);
+    c->response_len = header_len + body_len;
+    free(body);
+
+    watch_remove(fd);
+    if(watch_add_callback(fd, true, metrics_client_write, c) == -1){
+        close(fd);
+        free(c->response);
+        free(c);
+        metrics_client_count--;
+    }
+}
+
+/**
+ * Accepts a connection on either listening socket.
+ */
+void metrics_accept(int fd, short revents, void* arg){
+    (void)revents;
+    (void)arg;
+
+    int sock = accept(fd, NULL, NULL);
+    if(sock == -1){
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+            logmsg(LOG_WARNING, "metrics: Could not accept connection, %s\n", strerror(errno));
+        }
+        return;
+    }
+
+    if(metrics_client_count == METRICS_CLIENTS_MAX){
+        logmsg(LOG_DEBUG, "metrics: Turning away connection, %d are already open\n", METRICS_CLIENTS_MAX);
+        close(sock);
+        return;
+    }
+
+    struct metrics_client* c = calloc(1, sizeof(struct metrics_client));
+    if(c == NULL){
+        logmsg(LOG_WARNING, "metrics: Could not accept connection, the system is out of memory\n");
+        close(sock);
+        return;
+    }
+    c->sock = sock;
+
+    if(setnonblock(sock) == -1 || setcloexec(sock) == -1 || watch_add_callback(sock, false, metrics_client_read, c) == -1){
+        logmsg(LOG_WARNING, "metrics: Could not accept connection\n");
+        close(sock);
+        free(c);
+        return;
+    }
+    metrics_client_count++;
+}
+
+/**
+ * Starts listening for connections on a socket that's been bound, and watches
+ * it from the event loop.
+ *
+ * \return 0 on success.
+ * \return -1 on failure.
+ */
+int metrics_listen(int sock){
+    if(setnonblock(sock) == -1 || setcloexec(sock) == -1){
+        logmsg(LOG_WARNING, "metrics: Could not set socket file descriptor flags, %s\n", strerror(errno));
+        return -1;
+    }
+    if(listen(sock, METRICS_BACKLOG) == -1){
+        logmsg(LOG_WARNING, "metrics: Could not listen for connections, %s\n", strerror(errno));
+        return -1;
+    }
+    if(watch_add_callback(sock, false, metrics_accept, NULL) == -1){
+        return -1;
+    }
+    return 0;
+}
+
+int metrics_init(const char* socket_path, int port){
+    if(socket_path != NULL){
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if(strlen(socket_path) >= sizeof(addr.sun_path)){
+            logmsg(LOG_WARNING, "metrics: Socket path %s is too long\n", socket_path);
+            goto fail;
+        }
+        strcpy(addr.sun_path, socket_path);
+
+        if((metrics_unix_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
+            logmsg(LOG_WARNING, "metrics: Could not open socket, %s\n", strerror(errno));
+            goto fail;
+        }
+        //A socket left behind by an earlier process, or by the one that upgraded into this one
+        unlink(socket_path);
+        if(bind(metrics_unix_sock, (struct sockaddr*)&addr, sizeof(addr)) == -1){
+            logmsg(LOG_WARNING, "metrics: Could not bind to %s, %s\n", socket_path, strerror(errno));
+            goto fail;
+        }
+        if((metrics_unix_path = malloc(strlen(socket_path) + 1)) == NULL){
+            logmsg(LOG_WARNING, "metrics: Could not listen on %s, the system is out of memory\n", socket_path);
+            unlink(socket_path);
+            goto fail;
+        }
+        strcpy(metrics_unix_path, socket_path);
+        if(metrics_listen(metrics_unix_sock) == -1){
+            goto fail;
+        }
+        logmsg(LOG_INFO, "metrics: Serving metrics on %s\n", socket_path);
+    }
+
+    if(port != 0){
+        struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+        if((metrics_inet_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1){
+            logmsg(LOG_WARNING, "metrics: Could not open socket, %s\n", strerror(errno));
+            goto fail;
+        }
+        int reuse = 1;
+        setsockopt(metrics_inet_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if(bind(metrics_inet_sock, (struct sockaddr*)&addr, sizeof(addr)) == -1){
+            logmsg(LOG_WARNING, "metrics: Could not bind to port %d, %s\n", port, strerror(errno));
+            goto fail;
+        }
+        if(metrics_listen(metrics_inet_sock) == -1){
+            goto fail;
+        }
+        logmsg(LOG_INFO, "metrics: Serving metrics on 127.0.0.1:%d\n", port);
+    }
+
+    return 0;
+
+    fail:
+        metrics_close();
+        return -1;
+}
+
+void metrics_close(){
+    if(metrics_unix_sock != -1){
+        watch_remove(metrics_unix_sock);
+        close(metrics_unix_sock);
+        metrics_unix_sock = -1;
+    }
+    if(metrics_unix_path != NULL){
+        unlink(metrics_unix_path);
+        free(metrics_unix_path);
+        metrics_unix_path = NULL;
+    }
+    if(metrics_inet_sock != -1){
+        watch_remove(metrics_inet_sock);
+        close(metrics_inet_sock);
+        metrics_inet_sock = -1;
+    }
+}
@@ -19,14 +19,21 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "capture.h"
 #include "config.h"
 #include "htable.h"
 #include "inet.h"
 #include "irc.h"
 #include "ircmsg.h"
+#include "isupport.h"
 #include "log.h"
+#include "metrics.h"
 #include "plugin.h"
+#include "probes.h"
 #include "signals.h"
+#include "state.h"
+#include "timer.h"
+#include "watchdog.h"
 
 #define NOMEM_WAIT_SECONDS 0
 #define NOMEM_WAIT_NANOSECONDS 500000000
@@ -44,6 +51,17 @@ size_t monitor_list_count = 0;
  */
 struct pollfd* monitor_list = NULL;
 
+/**
+ * A hash table mapping file descriptors added via watch_add_callback() to
+ * their watch_callback structs.
+ */
+struct htable* watch_callbacks = NULL;
+
+struct watch_callback{
+    void (*fn)(int fd, short revents, void* arg);
+    void* arg;
+};
+
 int watch_add(const int fd, bool connection){
     if(monitor_list != NULL){
         for(size_t i = 0; i < monitor_list_size; i++){
@@ -55,6 +73,8 @@ int watch_add(const int fd, bool connection){
                 else{
                     monitor_list[i].events = POLLIN;
                 }
+                monitor_list[i].revents = 0;
+                monitor_list_count++;
                 return 0;
             }
         }
@@ -66,6 +86,7 @@ int watch_add(const int fd, bool connection){
     }
     monitor_list = tmp;
     monitor_list[monitor_list_size].fd = fd;
+    monitor_list[monitor_list_size].revents = 0;
     if(connection){
         monitor_list[monitor_list_size].events = POLLOUT;
     }
@@ -77,7 +98,43 @@ int watch_add(const int fd, bool connection){
     return 0;
 }
 
+int watch_add_callback(int fd, bool write, void (*fn)(int fd, short revents, void* arg), void* arg){
+    if(watch_callbacks == NULL && (watch_callbacks = htable_create(5)) == NULL){
+        logmsg(LOG_WARNING, "nexus: Could not add callback to global monitor list, the system is out of memory\n");
+        return -1;
+    }
+
+    struct watch_callback* cb = malloc(sizeof(struct watch_callback));
+    if(cb == NULL){
+        logmsg(LOG_WARNING, "nexus: Could not add callback to global monitor list, the system is out of memory\n");
+        return -1;
+    }
+    cb->fn = fn;
+    cb->arg = arg;
+
+    if(htable_add(watch_callbacks, (uint8_t*)&fd, sizeof(fd), cb) != 0){
+        logmsg(LOG_WARNING, "nexus: Could not add callback to global monitor list for file descriptor %d\n", fd);
+        free(cb);
+        return -1;
+    }
+    if(watch_add(fd, write) == -1){
+        htable_remove(watch_callbacks, (uint8_t*)&fd, sizeof(fd));
+        free(cb);
+        return -1;
+    }
+
+    return 0;
+}
+
 void watch_remove(const int fd){
+    if(watch_callbacks != NULL){
+        struct watch_callback* cb = htable_lookup(watch_callbacks, (uint8_t*)&fd, sizeof(fd));
+        if(cb != NULL){
+            htable_remove(watch_callbacks, (uint8_t*)&fd, sizeof(fd));
+            free(cb);
+        }
+    }
+
     for(size_t i = 0; i < monitor_list_size; i++){
         if(monitor_list[i].fd == fd){
             monitor_list[i].fd = -1;
@@ -90,22 +147,40 @@ void watch_remove(const int fd){
     }
 }
 
+/**
+ * Sleeps while waiting for memory to be freed, telling the watchdog why the
+ * event loop isn't making progress.
+ */
+void nomem_wait(const struct timespec* ts){
+    const char* activity = watchdog_enter("out-of-memory wait");
+    nanosleep(ts, NULL);
+    watchdog_leave(activity);
+}
+
 void run(){
     struct timespec ts = {.tv_sec = NOMEM_WAIT_SECONDS, .tv_nsec = NOMEM_WAIT_NANOSECONDS};
 
-    //If handling of any signal fails, we were out of memory
+    //Signals are handled as soon as they're read from the signal descriptor, but
+    //if handling any of them failed there, we were out of memory; try again
     if(handle_signals() == -1){
         //Sleep for a bit and then retry
-        nanosleep(&ts, NULL);
+        nomem_wait(&ts);
         return;
     }
 
-    if(monitor_list_count < 1){
+    //Descriptors with callbacks, like the signal descriptor, don't count; they'd keep us waiting forever.
+    //Timers and plugin processes that haven't been reaped yet still have work for us, though.
+    size_t callback_count = watch_callbacks == NULL ? 0 : htable_get_mapping_count(watch_callbacks);
+    if(monitor_list_count <= callback_count && timer_get_armed_count() == 0 && htable_get_mapping_count(rc_plugin_pid) == 0){
         logmsg(LOG_ERR, "nexus: No sockets to monitor, exiting\n");
+        capture_close();
         _exit(0);
     }
 
-    int poll_status = poll(monitor_list, monitor_list_size, POLL_TIMEOUT);
+    watchdog_idle();
+    int poll_status = poll(monitor_list, monitor_list_size, timer_next_timeout(POLL_TIMEOUT));
+    uint64_t busy_start = metrics_now();
+    watchdog_busy(busy_start);
     if(poll_status == -1){
         switch(errno){
             case EINTR:
@@ -119,32 +194,45 @@ void run(){
                 logmsg(LOG_WARNING, "nexus: Could not poll sockets, the system is out of memory\n");
                 logmsg(LOG_DEBUG, "nexus: Attempting another poll in %d seconds and %d nanoseconds\n", NOMEM_WAIT_SECONDS, NOMEM_WAIT_NANOSECONDS);
                 //Sleep for a quarter of a second and try again
-                nanosleep(&ts, NULL);
+                nomem_wait(&ts);
                 return;
         }
     }
     //Try to flush all send queues
     else if(poll_status == 0){
-        inet_send_all();
+        timer_run();
+        if(htable_get_mapping_count(rc_network_sock) > 0){
+            inet_send_all();
+        }
+        //Capture a quiet period to disk rather than leaving it in the buffer
+        capture_flush();
+        metrics_observe(&metrics_loop, metrics_now() - busy_start);
         return;
     }
 
-    //Grab the current list of configured plugins
+    //Grab the current list of configured plugins. A reload may remove some of these before we're done with the list.
     size_t size = 0;
     struct htable_key** plugins = NULL;
-    while((plugins = htable_get_keys(rc_plugin, &size)) == NULL){
+    while(htable_get_mapping_count(rc_plugin) > 0 && (plugins = htable_get_keys(rc_plugin, &size)) == NULL){
         logmsg(LOG_WARNING, "nexus: Could not load list of configured plugins, the system is out of memory\n");
         logmsg(LOG_WARNING, "nexus: Attempting to load list again in %d seconds and %d nanoseconds\n", NOMEM_WAIT_SECONDS, NOMEM_WAIT_NANOSECONDS);
-        nanosleep(&ts, NULL);
+        nomem_wait(&ts);
     }
 
-    for(size_t i = 0; i < monitor_list_count; i++){
-        if(monitor_list[i].fd == -1){
+    for(size_t i = 0; i < monitor_list_size; i++){
+        if(monitor_list[i].fd == -1 || monitor_list[i].revents == 0){
+            continue;
+        }
+
+        //Descriptors that aren't networks or plugins are handled by whoever added them
+        struct watch_callback* cb = NULL;
+        if(watch_callbacks != NULL && (cb = htable_lookup(watch_callbacks, (uint8_t*)&monitor_list[i].fd, sizeof(monitor_list[i].fd))) != NULL){
+            cb->fn(monitor_list[i].fd, monitor_list[i].revents, cb->arg);
             continue;
         }
 
         struct network* n;
-        struct plugin* p;
+        struct plugin* p = NULL;
 
         n = htable_lookup(rc_network_sock, (uint8_t*)&monitor_list[i].fd, sizeof(monitor_list[i].fd));
         if(n == NULL){
@@ -156,11 +244,12 @@ void run(){
             if(monitor_list[i].revents & POLLOUT){
                 if(inet_check_connection(n) == 0){
                     while(irc_register_connection(n) != 0){
-                        nanosleep(&ts, NULL);
+                        nomem_wait(&ts);
                     }
                     irc_join_all(n);
                 }
                 else{
+                    n->metrics.reconnects++;
                     inet_connect(n);
                 }
             }
@@ -171,36 +260,63 @@ void run(){
                 }
 
                 struct ircmsg* parsed_msg = NULL;
-                char msg[IRCMSG_SIZE_MAX];
+                //Lines may be as long as the network's LINELEN
+                char msg[ISUPPORT_LINELEN_MAX + 1];
                 
-                while(irc_recv(n, msg, IRCMSG_SIZE_MAX) != -1){
-                    parsed_msg = ircmsg_parse(n->name, msg, strlen(msg));
+                while(irc_recv(n, msg, sizeof(msg)) != -1){
+                    size_t len = strlen(msg);
+                    uint64_t line_at = metrics_now();
+                    PROBE3(line_received, n->name, msg, len);
+                    metrics_observe(&n->metrics.read_latency, line_at - n->recv_at);
+
+                    parsed_msg = ircmsg_parse(n->name, msg, len);
+                    if(parsed_msg == NULL){
+                        n->metrics.parse_failures++;
+                    }
+
+                    //Plugins subscribed to raw lines get them as they came (instead of parsed), if they could read them parsed
+                    for(size_t j = 0; j < size; j++){
+                        struct plugin* p_this = htable_lookup(rc_plugin, plugins[j]->key, plugins[j]->key_size);
+                        if(p_this != NULL && p_this->status == PLUGIN_LOADED && p_this->raw && plugin_can_read(p_this, n, parsed_msg)){
+                            plugin_send_raw(p_this, n->name, msg, len);
+                        }
+                    }
+                    if(parsed_msg == NULL){
+                        continue;
+                    }
+                    parsed_msg->recv_at = n->recv_at;
+                    PROBE2(parse_done, n->name, parsed_msg->cmd);
+
+                    //Plugins see the state as it is after the message, e.g. with a joining user already in their channel
+                    isupport_update(n, parsed_msg);
+                    state_update(n, parsed_msg);
+
                     if(parsed_msg->type == PING){
                         while(irc_handle_ping(n, parsed_msg) == -1){
-                            nanosleep(&ts, NULL);
+                            nomem_wait(&ts);
                         }
                     }
-                }
 
-                for(size_t j = 0; j < size; j++){
-                    struct plugin* p_this = htable_lookup(rc_plugin, plugins[i]->key, plugins[i]->key_size);
-                    plugin_send(p_this, parsed_msg);
+                    for(size_t j = 0; j < size; j++){
+                        struct plugin* p_this = htable_lookup(rc_plugin, plugins[j]->key, plugins[j]->key_size);
+                        if(p_this != NULL && p_this->status == PLUGIN_LOADED && !p_this->raw && plugin_can_read(p_this, n, parsed_msg)){
+                            plugin_send(p_this, parsed_msg);
+                        }
+                    }
+                    metrics_observe(&n->metrics.parse_latency, metrics_now() - line_at);
+
+                    ircmsg_free(parsed_msg);
+                    free(parsed_msg);
                 }
             }
         }
         else if(p != NULL){
             //Dispatch messages to networks according to ACLs and rate-limits
-            //json_t* obj = plugin_recv(p);
-            logmsg(LOG_DEBUG, "nexus: Plugin '%s' has data in the queue waiting to be read\n", p->name);
-            //if(obj == NULL){
-            //    continue;
-            //}
-
-            //char* network;
-            //char* msg = ircmsg_from_json(obj, &network);
-
-            //struct network* n_this = htable_lookup(rc_network, (uint8_t*)network, strlen(network)+1);
-            //irc_send(n_this, msg, strlen(msg));
+            json_t* obj;
+            while(p->status == PLUGIN_LOADED && (obj = plugin_recv(p)) != NULL){
+                plugin_dispatch(p, obj);
+                json_decref(obj);
+            }
         }
         else{
             //This should never happen.
@@ -208,4 +324,25 @@ void run(){
             _exit(-1);
         }
     }
+
+    timer_run();
+
+    //Write out everything batched for plugins during this iteration
+    for(size_t j = 0; j < size; j++){
+        struct plugin* p_this = htable_lookup(rc_plugin, plugins[j]->key, plugins[j]->key_size);
+        if(p_this != NULL && p_this->status == PLUGIN_LOADED && p_this->batch_count > 0 && rc_praetor->batch_delay == 0){
+            plugin_flush(p_this);
+        }
+    }
+
+    if(plugins != NULL){
+        htable_key_list_free(plugins, size);
+    }
+
+    //Send whatever plugins and timers queued during this iteration, rather than waiting for the next idle poll
+    if(htable_get_mapping_count(rc_network_sock) > 0){
+        inet_send_all();
+    }
+
+    metrics_observe(&metrics_loop, metrics_now() - busy_start);
 }
@@ -10,97 +10,392 @@
 * can be found in the "LICENSE" file bundled with this source distribution.
 */
 
+#include <dlfcn.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <jansson.h>
 #include <libgen.h>
+#include <limits.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "capture.h"
 #include "config.h"
 #include "htable.h"
+#include "irc.h"
 #include "ircmsg.h"
+#include "queue.h"
 #include "log.h"
+#include "metrics.h"
 #include "nexus.h"
 #include "plugin.h"
+#include "probes.h"
+#include "ring.h"
+#include "state.h"
+#include "supervisor.h"
+#include "timer.h"
+#include "trace.h"
+#include "util.h"
+
+//The size, in bytes, of each of the rings shared with a plugin using the shared memory transport
+#define PLUGIN_RING_SIZE 1048576
+
+//The size of the buffer used to drain wake-ups sent by plugins using the shared memory transport
+#define PLUGIN_BELL_SIZE 64
+
+//The number of milliseconds to wait before retrying a batch write that would have blocked
+#define PLUGIN_RETRY_DELAY 50
+
+//The size of the buffer for messages read from a plugin's socket, and thus the largest message a plugin may send
+#define PLUGIN_RECV_SIZE 65536
+
+//The number of rate-limited messages that may wait in a plugin's outbox before further messages are discarded
+#define PLUGIN_OUTBOX_MAX 64
+
+#ifdef IOV_MAX
+#define PLUGIN_IOV_MAX IOV_MAX
+#else
+#define PLUGIN_IOV_MAX 16
+#endif
+
+void plugin_batch_timeout(void* arg){
+    plugin_flush(arg);
+}
+
+void plugin_rings_destroy(struct plugin* p){
+    ring_destroy(p->ring_tx);
+    ring_destroy(p->ring_rx);
+    p->ring_tx = NULL;
+    p->ring_rx = NULL;
+}
+
+int plugin_fd_reserve(int* fd){
+    //dup2() onto the same descriptor leaves close-on-exec set, and any lower
+    //descriptor could be clobbered by the plugin's own standard descriptors
+    if(*fd > PLUGIN_RING_FD_OUT){
+        return setcloexec(*fd);
+    }
+
+    int moved = fcntl(*fd, F_DUPFD, PLUGIN_RING_FD_OUT + 1);
+    if(moved == -1){
+        return -1;
+    }
+    if(setcloexec(moved) == -1){
+        close(moved);
+        return -1;
+    }
+
+    close(*fd);
+    *fd = moved;
+
+    return 0;
+}
+
+int plugin_spawn(struct plugin* p, int sock, pid_t* pid){
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+
+    int err = posix_spawn_file_actions_init(&actions);
+    if(err != 0){
+        return err;
+    }
+    if((err = posix_spawnattr_init(&attr)) != 0){
+        posix_spawn_file_actions_destroy(&actions);
+        return err;
+    }
+
+    //Everything else the plugin could inherit is close-on-exec
+    if((err = posix_spawn_file_actions_adddup2(&actions, sock, 0)) != 0 || (err = posix_spawn_file_actions_adddup2(&actions, sock, 1)) != 0){
+        goto done;
+    }
+
+    char* envp[] = {"PRAETOR_PLUGIN=1", NULL, NULL};
+    if(p->transport == PLUGIN_TRANSPORT_SHM){
+        if((err = posix_spawn_file_actions_adddup2(&actions, p->ring_tx->fd, PLUGIN_RING_FD_IN)) != 0 || (err = posix_spawn_file_actions_adddup2(&actions, p->ring_rx->fd, PLUGIN_RING_FD_OUT)) != 0){
+            goto done;
+        }
+        envp[1] = "PRAETOR_TRANSPORT=shm";
+    }
+
+    //We may be called with signals blocked by handle_signals(); the plugin shouldn't start that way
+    sigset_t mask;
+    sigemptyset(&mask);
+    if((err = posix_spawnattr_setsigmask(&attr, &mask)) != 0 || (err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK)) != 0){
+        goto done;
+    }
+
+    char* argv[] = {basename(p->path), NULL};
+    err = posix_spawn(pid, p->path, &actions, &attr, argv, envp);
+
+    done:
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+        return err;
+}
+
+int plugin_rings_create(struct plugin* p){
+    p->ring_tx = ring_create(PLUGIN_RING_SIZE);
+    p->ring_rx = ring_create(PLUGIN_RING_SIZE);
+    if(p->ring_tx == NULL || p->ring_rx == NULL){
+        logmsg(LOG_WARNING, "plugin: Failed to create shared memory rings for plugin '%s'\n", p->name);
+        plugin_rings_destroy(p);
+        return -1;
+    }
+
+    if(plugin_fd_reserve(&p->ring_tx->fd) == -1 || plugin_fd_reserve(&p->ring_rx->fd) == -1){
+        logmsg(LOG_WARNING, "plugin: Failed to set flags on shared memory rings for plugin '%s', %s\n", p->name, strerror(errno));
+        plugin_rings_destroy(p);
+        return -1;
+    }
+
+    //We only ever wait for the plugin from within poll(), so we're always asleep as far as the plugin is concerned
+    ring_sleep(p->ring_rx);
+
+    return 0;
+}
+
+//The shared plugin whose code is running, which is the one calling into plugin_api
+struct plugin* plugin_shared_current = NULL;
+
+/**
+ * Checks whether a plugin may send a raw line to a network. The line must be
+ * a single line, and on a network with a plugins section, every channel or
+ * nick in its first parameter must pass plugin_can_write(); lines without
+ * parameters may not be sent there at all.
+ */
+bool plugin_can_write_line(const struct plugin* p, const struct network* n, const char* line, size_t len){
+    //Anything after an early line break would be another command, and go unchecked
+    if(len < 2 || len > ISUPPORT_LINELEN_MAX || memcmp(line + len - 2, "\r\n", 2) != 0 || memchr(line, '\r', len - 2) != NULL || memchr(line, '\n', len - 2) != NULL || memchr(line, '\0', len) != NULL){
+        return false;
+    }
+    if(htable_get_mapping_count(n->plugins) == 0){
+        return true;
+    }
+
+    char buf[ISUPPORT_LINELEN_MAX];
+    memcpy(buf, line, len - 2);
+    buf[len - 2] = '\0';
+
+    //Past any tags and prefix, and the command, to the first parameter
+    char* save = NULL;
+    char* token = strtok_r(buf, " ", &save);
+    if(token != NULL && token[0] == '@'){
+        token = strtok_r(NULL, " ", &save);
+    }
+    if(token != NULL && token[0] == ':'){
+        token = strtok_r(NULL, " ", &save);
+    }
+    char* param = token == NULL ? NULL : strtok_r(NULL, " ", &save);
+    if(param == NULL){
+        return false;
+    }
+    if(param[0] == ':'){
+        param++;
+    }
+
+    bool allowed = false;
+    for(char* target = strtok_r(param, ",", &save); target != NULL; target = strtok_r(NULL, ",", &save)){
+        if(!plugin_can_write(p, n, target)){
+            return false;
+        }
+        allowed = true;
+    }
+    return allowed;
+}
+
+int plugin_api_send(const char* network, const char* line, size_t len){
+    struct plugin* p = plugin_shared_current;
+    if(p == NULL){
+        logmsg(LOG_WARNING, "plugin: Shared plugin attempted to send a message from outside of praetor's event loop\n");
+        return -1;
+    }
+    struct network* n = htable_lookup(rc_network, (uint8_t*)network, strlen(network)+1);
+    if(n == NULL){
+        logmsg(LOG_WARNING, "plugin: Shared plugin '%s' attempted to send a message to unknown network '%s'\n", p->name, network);
+        return -1;
+    }
+    if(len > n->isupport.linelen){
+        logmsg(LOG_WARNING, "plugin: Shared plugin '%s' attempted to send a message longer than %zu bytes to network '%s'\n", p->name, n->isupport.linelen, network);
+        return -1;
+    }
+    if(!plugin_can_write_line(p, n, line, len)){
+        logmsg(LOG_WARNING, "plugin: Plugin '%s' is not allowed to send '%.*s' to network '%s'\n", p->name, (int)(len > 2 ? len - 2 : 0), line, network);
+        return -1;
+    }
+
+    return plugin_send_line(p, n, line, len, 0);
+}
+
+void plugin_api_log(int loglevel, const char* msg){
+    logmsg(loglevel, "plugin: %s\n", msg);
+}
+
+int plugin_api_members(const char* network, const char* channel, void (*fn)(void* arg, const char* nick, const char* prefixes), void* arg){
+    struct network* n = htable_lookup(rc_network, (uint8_t*)network, strlen(network)+1);
+    if(n == NULL){
+        return -1;
+    }
+
+    return state_members(n, channel, fn, arg);
+}
+
+int plugin_api_channels(const char* network, const char* nick, void (*fn)(void* arg, const char* channel, const char* prefixes), void* arg){
+    struct network* n = htable_lookup(rc_network, (uint8_t*)network, strlen(network)+1);
+    if(n == NULL){
+        return -1;
+    }
+
+    return state_channels(n, nick, fn, arg);
+}
+
+const struct praetor_api plugin_api = {
+    .abi_version = PRAETOR_PLUGIN_ABI_VERSION,
+    .send = plugin_api_send,
+    .log = plugin_api_log,
+    .members = plugin_api_members,
+    .channels = plugin_api_channels
+};
+
+int plugin_load_shared(struct plugin* p){
+    p->handle = dlopen(p->path, RTLD_NOW | RTLD_LOCAL);
+    if(p->handle == NULL){
+        logmsg(LOG_WARNING, "plugin: Failed to load shared plugin '%s', %s\n", p->name, dlerror());
+        return -1;
+    }
+
+    p->abi = dlsym(p->handle, PRAETOR_PLUGIN_SYMBOL);
+    if(p->abi == NULL){
+        logmsg(LOG_WARNING, "plugin: Shared plugin '%s' does not export '%s'\n", p->name, PRAETOR_PLUGIN_SYMBOL);
+        goto fail;
+    }
+    if(p->abi->abi_version != PRAETOR_PLUGIN_ABI_VERSION){
+        logmsg(LOG_WARNING, "plugin: Shared plugin '%s' was built for plugin ABI version %u, but this is version %d\n", p->name, p->abi->abi_version, PRAETOR_PLUGIN_ABI_VERSION);
+        goto fail;
+    }
+    if(p->raw ? p->abi->on_raw == NULL : p->abi->on_event == NULL){
+        logmsg(LOG_WARNING, "plugin: Shared plugin '%s' does not handle %s messages\n", p->name, p->raw ? "raw" : "parsed");
+        goto fail;
+    }
+
+    p->ctx = NULL;
+    plugin_shared_current = p;
+    int ret = p->abi->init == NULL ? 0 : p->abi->init(&plugin_api, &p->ctx);
+    plugin_shared_current = NULL;
+    if(ret == -1){
+        logmsg(LOG_WARNING, "plugin: Shared plugin '%s' failed to initialize\n", p->name);
+        goto fail;
+    }
+
+    p->status = PLUGIN_LOADED;
+    p->start_time = timer_now();
+    return 0;
+
+    fail:
+        dlclose(p->handle);
+        p->handle = NULL;
+        p->abi = NULL;
+        p->status = PLUGIN_UNLOADED;
+        return -1;
+}
 
 int plugin_load(struct plugin* p){
+    if(p->type == PLUGIN_TYPE_SHARED){
+        return plugin_load_shared(p);
+    }
+
+    if(p->batch == NULL){
+        if((p->batch = calloc(rc_praetor->batch_size, sizeof(struct plugin_frame))) == NULL){
+            logmsg(LOG_WARNING, "plugin: Failed to allocate message batch for plugin '%s', the system is out of memory\n", p->name);
+            return -1;
+        }
+    }
+    p->batch_count = 0;
+    p->batch_offset = 0;
+
+    if(p->recv_buf == NULL){
+        if((p->recv_buf = malloc(PLUGIN_RECV_SIZE)) == NULL){
+            logmsg(LOG_WARNING, "plugin: Failed to allocate receive buffer for plugin '%s', the system is out of memory\n", p->name);
+            return -1;
+        }
+    }
+    p->recv_len = 0;
+    timer_init(&p->batch_timer, plugin_batch_timeout, p);
+
+    if(p->transport == PLUGIN_TRANSPORT_SHM && plugin_rings_create(p) == -1){
+        return -1;
+    }
+
     int fds[2];
     if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1){
         logmsg(LOG_WARNING, "plugin: Failed to create IPC socket for plugin '%s', %s\n", p->name, strerror(errno));
+        plugin_rings_destroy(p);
+        return -1;
+    }
+    if(setcloexec(fds[0]) == -1 || plugin_fd_reserve(&fds[1]) == -1){
+        logmsg(LOG_WARNING, "plugin: Failed to set flags on IPC socket for plugin '%s', %s\n", p->name, strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        plugin_rings_destroy(p);
         return -1;
     }
 
-    pid_t child_pid = fork();
-    switch(child_pid){
-        case -1:
-            close(fds[0]);
-            close(fds[1]);
-            logmsg(LOG_WARNING, "plugin: Failed to fork plugin '%s', %s\n", p->name, strerror(errno));
-            return -1;
-        case 0:
-            if(dup2(fds[1], 0) == -1 || dup2(fds[1], 1) == -1){
-                logmsg(LOG_WARNING, "plugin: Failed to duplicate socket file descriptor to stdin/stdout for plugin '%s'\n", p->name);
-                _exit(-1);
-            }
+    pid_t child_pid;
+    int err = plugin_spawn(p, fds[1], &child_pid);
+    close(fds[1]);
+    if(err != 0){
+        close(fds[0]);
+        plugin_rings_destroy(p);
+        logmsg(LOG_WARNING, "plugin: Failed to spawn plugin '%s', %s\n", p->name, strerror(err));
+        return -1;
+    }
 
-            close(fds[0]);
-            close(fds[1]);
-            closelog();
+    p->pid = child_pid;
+    p->sock = fds[0];
 
-            char* argv[] = {basename(p->path), NULL};
-            char* envp[] = {"PRAETOR_PLUGIN=1", NULL};
-            execve(p->path, argv, envp);
+    if(supervisor_watch(p) == -1){
+        goto fail;
+    }
 
-            //The following error can never be printed in foreground mode, we've already closed stdin/stdout
-            logmsg(LOG_WARNING, "plugin: Failed to exec plugin '%s', %s\n", p->name, strerror(errno));
+    if(htable_add(rc_plugin_sock, (uint8_t*)&fds[0], sizeof(fds[0]), p) < 0){
+        logmsg(LOG_WARNING, "plugin: Failed to map IPC socket to configuration for plugin '%s'\n", p->name);
+        goto fail;
+    }
+    if(watch_add(fds[0], false) == -1){
+        logmsg(LOG_WARNING, "plugin: Failed to add plugin socket to global monitor list for plugin '%s'\n", p->name);
+        if(htable_remove(rc_plugin_sock, (uint8_t*)&fds[0], sizeof(fds[0])) != 0){
+            //If the index we just added doesn't exist, something's fucky
+            logmsg(LOG_ERR, "plugin: Software failure. Press left mouse button to continue. Guru Meditation #c4fe.b33f.b4b3\n");
             _exit(-1);
-        default:
-            close(fds[1]);
-
-            p->pid = child_pid;
-            p->sock = fds[0];
-
-            if(htable_add(rc_plugin_sock, (uint8_t*)&fds[0], sizeof(fds[0]), p) < 0){
-                logmsg(LOG_WARNING, "plugin: Failed to map IPC socket to configuration for plugin '%s'\n", p->name);
-                goto fail;
-            }
-            if(watch_add(fds[0], false) == -1){
-                logmsg(LOG_WARNING, "plugin: Failed to add plugin socket to global monitor list for plugin '%s'\n", p->name);
-                if(htable_remove(rc_plugin_sock, (uint8_t*)&fds[0], sizeof(fds[0])) != 0){
-                    //If the index we just added doesn't exist, something's fucky
-                    logmsg(LOG_ERR, "plugin: Software failure. Press left mouse button to continue. Guru Meditation #c4fe.b33f.b4b3\n");
-                    _exit(-1);
-                }
-                goto fail;
-            }
+        }
+        goto fail;
+    }
 
-            //If the socket isn't non-blocking, we can't read from it; a single shitty plugin could hang the bot
-            int flags = fcntl(fds[0], F_GETFL);
-            if(flags == -1){
-                logmsg(LOG_WARNING, "plugin: Failed to get flags for plugin socket for plugin '%s', %s\n", p->name, strerror(errno));
-                goto fail;
-            }
-            if(fcntl(fds[0], F_SETFL, flags | O_NONBLOCK) == -1){
-                logmsg(LOG_WARNING, "plugin: Failed to put plugin socket into non-blocking mode for plugin '%s', %s\n", p->name, strerror(errno));
-                goto fail;
-            }
+    //If the socket isn't non-blocking, we can't read from it; a single shitty plugin could hang the bot
+    if(setnonblock(fds[0]) == -1){
+        logmsg(LOG_WARNING, "plugin: Failed to put plugin socket into non-blocking mode for plugin '%s', %s\n", p->name, strerror(errno));
+        goto fail;
+    }
 
-            p->status = PLUGIN_LOADED;
-            return fds[0];
+    p->status = PLUGIN_LOADED;
+    p->start_time = timer_now();
+    return fds[0];
 
-            fail:
-                close(fds[0]);
-                if(kill(p->pid, SIGTERM) < 0){
-                    logmsg(LOG_ERR, "plugin: Could not send SIGTERM to failed plugin\n");
-                    _exit(-1);
-                }
-                p->status = PLUGIN_UNLOADED;
-                return -1;
-    }
+    fail:
+        close(fds[0]);
+        plugin_rings_destroy(p);
+        if(kill(p->pid, SIGTERM) < 0){
+            logmsg(LOG_ERR, "plugin: Could not send SIGTERM to failed plugin\n");
+            _exit(-1);
+        }
+        p->status = PLUGIN_UNLOADED;
+        return -1;
 }
 
 int plugin_load_all(){
@@ -132,6 +427,26 @@ int plugin_unload(struct plugin* p){
         logmsg(LOG_WARNING, "plugin: Attempted to unload already unloaded plugin '%s'\n", p->name);
         return 0;
     }
+    //Plugins waiting on the supervisor have nothing left to clean up
+    if(p->status == PLUGIN_RESTARTING || p->status == PLUGIN_QUARANTINED){
+        supervisor_cancel(p);
+        p->status = PLUGIN_UNLOADED;
+        return 0;
+    }
+    //Shared plugins have no process or socket, only a handle
+    if(p->type == PLUGIN_TYPE_SHARED){
+        if(p->abi->shutdown != NULL){
+            plugin_shared_current = p;
+            p->abi->shutdown(p->ctx);
+            plugin_shared_current = NULL;
+        }
+        dlclose(p->handle);
+        p->handle = NULL;
+        p->abi = NULL;
+        p->ctx = NULL;
+        p->status = PLUGIN_UNLOADED;
+        return 0;
+    }
     //If PLUGIN_LOADED, we need to kill the process.
     if(p->status == PLUGIN_LOADED){
         if(kill(p->pid, SIGTERM) < 0){
@@ -154,6 +469,16 @@ int plugin_unload(struct plugin* p){
     p->sock = -1;
     p->status = PLUGIN_UNLOADED;
 
+    //Anything still batched for this plugin can no longer be delivered
+    timer_disarm(&p->batch_timer);
+    for(size_t i = 0; i < p->batch_count; i++){
+        free(p->batch[i].buf);
+    }
+    p->batch_count = 0;
+    p->batch_offset = 0;
+
+    plugin_rings_destroy(p);
+
     return 0;
 }
 
@@ -194,46 +519,576 @@ int plugin_reload_all(){
     return -1;
 }
 
-json_t* plugin_recv(struct plugin* p){
-    json_error_t error;
-    json_t* obj = json_loadfd(p->sock, JSON_DISABLE_EOF_CHECK, &error);
-    //This covers malformed messages, and since the sockets are non-blocking, I
-    //*think* it covers hanging plugins as well (reads returning EAGAIN/EWOULDBLOCK).
-    if(obj == NULL){
-        logmsg(LOG_WARNING, "plugin: jansson error %d", json_error_code(&error));
+json_t* plugin_recv_ring(struct plugin* p){
+    //The socket only carries wake-ups, of which any number may have piled up
+    char bell[PLUGIN_BELL_SIZE];
+    while(read(p->sock, bell, PLUGIN_BELL_SIZE) > 0);
+
+    //Every record is taken off the ring, even those that can't be used, so that the ring keeps moving
+    while(true){
+        ssize_t len = ring_next_size(p->ring_rx);
+        //Make sure the plugin wakes us up when it writes again, unless it already has
+        if(len == 0 && (ring_sleep(p->ring_rx) || (len = ring_next_size(p->ring_rx)) == 0)){
+            return NULL;
+        }
+        if(len == -1){
+            goto corrupt;
+        }
+
+        char* buf = malloc(len);
+        if(buf == NULL){
+            logmsg(LOG_WARNING, "plugin: Discarding message from plugin '%s', the system is out of memory\n", p->name);
+            if(ring_skip(p->ring_rx) == -2){
+                goto corrupt;
+            }
+            continue;
+        }
+        if(ring_read(p->ring_rx, buf, len) != len){
+            free(buf);
+            goto corrupt;
+        }
+        capture(CAPTURE_PLUGIN_IN, p->name, buf, len);
+
+        json_error_t error;
+        json_t* obj = json_loadb(buf, len, 0, &error);
+        free(buf);
+        if(obj != NULL){
+            return obj;
+        }
         logmsg(LOG_WARNING, "plugin: %s at Line: %d, Column: %d in message sent by plugin '%s'\n", error.text, error.line, error.column, p->name);
-        //logmsg(LOG_WARNING, "plugin: Restarting plugin '%s'\n", p->name);
-        //plugin_reload(p);
+    }
+
+    corrupt:
+        logmsg(LOG_WARNING, "plugin: Plugin '%s' corrupted its shared memory ring\n", p->name);
         logmsg(LOG_WARNING, "plugin: Unloading plugin '%s' due to error\n", p->name);
         plugin_unload(p);
         return NULL;
+}
+
+json_t* plugin_recv(struct plugin* p){
+    if(p->transport == PLUGIN_TRANSPORT_SHM){
+        return plugin_recv_ring(p);
+    }
+
+    while(true){
+        //Plugins may separate messages however they like
+        size_t skip = 0;
+        while(skip < p->recv_len && isspace((unsigned char)p->recv_buf[skip])){
+            skip++;
+        }
+        memmove(p->recv_buf, p->recv_buf + skip, p->recv_len - skip);
+        p->recv_len -= skip;
+
+        if(p->recv_len > 0){
+            json_error_t error;
+            json_t* obj = json_loadb(p->recv_buf, p->recv_len, JSON_DISABLE_EOF_CHECK, &error);
+            if(obj != NULL){
+                capture(CAPTURE_PLUGIN_IN, p->name, p->recv_buf, error.position);
+                //With JSON_DISABLE_EOF_CHECK, position is the number of bytes that made up the message
+                memmove(p->recv_buf, p->recv_buf + error.position, p->recv_len - error.position);
+                p->recv_len -= error.position;
+
+                if(LOG_ENABLED(LOG_DEBUG)){
+                    char* plain = json_dumps(obj, JSON_COMPACT);
+                    logmsg(LOG_DEBUG, "plugin: Received message from plugin '%s':\n%s\n", p->name, plain);
+                    free(plain);
+                }
+
+                return obj;
+            }
+            //Anything but a message that hasn't been received in full yet is the plugin's fault
+            if(json_error_code(&error) != json_error_premature_end_of_input){
+                logmsg(LOG_WARNING, "plugin: %s at Line: %d, Column: %d in message sent by plugin '%s'\n", error.text, error.line, error.column, p->name);
+                logmsg(LOG_WARNING, "plugin: Unloading plugin '%s' due to error\n", p->name);
+                plugin_unload(p);
+                return NULL;
+            }
+            if(p->recv_len == PLUGIN_RECV_SIZE){
+                logmsg(LOG_WARNING, "plugin: Plugin '%s' sent a message larger than %d bytes\n", p->name, PLUGIN_RECV_SIZE);
+                logmsg(LOG_WARNING, "plugin: Unloading plugin '%s' due to error\n", p->name);
+                plugin_unload(p);
+                return NULL;
+            }
+        }
+
+        ssize_t ret = read(p->sock, p->recv_buf + p->recv_len, PLUGIN_RECV_SIZE - p->recv_len);
+        //The plugin is most likely exiting; stop polling its socket, and leave the rest to the supervisor
+        if(ret == 0){
+            logmsg(LOG_WARNING, "plugin: Plugin '%s' closed its socket\n", p->name);
+            watch_remove(p->sock);
+            return NULL;
+        }
+        if(ret == -1){
+            switch(errno){
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                case EAGAIN:
+                    return NULL;
+                case EINTR:
+                    continue;
+                default:
+                    logmsg(LOG_WARNING, "plugin: Unable to read messages from plugin '%s', %s\n", p->name, strerror(errno));
+                    logmsg(LOG_WARNING, "plugin: Unloading plugin '%s' due to error\n", p->name);
+                    plugin_unload(p);
+                    return NULL;
+            }
+        }
+        p->recv_len += ret;
+    }
+}
+
+size_t plugin_acl_key(char* buf, const char* network, const char* channel){
+    size_t network_size = strlen(network) + 1;
+    size_t channel_size = strlen(channel) + 1;
+    if(network_size + channel_size > PLUGIN_ACL_KEY_SIZE){
+        return 0;
     }
-    
-    char* plain = json_dumps(obj, JSON_INDENT(4));
-    logmsg(LOG_DEBUG, "plugin: Received message from plugin '%s':\n%s\n", p->name, plain);
-    free(plain);
 
-    return obj;
+    memcpy(buf, network, network_size);
+    memcpy(buf + network_size, channel, channel_size);
+
+    return network_size + channel_size;
 }
 
-int plugin_send(struct plugin* p, struct ircmsg* msg){
-    json_t* obj = ircmsg_to_json(msg);
-    if(obj == NULL){
+bool plugin_acl_allows(const struct htable* acl, const char* network, const char* channel){
+    if(htable_lookup(acl, (uint8_t*)network, strlen(network)+1) != NULL){
+        return true;
+    }
+
+    char key[PLUGIN_ACL_KEY_SIZE];
+    size_t key_size = plugin_acl_key(key, network, channel);
+
+    return key_size > 0 && htable_lookup(acl, (uint8_t*)key, key_size) != NULL;
+}
+
+bool plugin_can_read(const struct plugin* p, const struct network* n, const struct ircmsg* msg){
+    //Networks without a plugins section place no restrictions on plugins
+    if(htable_get_mapping_count(n->plugins) == 0){
+        return true;
+    }
+    if(msg == NULL || htable_lookup(n->plugins, (uint8_t*)p->name, strlen(p->name)+1) == NULL){
+        return false;
+    }
+
+    switch(msg->type){
+        case PRIVMSG:
+            if(msg->privmsg->is_pm){
+                return htable_lookup(p->private_messages, (uint8_t*)n->name, strlen(n->name)+1) != NULL;
+            }
+            return plugin_acl_allows(p->input, n->name, msg->privmsg->target);
+        case JOIN:
+            return plugin_acl_allows(p->input, n->name, msg->join->channel);
+        default:
+            return true;
+    }
+}
+
+bool plugin_can_write(const struct plugin* p, const struct network* n, const char* target){
+    if(htable_get_mapping_count(n->plugins) == 0){
+        return true;
+    }
+
+    if(!isupport_is_channel(&n->isupport, target)){
+        return htable_lookup(p->private_messages, (uint8_t*)n->name, strlen(n->name)+1) != NULL;
+    }
+
+    return plugin_acl_allows(p->output, n->name, target);
+}
+
+void plugin_rate_timeout(void* arg){
+    struct plugin* p = arg;
+
+    struct item* itm = queue_dequeue(p->outbox);
+    if(itm == NULL){
+        p->rate_token = true;
+        return;
+    }
+
+    //Items hold the message's correlation id, then the network's name, then the message
+    uint64_t id;
+    memcpy(&id, itm->value, sizeof(id));
+    const char* network = (char*)itm->value + sizeof(id);
+    size_t network_size = strlen(network) + 1;
+
+    //The network may have gone away while the message waited
+    struct network* n = htable_lookup(rc_network, (uint8_t*)network, network_size);
+    if(n != NULL && irc_send(n, (char*)network + network_size, itm->size - sizeof(id) - network_size) == 0){
+        trace_queued(id, p, n);
+    }
+    free(itm);
+
+    timer_arm(&p->rate_timer, p->rate_limit);
+}
+
+/**
+ * The channels a plugin asked about that it's allowed to know about.
+ */
+struct plugin_query_channels{
+    const struct plugin* p;
+    const struct network* n;
+    json_t* channels;
+};
+
+/**
+ * Adds a member to the object answering a members query.
+ */
+void plugin_query_member(void* arg, const char* nick, const char* prefixes){
+    json_object_set_new(arg, nick, json_string(prefixes));
+}
+
+/**
+ * Adds a channel to the object answering a channels query, if the plugin may
+ * read from it.
+ */
+void plugin_query_channel(void* arg, const char* channel, const char* prefixes){
+    struct plugin_query_channels* q = arg;
+    if(htable_get_mapping_count(q->n->plugins) == 0 || plugin_acl_allows(q->p->input, q->n->name, channel)){
+        json_object_set_new(q->channels, channel, json_string(prefixes));
+    }
+}
+
+int plugin_query(struct plugin* p, json_t* obj){
+    const char* query = NULL;
+    const char* network = NULL;
+    const char* name = NULL;
+    json_error_t error;
+
+    if(json_unpack_ex(obj, &error, 0, "{s:s, s:s}", "query", &query, "network", &network) == -1){
+        logmsg(LOG_WARNING, "plugin: Discarding malformed query from plugin '%s', %s\n", p->name, error.text);
         return -2;
     }
 
-    char* plain = json_dumps(obj, JSON_INDENT(4));
-    logmsg(LOG_DEBUG, "plugin: Sending message to plugin '%s':\n%s\n", p->name, plain);
-    free(plain);
+    struct network* n = htable_lookup(rc_network, (uint8_t*)network, strlen(network)+1);
+    if(n == NULL){
+        logmsg(LOG_WARNING, "plugin: Plugin '%s' queried unknown network '%s'\n", p->name, network);
+        return -2;
+    }
 
-    int ret = json_dumpfd(obj, p->sock, JSON_COMPACT);
-    if(ret == -1){
-        logmsg(LOG_WARNING, "plugin: Unable to send message to plugin '%s'\n", p->name);
-        //logmsg(LOG_WARNING, "plugin: Restarting plugin '%s'\n", p->name);
-        //plugin_reload(p);
+    json_t* result = NULL;
+    json_t* reply = NULL;
+    if(strcmp(query, "members") == 0 && json_unpack_ex(obj, &error, 0, "{s:s}", "channel", &name) == 0){
+        if(htable_get_mapping_count(n->plugins) > 0 && !plugin_acl_allows(p->input, n->name, name)){
+            logmsg(LOG_WARNING, "plugin: Plugin '%s' is not allowed to query '%s' on network '%s'\n", p->name, name, network);
+            return -2;
+        }
+
+        result = json_object();
+        if(result != NULL && state_members(n, name, plugin_query_member, result) == -1){
+            json_decref(result);
+            result = json_null();
+        }
+        reply = json_pack("{s:s, s:s, s:s, s:o?}", "query", query, "network", network, "channel", name, "members", result);
+    }
+    else if(strcmp(query, "channels") == 0 && json_unpack_ex(obj, &error, 0, "{s:s}", "nick", &name) == 0){
+        struct plugin_query_channels q = {.p = p, .n = n, .channels = json_object()};
+        result = q.channels;
+        if(result != NULL){
+            state_channels(n, name, plugin_query_channel, &q);
+        }
+        reply = json_pack("{s:s, s:s, s:s, s:o?}", "query", query, "network", network, "nick", name, "channels", result);
+    }
+    else{
+        logmsg(LOG_WARNING, "plugin: Discarding malformed query from plugin '%s'\n", p->name);
+        return -2;
+    }
+
+    char* buf = NULL;
+    if(result == NULL || reply == NULL || (buf = json_dumps(reply, JSON_COMPACT)) == NULL){
+        logmsg(LOG_WARNING, "plugin: Could not answer query from plugin '%s', the system is out of memory\n", p->name);
+        json_decref(reply);
+        return -1;
+    }
+    json_decref(reply);
+
+    return plugin_queue(p, buf, strlen(buf), 0);
+}
+
+int plugin_send_line(struct plugin* p, struct network* n, const char* msg, size_t len, uint64_t id){
+    int ret = 0;
+    if(p->rate_limit == 0){
+        ret = irc_send(n, (char*)msg, len);
+        if(ret == 0){
+            trace_queued(id, p, n);
+        }
+    }
+    //Nothing is waiting ahead of this message, and the plugin hasn't sent anything recently
+    else if(p->rate_token && queue_get_size(p->outbox) == 0){
+        p->rate_token = false;
+        timer_arm(&p->rate_timer, p->rate_limit);
+        ret = irc_send(n, (char*)msg, len);
+        if(ret == 0){
+            trace_queued(id, p, n);
+        }
+    }
+    else if(queue_get_size(p->outbox) >= PLUGIN_OUTBOX_MAX){
+        logmsg(LOG_WARNING, "plugin: Discarding message from plugin '%s', it has exceeded its rate limit by %d messages\n", p->name, PLUGIN_OUTBOX_MAX);
+        ret = -1;
+    }
+    else{
+        size_t network_size = strlen(n->name) + 1;
+        char* buf = malloc(sizeof(id) + network_size + len);
+        if(buf == NULL){
+            logmsg(LOG_WARNING, "plugin: Could not queue message from plugin '%s', the system is out of memory\n", p->name);
+            return -1;
+        }
+        memcpy(buf, &id, sizeof(id));
+        memcpy(buf + sizeof(id), n->name, network_size);
+        memcpy(buf + sizeof(id) + network_size, msg, len);
+
+        ret = queue_enqueue(p->outbox, buf, sizeof(id) + network_size + len);
+        free(buf);
+    }
+
+    return ret;
+}
+
+int plugin_dispatch(struct plugin* p, json_t* obj){
+    //Replies that echo the id of the message they answer are traced the rest of the way
+    uint64_t id = 0;
+    json_t* id_obj = json_object_get(obj, "id");
+    if(json_is_integer(id_obj) && json_integer_value(id_obj) > 0){
+        id = json_integer_value(id_obj);
+    }
+    PROBE2(frame_received, p->name, id);
+
+    if(json_object_get(obj, "query") != NULL){
+        return plugin_query(p, obj);
+    }
+
+    //The network decides how long the line may be
+    const char* network = json_string_value(json_object_get(obj, "network"));
+    struct network* n = network == NULL ? NULL : htable_lookup(rc_network, (uint8_t*)network, strlen(network)+1);
+    if(network != NULL && n == NULL){
+        logmsg(LOG_WARNING, "plugin: Plugin '%s' attempted to send a message to unknown network '%s'\n", p->name, network);
+        return -2;
+    }
+
+    const char* target = NULL;
+    char* msg = ircmsg_from_json(obj, &network, &target, n == NULL ? IRCMSG_SIZE_MAX : n->isupport.linelen);
+    if(msg == NULL){
+        logmsg(LOG_WARNING, "plugin: Discarding malformed message from plugin '%s'\n", p->name);
+        return -2;
+    }
+    size_t len = strlen(msg);
+
+    if(!plugin_can_write(p, n, target)){
+        logmsg(LOG_WARNING, "plugin: Plugin '%s' is not allowed to send messages to '%s' on network '%s'\n", p->name, target, network);
+        free(msg);
+        return -2;
+    }
+
+    if(id != 0 && !trace_reply(id, p)){
+        id = 0;
+    }
+
+    int ret = plugin_send_line(p, n, msg, len, id);
+    free(msg);
+    return ret;
+}
+
+/**
+ * Counts a message as written to a plugin, and records how long it waited.
+ */
+void plugin_delivered(struct plugin* p, const struct plugin_frame* frame){
+    p->metrics.delivered++;
+    metrics_observe(&p->metrics.ipc_latency, metrics_now() - frame->queued_at);
+    if(frame->trace != 0){
+        trace_written(frame->trace);
+    }
+}
+
+int plugin_flush_ring(struct plugin* p){
+    size_t done = 0;
+    int ret = 0;
+    for(; done < p->batch_count; done++){
+        //A message that can never fit in the ring would stall it forever
+        if(p->batch[done].len + sizeof(uint32_t) > p->ring_tx->size){
+            logmsg(LOG_WARNING, "plugin: Discarding message for plugin '%s', it is larger than the shared memory ring\n", p->name);
+            p->metrics.dropped++;
+        }
+        else if((ret = ring_write(p->ring_tx, p->batch[done].buf, p->batch[done].len)) < 0){
+            break;
+        }
+        else{
+            plugin_delivered(p, &p->batch[done]);
+        }
+        free(p->batch[done].buf);
+    }
+
+    memmove(p->batch, p->batch + done, (p->batch_count - done) * sizeof(struct plugin_frame));
+    p->batch_count -= done;
+
+    if(ret == -2){
+        logmsg(LOG_WARNING, "plugin: Plugin '%s' corrupted its shared memory ring\n", p->name);
         logmsg(LOG_WARNING, "plugin: Unloading plugin '%s' due to error\n", p->name);
         plugin_unload(p);
+        return -1;
+    }
+
+    //Only pay for a system call if the plugin went to sleep waiting for input
+    if(done > 0 && ring_wake(p->ring_tx)){
+        char bell = 0;
+        if(write(p->sock, &bell, 1) == -1 && errno != EAGAIN && errno != EWOULDBLOCK){
+            logmsg(LOG_WARNING, "plugin: Unable to wake plugin '%s', %s\n", p->name, strerror(errno));
+            logmsg(LOG_WARNING, "plugin: Unloading plugin '%s' due to error\n", p->name);
+            plugin_unload(p);
+            return -1;
+        }
+    }
+
+    //The ring is full; give the plugin some time to catch up
+    if(p->batch_count > 0){
+        logmsg(LOG_DEBUG, "plugin: Shared memory ring for plugin '%s' is full, retrying in %d milliseconds\n", p->name, PLUGIN_RETRY_DELAY);
+        timer_arm(&p->batch_timer, PLUGIN_RETRY_DELAY);
+    }
+
+    return 0;
+}
+
+int plugin_flush(struct plugin* p){
+    timer_disarm(&p->batch_timer);
+
+    if(p->transport == PLUGIN_TRANSPORT_SHM){
+        return plugin_flush_ring(p);
+    }
+
+    while(p->batch_count > 0){
+        struct iovec iov[PLUGIN_IOV_MAX];
+        size_t iovcnt = 0;
+        for(; iovcnt < p->batch_count && iovcnt < PLUGIN_IOV_MAX; iovcnt++){
+            iov[iovcnt].iov_base = p->batch[iovcnt].buf;
+            iov[iovcnt].iov_len = p->batch[iovcnt].len;
+        }
+        //Skip whatever was written of the first frame by a previous partial write
+        iov[0].iov_base = p->batch[0].buf + p->batch_offset;
+        iov[0].iov_len -= p->batch_offset;
+
+        ssize_t ret = writev(p->sock, iov, iovcnt);
+        if(ret == -1){
+            switch(errno){
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                case EAGAIN:
+                    logmsg(LOG_DEBUG, "plugin: Write to plugin '%s' would block, retrying in %d milliseconds\n", p->name, PLUGIN_RETRY_DELAY);
+                    timer_arm(&p->batch_timer, PLUGIN_RETRY_DELAY);
+                    return 0;
+                case EINTR:
+                    continue;
+                default:
+                    logmsg(LOG_WARNING, "plugin: Unable to send messages to plugin '%s', %s\n", p->name, strerror(errno));
+                    logmsg(LOG_WARNING, "plugin: Unloading plugin '%s' due to error\n", p->name);
+                    plugin_unload(p);
+                    return -1;
+            }
+        }
+
+        //Discard every frame that was written in full, and remember how much of the next one was written
+        size_t written = (size_t)ret + p->batch_offset;
+        size_t done = 0;
+        while(done < p->batch_count && written >= p->batch[done].len){
+            written -= p->batch[done].len;
+            plugin_delivered(p, &p->batch[done]);
+            free(p->batch[done].buf);
+            done++;
+        }
+
+        memmove(p->batch, p->batch + done, (p->batch_count - done) * sizeof(struct plugin_frame));
+        p->batch_count -= done;
+        p->batch_offset = written;
     }
 
     return 0;
 }
+
+int plugin_queue(struct plugin* p, char* buf, size_t len, uint64_t trace){
+    //If the batch is full, try to make room before giving up on the message
+    if(p->batch_count == rc_praetor->batch_size){
+        plugin_flush(p);
+        if(p->status != PLUGIN_LOADED || p->batch_count == rc_praetor->batch_size){
+            logmsg(LOG_WARNING, "plugin: Discarding message for plugin '%s', its message batch is full\n", p->name);
+            p->metrics.dropped++;
+            free(buf);
+            return -1;
+        }
+    }
+
+    p->batch[p->batch_count].buf = buf;
+    p->batch[p->batch_count].len = len;
+    p->batch[p->batch_count].queued_at = metrics_now();
+    p->batch[p->batch_count].trace = trace;
+    p->batch_count++;
+    capture(CAPTURE_PLUGIN_OUT, p->name, buf, len);
+
+    if(p->batch_count == rc_praetor->batch_size){
+        return plugin_flush(p);
+    }
+
+    if(rc_praetor->batch_delay > 0 && !timer_armed(&p->batch_timer)){
+        timer_arm(&p->batch_timer, rc_praetor->batch_delay);
+    }
+
+    return 0;
+}
+
+int plugin_send(struct plugin* p, struct ircmsg* msg){
+    if(p->type == PLUGIN_TYPE_SHARED){
+        PROBE2(event_dispatched, p->name, (uint64_t)0);
+        plugin_shared_current = p;
+        p->abi->on_event(p->ctx, msg);
+        plugin_shared_current = NULL;
+        p->metrics.delivered++;
+        return 0;
+    }
+
+    json_t* obj = ircmsg_to_json(msg);
+    if(obj == NULL){
+        return -2;
+    }
+
+    //Messages read from a network carry an id, which plugins echo in their replies
+    uint64_t id = 0;
+    if(msg->recv_at != 0){
+        id = trace_start(msg->recv_at);
+        json_object_set_new(obj, "id", json_integer(id));
+    }
+
+    char* buf = json_dumps(obj, JSON_COMPACT);
+    json_decref(obj);
+    if(buf == NULL){
+        logmsg(LOG_WARNING, "plugin: Unable to serialize message for plugin '%s', the system is out of memory\n", p->name);
+        p->metrics.dropped++;
+        return -1;
+    }
+
+    logmsg(LOG_DEBUG, "plugin: Sending message to plugin '%s':\n%s\n", p->name, buf);
+    PROBE2(event_dispatched, p->name, id);
+
+    return plugin_queue(p, buf, strlen(buf), id);
+}
+
+int plugin_send_raw(struct plugin* p, const char* network, const char* line, size_t len){
+    PROBE2(event_dispatched, p->name, (uint64_t)0);
+    if(p->type == PLUGIN_TYPE_SHARED){
+        plugin_shared_current = p;
+        p->abi->on_raw(p->ctx, network, line, len);
+        plugin_shared_current = NULL;
+        p->metrics.delivered++;
+        return 0;
+    }
+
+    size_t network_len = strlen(network);
+    char* buf = malloc(network_len + 1 + len);
+    if(buf == NULL){
+        logmsg(LOG_WARNING, "plugin: Unable to send raw line to plugin '%s', the system is out of memory\n", p->name);
+        p->metrics.dropped++;
+        return -1;
+    }
+
+    memcpy(buf, network, network_len);
+    buf[network_len] = ' ';
+    memcpy(buf + network_len + 1, line, len);
+
+    return plugin_queue(p, buf, network_len + 1 + len, 0);
+}
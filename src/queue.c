@@ -19,6 +19,8 @@
 struct queue{
     struct item* head;
     struct item* tail;
+    //The link pointing at the tail, either head or the next of the item before it
+    struct item** tail_link;
     size_t size;
 };
 
@@ -31,13 +33,14 @@ struct queue* queue_create(){
 
     q->head = NULL;
     q->tail = NULL;
+    q->tail_link = &q->head;
     q->size = 0;
 
     return q;
 }
 
 void queue_destroy(struct queue* q){
-    if(q->head == NULL){
+    if(q == NULL){
         return;
     }
 
@@ -65,9 +68,11 @@ int queue_enqueue(struct queue* q, const void* value, size_t size){
     if(q->head == NULL){
         q->head = itm;
         q->tail = itm;
+        q->tail_link = &q->head;
     }
     else{
         q->tail->next = itm;
+        q->tail_link = &q->tail->next;
         q->tail = itm;
     }
     
@@ -83,8 +88,16 @@ struct item* queue_dequeue(struct queue* q){
 
     struct item* itm = q->head;
     q->head = q->head->next;
+    if(q->head == NULL){
+        q->tail = NULL;
+    }
+    if(q->tail_link == &itm->next){
+        q->tail_link = &q->head;
+    }
     itm->next = NULL;
 
+    q->size--;
+
     return itm;
 }
 
@@ -106,6 +119,53 @@ struct item* queue_peek(struct queue* q){
     return itm;
 }
 
+struct item* queue_peek_tail(struct queue* q){
+    if(q->tail == NULL){
+        return NULL;
+    }
+
+    struct item* itm = malloc(sizeof(struct item) + q->tail->size);
+    if(itm == NULL){
+        logmsg(LOG_DEBUG, "queue: Could not allocate enough memory for a queue peek\n");
+        return NULL;
+    }
+
+    memcpy(itm->value, q->tail->value, q->tail->size);
+    itm->size = q->tail->size;
+    itm->next = NULL;
+
+    return itm;
+}
+
+int queue_replace_tail(struct queue* q, const void* value, size_t size){
+    if(q->tail == NULL){
+        return -1;
+    }
+
+    struct item* itm = realloc(q->tail, sizeof(struct item) + size);
+    if(itm == NULL){
+        logmsg(LOG_DEBUG, "queue: Could not allocate enough memory to replace queue item\n");
+        return -1;
+    }
+
+    memcpy(itm->value, value, size);
+    itm->size = size;
+    *q->tail_link = itm;
+    q->tail = itm;
+
+    return 0;
+}
+
+int queue_foreach(const struct queue* q, int (*fn)(void* arg, const uint8_t* value, size_t size), void* arg){
+    for(const struct item* itm = q->head; itm != NULL; itm = itm->next){
+        if(fn(arg, itm->value, itm->size) == -1){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 size_t queue_get_size(struct queue* q){
     return q->size;
 }
@@ -0,0 +1,283 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "ring.h"
+
+#define RING_NAME_SIZE 64
+#define RING_SIZE_MAX 0x40000000
+
+//Used to give every segment created by this process a unique name
+unsigned int ring_counter = 0;
+
+struct ring* ring_map(int fd, size_t map_size){
+    struct ring* r = malloc(sizeof(struct ring));
+    if(r == NULL){
+        logmsg(LOG_WARNING, "ring: Could not map ring, the system is out of memory\n");
+        return NULL;
+    }
+
+    void* addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(addr == MAP_FAILED){
+        logmsg(LOG_WARNING, "ring: Could not map ring, %s\n", strerror(errno));
+        free(r);
+        return NULL;
+    }
+
+    r->hdr = addr;
+    r->data = (uint8_t*)addr + sizeof(struct ring_header);
+    r->fd = fd;
+    r->map_size = map_size;
+
+    return r;
+}
+
+struct ring* ring_create(size_t size){
+    if(size == 0 || size > RING_SIZE_MAX){
+        logmsg(LOG_WARNING, "ring: Could not create ring, invalid size %zu\n", size);
+        return NULL;
+    }
+
+    size_t data_size = 1;
+    while(data_size < size){
+        data_size <<= 1;
+    }
+
+    //POSIX shared memory objects need a name, but we only ever share this one by file descriptor
+    char name[RING_NAME_SIZE];
+    snprintf(name, RING_NAME_SIZE, "/praetor-%ld-%u", (long)getpid(), ring_counter++);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if(fd == -1){
+        logmsg(LOG_WARNING, "ring: Could not create shared memory segment, %s\n", strerror(errno));
+        return NULL;
+    }
+    shm_unlink(name);
+
+    size_t map_size = sizeof(struct ring_header) + data_size;
+    if(ftruncate(fd, map_size) == -1){
+        logmsg(LOG_WARNING, "ring: Could not size shared memory segment, %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    struct ring* r = ring_map(fd, map_size);
+    if(r == NULL){
+        close(fd);
+        return NULL;
+    }
+
+    r->hdr->magic = RING_MAGIC;
+    r->hdr->size = data_size;
+    r->size = data_size;
+    atomic_init(&r->hdr->head, 0);
+    atomic_init(&r->hdr->tail, 0);
+    atomic_init(&r->hdr->waiting, 0);
+
+    return r;
+}
+
+struct ring* ring_attach(int fd){
+    struct stat st;
+    if(fstat(fd, &st) == -1){
+        logmsg(LOG_WARNING, "ring: Could not attach to ring, %s\n", strerror(errno));
+        return NULL;
+    }
+    if((size_t)st.st_size <= sizeof(struct ring_header)){
+        logmsg(LOG_WARNING, "ring: Could not attach to ring, shared memory segment is too small\n");
+        return NULL;
+    }
+
+    struct ring* r = ring_map(fd, st.st_size);
+    if(r == NULL){
+        return NULL;
+    }
+
+    //The size is read once, since the other process could change it between reads
+    r->size = r->hdr->size;
+    if(r->hdr->magic != RING_MAGIC || r->size == 0 || (r->size & (r->size - 1)) != 0 || sizeof(struct ring_header) + r->size != r->map_size){
+        logmsg(LOG_WARNING, "ring: Could not attach to ring, shared memory segment does not hold a ring\n");
+        munmap(r->hdr, r->map_size);
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+void ring_destroy(struct ring* r){
+    if(r == NULL){
+        return;
+    }
+
+    munmap(r->hdr, r->map_size);
+    close(r->fd);
+    free(r);
+}
+
+/**
+ * Returns whether the other process has corrupted the ring, given where it
+ * says its head and tail are: by changing the ring's size, or by moving its
+ * head or tail so that more than the whole ring is in use.
+ */
+bool ring_corrupt(const struct ring* r, uint32_t head, uint32_t tail){
+    return r->hdr->size != r->size || (uint32_t)(head - tail) > r->size;
+}
+
+//Copies len bytes into the ring at position pos, wrapping around the end of the data area
+void ring_copy_in(struct ring* r, uint32_t pos, const void* buf, size_t len){
+    uint32_t offset = pos & (r->size - 1);
+    size_t first = r->size - offset;
+    if(first >= len){
+        memcpy(r->data + offset, buf, len);
+        return;
+    }
+
+    memcpy(r->data + offset, buf, first);
+    memcpy(r->data, (const uint8_t*)buf + first, len - first);
+}
+
+//Copies len bytes out of the ring from position pos, wrapping around the end of the data area
+void ring_copy_out(struct ring* r, uint32_t pos, void* buf, size_t len){
+    uint32_t offset = pos & (r->size - 1);
+    size_t first = r->size - offset;
+    if(first >= len){
+        memcpy(buf, r->data + offset, len);
+        return;
+    }
+
+    memcpy(buf, r->data + offset, first);
+    memcpy((uint8_t*)buf + first, r->data, len - first);
+}
+
+int ring_write(struct ring* r, const void* buf, size_t len){
+    uint32_t head = atomic_load_explicit(&r->hdr->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->hdr->tail, memory_order_acquire);
+    if(len == 0 || ring_corrupt(r, head, tail)){
+        return -2;
+    }
+
+    size_t needed = sizeof(uint32_t) + len;
+    if(needed > r->size - (uint32_t)(head - tail)){
+        return -1;
+    }
+
+    uint32_t record_len = len;
+    ring_copy_in(r, head, &record_len, sizeof(record_len));
+    ring_copy_in(r, head + sizeof(record_len), buf, len);
+
+    atomic_store_explicit(&r->hdr->head, head + needed, memory_order_release);
+
+    return 0;
+}
+
+/**
+ * Reads the length of the record at \c tail into \c record_len.
+ *
+ * \return 0 on success.
+ * \return -1 if the ring is corrupt, or the record is empty or runs past
+ *         \c head.
+ */
+int ring_record_len(struct ring* r, uint32_t head, uint32_t tail, uint32_t* record_len){
+    uint32_t used = head - tail;
+    if(ring_corrupt(r, head, tail) || used < sizeof(uint32_t)){
+        return -1;
+    }
+
+    ring_copy_out(r, tail, record_len, sizeof(*record_len));
+    if(*record_len == 0 || *record_len > used - sizeof(uint32_t)){
+        return -1;
+    }
+
+    return 0;
+}
+
+ssize_t ring_next_size(struct ring* r){
+    uint32_t tail = atomic_load_explicit(&r->hdr->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+    if(head == tail){
+        return 0;
+    }
+
+    uint32_t record_len;
+    if(ring_record_len(r, head, tail, &record_len) == -1){
+        return -1;
+    }
+
+    return record_len;
+}
+
+ssize_t ring_read(struct ring* r, void* buf, size_t len){
+    uint32_t tail = atomic_load_explicit(&r->hdr->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+    if(head == tail){
+        return 0;
+    }
+
+    uint32_t record_len;
+    if(ring_record_len(r, head, tail, &record_len) == -1){
+        return -2;
+    }
+    if(record_len > len){
+        return -1;
+    }
+
+    ring_copy_out(r, tail + sizeof(record_len), buf, record_len);
+    atomic_store_explicit(&r->hdr->tail, tail + sizeof(record_len) + record_len, memory_order_release);
+
+    return record_len;
+}
+
+ssize_t ring_skip(struct ring* r){
+    uint32_t tail = atomic_load_explicit(&r->hdr->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+    if(head == tail){
+        return 0;
+    }
+
+    uint32_t record_len;
+    if(ring_record_len(r, head, tail, &record_len) == -1){
+        return -2;
+    }
+    atomic_store_explicit(&r->hdr->tail, tail + sizeof(record_len) + record_len, memory_order_release);
+
+    return record_len;
+}
+
+bool ring_sleep(struct ring* r){
+    atomic_store(&r->hdr->waiting, 1);
+    //Pairs with the fence in ring_wake(); either we see the new record, or the producer sees us waiting
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if(atomic_load(&r->hdr->head) != atomic_load_explicit(&r->hdr->tail, memory_order_relaxed)){
+        atomic_store(&r->hdr->waiting, 0);
+        return false;
+    }
+
+    return true;
+}
+
+bool ring_wake(struct ring* r){
+    atomic_thread_fence(memory_order_seq_cst);
+
+    return atomic_exchange(&r->hdr->waiting, 0) != 0;
+}
@@ -11,40 +11,156 @@
 */
 
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/wait.h>
 
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
+
+#include "capture.h"
 #include "config.h"
+#include "control.h"
 #include "htable.h"
 #include "irc.h"
 #include "log.h"
+#include "metrics.h"
 #include "nexus.h"
 #include "plugin.h"
+#include "signals.h"
+#include "supervisor.h"
+#include "trace.h"
+#include "upgrade.h"
+#include "util.h"
 
 volatile sig_atomic_t sigchld = 0;
 volatile sig_atomic_t sighup = 0;
 volatile sig_atomic_t sigpipe = 0;
 volatile sig_atomic_t sigterm = 0;
+volatile sig_atomic_t sigusr1 = 0;
+volatile sig_atomic_t sigusr2 = 0;
+
+int signal_fd = -1;
+
+#ifndef __linux__
+//The write end of the self-pipe, whose read end is signal_fd
+int signal_pipe = -1;
+
+void signal_notify(){
+    //Whatever was interrupted may still need errno
+    int saved_errno = errno;
+    char sig = 0;
+    write(signal_pipe, &sig, 1);
+    errno = saved_errno;
+}
 
 void signal_handle_sigchld(){
     sigchld = 1;
+    signal_notify();
 }
 
 void signal_handle_sighup(){
     sighup = 1;
+    signal_notify();
 }
 
 void signal_handle_sigpipe(){
     sigpipe = 1;
+    signal_notify();
 }
 
 void signal_handle_sigterm(){
     sigterm = 1;
+    signal_notify();
+}
+
+void signal_handle_sigusr1(){
+    sigusr1 = 1;
+    signal_notify();
+}
+
+void signal_handle_sigusr2(){
+    sigusr2 = 1;
+    signal_notify();
+}
+#endif
+
+void signal_dispatch(int fd, short revents, void* arg){
+    (void)revents;
+    (void)arg;
+
+#ifdef __linux__
+    struct signalfd_siginfo info;
+    while(read(fd, &info, sizeof(info)) == sizeof(info)){
+        switch(info.ssi_signo){
+            case SIGCHLD:
+                sigchld = 1;
+                break;
+            case SIGHUP:
+                sighup = 1;
+                break;
+            case SIGPIPE:
+                sigpipe = 1;
+                break;
+            case SIGTERM:
+                sigterm = 1;
+                break;
+            case SIGUSR1:
+                sigusr1 = 1;
+                break;
+            case SIGUSR2:
+                sigusr2 = 1;
+                break;
+        }
+    }
+#else
+    //The handlers have already set the flags; the bytes only exist to wake poll()
+    char buf[64];
+    while(read(fd, buf, sizeof(buf)) > 0);
+#endif
+
+    handle_signals();
 }
 
 int signal_init(){
+    sigset_t handled;
+    sigemptyset(&handled);
+    sigaddset(&handled, SIGCHLD);
+    sigaddset(&handled, SIGHUP);
+    sigaddset(&handled, SIGPIPE);
+    sigaddset(&handled, SIGTERM);
+    sigaddset(&handled, SIGUSR1);
+    sigaddset(&handled, SIGUSR2);
+
+#ifdef __linux__
+    //Signals must be blocked to be read from a signalfd, rather than delivered, and every other thread blocks them already
+    int err = pthread_sigmask(SIG_BLOCK, &handled, NULL);
+    if(err != 0){
+        logmsg(LOG_ERR, "signals: Failed to block handled signals, %s\n", strerror(err));
+        return -1;
+    }
+
+    signal_fd = signalfd(-1, &handled, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(signal_fd == -1){
+        logmsg(LOG_ERR, "signals: Failed to create signalfd, %s\n", strerror(errno));
+        return -1;
+    }
+#else
+    int fds[2];
+    if(pipe(fds) == -1){
+        logmsg(LOG_ERR, "signals: Failed to create self-pipe, %s\n", strerror(errno));
+        return -1;
+    }
+    //A handler must never block on a full pipe
+    if(setnonblock(fds[0]) == -1 || setnonblock(fds[1]) == -1 || setcloexec(fds[0]) == -1 || setcloexec(fds[1]) == -1){
+        logmsg(LOG_ERR, "signals: Failed to set flags on self-pipe, %s\n", strerror(errno));
+        return -1;
+    }
+    signal_fd = fds[0];
+    signal_pipe = fds[1];
+
     sigset_t mask_set;
     sigfillset(&mask_set);
 
@@ -72,91 +188,60 @@ int signal_init(){
        return -1;
     }
 
-    return 0;
-}
-
-int sigchld_handler(){
-    size_t size = 0;
-    struct htable_key** plugins = htable_get_keys(rc_plugin, &size);
-    if(plugins == NULL){
-        logmsg(LOG_WARNING, "signals: Failed to load list of configured plugins\n");
-        logmsg(LOG_WARNING, "signals: There are no configured plugins, or the system is out of memory\n");
-        return -1;
+    sa.sa_handler = signal_handle_sigusr1;
+    if(sigaction(SIGUSR1, &sa, NULL) == -1){
+       logmsg(LOG_ERR, "signals: Failed to install signal handler for SIGUSR1, %s", strerror(errno));
+       return -1;
     }
 
-    int wstatus;
-    pid_t pid;
-    struct plugin* p;
-    while((pid = waitpid(-1, &wstatus, WNOHANG)) > 0){
-        for(size_t i = 0; i < size; i++){
-            p = htable_lookup(rc_plugin, plugins[i]->key, plugins[i]->key_size);
-            if(pid == p->pid){
-                if(p->status == PLUGIN_UNLOADED){
-                    logmsg(LOG_WARNING, "signals: Plugin '%s' successfully terminated via unload\n", p->name);
-                }
-                else if (p->status == PLUGIN_LOADED){
-                    logmsg(LOG_WARNING, "signals: Plugin '%s' terminated unexpectedly\n", p->name);
-                    p->status = PLUGIN_DEAD;
-                    plugin_unload(p);
-                }
-                else{
-                    //Process was waited on before, but we never cleaned it up. This should never happen.
-                    logmsg(LOG_ERR, "signals: Unable to clean-up terminated plugin '%s', exiting\n", p->name);
-                    _exit(-1);
-                }
-                goto success;
-            }
-        }
-
-        //A child died, but it wasn't a plugin. This should never happen.
-        logmsg(LOG_ERR, "signals: Child process (%d) died, but was not a mapped plugin\n", pid);
-        _exit(-1);
-
-        success:
-
-        if(WIFSIGNALED(wstatus)){
-            //if we move to SUSv4, use strsignal() here
-            logmsg(LOG_WARNING, "signals: Plugin '%s' terminated due to unhandled signal: %d\n", p->name, WTERMSIG(wstatus));
-        }
-        else if(WIFEXITED(wstatus)){
-            logmsg(LOG_WARNING, "signals: Plugin '%s' exited with status: %d\n", p->name, WEXITSTATUS(wstatus));
-        }
-        else{
-            logmsg(LOG_WARNING, "signals: Plugin '%s' was terminated via black magic\n", p->name);
-        }
-
-        p->pid = -1;
+    sa.sa_handler = signal_handle_sigusr2;
+    if(sigaction(SIGUSR2, &sa, NULL) == -1){
+       logmsg(LOG_ERR, "signals: Failed to install signal handler for SIGUSR2, %s", strerror(errno));
+       return -1;
     }
+#endif
 
-    if(pid == -1){
-        switch(errno){
-            //None of these should ever happen
-            case EINTR:
-            case EINVAL:
-                logmsg(LOG_ERR, "signal: Error on waitpid(), %s\n", strerror(errno));
-                _exit(-1);
-        }
+    if(watch_add_callback(signal_fd, false, signal_dispatch, NULL) == -1){
+        logmsg(LOG_ERR, "signals: Failed to add signal descriptor to global monitor list\n");
+        return -1;
     }
 
-    htable_key_list_free(plugins, size);
     return 0;
 }
 
+int sigchld_handler(){
+    return supervisor_reap();
+}
+
 int sighup_handler(){
-    return 0;
+    return config_reload();
 }
 
 int sigpipe_handler(){
     return 0;
 }
 
+int sigusr1_handler(){
+    trace_dump();
+    return 0;
+}
+
+int sigusr2_handler(){
+    //A failed upgrade leaves praetor running as it was, and trying again right away wouldn't help
+    upgrade_exec();
+    return 0;
+}
+
 void sigterm_handler(){
     //irc_disconnect_all();
+    capture_close();
+    metrics_close();
+    control_close();
     _exit(-1);
 }
 
 int handle_signals(){
-    sigset_t mask_set;
+    sigset_t mask_set, old_set;
     sigemptyset(&mask_set);
 
     /*
@@ -166,35 +251,56 @@ int handle_signals(){
      * possibility. If the handler does clean up the newly-terminated
      * child before the next time it's called, it'll safely return 0
      * the next time it's called.
+     *
+     * The previous mask is restored afterward, rather than unblocking these
+     * signals, since they must stay blocked when they're read from a signalfd.
      */
     sigaddset(&mask_set, SIGCHLD);
     sigaddset(&mask_set, SIGPIPE);
-    sigprocmask(SIG_BLOCK, &mask_set, NULL);
+    pthread_sigmask(SIG_BLOCK, &mask_set, &old_set);
 
+    //Every pending signal is handled, not just the first one found
+    int ret = 0;
     if(sigchld){
+        sigchld = 0;
         if(sigchld_handler() == -1){
-            return -1;
+            sigchld = 1;
+            ret = -1;
         }
-        sigchld = 0;
     }
-    else if(sighup){
+    if(sighup){
+        sighup = 0;
         if(sighup_handler() == -1){
-            return -1;
+            sighup = 1;
+            ret = -1;
         }
-        sighup = 0;
     }
-    else if(sigpipe){
+    if(sigpipe){
+        sigpipe = 0;
         if(sigpipe_handler() == -1){
-            return -1;
+            sigpipe = 1;
+            ret = -1;
+        }
+    }
+    if(sigusr1){
+        sigusr1 = 0;
+        if(sigusr1_handler() == -1){
+            sigusr1 = 1;
+            ret = -1;
         }
-        sigpipe = 0;
     }
-    else if(sigterm){
+    if(sigusr2){
+        sigusr2 = 0;
+        if(sigusr2_handler() == -1){
+            sigusr2 = 1;
+            ret = -1;
+        }
+    }
+    if(sigterm){
         sigterm_handler();
     }
 
-    sigprocmask(SIG_UNBLOCK, &mask_set, NULL);
-    sigemptyset(&mask_set);
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
 
-    return 0;
+    return ret;
 }
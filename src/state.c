@@ -0,0 +1,883 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "casemap.h"
+#include "config.h"
+#include "htable.h"
+#include "intern.h"
+#include "ircmsg.h"
+#include "log.h"
+#include "state.h"
+
+//The fewest slots a channel's member set is given
+#define STATE_SLOTS_MIN 8
+
+struct state_user;
+struct state_channel;
+
+/**
+ * A user's membership in a channel. Each membership is in its channel's member
+ * set, and in its user's list of memberships, so that a user can be removed
+ * from every channel without searching them.
+ */
+struct state_member{
+    struct state_user* user;
+    struct state_channel* channel;
+    //The user's other memberships
+    struct state_member* prev;
+    struct state_member* next;
+    //The member's prefix modes, as bits indexed by their place in prefix_modes
+    uint8_t modes;
+    //The NAMES listing the member was last seen in
+    uint8_t names;
+};
+
+struct state_user{
+    struct istr* nick;
+    //The user's username and hostname, or NULL until they're known
+    struct istr* user;
+    struct istr* host;
+    struct state_member* channels;
+};
+
+struct state_channel{
+    struct istr* name;
+    //An open-addressed set of members keyed by their user, slot_count being a power of two
+    struct state_member** slots;
+    size_t slot_count;
+    size_t member_count;
+    //Set once the channel's NAMES listing has ended
+    bool synced;
+    //The NAMES listing currently being received
+    uint8_t names;
+};
+
+struct state{
+    //How the network compares names, which users and channels are keyed under
+    enum casemapping casemapping;
+    //Users, by their casefolded nick
+    struct htable* users;
+    //Channels praetor is in, by their casefolded name
+    struct htable* channels;
+    struct state_user* me;
+    //The network's membership prefixes and channel modes, which MODE messages and NAMES replies are read with
+    const struct isupport* support;
+};
+
+/**
+ * Returns the key a name is tracked under: its interned form casefolded under
+ * the network's casemapping.
+ */
+struct istr* state_key(const struct state* s, const struct istr* name){
+    return name->folded[s->casemapping];
+}
+
+/**
+ * Returns the user whose nick casefolds to \c folded, or NULL.
+ */
+struct state_user* state_user_find(const struct state* s, const struct istr* folded){
+    return htable_lookup(s->users, (uint8_t*)&folded, sizeof(folded));
+}
+
+struct state_user* state_user_lookup(const struct state* s, const char* nick, size_t len){
+    //A nick that isn't interned can't be tracked
+    struct istr* folded = intern_find_folded(nick, len, s->casemapping);
+    return folded == NULL ? NULL : state_user_find(s, folded);
+}
+
+struct state_channel* state_channel_lookup(const struct state* s, const char* name){
+    struct istr* folded = intern_find_folded(name, strlen(name), s->casemapping);
+    return folded == NULL ? NULL : htable_lookup(s->channels, (uint8_t*)&folded, sizeof(folded));
+}
+
+/**
+ * Returns the slot at which a user's membership in a channel would begin to
+ * be searched for.
+ */
+size_t state_slot_home(const struct state_channel* c, const struct state_user* u){
+    uint64_t h = ((uintptr_t)u >> 4) * UINT64_C(0x9E3779B97F4A7C15);
+    return (size_t)(h >> 32) & (c->slot_count - 1);
+}
+
+/**
+ * Returns the slot holding a user's membership in a channel, or the empty
+ * slot where it would go.
+ */
+size_t state_slot_find(const struct state_channel* c, const struct state_user* u){
+    size_t i = state_slot_home(c, u);
+    while(c->slots[i] != NULL && c->slots[i]->user != u){
+        i = (i + 1) & (c->slot_count - 1);
+    }
+    return i;
+}
+
+/**
+ * Doubles the number of slots in a channel's member set.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory.
+ */
+int state_slots_grow(struct state_channel* c){
+    struct state_member** old = c->slots;
+    size_t old_count = c->slot_count;
+
+    c->slots = calloc(old_count * 2, sizeof(struct state_member*));
+    if(c->slots == NULL){
+        c->slots = old;
+        return -1;
+    }
+    c->slot_count = old_count * 2;
+
+    for(size_t i = 0; i < old_count; i++){
+        if(old[i] != NULL){
+            c->slots[state_slot_find(c, old[i]->user)] = old[i];
+        }
+    }
+
+    free(old);
+    return 0;
+}
+
+/**
+ * Empties a slot in a channel's member set, moving back any members that were
+ * placed past it so that none of them become unreachable.
+ */
+void state_slot_clear(struct state_channel* c, size_t i){
+    size_t mask = c->slot_count - 1;
+    c->slots[i] = NULL;
+    for(size_t j = (i + 1) & mask; c->slots[j] != NULL; j = (j + 1) & mask){
+        size_t k = state_slot_home(c, c->slots[j]->user);
+        //Members whose home lies cyclically within (i, j] are still reachable
+        if(i <= j ? (k <= i || k > j) : (k <= i && k > j)){
+            c->slots[i] = c->slots[j];
+            c->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/**
+ * Starts tracking a user, taking over a reference to their nick, which is
+ * released if the system is out of memory.
+ */
+struct state_user* state_user_add(struct state* s, struct istr* nick){
+    struct state_user* u = calloc(1, sizeof(struct state_user));
+    if(u == NULL){
+        goto fail_oom;
+    }
+    u->nick = nick;
+    if(htable_add(s->users, (uint8_t*)&nick->folded[s->casemapping], sizeof(struct istr*), u) != 0){
+        goto fail_oom;
+    }
+
+    return u;
+
+    fail_oom:
+        logmsg(LOG_WARNING, "state: Could not track user '%s', the system is out of memory\n", nick->str);
+        intern_release(nick);
+        free(u);
+        return NULL;
+}
+
+void state_user_free(struct state* s, struct state_user* u){
+    htable_remove(s->users, (uint8_t*)&u->nick->folded[s->casemapping], sizeof(struct istr*));
+
+    intern_release(u->nick);
+    intern_release(u->user);
+    intern_release(u->host);
+    free(u);
+}
+
+/**
+ * Records the username and hostname of a user, if they're not already known.
+ */
+void state_user_set_host(struct state_user* u, const char* user, const char* host){
+    if(u->user == NULL && user != NULL){
+        u->user = intern_ref(intern_handle(user));
+    }
+    if(u->host == NULL && host != NULL){
+        u->host = intern_ref(intern_handle(host));
+    }
+}
+
+/**
+ * Returns the user with the given nick, which is tracked first if it isn't
+ * already.
+ */
+struct state_user* state_user_get(struct state* s, const char* nick, size_t len){
+    struct istr* interned = intern(nick, len);
+    if(interned == NULL){
+        return NULL;
+    }
+
+    struct state_user* u = state_user_find(s, state_key(s, interned));
+    if(u != NULL){
+        intern_release(interned);
+        return u;
+    }
+    return state_user_add(s, interned);
+}
+
+/**
+ * Returns a user's membership in a channel, or NULL if they're not in it.
+ */
+struct state_member* state_member_lookup(const struct state_channel* c, const struct state_user* u){
+    return c->slots[state_slot_find(c, u)];
+}
+
+/**
+ * Adds a user to a channel, unless they're already in it.
+ *
+ * \return The user's membership in the channel.
+ * \return NULL if the system is out of memory.
+ */
+struct state_member* state_member_add(struct state_channel* c, struct state_user* u){
+    struct state_member* m = state_member_lookup(c, u);
+    if(m != NULL){
+        return m;
+    }
+
+    //Keep the set at most three quarters full
+    if((c->member_count + 1) * 4 > c->slot_count * 3 && state_slots_grow(c) == -1){
+        goto fail_oom;
+    }
+
+    m = calloc(1, sizeof(struct state_member));
+    if(m == NULL){
+        goto fail_oom;
+    }
+    m->user = u;
+    m->channel = c;
+    m->names = c->names;
+
+    m->next = u->channels;
+    if(u->channels != NULL){
+        u->channels->prev = m;
+    }
+    u->channels = m;
+
+    c->slots[state_slot_find(c, u)] = m;
+    c->member_count++;
+
+    return m;
+
+    fail_oom:
+        logmsg(LOG_WARNING, "state: Could not track '%s' in channel '%s', the system is out of memory\n", u->nick->str, c->name->str);
+        return NULL;
+}
+
+/**
+ * Removes a member from its channel. The member's user is no longer tracked
+ * once they're in no channels, unless the user is praetor.
+ */
+void state_member_remove(struct state* s, struct state_member* m){
+    struct state_user* u = m->user;
+    struct state_channel* c = m->channel;
+
+    if(m->prev != NULL){
+        m->prev->next = m->next;
+    }
+    else{
+        u->channels = m->next;
+    }
+    if(m->next != NULL){
+        m->next->prev = m->prev;
+    }
+
+    state_slot_clear(c, state_slot_find(c, u));
+    c->member_count--;
+    free(m);
+
+    if(u->channels == NULL && u != s->me){
+        state_user_free(s, u);
+    }
+}
+
+/**
+ * Removes a user from every channel, and stops tracking them. Only takes as
+ * long as the number of channels the user is in.
+ */
+void state_user_drop(struct state* s, struct state_user* u){
+    if(u->channels == NULL){
+        if(u != s->me){
+            state_user_free(s, u);
+        }
+        return;
+    }
+
+    //The user is freed along with their last membership
+    bool last = false;
+    while(!last){
+        last = u->channels->next == NULL;
+        state_member_remove(s, u->channels);
+    }
+}
+
+/**
+ * Gives a user a new nick, dropping any other user that already has it.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory.
+ */
+int state_user_rename(struct state* s, struct state_user* u, const char* nick){
+    struct istr* new_nick = intern(nick, strlen(nick));
+    if(new_nick == NULL){
+        return -1;
+    }
+
+    if(state_key(s, new_nick) != state_key(s, u->nick)){
+        struct state_user* other = state_user_find(s, state_key(s, new_nick));
+        if(other != NULL){
+            logmsg(LOG_DEBUG, "state: '%s' changed their nick to '%s', which was already in use\n", u->nick->str, nick);
+            state_user_drop(s, other);
+        }
+        if(htable_add(s->users, (uint8_t*)&new_nick->folded[s->casemapping], sizeof(struct istr*), u) != 0){
+            logmsg(LOG_WARNING, "state: Could not track nick change from '%s' to '%s', the system is out of memory\n", u->nick->str, nick);
+            intern_release(new_nick);
+            return -1;
+        }
+        htable_remove(s->users, (uint8_t*)&u->nick->folded[s->casemapping], sizeof(struct istr*));
+    }
+
+    intern_release(u->nick);
+    u->nick = new_nick;
+    return 0;
+}
+
+struct state_channel* state_channel_add(struct state* s, struct istr* name){
+    struct state_channel* c = calloc(1, sizeof(struct state_channel));
+    if(c == NULL){
+        goto fail_oom;
+    }
+    c->slots = calloc(STATE_SLOTS_MIN, sizeof(struct state_member*));
+    if(c->slots == NULL){
+        goto fail_oom;
+    }
+    c->slot_count = STATE_SLOTS_MIN;
+    if(htable_add(s->channels, (uint8_t*)&name->folded[s->casemapping], sizeof(struct istr*), c) != 0){
+        goto fail_oom;
+    }
+    c->name = intern_ref(name);
+
+    return c;
+
+    fail_oom:
+        logmsg(LOG_WARNING, "state: Could not track channel '%s', the system is out of memory\n", name->str);
+        if(c != NULL){
+            free(c->slots);
+        }
+        free(c);
+        return NULL;
+}
+
+/**
+ * Removes every member from a channel, and stops tracking it.
+ */
+void state_channel_free(struct state* s, struct state_channel* c){
+    for(size_t i = 0; i < c->slot_count && c->member_count > 0; i++){
+        //Removing a member may move another into this slot
+        while(c->slots[i] != NULL){
+            state_member_remove(s, c->slots[i]);
+        }
+    }
+
+    htable_remove(s->channels, (uint8_t*)&c->name->folded[s->casemapping], sizeof(struct istr*));
+
+    intern_release(c->name);
+    free(c->slots);
+    free(c);
+}
+
+/**
+ * Creates an empty state for a network, on which praetor has the given nick.
+ *
+ * \return The state, or NULL if the system is out of memory.
+ */
+struct state* state_create(const struct network* n, const char* nick){
+    struct state* s = calloc(1, sizeof(struct state));
+    if(s == NULL){
+        goto fail_oom;
+    }
+    s->casemapping = n->casemapping;
+    s->users = htable_create(64);
+    s->channels = htable_create(8);
+    if(s->users == NULL || s->channels == NULL){
+        goto fail_oom;
+    }
+
+    s->support = &n->isupport;
+
+    struct istr* me = intern(nick, strlen(nick));
+    if(me == NULL || (s->me = state_user_add(s, me)) == NULL){
+        goto fail;
+    }
+
+    return s;
+
+    fail_oom:
+        logmsg(LOG_WARNING, "state: Could not track network state, the system is out of memory\n");
+    fail:
+        if(s != NULL){
+            if(s->users != NULL){
+                htable_destroy(s->users);
+            }
+            if(s->channels != NULL){
+                htable_destroy(s->channels);
+            }
+        }
+        free(s);
+        return NULL;
+}
+
+void state_free(struct state* s){
+    if(s == NULL){
+        return;
+    }
+
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(s->channels, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        state_channel_free(s, htable_lookup(s->channels, keys[i]->key, keys[i]->key_size));
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    //Only praetor itself is left, unless the system ran out of memory while listing channels
+    keys = htable_get_keys(s->users, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        struct state_user* u = htable_lookup(s->users, keys[i]->key, keys[i]->key_size);
+        while(u->channels != NULL){
+            struct state_member* m = u->channels;
+            u->channels = m->next;
+            free(m);
+        }
+        intern_release(u->nick);
+        intern_release(u->user);
+        intern_release(u->host);
+        free(u);
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    htable_destroy(s->users);
+    htable_destroy(s->channels);
+    free(s);
+}
+
+/**
+ * Returns the nick of a tracked user.
+ */
+struct istr* state_user_name(const void* u){
+    return ((const struct state_user*)u)->nick;
+}
+
+/**
+ * Returns the name of a tracked channel.
+ */
+struct istr* state_channel_name(const void* c){
+    return ((const struct state_channel*)c)->name;
+}
+
+/**
+ * Returns a copy of a table of users or channels, keyed by their names
+ * casefolded under \c mapping, or NULL if two of the names fold to the same
+ * name, or the system is out of memory.
+ */
+struct htable* state_rekey(const struct htable* table, struct istr* (*name)(const void* value), enum casemapping mapping){
+    struct htable* rekeyed = htable_create(htable_get_bucket_count(table));
+    if(rekeyed == NULL){
+        return NULL;
+    }
+
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(table, &size);
+    if(keys == NULL && htable_get_mapping_count(table) > 0){
+        htable_destroy(rekeyed);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < size; i++){
+        void* value = htable_lookup(table, keys[i]->key, keys[i]->key_size);
+        struct istr* folded = name(value)->folded[mapping];
+        if(htable_add(rekeyed, (uint8_t*)&folded, sizeof(folded), value) != 0){
+            htable_destroy(rekeyed);
+            rekeyed = NULL;
+            break;
+        }
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    return rekeyed;
+}
+
+int state_set_casemapping(struct state* s, enum casemapping mapping){
+    if(mapping == s->casemapping){
+        return 0;
+    }
+
+    struct htable* users = state_rekey(s->users, state_user_name, mapping);
+    struct htable* channels = users == NULL ? NULL : state_rekey(s->channels, state_channel_name, mapping);
+    if(channels == NULL){
+        if(users != NULL){
+            htable_destroy(users);
+        }
+        return -1;
+    }
+
+    htable_destroy(s->users);
+    htable_destroy(s->channels);
+    s->users = users;
+    s->channels = channels;
+    s->casemapping = mapping;
+    return 0;
+}
+
+int state_set_prefixes(struct state* s, const char* old_modes){
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(s->users, &size);
+    if(keys == NULL && htable_get_mapping_count(s->users) > 0){
+        return -1;
+    }
+
+    for(size_t i = 0; i < size; i++){
+        struct state_user* u = htable_lookup(s->users, keys[i]->key, keys[i]->key_size);
+        for(struct state_member* m = u->channels; m != NULL; m = m->next){
+            uint8_t modes = 0;
+            for(size_t j = 0; old_modes[j] != '\0'; j++){
+                const char* prefix = strchr(s->support->prefix_modes, old_modes[j]);
+                if((m->modes & (1u << j)) && prefix != NULL){
+                    modes |= 1u << (prefix - s->support->prefix_modes);
+                }
+            }
+            m->modes = modes;
+        }
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    return 0;
+}
+
+/**
+ * Writes the symbols for a member's prefix modes into \c buf, which must hold
+ * at least STATE_PREFIX_MAX + 1 characters.
+ */
+void state_prefixes(const struct state* s, uint8_t modes, char* buf){
+    size_t len = 0;
+    for(size_t i = 0; s->support->prefix_symbols[i] != '\0'; i++){
+        if(modes & (1u << i)){
+            buf[len++] = s->support->prefix_symbols[i];
+        }
+    }
+    buf[len] = '\0';
+}
+
+int state_handle_join(struct state* s, const struct ircmsg* msg){
+    if(msg->sender == NULL){
+        return 0;
+    }
+
+    struct istr* sender = intern_handle(msg->sender);
+    struct istr* channel = intern_handle(msg->join->channel);
+    struct state_user* u = state_user_find(s, state_key(s, sender));
+    struct state_channel* c = htable_lookup(s->channels, (uint8_t*)&channel->folded[s->casemapping], sizeof(struct istr*));
+    if(c == NULL){
+        //Only channels praetor is in are tracked
+        if(u != s->me){
+            return 0;
+        }
+        c = state_channel_add(s, channel);
+        if(c == NULL){
+            return -1;
+        }
+    }
+
+    if(u == NULL && (u = state_user_add(s, intern_ref(sender))) == NULL){
+        return -1;
+    }
+    state_user_set_host(u, msg->user, msg->host);
+
+    return state_member_add(c, u) == NULL ? -1 : 0;
+}
+
+/**
+ * Removes a nick from a channel, or stops tracking the channel if the nick is
+ * praetor's.
+ */
+void state_leave(struct state* s, const char* channel, const char* nick){
+    struct state_channel* c = state_channel_lookup(s, channel);
+    struct state_user* u = state_user_lookup(s, nick, strlen(nick));
+    if(c == NULL || u == NULL){
+        return;
+    }
+
+    if(u == s->me){
+        state_channel_free(s, c);
+        return;
+    }
+
+    struct state_member* m = state_member_lookup(c, u);
+    if(m != NULL){
+        state_member_remove(s, m);
+    }
+}
+
+/**
+ * Applies a channel MODE message's membership prefix changes, skipping over
+ * the parameters of every other mode.
+ */
+void state_handle_mode(struct state* s, const struct ircmsg_unknown* args){
+    struct state_channel* c = state_channel_lookup(s, args->argv[0]);
+    if(c == NULL || args->argc < 2){
+        return;
+    }
+
+    bool set = true;
+    size_t param = 2;
+    for(const char* mode = args->argv[1]; *mode != '\0'; mode++){
+        if(*mode == '+' || *mode == '-'){
+            set = *mode == '+';
+            continue;
+        }
+
+        const char* prefix = strchr(s->support->prefix_modes, *mode);
+        if(prefix != NULL){
+            if(param >= args->argc){
+                return;
+            }
+            struct state_user* u = state_user_lookup(s, args->argv[param], strlen(args->argv[param]));
+            param++;
+
+            struct state_member* m = u == NULL ? NULL : state_member_lookup(c, u);
+            if(m != NULL){
+                uint8_t bit = 1u << (prefix - s->support->prefix_modes);
+                m->modes = set ? m->modes | bit : m->modes & ~bit;
+            }
+        }
+        else if(strchr(s->support->chanmodes_list, *mode) != NULL || strchr(s->support->chanmodes_param, *mode) != NULL || (set && strchr(s->support->chanmodes_set_param, *mode) != NULL)){
+            param++;
+        }
+    }
+}
+
+/**
+ * Adds the members in a NAMES reply to their channel. A reply for a channel
+ * whose listing already ended begins a new listing, at the end of which
+ * anyone who wasn't in it is removed.
+ */
+int state_handle_names(struct state* s, const struct ircmsg_unknown* args){
+    if(args->argc < 3){
+        return 0;
+    }
+    struct state_channel* c = state_channel_lookup(s, args->argv[args->argc - 2]);
+    if(c == NULL){
+        return 0;
+    }
+
+    if(c->synced){
+        c->synced = false;
+        c->names++;
+    }
+
+    int ret = 0;
+    const char* name = args->argv[args->argc - 1];
+    while(*name != '\0'){
+        size_t len = strcspn(name, " ");
+
+        uint8_t modes = 0;
+        const char* symbol;
+        while(len > 0 && (symbol = strchr(s->support->prefix_symbols, *name)) != NULL){
+            modes |= 1u << (symbol - s->support->prefix_symbols);
+            name++;
+            len--;
+        }
+
+        //Servers with userhost-in-names enabled list members as nick!user@host
+        size_t nick_len = strcspn(name, "! ");
+        if(nick_len > len){
+            nick_len = len;
+        }
+
+        if(nick_len > 0){
+            struct state_user* u = state_user_get(s, name, nick_len);
+            struct state_member* m = u == NULL ? NULL : state_member_add(c, u);
+            if(m == NULL){
+                ret = -1;
+            }
+            else{
+                m->modes = modes;
+                m->names = c->names;
+                const char* host = memchr(name + nick_len, '@', len - nick_len);
+                if(host != NULL && u->user == NULL){
+                    u->user = intern(name + nick_len + 1, host - (name + nick_len + 1));
+                }
+                if(host != NULL && u->host == NULL){
+                    u->host = intern(host + 1, name + len - (host + 1));
+                }
+            }
+        }
+
+        name += len;
+        while(*name == ' '){
+            name++;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * Ends a channel's NAMES listing, removing every member that wasn't in it.
+ */
+void state_handle_end_of_names(struct state* s, const struct ircmsg_unknown* args){
+    if(args->argc < 2){
+        return;
+    }
+    struct state_channel* c = state_channel_lookup(s, args->argv[1]);
+    if(c == NULL){
+        return;
+    }
+
+    for(size_t i = 0; i < c->slot_count; i++){
+        //Removing a member may move another into this slot
+        while(c->slots[i] != NULL && c->slots[i]->names != c->names && c->slots[i]->user != s->me){
+            state_member_remove(s, c->slots[i]);
+        }
+    }
+    c->synced = true;
+}
+
+int state_update(struct network* n, const struct ircmsg* msg){
+    if(n->state == NULL && (n->state = state_create(n, n->nick)) == NULL){
+        return -1;
+    }
+    struct state* s = n->state;
+
+    if(msg->type == JOIN){
+        return state_handle_join(s, msg);
+    }
+    if(msg->type != UNKNOWN){
+        return 0;
+    }
+
+    const struct ircmsg_unknown* args = msg->unknown;
+    struct state_user* u = NULL;
+    if(msg->sender != NULL){
+        u = state_user_find(s, state_key(s, intern_handle(msg->sender)));
+    }
+
+    if(strcasecmp(msg->cmd, "PART") == 0 && args->argc >= 1 && msg->sender != NULL){
+        state_leave(s, args->argv[0], msg->sender);
+    }
+    else if(strcasecmp(msg->cmd, "KICK") == 0 && args->argc >= 2){
+        state_leave(s, args->argv[0], args->argv[1]);
+    }
+    else if(strcasecmp(msg->cmd, "QUIT") == 0 && u != NULL && u != s->me){
+        state_user_drop(s, u);
+    }
+    else if(strcasecmp(msg->cmd, "NICK") == 0 && args->argc >= 1 && u != NULL){
+        return state_user_rename(s, u, args->argv[0]);
+    }
+    else if(strcasecmp(msg->cmd, "MODE") == 0 && args->argc >= 2){
+        state_handle_mode(s, args);
+    }
+    else if(strcmp(msg->cmd, "353") == 0){
+        return state_handle_names(s, args);
+    }
+    else if(strcmp(msg->cmd, "366") == 0){
+        state_handle_end_of_names(s, args);
+    }
+    //The welcome message is addressed to the nick the server gave us
+    else if(strcmp(msg->cmd, "001") == 0 && args->argc >= 1){
+        return state_user_rename(s, s->me, args->argv[0]);
+    }
+
+    return 0;
+}
+
+int state_adopt(struct network* n, const char* nick){
+    state_free(n->state);
+    n->state = state_create(n, nick);
+    return n->state == NULL ? -1 : 0;
+}
+
+int state_adopt_channel(struct network* n, const char* channel){
+    struct istr* name = intern(channel, strlen(channel));
+    if(name == NULL){
+        logmsg(LOG_WARNING, "state: Could not track channel '%s', the system is out of memory\n", channel);
+        return -1;
+    }
+
+    struct state* s = n->state;
+    struct state_channel* c = htable_lookup(s->channels, (uint8_t*)&name->folded[s->casemapping], sizeof(struct istr*));
+    if(c == NULL){
+        c = state_channel_add(s, name);
+    }
+    intern_release(name);
+
+    return c == NULL || state_member_add(c, s->me) == NULL ? -1 : 0;
+}
+
+const char* state_get_nick(const struct network* n){
+    return n->state == NULL ? n->nick : n->state->me->nick->str;
+}
+
+int state_members(const struct network* n, const char* channel, void (*fn)(void* arg, const char* nick, const char* prefixes), void* arg){
+    struct state_channel* c = n->state == NULL ? NULL : state_channel_lookup(n->state, channel);
+    if(c == NULL){
+        return -1;
+    }
+
+    char prefixes[STATE_PREFIX_MAX + 1];
+    for(size_t i = 0; i < c->slot_count; i++){
+        if(c->slots[i] != NULL){
+            state_prefixes(n->state, c->slots[i]->modes, prefixes);
+            fn(arg, c->slots[i]->user->nick->str, prefixes);
+        }
+    }
+
+    return 0;
+}
+
+int state_channels(const struct network* n, const char* nick, void (*fn)(void* arg, const char* channel, const char* prefixes), void* arg){
+    struct state_user* u = n->state == NULL ? NULL : state_user_lookup(n->state, nick, strlen(nick));
+    if(u == NULL || u->channels == NULL){
+        return -1;
+    }
+
+    char prefixes[STATE_PREFIX_MAX + 1];
+    for(struct state_member* m = u->channels; m != NULL; m = m->next){
+        state_prefixes(n->state, m->modes, prefixes);
+        fn(arg, m->channel->name->str, prefixes);
+    }
+
+    return 0;
+}
+
+size_t state_get_channel_count(const struct network* n){
+    return n->state == NULL ? 0 : htable_get_mapping_count(n->state->channels);
+}
+
+size_t state_get_user_count(const struct network* n){
+    return n->state == NULL ? 0 : htable_get_mapping_count(n->state->users);
+}
@@ -0,0 +1,223 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "htable.h"
+#include "log.h"
+#include "plugin.h"
+#include "supervisor.h"
+#include "timer.h"
+
+//The number of milliseconds to wait before restarting a plugin after its first crash
+#define SUPERVISOR_BACKOFF_MIN 1000
+
+//The number of crashes within SUPERVISOR_CRASH_WINDOW after which a plugin is quarantined
+#define SUPERVISOR_CRASH_LIMIT 5
+
+//The window, in milliseconds, over which crashes are counted
+#define SUPERVISOR_CRASH_WINDOW 300000
+
+int supervisor_watch(struct plugin* p){
+    int ret = htable_add(rc_plugin_pid, (uint8_t*)&p->pid, sizeof(p->pid), p);
+    if(ret == -1){
+        //A pid can't be reused until we've reaped it, and reaping it removes the mapping
+        logmsg(LOG_ERR, "supervisor: Process ID %d for plugin '%s' is already mapped\n", p->pid, p->name);
+        _exit(-1);
+    }
+    else if(ret == -2){
+        logmsg(LOG_WARNING, "supervisor: Could not map process ID for plugin '%s', the system is out of memory\n", p->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+int supervisor_reap(){
+    int wstatus;
+    pid_t pid;
+    while((pid = waitpid(-1, &wstatus, WNOHANG)) > 0){
+        struct plugin* p = htable_lookup(rc_plugin_pid, (uint8_t*)&pid, sizeof(pid));
+        if(p == NULL){
+            logmsg(LOG_WARNING, "supervisor: Child process (%d) died, but was not a mapped plugin\n", pid);
+            continue;
+        }
+        htable_remove(rc_plugin_pid, (uint8_t*)&pid, sizeof(pid));
+
+        if(WIFSIGNALED(wstatus)){
+            //if we move to SUSv4, use strsignal() here
+            logmsg(LOG_WARNING, "supervisor: Plugin '%s' terminated due to unhandled signal: %d\n", p->name, WTERMSIG(wstatus));
+        }
+        else if(WIFEXITED(wstatus)){
+            logmsg(LOG_WARNING, "supervisor: Plugin '%s' exited with status: %d\n", p->name, WEXITSTATUS(wstatus));
+        }
+        else{
+            logmsg(LOG_WARNING, "supervisor: Plugin '%s' was terminated via black magic\n", p->name);
+        }
+
+        //Either we unloaded this process ourselves, or it's an old instance of a plugin that's since been reloaded
+        if(pid != p->pid || p->status != PLUGIN_LOADED){
+            logmsg(LOG_WARNING, "supervisor: Plugin '%s' successfully terminated via unload\n", p->name);
+            if(pid == p->pid){
+                p->pid = -1;
+            }
+            continue;
+        }
+
+        logmsg(LOG_WARNING, "supervisor: Plugin '%s' terminated unexpectedly after %llu seconds\n", p->name, (unsigned long long)((timer_now() - p->start_time) / 1000));
+        p->status = PLUGIN_DEAD;
+        plugin_unload(p);
+        p->pid = -1;
+
+        supervisor_schedule(p);
+    }
+
+    if(pid == -1){
+        switch(errno){
+            //None of these should ever happen
+            case EINTR:
+            case EINVAL:
+                logmsg(LOG_ERR, "supervisor: Error on waitpid(), %s\n", strerror(errno));
+                _exit(-1);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Forgets a reaped process, and the plugin it belonged to, if any.
+ */
+void supervisor_release(pid_t pid){
+    struct plugin* p = htable_lookup(rc_plugin_pid, (uint8_t*)&pid, sizeof(pid));
+    if(p == NULL){
+        return;
+    }
+    htable_remove(rc_plugin_pid, (uint8_t*)&pid, sizeof(pid));
+    if(pid == p->pid){
+        p->pid = -1;
+    }
+}
+
+int supervisor_reap_all(uint64_t timeout){
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+    uint64_t deadline = timer_now() + timeout;
+    pid_t pid;
+    while((pid = waitpid(-1, NULL, WNOHANG)) != -1){
+        if(pid > 0){
+            supervisor_release(pid);
+        }
+        else if(timer_now() >= deadline){
+            break;
+        }
+        else{
+            nanosleep(&ts, NULL);
+        }
+    }
+    if(pid == -1){
+        return 0;
+    }
+
+    size_t size = 0;
+    struct htable_key** pids = htable_get_keys(rc_plugin_pid, &size);
+    for(size_t i = 0; pids != NULL && i < size; i++){
+        memcpy(&pid, pids[i]->key, sizeof(pid));
+        logmsg(LOG_WARNING, "supervisor: Child process (%d) did not terminate in time, killing it\n", pid);
+        if(kill(pid, SIGKILL) == 0){
+            waitpid(pid, NULL, 0);
+        }
+        supervisor_release(pid);
+    }
+    if(pids != NULL){
+        htable_key_list_free(pids, size);
+    }
+
+    while((pid = waitpid(-1, NULL, WNOHANG)) > 0);
+
+    return pid == -1 ? 0 : -1;
+}
+
+uint64_t supervisor_delay(size_t crash_count){
+    if(crash_count == 0 || crash_count > SUPERVISOR_CRASH_LIMIT){
+        return 0;
+    }
+
+    //Quarantine comes first, so the delay tops out at SUPERVISOR_BACKOFF_MIN << (SUPERVISOR_CRASH_LIMIT - 1)
+    return (uint64_t)SUPERVISOR_BACKOFF_MIN << (crash_count - 1);
+}
+
+void supervisor_schedule(struct plugin* p){
+    uint64_t now = timer_now();
+    if(p->crash_count == 0 || now - p->crash_window_start > SUPERVISOR_CRASH_WINDOW){
+        p->crash_count = 0;
+        p->crash_window_start = now;
+    }
+    p->crash_count++;
+
+    uint64_t delay = supervisor_delay(p->crash_count);
+    if(delay == 0){
+        logmsg(LOG_ERR, "supervisor: Plugin '%s' crashed %zu times within %d seconds, quarantining it until it is reloaded\n", p->name, p->crash_count, SUPERVISOR_CRASH_WINDOW / 1000);
+        p->status = PLUGIN_QUARANTINED;
+        return;
+    }
+
+    logmsg(LOG_WARNING, "supervisor: Restarting plugin '%s' in %llu milliseconds\n", p->name, (unsigned long long)delay);
+    p->status = PLUGIN_RESTARTING;
+    if(timer_arm(&p->restart_timer, delay) == -1){
+        logmsg(LOG_ERR, "supervisor: Could not schedule restart for plugin '%s', quarantining it until it is reloaded\n", p->name);
+        p->status = PLUGIN_QUARANTINED;
+    }
+}
+
+void supervisor_cancel(struct plugin* p){
+    timer_disarm(&p->restart_timer);
+    p->crash_count = 0;
+}
+
+void supervisor_forget(struct plugin* p){
+    supervisor_cancel(p);
+
+    size_t size = 0;
+    struct htable_key** pids = htable_get_keys(rc_plugin_pid, &size);
+    if(pids == NULL){
+        return;
+    }
+
+    //Processes left behind by this plugin are still reaped, just no longer attributed to it
+    for(size_t i = 0; i < size; i++){
+        if(htable_lookup(rc_plugin_pid, pids[i]->key, pids[i]->key_size) == p){
+            htable_remove(rc_plugin_pid, pids[i]->key, pids[i]->key_size);
+        }
+    }
+
+    htable_key_list_free(pids, size);
+}
+
+void supervisor_restart(void* arg){
+    struct plugin* p = arg;
+
+    p->status = PLUGIN_UNLOADED;
+    p->restart_count++;
+    if(plugin_load(p) < 0){
+        logmsg(LOG_WARNING, "supervisor: Failed to restart plugin '%s'\n", p->name);
+        supervisor_schedule(p);
+        return;
+    }
+
+    logmsg(LOG_INFO, "supervisor: Restarted plugin '%s', %zu restarts so far\n", p->name, p->restart_count);
+}
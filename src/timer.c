@@ -0,0 +1,162 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "log.h"
+#include "probes.h"
+#include "timer.h"
+
+//The size of the timer heap.
+size_t timer_heap_size = 0;
+
+//The number of armed timers in the timer heap.
+size_t timer_heap_count = 0;
+
+/**
+ * A binary min-heap of armed timers, ordered by deadline.
+ */
+struct timer** timer_heap = NULL;
+
+void timer_swap(size_t a, size_t b){
+    struct timer* tmp = timer_heap[a];
+    timer_heap[a] = timer_heap[b];
+    timer_heap[b] = tmp;
+
+    timer_heap[a]->idx = a;
+    timer_heap[b]->idx = b;
+}
+
+void timer_sift_up(size_t i){
+    while(i > 0){
+        size_t parent = (i - 1) / 2;
+        if(timer_heap[parent]->deadline <= timer_heap[i]->deadline){
+            return;
+        }
+        timer_swap(i, parent);
+        i = parent;
+    }
+}
+
+void timer_sift_down(size_t i){
+    while(true){
+        size_t smallest = i;
+        size_t left = (2 * i) + 1;
+        size_t right = (2 * i) + 2;
+
+        if(left < timer_heap_count && timer_heap[left]->deadline < timer_heap[smallest]->deadline){
+            smallest = left;
+        }
+        if(right < timer_heap_count && timer_heap[right]->deadline < timer_heap[smallest]->deadline){
+            smallest = right;
+        }
+        if(smallest == i){
+            return;
+        }
+        timer_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+void timer_init(struct timer* t, void (*fn)(void* arg), void* arg){
+    t->deadline = 0;
+    t->fn = fn;
+    t->arg = arg;
+    t->idx = SIZE_MAX;
+}
+
+int timer_arm(struct timer* t, uint64_t delay){
+    if(timer_armed(t)){
+        timer_disarm(t);
+    }
+
+    if(timer_heap_count == timer_heap_size){
+        size_t new_size = (timer_heap_size == 0) ? 16 : timer_heap_size * 2;
+        void* tmp = realloc(timer_heap, new_size * sizeof(struct timer*));
+        if(tmp == NULL){
+            logmsg(LOG_WARNING, "timer: Could not arm timer, the system is out of memory\n");
+            return -1;
+        }
+        timer_heap = tmp;
+        timer_heap_size = new_size;
+    }
+
+    t->deadline = timer_now() + delay;
+    t->idx = timer_heap_count;
+    timer_heap[timer_heap_count++] = t;
+    timer_sift_up(t->idx);
+
+    return 0;
+}
+
+void timer_disarm(struct timer* t){
+    if(!timer_armed(t)){
+        return;
+    }
+
+    size_t i = t->idx;
+    timer_heap_count--;
+    if(i != timer_heap_count){
+        timer_swap(i, timer_heap_count);
+        //The timer moved into the hole may belong either above or below it
+        struct timer* moved = timer_heap[i];
+        timer_sift_up(i);
+        timer_sift_down(moved->idx);
+    }
+
+    t->idx = SIZE_MAX;
+}
+
+bool timer_armed(const struct timer* t){
+    return t->idx != SIZE_MAX;
+}
+
+uint64_t timer_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000) + ((uint64_t)ts.tv_nsec / 1000000);
+}
+
+size_t timer_get_armed_count(){
+    return timer_heap_count;
+}
+
+int timer_next_timeout(int max){
+    if(timer_heap_count == 0){
+        return max;
+    }
+
+    uint64_t now = timer_now();
+    if(timer_heap[0]->deadline <= now){
+        return 0;
+    }
+
+    uint64_t remaining = timer_heap[0]->deadline - now;
+    if(remaining > (uint64_t)max){
+        return max;
+    }
+
+    return (int)remaining;
+}
+
+void timer_run(){
+    uint64_t now = timer_now();
+    while(timer_heap_count > 0 && timer_heap[0]->deadline <= now){
+        struct timer* t = timer_heap[0];
+        PROBE2(timer_fire, t->arg, now - t->deadline);
+        timer_disarm(t);
+        t->fn(t->arg);
+    }
+}
@@ -0,0 +1,174 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "htable.h"
+#include "log.h"
+#include "metrics.h"
+#include "queue.h"
+#include "trace.h"
+
+/**
+ * The timestamps of a message sent to a plugin, from metrics_now(). A trace
+ * lives in the slot its id picks out until a later id takes the slot over.
+ */
+struct trace{
+    uint64_t id;
+    uint64_t recv_at;
+    uint64_t written_at;
+    uint64_t replied_at;
+    uint64_t queued_at;
+};
+
+struct trace trace_slots[TRACE_SLOTS];
+
+//The id given to the last message traced
+uint64_t trace_last_id = 0;
+
+/**
+ * Returns the trace with the given id, or NULL if its slot has been taken
+ * over.
+ */
+struct trace* trace_lookup(uint64_t id){
+    struct trace* t = &trace_slots[id % TRACE_SLOTS];
+    return id != 0 && t->id == id ? t : NULL;
+}
+
+uint64_t trace_start(uint64_t recv_at){
+    uint64_t id = ++trace_last_id;
+    trace_slots[id % TRACE_SLOTS] = (struct trace){.id = id, .recv_at = recv_at};
+    return id;
+}
+
+void trace_written(uint64_t id){
+    struct trace* t = trace_lookup(id);
+    if(t != NULL){
+        t->written_at = metrics_now();
+    }
+}
+
+bool trace_reply(uint64_t id, struct plugin* p){
+    struct trace* t = trace_lookup(id);
+    //Plugins may reply more than once, but only the first reply is traced
+    if(t == NULL || t->written_at == 0 || t->replied_at != 0){
+        return false;
+    }
+
+    t->replied_at = metrics_now();
+    metrics_observe(&p->metrics.reply_latency, t->replied_at - t->written_at);
+    return true;
+}
+
+void trace_queued(uint64_t id, struct plugin* p, struct network* n){
+    struct trace* t = trace_lookup(id);
+    if(t == NULL || n->send_queue == NULL || n->trace_sends.count == TRACE_SENDS_MAX){
+        return;
+    }
+
+    t->queued_at = metrics_now();
+    metrics_observe(&p->metrics.rate_limit_latency, t->queued_at - t->replied_at);
+
+    //The reply is the last line in the queue, and is sent once everything ahead of it has been
+    struct trace_sends* s = &n->trace_sends;
+    s->sends[(s->head + s->count) % TRACE_SENDS_MAX] = (struct trace_send){
+        .id = id,
+        .position = n->metrics.lines_out + queue_get_size(n->send_queue)
+    };
+    s->count++;
+}
+
+void trace_sent(struct network* n){
+    struct trace_sends* s = &n->trace_sends;
+    uint64_t now = metrics_now();
+    while(s->count > 0 && s->sends[s->head].position <= n->metrics.lines_out){
+        struct trace* t = trace_lookup(s->sends[s->head].id);
+        if(t != NULL){
+            metrics_observe(&n->metrics.send_queue_latency, now - t->queued_at);
+            metrics_observe(&n->metrics.total_latency, now - t->recv_at);
+        }
+        s->head = (s->head + 1) % TRACE_SENDS_MAX;
+        s->count--;
+    }
+}
+
+void trace_discard(struct network* n){
+    n->trace_sends.head = 0;
+    n->trace_sends.count = 0;
+}
+
+/**
+ * Logs one line summarizing a histogram.
+ */
+void trace_dump_histogram(void* arg, const char* kind, const char* name, const char* stage, const struct metrics_histogram* h){
+    (void)arg;
+    double quantiles[] = {0.5, 0.9, 0.99};
+    char bounds[3][32];
+    for(size_t i = 0; i < 3; i++){
+        uint64_t ns = metrics_quantile(h, quantiles[i]);
+        if(ns == UINT64_MAX){
+            snprintf(bounds[i], sizeof(bounds[i]), ">1s");
+        }
+        else{
+            snprintf(bounds[i], sizeof(bounds[i]), "<=%gms", ns / 1e6);
+        }
+    }
+
+    //Asked for explicitly, so written whatever the log threshold is
+    logprintf(LOG_NOTICE, "trace: %s '%s' %-10s %8llu samples, mean %.3fms, p50 %s, p90 %s, p99 %s\n",
+        kind, name, stage, (unsigned long long)h->count, h->sum / 1e6 / h->count, bounds[0], bounds[1], bounds[2]);
+}
+
+/**
+ * Hands a histogram to a trace_foreach() callback, unless it's empty.
+ */
+void trace_visit(void (*fn)(void* arg, const char* kind, const char* name, const char* stage, const struct metrics_histogram* h), void* arg, const char* kind, const char* name, const char* stage, const struct metrics_histogram* h){
+    if(h->count > 0){
+        fn(arg, kind, name, stage, h);
+    }
+}
+
+void trace_foreach(void (*fn)(void* arg, const char* kind, const char* name, const char* stage, const struct metrics_histogram* h), void* arg){
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(rc_network, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        const struct network* n = htable_lookup(rc_network, keys[i]->key, keys[i]->key_size);
+        trace_visit(fn, arg, "network", n->name, "read", &n->metrics.read_latency);
+        trace_visit(fn, arg, "network", n->name, "parse", &n->metrics.parse_latency);
+        trace_visit(fn, arg, "network", n->name, "send_queue", &n->metrics.send_queue_latency);
+        trace_visit(fn, arg, "network", n->name, "total", &n->metrics.total_latency);
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    keys = htable_get_keys(rc_plugin, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        const struct plugin* p = htable_lookup(rc_plugin, keys[i]->key, keys[i]->key_size);
+        trace_visit(fn, arg, "plugin", p->name, "ipc", &p->metrics.ipc_latency);
+        trace_visit(fn, arg, "plugin", p->name, "plugin", &p->metrics.reply_latency);
+        trace_visit(fn, arg, "plugin", p->name, "rate_limit", &p->metrics.rate_limit_latency);
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+
+    trace_visit(fn, arg, "praetor", "event loop", "iteration", &metrics_loop);
+}
+
+void trace_dump(){
+    trace_foreach(trace_dump_histogram, NULL);
+}
@@ -0,0 +1,578 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
+#include "capture.h"
+#include "casemap.h"
+#include "config.h"
+#include "htable.h"
+#include "inet.h"
+#include "irc.h"
+#include "ircmsg.h"
+#include "isupport.h"
+#include "log.h"
+#include "nexus.h"
+#include "plugin.h"
+#include "queue.h"
+#include "state.h"
+#include "supervisor.h"
+#include "upgrade.h"
+#include "util.h"
+
+#define SCHEMA_UPGRADE "{s:o}"
+#define SCHEMA_UPGRADE_NETWORK "{s:s, s:i, s:s, s:s, s:s, s:s, s:s, s:o, s:o, s?:s, s?:o}"
+
+//The number of milliseconds plugins are given to exit before the new binary is executed
+#define UPGRADE_PLUGIN_TIMEOUT 2000
+
+char* upgrade_binary = NULL;
+
+int upgrade_init(const char* argv0){
+    //Without a slash, the binary is found on PATH, which doesn't depend on our working directory
+    if(strchr(argv0, '/') == NULL){
+        if((upgrade_binary = malloc(strlen(argv0)+1)) == NULL){
+            logmsg(LOG_ERR, "upgrade: Could not remember binary path, the system is out of memory\n");
+            return -1;
+        }
+        strcpy(upgrade_binary, argv0);
+        return 0;
+    }
+
+    char resolved[PATH_MAX];
+    if(realpath(argv0, resolved) == NULL){
+        logmsg(LOG_ERR, "upgrade: Could not resolve binary path %s, %s\n", argv0, strerror(errno));
+        return -1;
+    }
+    if((upgrade_binary = malloc(strlen(resolved)+1)) == NULL){
+        logmsg(LOG_ERR, "upgrade: Could not remember binary path, the system is out of memory\n");
+        return -1;
+    }
+    strcpy(upgrade_binary, resolved);
+
+    return 0;
+}
+
+bool upgrade_pending(){
+    return getenv(UPGRADE_ENV) != NULL;
+}
+
+/**
+ * Returns a NUL-terminated string holding \c len bytes of \c buf in
+ * hexadecimal, or NULL if the system is out of memory. IRC traffic isn't
+ * guaranteed to be UTF-8, so it can't be stored in a JSON string as-is.
+ */
+char* upgrade_hex_encode(const uint8_t* buf, size_t len){
+    static const char digits[] = "0123456789abcdef";
+    char* hex = malloc((len * 2) + 1);
+    if(hex == NULL){
+        return NULL;
+    }
+
+    for(size_t i = 0; i < len; i++){
+        hex[i * 2] = digits[buf[i] >> 4];
+        hex[(i * 2) + 1] = digits[buf[i] & 0x0f];
+    }
+    hex[len * 2] = '\0';
+
+    return hex;
+}
+
+/**
+ * Decodes a string written by upgrade_hex_encode() into \c buf.
+ *
+ * \return The number of bytes decoded.
+ * \return -1 if the string is malformed, or would not fit in \c size bytes.
+ */
+ssize_t upgrade_hex_decode(const char* hex, uint8_t* buf, size_t size){
+    size_t len = strlen(hex);
+    if(len % 2 != 0 || len / 2 > size){
+        return -1;
+    }
+
+    for(size_t i = 0; i < len / 2; i++){
+        unsigned int byte;
+        if(sscanf(hex + (i * 2), "%2x", &byte) != 1){
+            return -1;
+        }
+        buf[i] = byte;
+    }
+
+    return len / 2;
+}
+
+/**
+ * Returns true if a network is connected, or in the middle of connecting.
+ */
+bool upgrade_connected(const struct network* n){
+    return n->sock != -1 && htable_lookup(rc_network_sock, (uint8_t*)&n->sock, sizeof(n->sock)) == n;
+}
+
+/**
+ * Returns true if a network's connection can be handed over. Connections
+ * that haven't started registering yet are simply made again.
+ */
+bool upgrade_portable(const struct network* n){
+    return upgrade_connected(n) && n->connected && !n->ssl;
+}
+
+/**
+ * Appends a line waiting in a network's send queue to a JSON array, hex
+ * encoded.
+ *
+ * \return 0 on success.
+ * \return -1 if the system is out of memory.
+ */
+int upgrade_save_line(void* arg, const uint8_t* value, size_t size){
+    char* hex = upgrade_hex_encode(value, size);
+    if(hex == NULL || json_array_append_new(arg, json_string(hex)) == -1){
+        free(hex);
+        return -1;
+    }
+    free(hex);
+    return 0;
+}
+
+/**
+ * Appends the name of a channel praetor is in to a JSON array, hex encoded
+ * since the network may not use UTF-8.
+ */
+void upgrade_save_channel(void* arg, const char* channel, const char* prefixes){
+    (void)prefixes;
+    char* hex = upgrade_hex_encode((const uint8_t*)channel, strlen(channel));
+    if(hex != NULL){
+        json_array_append_new(arg, json_string(hex));
+        free(hex);
+    }
+}
+
+/**
+ * Serializes the state of a plaintext connection.
+ */
+json_t* upgrade_save_network(const struct network* n){
+    json_t* send = json_array(), * channels = json_array(), * joined = json_array();
+    char* recv = upgrade_hex_encode((uint8_t*)n->recv_queue, n->recv_queue_idx);
+    if(send == NULL || channels == NULL || joined == NULL || recv == NULL){
+        goto fail;
+    }
+
+    if(queue_foreach(n->send_queue, upgrade_save_line, send) == -1){
+        goto fail;
+    }
+
+    //Channel names are just bytes, so they're hex encoded the same as the channels praetor is in
+    size_t count = 0;
+    struct htable_key** keys = htable_get_keys(n->channels, &count);
+    for(size_t i = 0; keys != NULL && i < count; i++){
+        char* hex = upgrade_hex_encode(keys[i]->key, keys[i]->key_size - 1);
+        if(hex == NULL || json_array_append_new(channels, json_string(hex)) == -1){
+            free(hex);
+            htable_key_list_free(keys, count);
+            goto fail;
+        }
+        free(hex);
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, count);
+    }
+
+    //Channels that couldn't be listed would be left without their members
+    const char* me = state_get_nick(n);
+    state_channels(n, me, upgrade_save_channel, joined);
+    if(json_array_size(joined) != state_get_channel_count(n)){
+        goto fail;
+    }
+
+    json_t* obj = json_pack(
+        "{s:s, s:i, s:s, s:s, s:s, s:s, s:s, s:o, s:o, s:s, s:o}",
+        "name", n->name,
+        "sock", n->sock,
+        "host", n->host,
+        "nick", n->nick,
+        "user", n->user,
+        "real_name", n->real_name,
+        "recv", recv,
+        "send", send,
+        "channels", channels,
+        "me", me,
+        "joined", joined
+    );
+    free(recv);
+
+    return obj;
+
+    fail:
+        logmsg(LOG_WARNING, "upgrade: Could not save connection to network '%s', the system is out of memory\n", n->name);
+        json_decref(send);
+        json_decref(channels);
+        json_decref(joined);
+        free(recv);
+        return NULL;
+}
+
+int upgrade_exec(){
+    if(upgrade_binary == NULL || rc_path == NULL){
+        logmsg(LOG_WARNING, "upgrade: Cannot upgrade, praetor was not started with a known binary and configuration path\n");
+        return -1;
+    }
+    logmsg(LOG_INFO, "upgrade: Upgrading to %s\n", upgrade_binary);
+
+    //Whatever can be sent now doesn't need to be handed over
+    if(htable_get_mapping_count(rc_network_sock) > 0){
+        inet_send_all();
+    }
+
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(rc_network, &size);
+
+    json_t* networks = json_array();
+    if(networks == NULL){
+        logmsg(LOG_WARNING, "upgrade: Could not save connections, the system is out of memory\n");
+        goto fail_save;
+    }
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        struct network* n = htable_lookup(rc_network, keys[i]->key, keys[i]->key_size);
+        if(!upgrade_portable(n)){
+            continue;
+        }
+
+        json_t* obj = upgrade_save_network(n);
+        if(obj == NULL || json_array_append_new(networks, obj) == -1){
+            goto fail_save;
+        }
+    }
+
+    //The file is unlinked as soon as it's created, so it's gone once both processes are done with it
+    FILE* state = tmpfile();
+    if(state == NULL){
+        logmsg(LOG_WARNING, "upgrade: Could not create state file, %s\n", strerror(errno));
+        goto fail_save;
+    }
+    json_t* root = json_pack("{s:o}", "networks", networks);
+    networks = NULL;
+    if(root == NULL || json_dumpf(root, state, JSON_COMPACT) == -1 || fflush(state) == EOF){
+        logmsg(LOG_WARNING, "upgrade: Could not write state file, %s\n", strerror(errno));
+        json_decref(root);
+        fclose(state);
+        goto fail_save;
+    }
+    json_decref(root);
+    rewind(state);
+
+    char fd[16];
+    snprintf(fd, sizeof(fd), "%d", fileno(state));
+    if(clearcloexec(fileno(state)) == -1 || setenv(UPGRADE_ENV, fd, 1) == -1){
+        logmsg(LOG_WARNING, "upgrade: Could not hand state file to new process, %s\n", strerror(errno));
+        fclose(state);
+        goto fail_save;
+    }
+
+    //TLS connections are closed before exec(), and must be made again if exec() fails
+    bool* released = calloc(size == 0 ? 1 : size, sizeof(bool));
+    if(released == NULL){
+        logmsg(LOG_WARNING, "upgrade: Could not prepare connections for upgrade, the system is out of memory\n");
+        unsetenv(UPGRADE_ENV);
+        fclose(state);
+        goto fail_save;
+    }
+
+    //Nothing can fail from here until exec(), so we can start letting go of things
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        struct network* n = htable_lookup(rc_network, keys[i]->key, keys[i]->key_size);
+        if(upgrade_portable(n)){
+            clearcloexec(n->sock);
+        }
+        else if(upgrade_connected(n) && n->ssl){
+            if(irc_quit(n) == 0){
+                inet_send(n);
+            }
+            inet_disconnect(n);
+            released[i] = true;
+        }
+    }
+
+    //Plugins hold descriptors and shared memory that the new process knows nothing about
+    size_t plugin_count = 0;
+    struct htable_key** plugins = htable_get_keys(rc_plugin, &plugin_count);
+    for(size_t i = 0; plugins != NULL && i < plugin_count; i++){
+        struct plugin* p = htable_lookup(rc_plugin, plugins[i]->key, plugins[i]->key_size);
+        if(p->status != PLUGIN_UNLOADED){
+            plugin_unload(p);
+        }
+    }
+    if(plugins != NULL){
+        htable_key_list_free(plugins, plugin_count);
+    }
+    //Plugins left running would be reported by the new process as children it knows nothing about
+    if(supervisor_reap_all(UPGRADE_PLUGIN_TIMEOUT) == -1){
+        logmsg(LOG_WARNING, "upgrade: Some child processes are still running, the new process will reap them\n");
+    }
+
+    char* argv[10] = {upgrade_binary, "-c", rc_path, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+    int argc = 3;
+    if(debug){
+        argv[argc++] = "-d";
+    }
+    if(foreground){
+        argv[argc++] = "-f";
+    }
+    //The log file is opened relative to the working directory, which the new process shares
+    if(log_path != NULL){
+        argv[argc++] = "-l";
+        argv[argc++] = (char*)log_path;
+    }
+    //The new process carries on with the same capture, starting from its own clock record
+    const char* capturing = capture_path;
+    if(capturing != NULL){
+        argv[argc++] = "-C";
+        argv[argc++] = (char*)capturing;
+        capture_close();
+    }
+    //Anything still waiting to be logged would be lost along with the writer thread
+    log_flush();
+    execvp(upgrade_binary, argv);
+
+    //We're still here, so put everything back the way it was
+    logmsg(LOG_ERR, "upgrade: Could not execute %s, %s\n", upgrade_binary, strerror(errno));
+    unsetenv(UPGRADE_ENV);
+    fclose(state);
+    if(capturing != NULL){
+        capture_open(capturing);
+    }
+
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        struct network* n = htable_lookup(rc_network, keys[i]->key, keys[i]->key_size);
+        if(released[i]){
+            inet_connect(n);
+        }
+        else if(upgrade_portable(n)){
+            setcloexec(n->sock);
+        }
+    }
+    free(released);
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+    plugin_load_all();
+
+    return -1;
+
+    fail_save:
+        json_decref(networks);
+        if(keys != NULL){
+            htable_key_list_free(keys, size);
+        }
+        logmsg(LOG_WARNING, "upgrade: Upgrade aborted, praetor will keep running as it is\n");
+        return -1;
+}
+
+/**
+ * Sends QUIT on a handed over connection that won't be adopted, and closes
+ * it.
+ */
+void upgrade_release(int sock, const char* quit_msg){
+    char* quit = ircmsg_quit(quit_msg, IRCMSG_SIZE_MAX);
+    if(quit != NULL){
+        write(sock, quit, strlen(quit));
+        free(quit);
+    }
+    close(sock);
+}
+
+/**
+ * Adopts a single handed over connection.
+ *
+ * \return 0 on success.
+ * \return -1 if the connection was released instead.
+ */
+int upgrade_adopt_network(json_t* obj){
+    const char* name, * host, * nick, * user, * real_name, * recv, * me = NULL;
+    int sock;
+    json_t* send, * channels, * joined = NULL;
+    json_error_t error;
+    if(json_unpack_ex(obj, &error, 0, SCHEMA_UPGRADE_NETWORK, "name", &name, "sock", &sock, "host", &host, "nick", &nick, "user", &user, "real_name", &real_name, "recv", &recv, "send", &send, "channels", &channels, "me", &me, "joined", &joined) == -1){
+        logmsg(LOG_WARNING, "upgrade: Could not adopt connection, %s\n", error.text);
+        return -1;
+    }
+    //Whatever happens to the connection, it must not leak into plugins
+    setcloexec(sock);
+
+    struct network* n = htable_lookup(rc_network, (uint8_t*)name, strlen(name)+1);
+    if(n == NULL){
+        logmsg(LOG_INFO, "upgrade: Network '%s' is no longer configured, disconnecting\n", name);
+        upgrade_release(sock, NULL);
+        return -1;
+    }
+    if(n->ssl || config_str_differs(n->host, host) || config_str_differs(n->nick, nick) || config_str_differs(n->user, user) || config_str_differs(n->real_name, real_name)){
+        logmsg(LOG_INFO, "upgrade: Connection settings for network '%s' changed, reconnecting\n", name);
+        upgrade_release(sock, n->quit_msg);
+        return -1;
+    }
+
+    //The old process may have grown its receive queue for a network with a longer LINELEN
+    if((n->recv_queue = calloc(ISUPPORT_LINELEN_MAX + 1, sizeof(char))) == NULL || (n->send_queue = queue_create()) == NULL){
+        goto fail_nomem;
+    }
+    n->recv_queue_size = ISUPPORT_LINELEN_MAX + 1;
+    ssize_t len = upgrade_hex_decode(recv, (uint8_t*)n->recv_queue, ISUPPORT_LINELEN_MAX);
+    if(len == -1){
+        logmsg(LOG_WARNING, "upgrade: Discarding malformed receive queue for network '%s'\n", name);
+        len = 0;
+    }
+    n->recv_queue_idx = len;
+
+    json_t* value;
+    size_t index;
+    uint8_t buf[ISUPPORT_LINELEN_MAX + 1];
+    json_array_foreach(send, index, value){
+        if(!json_is_string(value) || (len = upgrade_hex_decode(json_string_value(value), buf, sizeof(buf))) == -1){
+            logmsg(LOG_WARNING, "upgrade: Discarding malformed message queued for network '%s'\n", name);
+            continue;
+        }
+        if(queue_enqueue(n->send_queue, buf, len) == -1){
+            goto fail_nomem;
+        }
+    }
+
+    //The nick and channels praetor has on the network carry over, their members are asked for again
+    if(state_adopt(n, me == NULL ? nick : me) == -1){
+        goto fail_nomem;
+    }
+    json_array_foreach(joined, index, value){
+        if(!json_is_string(value) || (len = upgrade_hex_decode(json_string_value(value), buf, sizeof(buf) - 1)) == -1){
+            logmsg(LOG_WARNING, "upgrade: Discarding malformed channel for network '%s'\n", name);
+            continue;
+        }
+        buf[len] = '\0';
+        if(state_adopt_channel(n, (char*)buf) == -1){
+            goto fail_nomem;
+        }
+    }
+
+    n->sock = sock;
+    n->connected = true;
+    if(watch_add(sock, false) == -1){
+        goto fail_nomem;
+    }
+    if(htable_add(rc_network_sock, (uint8_t*)&n->sock, sizeof(n->sock), n) != 0){
+        watch_remove(sock);
+        goto fail_nomem;
+    }
+
+    //Catch up with channels that were added or removed along with the upgrade, "#Foo" and "#foo" being the same channel
+    size_t size = 0;
+    struct htable_key** keys = htable_get_keys(n->channels, &size);
+    for(size_t i = 0; keys != NULL && i < size; i++){
+        bool joined = false;
+        json_array_foreach(channels, index, value){
+            if(json_is_string(value) && (len = upgrade_hex_decode(json_string_value(value), buf, sizeof(buf) - 1)) != -1 && (size_t)len == keys[i]->key_size - 1 && casemap_equal((char*)buf, (char*)keys[i]->key, len, n->casemapping)){
+                joined = true;
+                break;
+            }
+        }
+        if(!joined){
+            irc_join(n, htable_lookup(n->channels, keys[i]->key, keys[i]->key_size));
+        }
+    }
+    if(keys != NULL){
+        htable_key_list_free(keys, size);
+    }
+    json_array_foreach(channels, index, value){
+        if(!json_is_string(value) || (len = upgrade_hex_decode(json_string_value(value), buf, sizeof(buf) - 1)) == -1){
+            logmsg(LOG_WARNING, "upgrade: Discarding malformed configured channel for network '%s'\n", name);
+            continue;
+        }
+        buf[len] = '\0';
+        if(htable_lookup(n->channels, buf, len + 1) == NULL){
+            irc_part(n, (char*)buf);
+        }
+    }
+
+    //What the server supports isn't handed over, but it's sent again along with its version
+    irc_send(n, "VERSION\r\n", strlen("VERSION\r\n"));
+    json_array_foreach(joined, index, value){
+        if(json_is_string(value) && (len = upgrade_hex_decode(json_string_value(value), buf, sizeof(buf) - 1)) != -1){
+            buf[len] = '\0';
+            irc_names(n, (char*)buf);
+        }
+    }
+
+    logmsg(LOG_INFO, "upgrade: Adopted connection to network '%s'\n", name);
+    return 0;
+
+    fail_nomem:
+        logmsg(LOG_WARNING, "upgrade: Could not adopt connection to network '%s', the system is out of memory\n", name);
+        free(n->recv_queue);
+        n->recv_queue = NULL;
+        n->recv_queue_size = 0;
+        n->recv_queue_idx = 0;
+        queue_destroy(n->send_queue);
+        n->send_queue = NULL;
+        state_free(n->state);
+        n->state = NULL;
+        n->sock = -1;
+        n->connected = false;
+        upgrade_release(sock, n->quit_msg);
+        return -1;
+}
+
+int upgrade_adopt(){
+    const char* env = getenv(UPGRADE_ENV);
+    if(env == NULL){
+        return 0;
+    }
+
+    char* end;
+    errno = 0;
+    long fd = strtol(env, &end, 10);
+    unsetenv(UPGRADE_ENV);
+    if(errno != 0 || *end != '\0' || fd < 0 || fd > INT_MAX){
+        logmsg(LOG_ERR, "upgrade: %s holds an invalid file descriptor\n", UPGRADE_ENV);
+        return -1;
+    }
+
+    FILE* state = fdopen(fd, "r");
+    if(state == NULL){
+        logmsg(LOG_ERR, "upgrade: Could not open state file, %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    json_error_t error;
+    json_t* root = json_loadf(state, 0, &error);
+    fclose(state);
+    json_t* networks;
+    if(root == NULL || json_unpack_ex(root, &error, 0, SCHEMA_UPGRADE, "networks", &networks) == -1 || !json_is_array(networks)){
+        logmsg(LOG_ERR, "upgrade: Could not read state file, %s\n", error.text);
+        json_decref(root);
+        return -1;
+    }
+
+    json_t* value;
+    size_t index, adopted = 0;
+    json_array_foreach(networks, index, value){
+        if(upgrade_adopt_network(value) == 0){
+            adopted++;
+        }
+    }
+    logmsg(LOG_INFO, "upgrade: Adopted %zu of %zu connections\n", adopted, json_array_size(networks));
+
+    json_decref(root);
+    return 0;
+}
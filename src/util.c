@@ -10,6 +10,7 @@
 * can be found in the "LICENSE" file bundled with this source distribution.
 */
 
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include "log.h"
@@ -29,3 +30,30 @@ int strrepl(char* src, char i, char (*f)(), bool first){
     }
     return repl;
 }
+
+int setcloexec(int fd){
+    int flags = fcntl(fd, F_GETFD);
+    if(flags == -1){
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+int clearcloexec(int fd){
+    int flags = fcntl(fd, F_GETFD);
+    if(flags == -1){
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC);
+}
+
+int setnonblock(int fd){
+    int flags = fcntl(fd, F_GETFL);
+    if(flags == -1){
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
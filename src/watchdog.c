@@ -0,0 +1,208 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __GLIBC__
+#include <execinfo.h>
+#endif
+
+#include "log.h"
+#include "metrics.h"
+#include "watchdog.h"
+
+//The most stack frames recorded for a stall
+#define WATCHDOG_FRAMES_MAX 32
+
+//The longest the watchdog waits for the event loop's thread to record its backtrace, in milliseconds
+#define WATCHDOG_BACKTRACE_TIMEOUT 100
+
+struct watchdog_stall watchdog_stalls[WATCHDOG_ACTIVITIES_MAX];
+_Atomic size_t watchdog_stall_count = 0;
+
+//When the event loop's current iteration started, or 0 while it waits for input
+_Atomic uint64_t watchdog_busy_since = 0;
+
+//The busy_since of the last iteration reported as stalled
+_Atomic uint64_t watchdog_reported = 0;
+
+//The instrumented section the event loop is in, or NULL
+_Atomic(const char*) watchdog_activity = NULL;
+
+//The event loop's backtrace, written by the signal handler on the event loop's thread
+void* watchdog_frames[WATCHDOG_FRAMES_MAX];
+
+//The number of frames in watchdog_frames, or -1 while the watchdog waits for them
+_Atomic int watchdog_frame_count = -1;
+
+pthread_t watchdog_loop_thread;
+pthread_t watchdog_thread;
+
+/**
+ * Records the backtrace of the event loop's thread, on which it runs as the
+ * handler for WATCHDOG_SIGNAL.
+ */
+void watchdog_handle_signal(int sig){
+    (void)sig;
+    int saved_errno = errno;
+    int count = 0;
+#ifdef __GLIBC__
+    count = backtrace(watchdog_frames, WATCHDOG_FRAMES_MAX);
+#endif
+    atomic_store_explicit(&watchdog_frame_count, count, memory_order_release);
+    errno = saved_errno;
+}
+
+/**
+ * Counts a stall against the activity it happened in.
+ */
+void watchdog_count(const char* activity){
+    size_t count = atomic_load_explicit(&watchdog_stall_count, memory_order_relaxed);
+    for(size_t i = 0; i < count; i++){
+        if(strcmp(watchdog_stalls[i].activity, activity) == 0){
+            atomic_fetch_add_explicit(&watchdog_stalls[i].count, 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    if(count == WATCHDOG_ACTIVITIES_MAX){
+        return;
+    }
+    watchdog_stalls[count].activity = activity;
+    atomic_init(&watchdog_stalls[count].count, 1);
+    atomic_store_explicit(&watchdog_stall_count, count + 1, memory_order_release);
+}
+
+/**
+ * Logs the backtrace of the event loop's thread, if it can be had.
+ */
+void watchdog_backtrace(){
+#ifdef __GLIBC__
+    atomic_store_explicit(&watchdog_frame_count, -1, memory_order_relaxed);
+    if(pthread_kill(watchdog_loop_thread, WATCHDOG_SIGNAL) != 0){
+        return;
+    }
+
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = 1000000};
+    int count = -1;
+    for(int i = 0; i < WATCHDOG_BACKTRACE_TIMEOUT && (count = atomic_load_explicit(&watchdog_frame_count, memory_order_acquire)) == -1; i++){
+        nanosleep(&ts, NULL);
+    }
+    if(count <= 0){
+        logmsg(LOG_WARNING, "watchdog: Could not get a backtrace of the event loop\n");
+        return;
+    }
+
+    char** symbols = backtrace_symbols(watchdog_frames, count);
+    if(symbols == NULL){
+        logmsg(LOG_WARNING, "watchdog: Could not get a backtrace of the event loop, the system is out of memory\n");
+        return;
+    }
+    //The first two frames are the signal handler and the signal trampoline
+    for(int i = 2; i < count; i++){
+        logmsg(LOG_WARNING, "watchdog:     #%d %s\n", i - 2, symbols[i]);
+    }
+    free(symbols);
+#endif
+}
+
+/**
+ * The watchdog thread, which reports each iteration of the event loop that
+ * runs longer than WATCHDOG_THRESHOLD once.
+ */
+void* watchdog_main(void* arg){
+    (void)arg;
+
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = WATCHDOG_THRESHOLD * 1000000L / 4};
+    while(true){
+        nanosleep(&ts, NULL);
+
+        uint64_t since = atomic_load_explicit(&watchdog_busy_since, memory_order_acquire);
+        if(since == 0 || since == atomic_load_explicit(&watchdog_reported, memory_order_relaxed)){
+            continue;
+        }
+        uint64_t stalled = metrics_now() - since;
+        if(stalled < WATCHDOG_THRESHOLD * 1000000ULL){
+            continue;
+        }
+
+        const char* activity = atomic_load_explicit(&watchdog_activity, memory_order_acquire);
+        if(activity == NULL){
+            activity = "event loop";
+        }
+        atomic_store_explicit(&watchdog_reported, since, memory_order_relaxed);
+        watchdog_count(activity);
+
+        logmsg(LOG_WARNING, "watchdog: Event loop has been stalled for %llu milliseconds in %s\n", (unsigned long long)(stalled / 1000000), activity);
+        watchdog_backtrace();
+    }
+
+    return NULL;
+}
+
+int watchdog_init(){
+    watchdog_loop_thread = pthread_self();
+
+#ifdef __GLIBC__
+    //The first call loads the unwinder, which mustn't happen for the first time in a signal handler
+    void* frame;
+    backtrace(&frame, 1);
+#endif
+
+    sigset_t mask_set;
+    sigfillset(&mask_set);
+    struct sigaction sa = {.sa_flags = SA_RESTART, .sa_handler = watchdog_handle_signal, .sa_mask = mask_set};
+    if(sigaction(WATCHDOG_SIGNAL, &sa, NULL) == -1){
+        logmsg(LOG_ERR, "watchdog: Failed to install signal handler for backtraces, %s\n", strerror(errno));
+        return -1;
+    }
+
+    //The watchdog thread must not take any of the signals that the event loop handles
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int ret = pthread_create(&watchdog_thread, NULL, watchdog_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(ret != 0){
+        logmsg(LOG_ERR, "watchdog: Could not start watchdog, %s\n", strerror(ret));
+        return -1;
+    }
+
+    return 0;
+}
+
+void watchdog_busy(uint64_t since){
+    atomic_store_explicit(&watchdog_busy_since, since, memory_order_release);
+}
+
+void watchdog_idle(){
+    uint64_t since = atomic_exchange_explicit(&watchdog_busy_since, 0, memory_order_acq_rel);
+    if(since != 0 && since == atomic_load_explicit(&watchdog_reported, memory_order_relaxed)){
+        logmsg(LOG_WARNING, "watchdog: Event loop recovered after %llu milliseconds\n", (unsigned long long)((metrics_now() - since) / 1000000));
+    }
+}
+
+const char* watchdog_enter(const char* activity){
+    return atomic_exchange_explicit(&watchdog_activity, activity, memory_order_acq_rel);
+}
+
+void watchdog_leave(const char* previous){
+    atomic_store_explicit(&watchdog_activity, previous, memory_order_release);
+}
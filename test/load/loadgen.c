@@ -0,0 +1,564 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+/*
+ * Drives a praetor binary end to end, entirely on localhost.
+ *
+ * A mock IRC server is started, and praetor is configured to connect to it as
+ * N networks, each of them M channels, with this program as its only plugin.
+ * Once every network has joined every channel, each channel receives K
+ * messages per second for the length of the run, and the following is
+ * measured:
+ *
+ *   processing rate   Each network is sent a PING every PING_INTERVAL ms.
+ *                     praetor handles lines in order, so its PONG means
+ *                     everything sent before the PING has been handled.
+ *   PING latency      The time from each PING to its PONG.
+ *   plugin latency    Each network is sent R messages per second starting with
+ *                     "!rtt". The plugin answers each of them, and the time
+ *                     until the answer reaches the server is measured.
+ *   memory growth     praetor's resident set size, once every network has
+ *                     joined, at its largest, and at the end of the run.
+ *   joins             The number of JOIN lines each network sent, and the
+ *                     time from its NICK until it was in every channel.
+ *
+ * If the server can't write to a network as fast as messages are due,
+ * messages are held back rather than queued without bound, and counted.
+ *
+ * When praetor starts this program as its plugin, it answers "!rtt" messages
+ * and nothing else.
+ *
+ * Usage: loadgen [-p praetor_path] [-n networks] [-m channels] [-k msgs/s]
+ *                [-r probes/s] [-d seconds] [-c cert_file -K key_file]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
+#include "mockircd.h"
+
+#define DEFAULT_PRAETOR "bin/praetor"
+#define DEFAULT_NETWORKS 4
+#define DEFAULT_CHANNELS 10
+#define DEFAULT_RATE 10
+#define DEFAULT_PROBES 10
+#define DEFAULT_DURATION 10
+
+//How often each network is sent a PING, in milliseconds
+#define PING_INTERVAL 100
+//How long praetor has to connect and join every channel, and to catch up at the end, in seconds
+#define SETTLE_TIMEOUT 30
+//Messages are held back from a network while this many bytes are waiting to be written to it
+#define BACKLOG_MAX 1048576
+
+#define PLUGIN_BUF_SIZE 65536
+#define PLUGIN_ANSWER_SIZE 64
+
+/**
+ * A network praetor is connected to, as seen by the mock server.
+ */
+struct load_network{
+    struct mockircd_client* client;
+    //Messages sent to the network, and held back because it fell behind
+    size_t sent, held;
+    //The number of messages known to have been handled, from the last PONG
+    size_t handled;
+    uint64_t next_ping;
+    uint64_t next_probe;
+    //When the network sent its NICK, and when it had joined every channel
+    uint64_t connected_at, joined_at;
+    size_t join_lines;
+};
+
+/**
+ * A PING or a probe that's waiting for an answer.
+ */
+struct load_probe{
+    uint64_t sent_at;
+    //For a PING, the number of messages sent to its network before it
+    size_t mark;
+    size_t network;
+    bool answered;
+};
+
+struct load_samples{
+    uint64_t* values;
+    size_t count, size;
+};
+
+struct mockircd server;
+
+struct load_network* networks = NULL;
+size_t network_count = DEFAULT_NETWORKS;
+size_t channel_count = DEFAULT_CHANNELS;
+
+struct load_probe* pings = NULL, * probes = NULL;
+size_t ping_count = 0, ping_size = 0, probe_count = 0, probe_size = 0;
+
+struct load_samples ping_latency, probe_latency;
+
+//The time at which the last PONG was received
+uint64_t last_pong = 0;
+
+uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void die(const char* msg){
+    fprintf(stderr, "loadgen: %s\n", msg);
+    exit(1);
+}
+
+void sample(struct load_samples* s, uint64_t value){
+    if(s->count == s->size){
+        s->size = s->size == 0 ? 1024 : s->size * 2;
+        if((s->values = realloc(s->values, s->size * sizeof(uint64_t))) == NULL){
+            die("Out of memory");
+        }
+    }
+    s->values[s->count++] = value;
+}
+
+int compare_u64(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+void report_latency(const char* name, struct load_samples* s){
+    if(s->count == 0){
+        printf("%-24s no samples\n", name);
+        return;
+    }
+    qsort(s->values, s->count, sizeof(uint64_t), compare_u64);
+    printf("%-24s p50 %.1f, p90 %.1f, p99 %.1f, max %.1f us (%zu samples)\n", name,
+        s->values[s->count / 2] / 1e3, s->values[(size_t)(0.9 * (s->count - 1))] / 1e3,
+        s->values[(size_t)(0.99 * (s->count - 1))] / 1e3, s->values[s->count - 1] / 1e3, s->count);
+}
+
+/**
+ * Starts tracking a PING or a probe.
+ *
+ * \return Its id.
+ */
+size_t track(struct load_probe** list, size_t* count, size_t* size, size_t network, size_t mark){
+    if(*count == *size){
+        *size = *size == 0 ? 1024 : *size * 2;
+        if((*list = realloc(*list, *size * sizeof(struct load_probe))) == NULL){
+            die("Out of memory");
+        }
+    }
+    (*list)[*count] = (struct load_probe){.sent_at = now_ns(), .mark = mark, .network = network, .answered = false};
+    return (*count)++;
+}
+
+/**
+ * Returns praetor's resident set size in kilobytes, or 0 if it can't be read.
+ */
+size_t rss(pid_t pid){
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE* f = fopen(path, "r");
+    if(f == NULL){
+        return 0;
+    }
+
+    char line[256];
+    size_t kb = 0;
+    while(fgets(line, sizeof(line), f) != NULL){
+        if(sscanf(line, "VmRSS: %zu kB", &kb) == 1){
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+void on_line(struct mockircd* m, struct mockircd_client* c, const struct mockircd_msg* msg){
+    (void)m;
+    uint64_t now = now_ns();
+
+    //Networks are told apart by their nicks, load0 through loadN
+    if(c->arg == NULL && strcmp(msg->cmd, "NICK") == 0 && msg->param_count > 0){
+        size_t idx;
+        if(sscanf(msg->params[0], "load%zu", &idx) == 1 && idx < network_count){
+            networks[idx].client = c;
+            networks[idx].connected_at = now;
+            c->arg = &networks[idx];
+        }
+        return;
+    }
+
+    struct load_network* n = c->arg;
+    if(n != NULL && strcmp(msg->cmd, "JOIN") == 0){
+        n->join_lines++;
+        if(n->joined_at == 0 && c->channels == channel_count){
+            n->joined_at = now;
+        }
+    }
+
+    if(strcmp(msg->cmd, "PONG") == 0 && msg->param_count > 0){
+        size_t id = strtoul(msg->params[msg->param_count - 1], NULL, 10);
+        if(id < ping_count && !pings[id].answered){
+            pings[id].answered = true;
+            sample(&ping_latency, now - pings[id].sent_at);
+            if(networks[pings[id].network].handled < pings[id].mark){
+                networks[pings[id].network].handled = pings[id].mark;
+            }
+            last_pong = now;
+        }
+    }
+    else if(strcmp(msg->cmd, "PRIVMSG") == 0 && msg->param_count > 1 && strncmp(msg->params[1], "rtt ", 4) == 0){
+        size_t id = strtoul(msg->params[1] + 4, NULL, 10);
+        if(id < probe_count && !probes[id].answered){
+            probes[id].answered = true;
+            sample(&probe_latency, now - probes[id].sent_at);
+        }
+    }
+}
+
+void on_close(struct mockircd* m, struct mockircd_client* c){
+    (void)m;
+    if(c->arg != NULL){
+        ((struct load_network*)c->arg)->client = NULL;
+    }
+}
+
+/**
+ * Runs as praetor's plugin, answering every "!rtt" message in the channel it
+ * came from.
+ */
+int plugin(){
+    char buf[PLUGIN_BUF_SIZE];
+    size_t len = 0;
+    ssize_t ret;
+    while((ret = read(STDIN_FILENO, buf + len, sizeof(buf) - len)) > 0){
+        len += ret;
+        size_t done = 0;
+        while(done < len){
+            while(done < len && (buf[done] == ' ' || buf[done] == '\n' || buf[done] == '\r' || buf[done] == '\t')){
+                done++;
+            }
+            json_error_t error;
+            json_t* obj = json_loadb(buf + done, len - done, JSON_DISABLE_EOF_CHECK, &error);
+            if(obj == NULL){
+                break;
+            }
+            done += error.position;
+
+            const char* network, * cmd, * target, * text;
+            if(json_unpack(obj, "{s:s, s:s, s:s, s:s}", "network", &network, "cmd", &cmd, "target", &target, "msg", &text) == 0
+                && strcmp(cmd, "PRIVMSG") == 0 && strncmp(text, "!rtt ", 5) == 0){
+                char answer[PLUGIN_ANSWER_SIZE];
+                snprintf(answer, sizeof(answer), "rtt %s", text + 5);
+                json_t* reply = json_pack("{s:s, s:s, s:s, s:s}", "network", network, "cmd", "PRIVMSG", "target", target, "msg", answer);
+                //Echoing the id lets praetor trace the reply
+                json_t* id = json_object_get(obj, "id");
+                if(reply != NULL && id != NULL){
+                    json_object_set(reply, "id", id);
+                }
+                char* out = reply == NULL ? NULL : json_dumps(reply, JSON_COMPACT);
+                if(out != NULL){
+                    size_t out_len = strlen(out);
+                    out[out_len] = '\n';
+                    for(size_t written = 0; written <= out_len;){
+                        ssize_t w = write(STDOUT_FILENO, out + written, out_len + 1 - written);
+                        if(w <= 0){
+                            return 1;
+                        }
+                        written += w;
+                    }
+                    free(out);
+                }
+                json_decref(reply);
+            }
+            json_decref(obj);
+        }
+        memmove(buf, buf + done, len - done);
+        len -= done;
+        if(len == sizeof(buf)){
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Writes a configuration file for praetor, with this program as its plugin.
+ */
+int write_config(const char* path, const char* self, const char* cert_file){
+    json_t* nets = json_array();
+    for(size_t i = 0; i < network_count; i++){
+        char name[32], host[64];
+        snprintf(name, sizeof(name), "load%zu", i);
+        //The certificate is issued to localhost
+        snprintf(host, sizeof(host), "%s:%u", cert_file != NULL ? "localhost" : "127.0.0.1", server.port);
+
+        json_t* channels = json_array();
+        for(size_t j = 0; j < channel_count; j++){
+            char channel[32];
+            snprintf(channel, sizeof(channel), "#c%zu", j);
+            json_array_append_new(channels, json_pack("{s:s}", "name", channel));
+        }
+
+        json_t* net = json_pack("{s:s, s:s, s:s, s:s, s:s, s:s, s:s, s:b, s:o}",
+            "name", name, "host", host, "nick", name, "alt_nick", "load?", "user", "load",
+            "real_name", "praetor load generator", "quit_msg", "done", "ssl", cert_file != NULL, "channels", channels);
+        if(cert_file != NULL){
+            json_object_set_new(net, "ca_file", json_string(cert_file));
+        }
+        json_array_append_new(nets, net);
+    }
+
+    json_t* root = json_pack("{s:o, s:[{s:s, s:s}]}", "networks", nets, "plugins", "name", "loadgen", "path", self);
+    if(root == NULL){
+        return -1;
+    }
+    int ret = json_dump_file(root, path, JSON_INDENT(2));
+    json_decref(root);
+    return ret;
+}
+
+/**
+ * Runs the mock server until every network has joined every channel, or the
+ * time runs out.
+ */
+bool settle(pid_t praetor){
+    uint64_t deadline = now_ns() + SETTLE_TIMEOUT * 1000000000ULL;
+    while(now_ns() < deadline){
+        if(waitpid(praetor, NULL, WNOHANG) == praetor){
+            return false;
+        }
+
+        size_t ready = 0;
+        for(size_t i = 0; i < network_count; i++){
+            ready += networks[i].client != NULL && networks[i].client->registered && networks[i].client->channels == channel_count;
+        }
+        if(ready == network_count){
+            return true;
+        }
+        mockircd_poll(&server, 10);
+    }
+    return false;
+}
+
+int main(int argc, char** argv){
+    if(getenv("PRAETOR_PLUGIN") != NULL){
+        return plugin();
+    }
+
+    const char* praetor_path = DEFAULT_PRAETOR, * cert_file = NULL, * key_file = NULL;
+    double rate = DEFAULT_RATE, probe_rate = DEFAULT_PROBES, duration = DEFAULT_DURATION;
+    int opt;
+    while((opt = getopt(argc, argv, "c:d:k:K:m:n:p:r:")) != -1){
+        switch(opt){
+            case 'c': cert_file = optarg; break;
+            case 'd': duration = strtod(optarg, NULL); break;
+            case 'k': rate = strtod(optarg, NULL); break;
+            case 'K': key_file = optarg; break;
+            case 'm': channel_count = strtoul(optarg, NULL, 10); break;
+            case 'n': network_count = strtoul(optarg, NULL, 10); break;
+            case 'p': praetor_path = optarg; break;
+            case 'r': probe_rate = strtod(optarg, NULL); break;
+            default:
+                die("Usage: loadgen [-p praetor_path] [-n networks] [-m channels] [-k msgs/s] [-r probes/s] [-d seconds] [-c cert_file -K key_file]");
+        }
+    }
+    if((cert_file == NULL) != (key_file == NULL)){
+        die("A certificate and its key must be given together");
+    }
+    if(network_count == 0 || channel_count == 0){
+        die("There must be at least one network and one channel");
+    }
+
+    //praetor runs plugins and reads certificates after changing directories
+    char self[4096], cert[4096], praetor[4096];
+    if(realpath(argv[0], self) == NULL || realpath(praetor_path, praetor) == NULL || (cert_file != NULL && realpath(cert_file, cert) == NULL)){
+        die("Could not resolve paths");
+    }
+
+    if((networks = calloc(network_count, sizeof(struct load_network))) == NULL){
+        die("Out of memory");
+    }
+    server.on_line = on_line;
+    server.on_close = on_close;
+    if(mockircd_init(&server, cert_file, key_file) == -1){
+        die("Could not start mock server");
+    }
+
+    char dir[64], config_path[96], log_path[96];
+    snprintf(dir, sizeof(dir), "/tmp/praetor-load.%d", (int)getpid());
+    if(mkdir(dir, S_IRWXU) == -1){
+        die("Could not create temporary directory");
+    }
+    snprintf(config_path, sizeof(config_path), "%s/praetor.json", dir);
+    snprintf(log_path, sizeof(log_path), "%s/praetor.log", dir);
+    if(write_config(config_path, self, cert_file != NULL ? cert : NULL) == -1){
+        die("Could not write configuration");
+    }
+
+    pid_t pid = fork();
+    if(pid == -1){
+        die("Could not start praetor");
+    }
+    if(pid == 0){
+        //Whatever praetor logs before it opens its log file goes there too
+        int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+        if(fd != -1){
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+        }
+        execl(praetor, praetor, "-f", "-l", log_path, "-c", config_path, (char*)NULL);
+        _exit(127);
+    }
+
+    printf("%-24s %zu networks, %zu channels each, %.1f msgs/s per channel, %.1f probes/s per network, %.1f s%s\n",
+        "load", network_count, channel_count, rate, probe_rate, duration, cert_file != NULL ? ", TLS" : "");
+
+    if(!settle(pid)){
+        kill(pid, SIGTERM);
+        fprintf(stderr, "loadgen: praetor did not join every channel in time, see %s\n", log_path);
+        return 1;
+    }
+    size_t rss_start = rss(pid), rss_peak = rss_start;
+
+    uint64_t start = now_ns(), end = start + (uint64_t)(duration * 1e9);
+    for(size_t i = 0; i < network_count; i++){
+        networks[i].next_ping = start;
+        networks[i].next_probe = start;
+    }
+
+    size_t offered = 0;
+    uint64_t next_rss = start;
+    for(uint64_t now = start; now < end; now = now_ns()){
+        //Everything that's come due since the last pass
+        size_t due = (size_t)((now - start) / 1e9 * rate * channel_count);
+        for(size_t i = 0; i < network_count; i++){
+            struct load_network* n = &networks[i];
+            if(n->client == NULL){
+                continue;
+            }
+
+            while(n->sent + n->held < due){
+                if(n->client->send_len > BACKLOG_MAX){
+                    n->held++;
+                    continue;
+                }
+                size_t seq = n->sent + n->held;
+                mockircd_send(n->client, ":user%zu!user@localhost PRIVMSG #c%zu :load message %zu, the quick brown fox jumps over the lazy dog\r\n",
+                    seq % 97, seq % channel_count, seq);
+                n->sent++;
+            }
+
+            if(probe_rate > 0 && now >= n->next_probe){
+                size_t id = track(&probes, &probe_count, &probe_size, i, 0);
+                mockircd_send(n->client, ":prober!user@localhost PRIVMSG #c0 :!rtt %zu\r\n", id);
+                n->next_probe += (uint64_t)(1e9 / probe_rate);
+            }
+            if(now >= n->next_ping){
+                size_t id = track(&pings, &ping_count, &ping_size, i, n->sent);
+                mockircd_send(n->client, "PING :%zu\r\n", id);
+                n->next_ping += PING_INTERVAL * 1000000ULL;
+            }
+        }
+        offered = due * network_count;
+
+        if(now >= next_rss){
+            size_t kb = rss(pid);
+            rss_peak = kb > rss_peak ? kb : rss_peak;
+            next_rss += 100000000ULL;
+        }
+
+        mockircd_poll(&server, 1);
+    }
+
+    //A last PING for each network tells us when praetor has caught up
+    size_t* final = calloc(network_count, sizeof(size_t));
+    if(final == NULL){
+        die("Out of memory");
+    }
+    for(size_t i = 0; i < network_count; i++){
+        if(networks[i].client != NULL){
+            final[i] = track(&pings, &ping_count, &ping_size, i, networks[i].sent);
+            mockircd_send(networks[i].client, "PING :%zu\r\n", final[i]);
+        }
+    }
+    uint64_t deadline = now_ns() + SETTLE_TIMEOUT * 1000000000ULL;
+    bool caught_up = false;
+    while(!caught_up && now_ns() < deadline){
+        mockircd_poll(&server, 10);
+        caught_up = true;
+        for(size_t i = 0; i < network_count; i++){
+            caught_up = caught_up && networks[i].client != NULL && pings[final[i]].answered;
+        }
+    }
+    //Give the plugin a moment to answer the last probes
+    for(uint64_t quiet = now_ns() + 200000000ULL; now_ns() < quiet;){
+        mockircd_poll(&server, 10);
+    }
+    size_t rss_end = rss(pid);
+    rss_peak = rss_end > rss_peak ? rss_end : rss_peak;
+
+    size_t sent = 0, held = 0, handled = 0, answered = 0, join_lines = 0;
+    uint64_t join_time = 0;
+    for(size_t i = 0; i < network_count; i++){
+        sent += networks[i].sent;
+        held += networks[i].held;
+        handled += networks[i].handled;
+        join_lines += networks[i].join_lines;
+        if(networks[i].joined_at - networks[i].connected_at > join_time){
+            join_time = networks[i].joined_at - networks[i].connected_at;
+        }
+    }
+    for(size_t i = 0; i < probe_count; i++){
+        answered += probes[i].answered;
+    }
+    double elapsed = ((caught_up ? last_pong : now_ns()) - start) / 1e9;
+
+    printf("%-24s %zu offered, %zu sent, %zu held back\n", "messages", offered, sent, held);
+    printf("%-24s %zu in %.3f s, %.0f msgs/s%s\n", "handled", handled, elapsed, handled / elapsed, caught_up ? "" : " (did not catch up)");
+    report_latency("PING latency", &ping_latency);
+    report_latency("plugin latency", &probe_latency);
+    printf("%-24s %zu sent, %zu answered\n", "probes", probe_count, answered);
+    printf("%-24s %.1f lines per network for %zu channels, all joined within %.1f ms\n", "joins", (double)join_lines / network_count, channel_count, join_time / 1e6);
+    printf("%-24s %zu kB at start, %zu kB peak, %zu kB at end, %+ld kB growth\n", "praetor RSS", rss_start, rss_peak, rss_end, (long)rss_end - (long)rss_start);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    mockircd_close(&server);
+    free(final);
+
+    if(caught_up){
+        unlink(config_path);
+        unlink(log_path);
+        rmdir(dir);
+    }
+    else{
+        fprintf(stderr, "loadgen: praetor's configuration and log are in %s\n", dir);
+    }
+
+    return caught_up ? 0 : 1;
+}
@@ -0,0 +1,389 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <tls.h>
+
+#include "mockircd.h"
+
+#define MOCKIRCD_BACKLOG 64
+
+/**
+ * Splits a line into its prefix, command, and parameters, in place.
+ *
+ * \return 0 on success.
+ * \return -1 if the line has no command.
+ */
+int mockircd_parse(char* line, struct mockircd_msg* msg){
+    memset(msg, 0, sizeof(struct mockircd_msg));
+
+    char* p = line;
+    if(*p == ':'){
+        msg->prefix = ++p;
+        p = strchr(p, ' ');
+        if(p == NULL){
+            return -1;
+        }
+        *p++ = '\0';
+    }
+    while(*p == ' '){
+        p++;
+    }
+    if(*p == '\0'){
+        return -1;
+    }
+
+    msg->cmd = p;
+    while((p = strchr(p, ' ')) != NULL){
+        *p++ = '\0';
+        while(*p == ' '){
+            p++;
+        }
+        if(*p == '\0' || msg->param_count == MOCKIRCD_PARAMS_MAX){
+            break;
+        }
+        if(*p == ':'){
+            msg->params[msg->param_count++] = p + 1;
+            break;
+        }
+        msg->params[msg->param_count++] = p;
+    }
+
+    return 0;
+}
+
+int mockircd_send(struct mockircd_client* c, const char* fmt, ...){
+    char line[MOCKIRCD_LINE_MAX + 1];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if(len < 0 || (size_t)len >= sizeof(line)){
+        return -1;
+    }
+
+    if(c->send_len + len > c->send_size){
+        size_t size = c->send_size == 0 ? 4096 : c->send_size;
+        while(size < c->send_len + len){
+            size *= 2;
+        }
+        void* tmp = realloc(c->send_buf, size);
+        if(tmp == NULL){
+            return -1;
+        }
+        c->send_buf = tmp;
+        c->send_size = size;
+    }
+    memcpy(c->send_buf + c->send_len, line, len);
+    c->send_len += len;
+
+    return 0;
+}
+
+/**
+ * Handles the parts of the protocol the mock server takes care of itself.
+ */
+void mockircd_handle(struct mockircd_client* c, const struct mockircd_msg* msg){
+    if(strcmp(msg->cmd, "NICK") == 0 && msg->param_count > 0){
+        snprintf(c->nick, sizeof(c->nick), "%s", msg->params[0]);
+    }
+    else if(strcmp(msg->cmd, "USER") == 0){
+        c->has_user = true;
+    }
+    else if(strcmp(msg->cmd, "PING") == 0 && msg->param_count > 0){
+        mockircd_send(c, ":%s PONG %s :%s\r\n", MOCKIRCD_NAME, MOCKIRCD_NAME, msg->params[0]);
+    }
+    else if(strcmp(msg->cmd, "JOIN") == 0 && msg->param_count > 0){
+        char channels[MOCKIRCD_LINE_MAX];
+        snprintf(channels, sizeof(channels), "%s", msg->params[0]);
+        char* save = NULL;
+        for(char* ch = strtok_r(channels, ",", &save); ch != NULL; ch = strtok_r(NULL, ",", &save)){
+            c->channels++;
+            mockircd_send(c, ":%s!user@localhost JOIN :%s\r\n", c->nick, ch);
+            mockircd_send(c, ":%s 366 %s %s :End of /NAMES list.\r\n", MOCKIRCD_NAME, c->nick, ch);
+        }
+    }
+    else if(strcmp(msg->cmd, "PART") == 0 && msg->param_count > 0 && c->channels > 0){
+        c->channels--;
+    }
+
+    //Clients may send NICK and USER in either order; JOINs sent early are let through
+    if(!c->registered && c->nick[0] != '\0' && c->has_user){
+        c->registered = true;
+        mockircd_send(c, ":%s 001 %s :Welcome to the mock IRC network %s\r\n", MOCKIRCD_NAME, c->nick, c->nick);
+        mockircd_send(c, ":%s 005 %s %s :are supported by this server\r\n", MOCKIRCD_NAME, c->nick, MOCKIRCD_ISUPPORT);
+        mockircd_send(c, ":%s 376 %s :End of /MOTD command.\r\n", MOCKIRCD_NAME, c->nick);
+    }
+}
+
+/**
+ * Disconnects a client, and removes it from the server.
+ */
+void mockircd_drop(struct mockircd* m, size_t idx){
+    struct mockircd_client* c = m->clients[idx];
+    if(m->on_close != NULL){
+        m->on_close(m, c);
+    }
+
+    if(c->ctx != NULL){
+        tls_close(c->ctx);
+        tls_free(c->ctx);
+    }
+    close(c->sock);
+    free(c->send_buf);
+    free(c);
+
+    m->clients[idx] = m->clients[--m->client_count];
+}
+
+/**
+ * Writes out as much of a client's queued lines as the socket will take.
+ *
+ * \return 0 on success.
+ * \return -1 if the client has gone away.
+ */
+int mockircd_flush(struct mockircd_client* c){
+    c->want_write = false;
+    size_t done = 0;
+    while(done < c->send_len){
+        ssize_t ret;
+        if(c->ctx != NULL){
+            ret = tls_write(c->ctx, c->send_buf + done, c->send_len - done);
+            if(ret == TLS_WANT_POLLOUT || ret == TLS_WANT_POLLIN){
+                c->want_write = ret == TLS_WANT_POLLOUT;
+                break;
+            }
+        }
+        else{
+            ret = send(c->sock, c->send_buf + done, c->send_len - done, MSG_NOSIGNAL);
+            if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                c->want_write = true;
+                break;
+            }
+        }
+        if(ret <= 0){
+            return -1;
+        }
+        done += ret;
+    }
+
+    memmove(c->send_buf, c->send_buf + done, c->send_len - done);
+    c->send_len -= done;
+    return 0;
+}
+
+/**
+ * Reads whatever a client has sent, and handles every complete line.
+ *
+ * \return 0 on success.
+ * \return -1 if the client has gone away.
+ */
+int mockircd_read(struct mockircd* m, struct mockircd_client* c){
+    while(true){
+        size_t room = sizeof(c->recv_buf) - 1 - c->recv_len;
+        ssize_t ret;
+        if(c->ctx != NULL){
+            ret = tls_read(c->ctx, c->recv_buf + c->recv_len, room);
+            if(ret == TLS_WANT_POLLIN || ret == TLS_WANT_POLLOUT){
+                c->want_write = ret == TLS_WANT_POLLOUT;
+                return 0;
+            }
+        }
+        else{
+            ret = recv(c->sock, c->recv_buf + c->recv_len, room, 0);
+            if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                return 0;
+            }
+        }
+        if(ret <= 0){
+            return -1;
+        }
+        c->recv_len += ret;
+        c->recv_buf[c->recv_len] = '\0';
+
+        char* line = c->recv_buf;
+        char* eol;
+        while((eol = strchr(line, '\n')) != NULL){
+            *eol = '\0';
+            if(eol > line && eol[-1] == '\r'){
+                eol[-1] = '\0';
+            }
+
+            struct mockircd_msg msg;
+            if(mockircd_parse(line, &msg) == 0){
+                mockircd_handle(c, &msg);
+                if(m->on_line != NULL){
+                    m->on_line(m, c, &msg);
+                }
+            }
+            line = eol + 1;
+        }
+
+        //A line that fills the whole buffer is cut short
+        c->recv_len -= line - c->recv_buf;
+        if(c->recv_len == sizeof(c->recv_buf) - 1){
+            c->recv_len = 0;
+        }
+        memmove(c->recv_buf, line, c->recv_len);
+    }
+}
+
+/**
+ * Accepts every connection waiting on the listening socket.
+ */
+void mockircd_accept(struct mockircd* m){
+    int sock;
+    while((sock = accept(m->listener, NULL, NULL)) != -1){
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        fcntl(sock, F_SETFD, FD_CLOEXEC);
+        //Latency is what's being measured; don't let Nagle's algorithm add to it
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        struct mockircd_client* c = calloc(1, sizeof(struct mockircd_client));
+        void* tmp = realloc(m->clients, (m->client_count + 1) * sizeof(struct mockircd_client*));
+        if(c == NULL || tmp == NULL){
+            free(c);
+            close(sock);
+            continue;
+        }
+        m->clients = tmp;
+        c->sock = sock;
+
+        if(m->tls != NULL && tls_accept_socket(m->tls, &c->ctx, sock) == -1){
+            fprintf(stderr, "mockircd: Could not accept TLS connection, %s\n", tls_error(m->tls));
+            free(c);
+            close(sock);
+            continue;
+        }
+        m->clients[m->client_count++] = c;
+    }
+}
+
+int mockircd_init(struct mockircd* m, const char* cert_file, const char* key_file){
+    m->tls = NULL;
+    m->clients = NULL;
+    m->client_count = 0;
+
+    if(cert_file != NULL){
+        struct tls_config* cfg = NULL;
+        if(tls_init() == -1 || (m->tls = tls_server()) == NULL || (cfg = tls_config_new()) == NULL){
+            fprintf(stderr, "mockircd: Could not set up TLS\n");
+            goto fail;
+        }
+        if(tls_config_set_cert_file(cfg, cert_file) == -1 || tls_config_set_key_file(cfg, key_file) == -1 || tls_configure(m->tls, cfg) == -1){
+            fprintf(stderr, "mockircd: Could not load certificate %s and key %s, %s\n", cert_file, key_file, tls_config_error(cfg));
+            tls_config_free(cfg);
+            goto fail;
+        }
+        tls_config_free(cfg);
+    }
+
+    if((m->listener = socket(AF_INET, SOCK_STREAM, 0)) == -1){
+        fprintf(stderr, "mockircd: Could not create socket, %s\n", strerror(errno));
+        goto fail;
+    }
+    fcntl(m->listener, F_SETFL, fcntl(m->listener, F_GETFL) | O_NONBLOCK);
+    fcntl(m->listener, F_SETFD, FD_CLOEXEC);
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if(bind(m->listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(m->listener, MOCKIRCD_BACKLOG) == -1 || getsockname(m->listener, (struct sockaddr*)&addr, &addr_len) == -1){
+        fprintf(stderr, "mockircd: Could not listen on 127.0.0.1, %s\n", strerror(errno));
+        close(m->listener);
+        goto fail;
+    }
+    m->port = ntohs(addr.sin_port);
+
+    return 0;
+
+    fail:
+        if(m->tls != NULL){
+            tls_free(m->tls);
+            m->tls = NULL;
+        }
+        return -1;
+}
+
+int mockircd_poll(struct mockircd* m, int timeout){
+    //Lines may have been queued since the last poll; don't wait on them
+    for(size_t i = 0; i < m->client_count;){
+        if(m->clients[i]->send_len > 0 && mockircd_flush(m->clients[i]) == -1){
+            mockircd_drop(m, i);
+            continue;
+        }
+        i++;
+    }
+
+    struct pollfd* fds = malloc((m->client_count + 1) * sizeof(struct pollfd));
+    if(fds == NULL){
+        return -1;
+    }
+    size_t count = m->client_count;
+    fds[0].fd = m->listener;
+    fds[0].events = POLLIN;
+    for(size_t i = 0; i < count; i++){
+        fds[i+1].fd = m->clients[i]->sock;
+        fds[i+1].events = POLLIN | (m->clients[i]->want_write ? POLLOUT : 0);
+    }
+
+    if(poll(fds, count + 1, timeout) == -1){
+        free(fds);
+        return errno == EINTR ? 0 : -1;
+    }
+
+    //Dropping a client moves the last one into its place, so go backwards
+    for(size_t i = count; i > 0; i--){
+        struct mockircd_client* c = m->clients[i-1];
+        if(fds[i].revents == 0){
+            continue;
+        }
+        if(((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && mockircd_read(m, c) == -1) || mockircd_flush(c) == -1){
+            mockircd_drop(m, i-1);
+        }
+    }
+    if(fds[0].revents & POLLIN){
+        mockircd_accept(m);
+    }
+
+    free(fds);
+    return 0;
+}
+
+void mockircd_close(struct mockircd* m){
+    while(m->client_count > 0){
+        mockircd_drop(m, m->client_count - 1);
+    }
+    free(m->clients);
+    m->clients = NULL;
+    close(m->listener);
+    if(m->tls != NULL){
+        tls_free(m->tls);
+        m->tls = NULL;
+    }
+}
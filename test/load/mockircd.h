@@ -0,0 +1,166 @@
+/*
+* This source file is part of praetor, a free and open-source IRC bot,
+* designed to be robust, portable, and easily extensible.
+*
+* Copyright (c) 2015-2018 David Zero
+* All rights reserved.
+*
+* The following code is licensed for use, modification, and redistribution
+* according to the terms of the Revised BSD License. The text of this license
+* can be found in the "LICENSE" file bundled with this source distribution.
+*/
+
+#ifndef PRAETOR_MOCKIRCD
+#define PRAETOR_MOCKIRCD
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tls.h>
+
+/**
+ * The name the mock server goes by, as the prefix of its own messages.
+ */
+#define MOCKIRCD_NAME "mock.irc"
+
+/**
+ * What the mock server says it supports in its RPL_ISUPPORT reply, which it
+ * sends after RPL_WELCOME.
+ */
+#define MOCKIRCD_ISUPPORT "CASEMAPPING=rfc1459 CHANLIMIT=#&:100 CHANMODES=beI,k,l,imnpst MODES=4 NICKLEN=30 PREFIX=(ov)@+ TARGMAX=JOIN:,PART:,PRIVMSG:4,NOTICE:4"
+
+/**
+ * The longest line the mock server reads, including its CRLF. Longer lines
+ * are cut short.
+ */
+#define MOCKIRCD_LINE_MAX 512
+
+#define MOCKIRCD_PARAMS_MAX 15
+#define MOCKIRCD_NICK_MAX 32
+
+/**
+ * A line received by the mock server, split into its parts. The strings point
+ * into the client's receive buffer, and are only valid during the callback
+ * they're passed to.
+ */
+struct mockircd_msg{
+    /**
+     * The prefix, without its leading colon, or NULL.
+     */
+    const char* prefix;
+    const char* cmd;
+    /**
+     * The parameters, with the trailing parameter's colon removed.
+     */
+    const char* params[MOCKIRCD_PARAMS_MAX];
+    size_t param_count;
+};
+
+/**
+ * A connection to the mock server.
+ */
+struct mockircd_client{
+    int sock;
+    /**
+     * The TLS session for this connection, or NULL if it's plaintext.
+     */
+    struct tls* ctx;
+    /**
+     * Set when the last TLS operation needs the socket to be writable.
+     */
+    bool want_write;
+    char nick[MOCKIRCD_NICK_MAX];
+    bool has_user;
+    /**
+     * Set once both NICK and USER have been received, and welcomed.
+     */
+    bool registered;
+    /**
+     * The number of channels the client is in.
+     */
+    size_t channels;
+    char recv_buf[MOCKIRCD_LINE_MAX * 2];
+    size_t recv_len;
+    /**
+     * Lines waiting to be written to the client.
+     */
+    char* send_buf;
+    size_t send_len, send_size;
+    /**
+     * Belongs to the user of the mock server.
+     */
+    void* arg;
+};
+
+/**
+ * A mock IRC server, which speaks just enough RFC 2812 to register clients,
+ * let them join and part channels, and answer their PINGs. Everything it
+ * receives, including what it handles itself, is passed on to \c on_line.
+ *
+ * The server is driven by calling mockircd_poll(), and only ever listens on
+ * the loopback interface.
+ */
+struct mockircd{
+    int listener;
+    /**
+     * The port the server is listening on.
+     */
+    uint16_t port;
+    /**
+     * The TLS context for accepting connections, or NULL if the server speaks
+     * plaintext.
+     */
+    struct tls* tls;
+    struct mockircd_client** clients;
+    size_t client_count;
+    /**
+     * Called for every line received. May be NULL.
+     */
+    void (*on_line)(struct mockircd* m, struct mockircd_client* c, const struct mockircd_msg* msg);
+    /**
+     * Called when a client disconnects, right before it's freed. May be NULL.
+     */
+    void (*on_close)(struct mockircd* m, struct mockircd_client* c);
+    /**
+     * Belongs to the user of the mock server.
+     */
+    void* arg;
+};
+
+/**
+ * Starts a mock server listening on an unused port of 127.0.0.1.
+ *
+ * \param m         The server. Its callbacks and \c arg are left alone.
+ * \param cert_file If not NULL, the server speaks TLS, and presents the
+ *                  PEM-encoded certificate in this file.
+ * \param key_file  The private key for \c cert_file.
+ *
+ * \return 0 on success.
+ * \return -1 on failure.
+ */
+int mockircd_init(struct mockircd* m, const char* cert_file, const char* key_file);
+
+/**
+ * Queues a line for a client. The line must include its CRLF.
+ *
+ * \return 0 on success.
+ * \return -1 if the line is too long, or the system is out of memory.
+ */
+int mockircd_send(struct mockircd_client* c, const char* fmt, ...);
+
+/**
+ * Waits up to \c timeout milliseconds for something to happen, and handles
+ * everything that did.
+ *
+ * \return 0 on success.
+ * \return -1 if polling failed.
+ */
+int mockircd_poll(struct mockircd* m, int timeout);
+
+/**
+ * Disconnects every client, and stops listening.
+ */
+void mockircd_close(struct mockircd* m);
+
+#endif
@@ -1,5 +1,460 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
 #include "unity.h"
 
+#include "casemap.h"
+#include "config.h"
+#include "htable.h"
+#include "irc.h"
+#include "ircmsg.h"
+#include "isupport.h"
+#include "queue.h"
+#include "state.h"
+#include "supervisor.h"
+
 void testWillAlwaysPass(){
     TEST_ASSERT_EQUAL_INT(44, 44);
 }
+
+void testSupervisorDelayDoubles(){
+    TEST_ASSERT_EQUAL_UINT64(1000, supervisor_delay(1));
+    TEST_ASSERT_EQUAL_UINT64(2000, supervisor_delay(2));
+    TEST_ASSERT_EQUAL_UINT64(4000, supervisor_delay(3));
+    TEST_ASSERT_EQUAL_UINT64(8000, supervisor_delay(4));
+    TEST_ASSERT_EQUAL_UINT64(16000, supervisor_delay(5));
+}
+
+void testSupervisorDelayQuarantines(){
+    TEST_ASSERT_EQUAL_UINT64(0, supervisor_delay(0));
+    TEST_ASSERT_EQUAL_UINT64(0, supervisor_delay(6));
+    TEST_ASSERT_EQUAL_UINT64(0, supervisor_delay(64));
+}
+
+void testCasemapAsciiFoldsLettersOnly(){
+    char buf[16];
+    casemap_fold(buf, "#A[]\\~Z", 7, CASEMAP_ASCII);
+    TEST_ASSERT_EQUAL_STRING_LEN("#a[]\\~z", buf, 7);
+    TEST_ASSERT_TRUE(casemap_equal("#FOO", "#foo", 4, CASEMAP_ASCII));
+    TEST_ASSERT_FALSE(casemap_equal("[]\\~", "{}|^", 4, CASEMAP_ASCII));
+}
+
+void testCasemapRfc1459FoldsBrackets(){
+    char buf[16];
+    casemap_fold(buf, "#A[]\\~Z", 7, CASEMAP_RFC1459);
+    TEST_ASSERT_EQUAL_STRING_LEN("#a{}|~z", buf, 7);
+    casemap_fold(buf, "^", 1, CASEMAP_RFC1459);
+    TEST_ASSERT_EQUAL_STRING_LEN("~", buf, 1);
+    TEST_ASSERT_TRUE(casemap_equal("[]\\^", "{}|~", 4, CASEMAP_RFC1459));
+    TEST_ASSERT_TRUE(casemap_equal("{}|~", "[]\\^", 4, CASEMAP_RFC1459));
+    TEST_ASSERT_TRUE(casemap_equal("^", "~", 1, CASEMAP_RFC1459));
+}
+
+void testCasemapStrictRfc1459KeepsTilde(){
+    char buf[16];
+    casemap_fold(buf, "#A[]\\~Z", 7, CASEMAP_STRICT_RFC1459);
+    TEST_ASSERT_EQUAL_STRING_LEN("#a{}|~z", buf, 7);
+    TEST_ASSERT_TRUE(casemap_equal("[]\\", "{}|", 3, CASEMAP_STRICT_RFC1459));
+    TEST_ASSERT_FALSE(casemap_equal("~", "^", 1, CASEMAP_STRICT_RFC1459));
+    casemap_fold(buf, "^", 1, CASEMAP_STRICT_RFC1459);
+    TEST_ASSERT_EQUAL_STRING_LEN("^", buf, 1);
+}
+
+void testCasemapNames(){
+    enum casemapping mapping;
+    TEST_ASSERT_EQUAL_INT(0, casemap_from_name("ascii", &mapping));
+    TEST_ASSERT_EQUAL_INT(CASEMAP_ASCII, mapping);
+    TEST_ASSERT_EQUAL_INT(0, casemap_from_name("rfc1459", &mapping));
+    TEST_ASSERT_EQUAL_INT(CASEMAP_RFC1459, mapping);
+    TEST_ASSERT_EQUAL_INT(0, casemap_from_name("strict-rfc1459", &mapping));
+    TEST_ASSERT_EQUAL_INT(CASEMAP_STRICT_RFC1459, mapping);
+    TEST_ASSERT_EQUAL_INT(-1, casemap_from_name("rfc7613", &mapping));
+    TEST_ASSERT_EQUAL_STRING("strict-rfc1459", casemap_name(CASEMAP_STRICT_RFC1459));
+}
+
+/**
+ * Looks up a NUL-terminated key, the way channel and nick tables are keyed.
+ */
+void* lookup(struct htable* table, const char* key){
+    return htable_lookup(table, (const uint8_t*)key, strlen(key)+1);
+}
+
+void testHtableLookupsUnderEachCasemapping(){
+    int value = 0;
+    for(int mapping = 0; mapping < CASEMAP_COUNT; mapping++){
+        struct htable* table = htable_create(8);
+        TEST_ASSERT_NOT_NULL(table);
+        TEST_ASSERT_EQUAL_INT(0, htable_set_casemapping(table, mapping));
+        TEST_ASSERT_EQUAL_INT(0, htable_add(table, (const uint8_t*)"#Foo[1]~", strlen("#Foo[1]~")+1, &value));
+
+        TEST_ASSERT_EQUAL_PTR(&value, lookup(table, "#Foo[1]~"));
+        TEST_ASSERT_EQUAL_PTR(&value, lookup(table, "#FOO[1]~"));
+        TEST_ASSERT_EQUAL_PTR(mapping == CASEMAP_ASCII ? NULL : &value, lookup(table, "#foo{1}~"));
+        TEST_ASSERT_EQUAL_PTR(mapping == CASEMAP_RFC1459 ? &value : NULL, lookup(table, "#foo{1}^"));
+        TEST_ASSERT_NULL(lookup(table, "#foo[2]~"));
+
+        //Removing by another case of the key removes the mapping
+        TEST_ASSERT_EQUAL_INT(0, htable_remove(table, (const uint8_t*)"#FOO[1]~", strlen("#FOO[1]~")+1));
+        TEST_ASSERT_NULL(lookup(table, "#Foo[1]~"));
+        htable_destroy(table);
+    }
+}
+
+void testHtableCasemappingCollisionLeavesTable(){
+    int a = 0, b = 0;
+    struct htable* table = htable_create(8);
+    TEST_ASSERT_NOT_NULL(table);
+    TEST_ASSERT_EQUAL_INT(0, htable_set_casemapping(table, CASEMAP_ASCII));
+    TEST_ASSERT_EQUAL_INT(0, htable_add(table, (const uint8_t*)"#a[", 4, &a));
+    TEST_ASSERT_EQUAL_INT(0, htable_add(table, (const uint8_t*)"#a{", 4, &b));
+
+    TEST_ASSERT_EQUAL_INT(-1, htable_set_casemapping(table, CASEMAP_RFC1459));
+    TEST_ASSERT_EQUAL_PTR(&a, lookup(table, "#A["));
+    TEST_ASSERT_EQUAL_PTR(&b, lookup(table, "#A{"));
+    htable_destroy(table);
+}
+
+/**
+ * Sets up just enough of a network for isupport_update() to apply tokens to.
+ */
+void network_init(struct network* n){
+    memset(n, 0, sizeof(struct network));
+    n->name = "test";
+    n->casemapping = CASEMAP_DEFAULT;
+    n->channels = htable_create(8);
+    n->admins = htable_create(8);
+    isupport_init(&n->isupport);
+}
+
+void network_free(struct network* n){
+    htable_destroy(n->channels);
+    htable_destroy(n->admins);
+}
+
+/**
+ * Hands a network an RPL_ISUPPORT reply holding the given tokens.
+ */
+void send_isupport(struct network* n, const char* tokens){
+    char line[512];
+    snprintf(line, sizeof(line), ":irc.example.net 005 praetor %s :are supported by this server", tokens);
+    struct ircmsg* msg = ircmsg_parse(n->name, line, strlen(line));
+    TEST_ASSERT_NOT_NULL(msg);
+    isupport_update(n, msg);
+    ircmsg_free(msg);
+    free(msg);
+}
+
+void testIsupportCasemapping(){
+    struct network n;
+    network_init(&n);
+    TEST_ASSERT_EQUAL_INT(CASEMAP_RFC1459, n.casemapping);
+
+    send_isupport(&n, "CASEMAPPING=ascii");
+    TEST_ASSERT_EQUAL_INT(CASEMAP_ASCII, n.casemapping);
+    send_isupport(&n, "CASEMAPPING=strict-rfc1459");
+    TEST_ASSERT_EQUAL_INT(CASEMAP_STRICT_RFC1459, n.casemapping);
+    //Unknown casemappings leave the one in use alone
+    send_isupport(&n, "CASEMAPPING=rfc7613");
+    TEST_ASSERT_EQUAL_INT(CASEMAP_STRICT_RFC1459, n.casemapping);
+    send_isupport(&n, "-CASEMAPPING");
+    TEST_ASSERT_EQUAL_INT(CASEMAP_DEFAULT, n.casemapping);
+    network_free(&n);
+}
+
+void testIsupportPrefix(){
+    struct network n;
+    network_init(&n);
+
+    send_isupport(&n, "PREFIX=(qaohv)~&@%+");
+    TEST_ASSERT_EQUAL_STRING("qaohv", n.isupport.prefix_modes);
+    TEST_ASSERT_EQUAL_STRING("~&@%+", n.isupport.prefix_symbols);
+    //An empty PREFIX means there are none
+    send_isupport(&n, "PREFIX=");
+    TEST_ASSERT_EQUAL_STRING("", n.isupport.prefix_modes);
+    TEST_ASSERT_EQUAL_STRING("", n.isupport.prefix_symbols);
+    send_isupport(&n, "-PREFIX");
+    TEST_ASSERT_EQUAL_STRING(STATE_PREFIX_MODES, n.isupport.prefix_modes);
+    TEST_ASSERT_EQUAL_STRING(STATE_PREFIX_SYMBOLS, n.isupport.prefix_symbols);
+    network_free(&n);
+}
+
+void testIsupportMalformedPrefix(){
+    struct network n;
+    network_init(&n);
+    send_isupport(&n, "PREFIX=(ov)@+");
+
+    //Mismatched counts, no parentheses, and too many prefixes are all ignored
+    send_isupport(&n, "PREFIX=(ov)@");
+    send_isupport(&n, "PREFIX=ov@+");
+    send_isupport(&n, "PREFIX=(ov@+");
+    send_isupport(&n, "PREFIX=(abcdefghi)!\"#$%&'()");
+    TEST_ASSERT_EQUAL_STRING("ov", n.isupport.prefix_modes);
+    TEST_ASSERT_EQUAL_STRING("@+", n.isupport.prefix_symbols);
+    network_free(&n);
+}
+
+void testIsupportChantypes(){
+    struct network n;
+    network_init(&n);
+    TEST_ASSERT_TRUE(isupport_is_channel(&n.isupport, "+modeless"));
+
+    send_isupport(&n, "CHANTYPES=#");
+    TEST_ASSERT_EQUAL_STRING("#", n.isupport.chantypes);
+    TEST_ASSERT_TRUE(isupport_is_channel(&n.isupport, "#praetor"));
+    TEST_ASSERT_FALSE(isupport_is_channel(&n.isupport, "&local"));
+    TEST_ASSERT_FALSE(isupport_is_channel(&n.isupport, ""));
+
+    //A network with no channels
+    send_isupport(&n, "CHANTYPES=");
+    TEST_ASSERT_FALSE(isupport_is_channel(&n.isupport, "#praetor"));
+
+    send_isupport(&n, "CHANTYPES=#&");
+    send_isupport(&n, "CHANTYPES=#&+!~.-=^*$");
+    send_isupport(&n, "CHANTYPES=#,&");
+    TEST_ASSERT_EQUAL_STRING("#&", n.isupport.chantypes);
+
+    send_isupport(&n, "-CHANTYPES");
+    TEST_ASSERT_EQUAL_STRING(IRCMSG_CHANNEL_PREFIXES, n.isupport.chantypes);
+    network_free(&n);
+}
+
+void testIsupportNegatedTokens(){
+    struct network n;
+    network_init(&n);
+
+    send_isupport(&n, "LINELEN=2048 NICKLEN=30 MODES=6 TARGMAX=PRIVMSG:4,JOIN: CHANLIMIT=#:25");
+    TEST_ASSERT_EQUAL_size_t(2048, n.isupport.linelen);
+    TEST_ASSERT_EQUAL_size_t(30, n.isupport.nicklen);
+    TEST_ASSERT_EQUAL_size_t(6, n.isupport.modes);
+    TEST_ASSERT_EQUAL_size_t(4, isupport_targmax(&n.isupport, "PRIVMSG"));
+    TEST_ASSERT_EQUAL_size_t(ISUPPORT_UNLIMITED, isupport_targmax(&n.isupport, "JOIN"));
+    TEST_ASSERT_EQUAL_size_t(25, isupport_chanlimit(&n.isupport, "#praetor"));
+
+    send_isupport(&n, "-LINELEN -NICKLEN -MODES -TARGMAX -CHANLIMIT");
+    TEST_ASSERT_EQUAL_size_t(IRCMSG_SIZE_MAX, n.isupport.linelen);
+    TEST_ASSERT_EQUAL_size_t(ISUPPORT_UNLIMITED, n.isupport.nicklen);
+    TEST_ASSERT_EQUAL_size_t(3, n.isupport.modes);
+    TEST_ASSERT_EQUAL_size_t(1, isupport_targmax(&n.isupport, "PRIVMSG"));
+    TEST_ASSERT_EQUAL_size_t(ISUPPORT_UNLIMITED, isupport_chanlimit(&n.isupport, "#praetor"));
+    network_free(&n);
+}
+
+void testIsupportMalformedNumbers(){
+    struct network n;
+    network_init(&n);
+
+    //Values that aren't numbers fall back to what's assumed, and LINELEN is clamped
+    send_isupport(&n, "LINELEN=lots NICKLEN=-1 MODES=99999999999999999999999");
+    TEST_ASSERT_EQUAL_size_t(IRCMSG_SIZE_MAX, n.isupport.linelen);
+    TEST_ASSERT_EQUAL_size_t(ISUPPORT_UNLIMITED, n.isupport.nicklen);
+    TEST_ASSERT_EQUAL_size_t(3, n.isupport.modes);
+    send_isupport(&n, "LINELEN=100");
+    TEST_ASSERT_EQUAL_size_t(IRCMSG_SIZE_MAX, n.isupport.linelen);
+    send_isupport(&n, "LINELEN=1000000");
+    TEST_ASSERT_EQUAL_size_t(ISUPPORT_LINELEN_MAX, n.isupport.linelen);
+
+    //Limits without a name, or with one too long to keep, are skipped
+    send_isupport(&n, "TARGMAX=:4,AVERYLONGCOMMANDNAME:2,NOTICE:x,PRIVMSG:3");
+    TEST_ASSERT_EQUAL_size_t(2, n.isupport.targmax_count);
+    TEST_ASSERT_EQUAL_size_t(1, isupport_targmax(&n.isupport, "NOTICE"));
+    TEST_ASSERT_EQUAL_size_t(3, isupport_targmax(&n.isupport, "PRIVMSG"));
+    network_free(&n);
+}
+
+/**
+ * Queues a line on a network, as praetor does with everything it sends.
+ */
+void send_line(struct network* n, const char* line){
+    TEST_ASSERT_EQUAL_INT(0, irc_send(n, (char*)line, strlen(line)));
+}
+
+/**
+ * Checks the line at the front of a network's send queue, and removes it.
+ */
+void expect_line(struct network* n, const char* line){
+    struct item* itm = queue_dequeue(n->send_queue);
+    TEST_ASSERT_NOT_NULL(itm);
+    TEST_ASSERT_EQUAL_size_t(strlen(line), itm->size);
+    TEST_ASSERT_EQUAL_MEMORY(line, itm->value, itm->size);
+    free(itm);
+}
+
+void testCoalesceNeverTouchesTheHead(){
+    struct network n;
+    network_init(&n);
+    n.send_queue = queue_create();
+
+    //The head may be partly written already
+    send_line(&n, "JOIN #a\r\n");
+    send_line(&n, "JOIN #b\r\n");
+    send_line(&n, "JOIN #c\r\n");
+    TEST_ASSERT_EQUAL_size_t(2, queue_get_size(n.send_queue));
+    expect_line(&n, "JOIN #a\r\n");
+    expect_line(&n, "JOIN #b,#c\r\n");
+
+    queue_destroy(n.send_queue);
+    network_free(&n);
+}
+
+void testCoalesceKeepsKeysInLine(){
+    struct network n;
+    network_init(&n);
+    n.send_queue = queue_create();
+
+    send_line(&n, "PING :x\r\n");
+    send_line(&n, "JOIN #a\r\n");
+    send_line(&n, "JOIN #b key\r\n");
+    send_line(&n, "JOIN #c\r\n");
+    expect_line(&n, "PING :x\r\n");
+    expect_line(&n, "JOIN #b,#a,#c key\r\n");
+
+    queue_destroy(n.send_queue);
+    network_free(&n);
+}
+
+void testCoalesceRefusesDifferentLines(){
+    struct network n;
+    network_init(&n);
+    n.send_queue = queue_create();
+    send_isupport(&n, "TARGMAX=PRIVMSG:4,NOTICE:4");
+
+    send_line(&n, "PING :x\r\n");
+    send_line(&n, "PRIVMSG #a :hello\r\n");
+    send_line(&n, "PRIVMSG #b :goodbye\r\n");
+    send_line(&n, "NOTICE #c :goodbye\r\n");
+    send_line(&n, "JOIN #d\r\n");
+    //The same target twice might be sent to once, or twice
+    send_line(&n, "JOIN #D\r\n");
+    send_line(&n, "JOIN 0\r\n");
+    send_line(&n, "JOIN #e\r\n");
+    TEST_ASSERT_EQUAL_size_t(8, queue_get_size(n.send_queue));
+    expect_line(&n, "PING :x\r\n");
+    expect_line(&n, "PRIVMSG #a :hello\r\n");
+    expect_line(&n, "PRIVMSG #b :goodbye\r\n");
+    expect_line(&n, "NOTICE #c :goodbye\r\n");
+    expect_line(&n, "JOIN #d\r\n");
+    expect_line(&n, "JOIN #D\r\n");
+    expect_line(&n, "JOIN 0\r\n");
+    expect_line(&n, "JOIN #e\r\n");
+
+    queue_destroy(n.send_queue);
+    network_free(&n);
+}
+
+void testCoalesceHonorsTargmax(){
+    struct network n;
+    network_init(&n);
+    n.send_queue = queue_create();
+
+    //Without TARGMAX or MAXTARGETS, a PRIVMSG takes a single target
+    send_line(&n, "PING :x\r\n");
+    send_line(&n, "PRIVMSG #a :hi\r\n");
+    send_line(&n, "PRIVMSG #b :hi\r\n");
+    TEST_ASSERT_EQUAL_size_t(3, queue_get_size(n.send_queue));
+
+    send_isupport(&n, "TARGMAX=PRIVMSG:3");
+    send_line(&n, "PRIVMSG #c :hi\r\n");
+    send_line(&n, "PRIVMSG #d :hi\r\n");
+    send_line(&n, "PRIVMSG #e :hi\r\n");
+    expect_line(&n, "PING :x\r\n");
+    expect_line(&n, "PRIVMSG #a :hi\r\n");
+    expect_line(&n, "PRIVMSG #b,#c,#d :hi\r\n");
+    expect_line(&n, "PRIVMSG #e :hi\r\n");
+
+    queue_destroy(n.send_queue);
+    network_free(&n);
+}
+
+void testCoalesceHonorsLinelen(){
+    struct network n;
+    network_init(&n);
+    n.send_queue = queue_create();
+
+    //Channel names of 100 characters, five of which fit in a 512 byte line, with JOIN and CRLF
+    char channels[8][128];
+    char line[160];
+    send_line(&n, "PING :x\r\n");
+    for(size_t i = 0; i < 8; i++){
+        snprintf(channels[i], sizeof(channels[i]), "#%099zu", i);
+        snprintf(line, sizeof(line), "JOIN %s\r\n", channels[i]);
+        send_line(&n, line);
+    }
+    TEST_ASSERT_EQUAL_size_t(3, queue_get_size(n.send_queue));
+
+    expect_line(&n, "PING :x\r\n");
+    for(size_t i = 0; i < 2; i++){
+        struct item* itm = queue_dequeue(n.send_queue);
+        TEST_ASSERT_NOT_NULL(itm);
+        TEST_ASSERT_TRUE(itm->size <= n.isupport.linelen);
+        free(itm);
+    }
+
+    //A longer LINELEN lets more channels share a line
+    send_isupport(&n, "LINELEN=1024");
+    send_line(&n, "PING :x\r\n");
+    for(size_t i = 0; i < 8; i++){
+        snprintf(line, sizeof(line), "JOIN %s\r\n", channels[i]);
+        send_line(&n, line);
+    }
+    TEST_ASSERT_EQUAL_size_t(2, queue_get_size(n.send_queue));
+    expect_line(&n, "PING :x\r\n");
+    struct item* itm = queue_dequeue(n.send_queue);
+    TEST_ASSERT_NOT_NULL(itm);
+    TEST_ASSERT_EQUAL_size_t(5 + (8 * 100) + 7 + 2, itm->size);
+    free(itm);
+
+    queue_destroy(n.send_queue);
+    network_free(&n);
+}
+
+/**
+ * Writes a configuration file holding a single TLS network.
+ */
+void write_config(const char* path, const char* quit_msg){
+    FILE* f = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL(f);
+    fprintf(f, "{\"networks\": [{\"name\": \"tls\", \"host\": \"irc.example.net:6697\", \"ssl\": true, \"ca_file\": \"/etc/ssl/ca.pem\","
+        " \"nick\": \"praetor\", \"alt_nick\": \"praetor_\", \"user\": \"praetor\", \"real_name\": \"praetor\", \"quit_msg\": \"%s\"}]}\n", quit_msg);
+    fclose(f);
+}
+
+void testReloadKeepsTlsNetworkSettings(){
+    char path[] = "/tmp/praetor_test_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd != -1);
+    close(fd);
+
+    rc_praetor = calloc(1, sizeof(struct praetor));
+    rc_network = htable_create(5);
+    rc_network_sock = htable_create(5);
+    rc_plugin = htable_create(5);
+    TEST_ASSERT_NOT_NULL(rc_praetor);
+
+    write_config(path, "bye");
+    TEST_ASSERT_EQUAL_INT(0, config_load(path));
+    struct network* n = htable_lookup(rc_network, (const uint8_t*)"tls", 4);
+    TEST_ASSERT_NOT_NULL(n);
+
+    //Only the quit message changes, so the connection is kept
+    write_config(path, "later");
+    TEST_ASSERT_EQUAL_INT(0, config_reload());
+    TEST_ASSERT_EQUAL_PTR(n, htable_lookup(rc_network, (const uint8_t*)"tls", 4));
+    TEST_ASSERT_EQUAL_STRING("later", n->quit_msg);
+
+    //Every setting must live in the configuration the network now holds, not the one that was freed
+    TEST_ASSERT_EQUAL_PTR(json_string_value(json_object_get(n->source, "ca_file")), n->ca_file);
+    TEST_ASSERT_EQUAL_PTR(json_string_value(json_object_get(n->source, "host")), n->host);
+    TEST_ASSERT_EQUAL_STRING("/etc/ssl/ca.pem", n->ca_file);
+
+    unlink(path);
+    config_free(rc_network, rc_plugin);
+    htable_destroy(rc_network_sock);
+    json_decref(rc_praetor->source);
+    free(rc_praetor);
+    free(rc_path);
+    rc_path = NULL;
+}